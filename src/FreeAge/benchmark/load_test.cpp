@@ -0,0 +1,648 @@
+// Copyright 2020 The FreeAge authors
+// This file is part of FreeAge, licensed under the new BSD license.
+// See the COPYING file in the project root for the license text.
+
+#include <algorithm>
+#include <functional>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <QCoreApplication>
+#include <QDir>
+#include <QProcess>
+#include <QTcpSocket>
+
+#include "FreeAge/common/building_types.hpp"
+#include "FreeAge/common/free_age.hpp"
+#include "FreeAge/common/logging.hpp"
+#include "FreeAge/common/message_buffer.hpp"
+#include "FreeAge/common/messages.hpp"
+#include "FreeAge/common/object_types.hpp"
+#include "FreeAge/common/resources.hpp"
+#include "FreeAge/common/unit_types.hpp"
+#include "FreeAge/server/event_waiter.hpp"
+
+#include <mango/core/endian.hpp>
+
+/// Number of ServerToClientMessage types.
+constexpr int kNumServerToClientMessages = static_cast<int>(ServerToClientMessage::UnitMovementBatch) + 1;
+
+static const char* GetServerToClientMessageName(int type) {
+  switch (static_cast<ServerToClientMessage>(type)) {
+  case ServerToClientMessage::Welcome: return "Welcome";
+  case ServerToClientMessage::SettingsUpdateBroadcast: return "SettingsUpdateBroadcast";
+  case ServerToClientMessage::GameAborted: return "GameAborted";
+  case ServerToClientMessage::PlayerList: return "PlayerList";
+  case ServerToClientMessage::ChatBroadcast: return "ChatBroadcast";
+  case ServerToClientMessage::PingResponse: return "PingResponse";
+  case ServerToClientMessage::StartGameBroadcast: return "StartGameBroadcast";
+  case ServerToClientMessage::LoadingProgressBroadcast: return "LoadingProgressBroadcast";
+  case ServerToClientMessage::GameBegin: return "GameBegin";
+  case ServerToClientMessage::MapUncover: return "MapUncover";
+  case ServerToClientMessage::AddObject: return "AddObject";
+  case ServerToClientMessage::GameStepTime: return "GameStepTime";
+  case ServerToClientMessage::ResourcesUpdate: return "ResourcesUpdate";
+  case ServerToClientMessage::BuildPercentageUpdate: return "BuildPercentageUpdate";
+  case ServerToClientMessage::ChangeUnitType: return "ChangeUnitType";
+  case ServerToClientMessage::SetCarriedResources: return "SetCarriedResources";
+  case ServerToClientMessage::HPUpdate: return "HPUpdate";
+  case ServerToClientMessage::ObjectDeath: return "ObjectDeath";
+  case ServerToClientMessage::PlayerLeaveBroadcast: return "PlayerLeaveBroadcast";
+  case ServerToClientMessage::QueueUnit: return "QueueUnit";
+  case ServerToClientMessage::UpdateProduction: return "UpdateProduction";
+  case ServerToClientMessage::RemoveFromProductionQueue: return "RemoveFromProductionQueue";
+  case ServerToClientMessage::SetHoused: return "SetHoused";
+  case ServerToClientMessage::ObjectLeaveView: return "ObjectLeaveView";
+  case ServerToClientMessage::UnitMovementBatch: return "UnitMovementBatch";
+  }
+  return "Unknown";
+}
+
+/// Settings of the load test, given on the command line.
+struct LoadTestSettings {
+  int botCount = 4;
+  float actionsPerMinute = 120;
+  float durationSeconds = 60;
+  u16 mapSize = kDefaultMapSize;
+  int seed = 0;
+  
+  /// Whether to print the server's output while the test runs.
+  bool showServerOutput = false;
+  
+  /// Additional arguments for FreeAgeServer.
+  QStringList serverArguments;
+};
+
+/// A map object as known to a bot.
+struct BotObject {
+  ObjectType objectType;
+  int playerIndex;
+  
+  /// The BuildingType or UnitType.
+  int type;
+  
+  /// For buildings, the base tile. For units, the start point of their last movement.
+  QPointF mapCoord;
+  
+  /// For units, the movement reference coord (see ServerUnit::GetMovementReferenceCoord()).
+  QPoint movementReferenceCoord;
+};
+
+/// A headless client that connects to the server over loopback and plays the game
+/// by issuing random move, gather, build, attack, and unit production commands.
+/// It decodes the messages that it needs for this and counts all received messages.
+class Bot {
+ public:
+  Bot(int index, const LoadTestSettings& settings)
+      : index(index),
+        generator(settings.seed + index),
+        actionInterval(60.f / std::max(1e-3f, settings.actionsPerMinute)) {}
+  
+  /// Connects to the server and sends the HostConnect or Connect message.
+  bool Connect(bool isHost, const QByteArray& hostToken) {
+    constexpr int kConnectTimeout = 5000;
+    TimePoint connectStartTime = Clock::now();
+    while (true) {
+      socket.connectToHost(QHostAddress::LocalHost, serverPort);
+      if (socket.waitForConnected(100)) {
+        break;
+      }
+      socket.abort();
+      if (MillisecondsDuration(Clock::now() - connectStartTime).count() > kConnectTimeout) {
+        LOG(ERROR) << "Bot " << index << ": Failed to connect to the server";
+        return false;
+      }
+    }
+    socket.setSocketOption(QAbstractSocket::LowDelayOption, 1);
+    
+    QString name = QStringLiteral("Bot %1").arg(index);
+    socket.write(isHost ? CreateHostConnectMessage(hostToken, name) : CreateConnectMessage(name));
+    socket.flush();
+    lastPingTime = Clock::now();
+    return true;
+  }
+  
+  /// Reads and handles all messages that have arrived.
+  void ReceiveMessages() {
+    usize readCount = receiveBuffer.ReadFrom(&socket);
+    if (inGame) {
+      gameReceivedBytes += readCount;
+    }
+    
+    MessageView msg;
+    while (receiveBuffer.GetNextMessage(&msg)) {
+      int type = msg.GetType();
+      if (type < kNumServerToClientMessages) {
+        ++ messageCounts[type];
+        messageBytes[type] += msg.GetSize();
+      }
+      HandleMessage(msg);
+      receiveBuffer.PopMessage(msg);
+    }
+  }
+  
+  /// Sends a Ping message once per second (which the server requires to keep the connection).
+  void SendPingIfDue(const TimePoint& now) {
+    constexpr int kPingInterval = 1000;
+    if (MillisecondsDuration(now - lastPingTime).count() >= kPingInterval) {
+      socket.write(CreatePingMessage(nextPingNumber));
+      socket.flush();
+      ++ nextPingNumber;
+      lastPingTime = now;
+    }
+  }
+  
+  /// Issues the next command if it is due.
+  void PerformActionIfDue(const TimePoint& now) {
+    if (!inGame || now < nextActionTime) {
+      return;
+    }
+    PerformAction();
+    socket.flush();
+    nextActionTime += std::chrono::duration_cast<Clock::duration>(SecondsDuration(actionInterval));
+  }
+  
+  void SendReadyUp() {
+    socket.write(CreateReadyUpMessage(true));
+    socket.flush();
+  }
+  
+  void SendMapSize(u16 mapSize) {
+    socket.write(CreateSettingsUpdateMessage(/*allowMorePlayersToJoin*/ true, mapSize, /*isBroadcast*/ false));
+    socket.flush();
+  }
+  
+  void SendStartGame() {
+    socket.write(CreateStartGameMessage());
+    socket.flush();
+  }
+  
+  void Leave() {
+    socket.write(CreateLeaveMessage());
+    socket.flush();
+    socket.disconnectFromHost();
+  }
+  
+  inline bool IsWelcomed() const { return welcomed; }
+  inline int GetReadyPlayerCount() const { return readyPlayerCount; }
+  inline bool IsInGame() const { return inGame; }
+  inline bool IsConnected() const { return socket.state() == QAbstractSocket::ConnectedState; }
+  
+  inline i64 GetGameReceivedBytes() const { return gameReceivedBytes; }
+  inline i64 GetActionCount() const { return actionCount; }
+  inline const i64* GetMessageCounts() const { return messageCounts; }
+  inline const i64* GetMessageBytes() const { return messageBytes; }
+  
+ private:
+  void HandleMessage(const MessageView& msg) {
+    const char* data = msg.GetData();
+    switch (static_cast<ServerToClientMessage>(msg.GetType())) {
+    case ServerToClientMessage::Welcome:
+      welcomed = true;
+      break;
+    case ServerToClientMessage::PlayerList:
+      HandlePlayerList(msg);
+      break;
+    case ServerToClientMessage::GameAborted:
+      LOG(ERROR) << "Bot " << index << ": The game was aborted";
+      break;
+    case ServerToClientMessage::StartGameBroadcast:
+      // There are no resources to load.
+      socket.write(CreateLoadingFinishedMessage());
+      socket.flush();
+      break;
+    case ServerToClientMessage::GameBegin:
+      if (msg.GetSize() < 3 + 36) {
+        LOG(ERROR) << "Bot " << index << ": Received a too short GameBegin message";
+        break;
+      }
+      resources = ResourceAmount(mango::uload32(data + 19), mango::uload32(data + 23), mango::uload32(data + 27), mango::uload32(data + 31));
+      mapWidth = mango::uload16(data + 35);
+      mapHeight = mango::uload16(data + 37);
+      inGame = true;
+      nextActionTime = Clock::now() + std::chrono::duration_cast<Clock::duration>(SecondsDuration(
+          std::uniform_real_distribution<float>(0, actionInterval)(generator)));
+      break;
+    case ServerToClientMessage::AddObject:
+      HandleAddObject(msg);
+      break;
+    case ServerToClientMessage::UnitMovementBatch:
+      HandleUnitMovementBatch(msg);
+      break;
+    case ServerToClientMessage::ChangeUnitType:
+      if (msg.GetSize() >= 3 + 6) {
+        auto it = objects.find(mango::uload32(data + 3));
+        if (it != objects.end()) {
+          it->second.type = mango::uload16(data + 7);
+        }
+      }
+      break;
+    case ServerToClientMessage::ObjectDeath:
+    case ServerToClientMessage::ObjectLeaveView:
+      if (msg.GetSize() >= 3 + 4) {
+        objects.erase(mango::uload32(data + 3));
+      }
+      break;
+    case ServerToClientMessage::ResourcesUpdate:
+      if (msg.GetSize() >= 3 + 16) {
+        resources = ResourceAmount(mango::uload32(data + 3), mango::uload32(data + 7), mango::uload32(data + 11), mango::uload32(data + 15));
+      }
+      break;
+    default:
+      break;
+    }
+  }
+  
+  void HandlePlayerList(const MessageView& msg) {
+    // Determine our player index and how many players are ready.
+    const char* data = msg.GetData();
+    if (msg.GetSize() < 4) {
+      return;
+    }
+    playerIndex = static_cast<u8>(data[3]);
+    
+    readyPlayerCount = 0;
+    int offset = 4;
+    while (offset + 2 <= msg.GetSize()) {
+      int nameLength = mango::uload16(data + offset);
+      offset += 2 + nameLength + 2;
+      if (offset + 1 > msg.GetSize()) {
+        break;
+      }
+      readyPlayerCount += (data[offset] != 0) ? 1 : 0;
+      offset += 1;
+    }
+  }
+  
+  void HandleAddObject(const MessageView& msg) {
+    const char* data = msg.GetData();
+    if (msg.GetSize() < 3 + 20) {
+      LOG(ERROR) << "Bot " << index << ": Received a too short AddObject message";
+      return;
+    }
+    
+    BotObject object;
+    object.objectType = static_cast<ObjectType>(data[3]);
+    u32 objectId = mango::uload32(data + 4);
+    object.playerIndex = static_cast<u8>(data[8]);
+    object.type = mango::uload16(data + 13);
+    if (object.objectType == ObjectType::Building) {
+      object.mapCoord = QPointF(mango::uload16(data + 15), mango::uload16(data + 17));
+    } else {
+      object.mapCoord = QPointF(*reinterpret_cast<const float*>(data + 15), *reinterpret_cast<const float*>(data + 19));
+      object.movementReferenceCoord = QuantizeUnitMovementCoord(object.mapCoord);
+    }
+    objects[objectId] = object;
+  }
+  
+  void HandleUnitMovementBatch(const MessageView& msg) {
+    const char* data = msg.GetData() + MessageBuffer::kHeaderSize;
+    int size = msg.GetSize() - MessageBuffer::kHeaderSize;
+    int offset = 0;
+    UnitMovementBatchEntry entry;
+    while (offset < size) {
+      if (!ParseUnitMovementBatchEntry(data, size, &offset, &entry)) {
+        LOG(ERROR) << "Bot " << index << ": Received a UnitMovementBatch message with an invalid entry";
+        return;
+      }
+      auto it = objects.find(entry.unitId);
+      if (it == objects.end()) {
+        LOG(ERROR) << "Bot " << index << ": Received a UnitMovementBatch entry for an unknown object ID";
+        continue;
+      }
+      BotObject& unit = it->second;
+      unit.movementReferenceCoord += entry.coordDelta;
+      unit.mapCoord = QPointF(unit.movementReferenceCoord.x() / kUnitMovementCoordScale, unit.movementReferenceCoord.y() / kUnitMovementCoordScale);
+    }
+  }
+  
+  /// Returns up to maxCount randomly chosen elements of ids.
+  std::vector<u32> ChooseRandomly(std::vector<u32> ids, usize maxCount) {
+    std::shuffle(ids.begin(), ids.end(), generator);
+    ids.resize(std::min(ids.size(), maxCount));
+    return ids;
+  }
+  
+  /// Returns the ID of the object in ids that is closest to mapCoord.
+  u32 FindClosest(const std::vector<u32>& ids, const QPointF& mapCoord) {
+    u32 closestId = ids.front();
+    float closestSquaredDistance = std::numeric_limits<float>::infinity();
+    for (u32 id : ids) {
+      QPointF offset = objects.at(id).mapCoord - mapCoord;
+      float squaredDistance = offset.x() * offset.x() + offset.y() * offset.y();
+      if (squaredDistance < closestSquaredDistance) {
+        closestSquaredDistance = squaredDistance;
+        closestId = id;
+      }
+    }
+    return closestId;
+  }
+  
+  void PerformAction() {
+    std::vector<u32> ownUnits;
+    std::vector<u32> ownVillagers;
+    std::vector<u32> ownTownCenters;
+    std::vector<u32> resourceObjects;
+    std::vector<u32> enemyObjects;
+    for (const auto& item : objects) {
+      const BotObject& object = item.second;
+      if (object.playerIndex == playerIndex) {
+        if (object.objectType == ObjectType::Unit) {
+          ownUnits.push_back(item.first);
+          if (IsVillager(static_cast<UnitType>(object.type))) {
+            ownVillagers.push_back(item.first);
+          }
+        } else if (static_cast<BuildingType>(object.type) == BuildingType::TownCenter) {
+          ownTownCenters.push_back(item.first);
+        }
+      } else if (object.playerIndex == kGaiaPlayerIndex) {
+        resourceObjects.push_back(item.first);
+      } else {
+        enemyObjects.push_back(item.first);
+      }
+    }
+    if (ownUnits.empty()) {
+      return;
+    }
+    
+    enum class Action {
+      Move = 0,
+      Gather,
+      Build,
+      Attack,
+      ProduceVillager,
+      NumActions
+    };
+    Action action = static_cast<Action>(std::uniform_int_distribution<int>(0, static_cast<int>(Action::NumActions) - 1)(generator));
+    
+    // Fall back to moving if the chosen action is not possible.
+    ResourceAmount houseCost = GetBuildingCost(BuildingType::House);
+    ResourceAmount villagerCost = GetUnitCost(UnitType::MaleVillager);
+    if ((action == Action::Gather && (ownVillagers.empty() || resourceObjects.empty())) ||
+        (action == Action::Build && (ownVillagers.empty() || ownTownCenters.empty() || !resources.CanAfford(houseCost))) ||
+        (action == Action::Attack && enemyObjects.empty()) ||
+        (action == Action::ProduceVillager && (ownTownCenters.empty() || !resources.CanAfford(villagerCost)))) {
+      action = Action::Move;
+    }
+    
+    std::uniform_int_distribution<int> offsetDistribution(-10, 10);
+    switch (action) {
+    case Action::Move: {
+      std::vector<u32> unitIds = ChooseRandomly(ownUnits, 5);
+      QPointF start = objects.at(unitIds.front()).mapCoord;
+      QPointF target(
+          std::max(0.f, std::min<float>(mapWidth - 0.01f, start.x() + offsetDistribution(generator))),
+          std::max(0.f, std::min<float>(mapHeight - 0.01f, start.y() + offsetDistribution(generator))));
+      socket.write(CreateMoveToMapCoordMessage(unitIds, target));
+      break;
+    }
+    case Action::Gather: {
+      std::vector<u32> villagerIds = ChooseRandomly(ownVillagers, 3);
+      u32 resourceId = FindClosest(resourceObjects, objects.at(villagerIds.front()).mapCoord);
+      socket.write(CreateSetTargetMessage(villagerIds, resourceId));
+      break;
+    }
+    case Action::Build: {
+      std::vector<u32> villagerIds = ChooseRandomly(ownVillagers, 2);
+      QPointF townCenterBaseTile = objects.at(ownTownCenters.front()).mapCoord;
+      QPoint baseTile(
+          std::max(0, std::min(mapWidth - 2, static_cast<int>(townCenterBaseTile.x()) + offsetDistribution(generator))),
+          std::max(0, std::min(mapHeight - 2, static_cast<int>(townCenterBaseTile.y()) + offsetDistribution(generator))));
+      socket.write(CreatePlaceBuildingFoundationMessage(BuildingType::House, baseTile, villagerIds));
+      break;
+    }
+    case Action::Attack: {
+      std::vector<u32> unitIds = ChooseRandomly(ownUnits, 5);
+      u32 targetId = FindClosest(enemyObjects, objects.at(unitIds.front()).mapCoord);
+      socket.write(CreateSetTargetMessage(unitIds, targetId));
+      break;
+    }
+    case Action::ProduceVillager:
+      socket.write(CreateProduceUnitMessage(ownTownCenters.front(), static_cast<u16>(UnitType::MaleVillager)));
+      break;
+    case Action::NumActions:
+      break;
+    }
+    
+    ++ actionCount;
+  }
+  
+  
+  int index;
+  std::mt19937 generator;
+  
+  QTcpSocket socket;
+  MessageBuffer receiveBuffer;
+  
+  TimePoint lastPingTime;
+  u64 nextPingNumber = 0;
+  
+  bool welcomed = false;
+  int playerIndex = -1;
+  int readyPlayerCount = 0;
+  
+  bool inGame = false;
+  int mapWidth = 0;
+  int mapHeight = 0;
+  ResourceAmount resources;
+  std::unordered_map<u32, BotObject> objects;
+  
+  float actionInterval;
+  TimePoint nextActionTime;
+  i64 actionCount = 0;
+  
+  i64 gameReceivedBytes = 0;
+  i64 messageCounts[kNumServerToClientMessages] = {};
+  i64 messageBytes[kNumServerToClientMessages] = {};
+};
+
+/// Runs FreeAgeServer together with a number of headless bot clients that play a game over loopback,
+/// and reports the server's game step simulation time percentiles, the bytes per second received by
+/// each player, and the number of received messages per ServerToClientMessage type.
+///
+/// Usage: FreeAgeLoadTest [--bots=<count>] [--actions-per-minute=<apm>] [--duration=<seconds>]
+///                        [--map-size=<size>] [--seed=<seed>] [--show-server-output] [-- <server arguments>]
+int main(int argc, char** argv) {
+  // Initialize loguru.
+  loguru::g_preamble_date = false;
+  loguru::g_preamble_thread = false;
+  loguru::g_preamble_uptime = false;
+  loguru::g_stderr_verbosity = 2;
+  if (argc > 0) {
+    loguru::init(argc, argv, /*verbosity_flag*/ nullptr);
+  }
+  
+  QCoreApplication qapp(argc, argv);
+  
+  // Parse command line arguments.
+  LoadTestSettings settings;
+  for (int i = 1; i < argc; ++ i) {
+    std::string argument = argv[i];
+    auto getValue = [&](const char* prefix) { return argument.c_str() + std::string(prefix).size(); };
+    if (argument.rfind("--bots=", 0) == 0) {
+      settings.botCount = std::atoi(getValue("--bots="));
+    } else if (argument.rfind("--actions-per-minute=", 0) == 0) {
+      settings.actionsPerMinute = std::atof(getValue("--actions-per-minute="));
+    } else if (argument.rfind("--duration=", 0) == 0) {
+      settings.durationSeconds = std::atof(getValue("--duration="));
+    } else if (argument.rfind("--map-size=", 0) == 0) {
+      settings.mapSize = std::atoi(getValue("--map-size="));
+    } else if (argument.rfind("--seed=", 0) == 0) {
+      settings.seed = std::atoi(getValue("--seed="));
+    } else if (argument == "--show-server-output") {
+      settings.showServerOutput = true;
+    } else if (argument == "--") {
+      for (++ i; i < argc; ++ i) {
+        settings.serverArguments << QString::fromLocal8Bit(argv[i]);
+      }
+    } else {
+      LOG(ERROR) << "Unknown argument: " << argument;
+      LOG(INFO) << "Usage: FreeAgeLoadTest [--bots=<count>] [--actions-per-minute=<apm>] [--duration=<seconds>] [--map-size=<size>] [--seed=<seed>] [--show-server-output] [-- <server arguments>]";
+      return 1;
+    }
+  }
+  if (settings.botCount < 2) {
+    LOG(ERROR) << "At least two bots are required, since the server exits once only one player is left.";
+    return 1;
+  }
+  
+  // Start the server.
+  QByteArray hostToken = "loadts";
+  QProcess serverProcess;
+  serverProcess.setProcessChannelMode(QProcess::MergedChannels);
+  QByteArray serverOutput;
+  auto readServerOutput = [&]() {
+    QByteArray output = serverProcess.readAllStandardOutput();
+    if (settings.showServerOutput) {
+      std::cout << output.data() << std::flush;
+    }
+    serverOutput += output;
+  };
+  QString serverPath = QDir(QCoreApplication::applicationDirPath()).filePath("FreeAgeServer");
+  serverProcess.start(serverPath, QStringList() << hostToken << settings.serverArguments);
+  if (!serverProcess.waitForStarted(10000)) {
+    LOG(ERROR) << "Failed to start the server (path: " << serverPath.toStdString() << ")";
+    return 1;
+  }
+  
+  std::vector<std::unique_ptr<Bot>> bots;
+  for (int i = 0; i < settings.botCount; ++ i) {
+    bots.emplace_back(new Bot(i, settings));
+  }
+  
+  // Runs the bots until the given condition is fulfilled or the timeout is reached.
+  // Returns whether the condition was fulfilled.
+  EventWaiter eventWaiter;
+  auto runBotsUntil = [&](const std::function<bool()>& condition, double timeoutSeconds) {
+    constexpr int kMaxWaitMilliseconds = 10;
+    TimePoint endTime = Clock::now() + std::chrono::duration_cast<Clock::duration>(SecondsDuration(timeoutSeconds));
+    while (true) {
+      TimePoint now = Clock::now();
+      for (auto& bot : bots) {
+        if (bot->IsConnected()) {
+          bot->ReceiveMessages();
+          bot->SendPingIfDue(now);
+          bot->PerformActionIfDue(now);
+        }
+      }
+      readServerOutput();
+      
+      if (condition()) {
+        return true;
+      } else if (now >= endTime) {
+        return false;
+      }
+      eventWaiter.ProcessEventsUntil(std::min(endTime, now + std::chrono::milliseconds(kMaxWaitMilliseconds)));
+    }
+  };
+  
+  // Set up the match: the first bot is the host, which has to be connected before the others can join.
+  constexpr double kSetupTimeoutSeconds = 10;
+  if (!bots[0]->Connect(/*isHost*/ true, hostToken) ||
+      !runBotsUntil([&]() { return bots[0]->IsWelcomed(); }, kSetupTimeoutSeconds)) {
+    LOG(ERROR) << "The host bot did not get welcomed by the server";
+    serverProcess.kill();
+    return 1;
+  }
+  bots[0]->SendMapSize(settings.mapSize);
+  for (int i = 1; i < settings.botCount; ++ i) {
+    if (!bots[i]->Connect(/*isHost*/ false, QByteArray())) {
+      serverProcess.kill();
+      return 1;
+    }
+  }
+  if (!runBotsUntil([&]() { return std::all_of(bots.begin(), bots.end(), [](const std::unique_ptr<Bot>& bot) { return bot->IsWelcomed(); }); }, kSetupTimeoutSeconds)) {
+    LOG(ERROR) << "Not all bots got welcomed by the server";
+    serverProcess.kill();
+    return 1;
+  }
+  
+  for (auto& bot : bots) {
+    bot->SendReadyUp();
+  }
+  if (!runBotsUntil([&]() { return bots[0]->GetReadyPlayerCount() == settings.botCount; }, kSetupTimeoutSeconds)) {
+    LOG(ERROR) << "Not all bots became ready";
+    serverProcess.kill();
+    return 1;
+  }
+  bots[0]->SendStartGame();
+  
+  // Play the game.
+  constexpr double kGameStartTimeoutSeconds = 60;
+  if (!runBotsUntil([&]() { return std::all_of(bots.begin(), bots.end(), [](const std::unique_ptr<Bot>& bot) { return bot->IsInGame(); }); }, kGameStartTimeoutSeconds)) {
+    LOG(ERROR) << "The game did not begin for all bots";
+    serverProcess.kill();
+    return 1;
+  }
+  LOG(INFO) << "Game began with " << settings.botCount << " bots, running for " << settings.durationSeconds << " seconds ...";
+  runBotsUntil([]() { return false; }, settings.durationSeconds);
+  
+  // Leave the game. The server exits once all players left.
+  for (auto& bot : bots) {
+    bot->Leave();
+  }
+  constexpr int kServerExitTimeout = 10000;
+  if (!serverProcess.waitForFinished(kServerExitTimeout)) {
+    LOG(ERROR) << "The server did not exit after all bots left";
+    serverProcess.kill();
+  }
+  readServerOutput();
+  
+  // Report the results.
+  LOG(INFO) << "Load test results (" << settings.botCount << " bots, " << settings.actionsPerMinute << " actions per minute, " << settings.durationSeconds << " seconds):";
+  for (const QByteArray& line : serverOutput.split('\n')) {
+    if (line.contains("Game step simulation time percentiles")) {
+      LOG(INFO) << line.trimmed().toStdString();
+    }
+  }
+  
+  i64 totalMessageCounts[kNumServerToClientMessages] = {};
+  i64 totalMessageBytes[kNumServerToClientMessages] = {};
+  for (int i = 0; i < settings.botCount; ++ i) {
+    const Bot& bot = *bots[i];
+    LOG(INFO) << "Player " << i << ": " << (bot.GetGameReceivedBytes() / settings.durationSeconds) << " bytes/s received, " << bot.GetActionCount() << " actions";
+    for (int type = 0; type < kNumServerToClientMessages; ++ type) {
+      totalMessageCounts[type] += bot.GetMessageCounts()[type];
+      totalMessageBytes[type] += bot.GetMessageBytes()[type];
+    }
+  }
+  
+  std::vector<int> types;
+  for (int type = 0; type < kNumServerToClientMessages; ++ type) {
+    if (totalMessageCounts[type] > 0) {
+      types.push_back(type);
+    }
+  }
+  std::sort(types.begin(), types.end(), [&](int a, int b) { return totalMessageBytes[a] > totalMessageBytes[b]; });
+  LOG(INFO) << "Messages received by all players (by type):";
+  for (int type : types) {
+    LOG(INFO) << "  " << GetServerToClientMessageName(type) << ": " << totalMessageCounts[type] << " messages, " << totalMessageBytes[type] << " bytes";
+  }
+  
+  return 0;
+}
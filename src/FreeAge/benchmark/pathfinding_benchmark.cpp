@@ -0,0 +1,464 @@
+// Copyright 2020 The FreeAge authors
+// This file is part of FreeAge, licensed under the new BSD license.
+// See the COPYING file in the project root for the license text.
+
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "FreeAge/common/free_age.hpp"
+#include "FreeAge/common/logging.hpp"
+#include "FreeAge/common/messages.hpp"
+#include "FreeAge/common/thread_pool.hpp"
+#include "FreeAge/server/building.hpp"
+#include "FreeAge/server/connected_components.hpp"
+#include "FreeAge/server/flow_field.hpp"
+#include "FreeAge/server/hierarchical_pathfinding.hpp"
+#include "FreeAge/server/map.hpp"
+#include "FreeAge/server/pathfinding.hpp"
+#include "FreeAge/server/unit.hpp"
+#include "FreeAge/server/unit_movement.hpp"
+
+/// Statistics accumulated over all queries for one planner.
+struct PlannerStatistics {
+  std::string name;
+  
+  int queryCount = 0;
+  int reachedGoalCount = 0;
+  
+  i64 expandedNodeCount = 0;
+  double totalSeconds = 0;
+  double maxSeconds = 0;
+  
+  /// Sum of the lengths of all paths that reached the goal, in tiles.
+  double totalPathLength = 0;
+};
+
+static float ComputePathLength(const QPoint& start, const std::vector<QPoint>& reverseTilePath) {
+  float length = 0;
+  QPoint previous = start;
+  for (auto it = reverseTilePath.rbegin(); it != reverseTilePath.rend(); ++ it) {
+    length += DiagonalDistance(it->x() - previous.x(), it->y() - previous.y());
+    previous = *it;
+  }
+  return length;
+}
+
+static void RunQueries(const PathfindingGrid& grid, const std::vector<std::pair<QPoint, QPoint>>& queries, GridPathPlanner* planner, PlannerStatistics* statistics) {
+  std::vector<QPoint> reverseTilePath;
+  for (const auto& query : queries) {
+    bool reachedGoal;
+    TimePoint startTime = Clock::now();
+    bool success = planner->PlanPath(grid, query.first, QRect(query.second, QSize(1, 1)), &reverseTilePath, &reachedGoal);
+    double seconds = SecondsDuration(Clock::now() - startTime).count();
+    
+    ++ statistics->queryCount;
+    statistics->expandedNodeCount += planner->GetExpandedNodeCount();
+    statistics->totalSeconds += seconds;
+    statistics->maxSeconds = std::max(statistics->maxSeconds, seconds);
+    if (success && reachedGoal) {
+      ++ statistics->reachedGoalCount;
+      statistics->totalPathLength += ComputePathLength(query.first, reverseTilePath);
+    }
+  }
+}
+
+static void PrintStatistics(const PlannerStatistics& statistics) {
+  LOG(INFO) << statistics.name << ": "
+            << statistics.reachedGoalCount << " / " << statistics.queryCount << " goals reached, "
+            << (statistics.expandedNodeCount / std::max(1, statistics.queryCount)) << " nodes expanded per query, "
+            << (1000 * statistics.totalSeconds / std::max(1, statistics.queryCount)) << " ms per query (max: " << (1000 * statistics.maxSeconds) << " ms), "
+            << "total path length: " << statistics.totalPathLength;
+}
+
+/// Adds units at random free positions of the map and sends each of them along a planned path to a random nearby tile.
+static void SpawnMovingUnits(ServerMap* map, int unitCount, int seed) {
+  constexpr int kMaxGoalOffset = 20;
+  
+  PathfindingGrid grid = map->GetPathfindingGrid();
+  std::mt19937 generator(seed);
+  std::uniform_real_distribution<float> coordDistribution(0, map->GetWidth());
+  std::uniform_int_distribution<int> goalOffsetDistribution(-kMaxGoalOffset, kMaxGoalOffset);
+  AStarPathPlanner planner;
+  std::vector<QPoint> reverseTilePath;
+  std::vector<QPointF> reversePath;
+  
+  int spawnedCount = 0;
+  for (int attempt = 0; spawnedCount < unitCount && attempt < 100 * unitCount; ++ attempt) {
+    QPointF mapCoord(coordDistribution(generator), coordDistribution(generator));
+    ServerUnit* unit = new ServerUnit(/*playerIndex*/ 0, UnitType::Militia, mapCoord);
+    if (map->DoesUnitCollide(unit, mapCoord)) {
+      delete unit;
+      continue;
+    }
+    map->AddUnit(unit);
+    unit->SetMovementReferenceCoord(QuantizeUnitMovementCoord(mapCoord));
+    ++ spawnedCount;
+    
+    QPoint start(mapCoord.x(), mapCoord.y());
+    QPoint goal(
+        std::max(0, std::min(map->GetWidth() - 1, start.x() + goalOffsetDistribution(generator))),
+        std::max(0, std::min(map->GetHeight() - 1, start.y() + goalOffsetDistribution(generator))));
+    QRect goalRect(goal, QSize(1, 1));
+    QPointF goalMapCoord(goal.x() + 0.5f, goal.y() + 0.5f);
+    bool reachedGoal;
+    if (grid.IsOccupied(goal.x(), goal.y()) ||
+        !planner.PlanPath(grid, start, goalRect, &reverseTilePath, &reachedGoal)) {
+      continue;
+    }
+    TilePathToSmoothedPath(grid, GetUnitRadius(unit->GetUnitType()), mapCoord, goalRect, goalMapCoord, reachedGoal, reverseTilePath, &reversePath);
+    if (!reversePath.empty()) {
+      unit->SetMoveToTarget(goalMapCoord);
+      SetUnitPath(unit, reversePath);
+    }
+  }
+}
+
+static bool IsMovingAlongPath(ServerObject* object) {
+  return object->isUnit() && AsUnit(object)->HasPath() && AsUnit(object)->GetMovementDirection() != QPointF(0, 0);
+}
+
+/// Moves all units along their paths for one game step, one unit after the other.
+/// Appends the IDs of the units whose clients need to be notified about their new movement to notifiedUnitIds.
+static void MoveUnitsSerially(ServerMap* map, float stepLengthInSeconds, std::vector<u32>* notifiedUnitIds) {
+  UnitMovement movement;
+  for (const auto& item : map->GetObjects()) {
+    if (IsMovingAlongPath(item.second)) {
+      PlanUnitMovement(*map, AsUnit(item.second), stepLengthInSeconds, &movement);
+      if (ApplyUnitMovement(map, AsUnit(item.second), movement)) {
+        notifiedUnitIds->push_back(item.first);
+      }
+    }
+  }
+}
+
+/// The size of the individual UnitMovement message that the server used to send for each moving unit before
+/// the UnitMovementBatch message replaced it: the message header, the unit ID, the start point and speed as floats,
+/// and the action. It serves as the baseline for the UnitMovementBatch message size.
+static constexpr int kUnitMovementMessageSize = 3 + 4 + 4 * 4 + 1;
+
+/// Encodes the movements of the given units like Game::SendUnitMovementMessage() does, both with individual
+/// UnitMovement messages and with a UnitMovementBatch message, and adds the resulting sizes to the given counters.
+static void EncodeUnitMovements(ServerMap* map, const std::vector<u32>& unitIds, i64* unitMovementBytes, i64* unitMovementBatchBytes) {
+  MessageWriter batchedMessages;
+  int batchOffset = -1;
+  for (u32 unitId : unitIds) {
+    ServerUnit* unit = AsUnit(map->GetObjects().find(unitId)->second);
+    QPointF speed = unit->GetMoveSpeed() * unit->GetMovementDirection();
+    *unitMovementBytes += kUnitMovementMessageSize;
+    
+    QPoint coord = QuantizeUnitMovementCoord(unit->GetMapCoord());
+    AppendUnitMovementBatchEntry(&batchedMessages, &batchOffset, unitId, coord - unit->GetMovementReferenceCoord(), speed, unit->GetCurrentAction());
+    unit->SetMovementReferenceCoord(coord);
+  }
+  *unitMovementBatchBytes += batchedMessages.GetMessagesSize();
+}
+
+/// Moves all units along their paths for one game step like Game::SimulateGameStep() does with multiple threads:
+/// plans all movements in parallel first, then applies them in order, re-planning the movements that became outdated.
+/// Returns the number of movements that were re-planned.
+static int MoveUnitsInParallel(ServerMap* map, float stepLengthInSeconds, ThreadPool* threadPool, std::vector<UnitMovement>* movements) {
+  const auto& objects = map->GetObjects();
+  movements->resize(objects.size());
+  
+  usize chunkCount = 4 * threadPool->GetThreadCount();
+  usize chunkSize = (objects.size() + chunkCount - 1) / chunkCount;
+  for (usize begin = 0; begin < objects.size(); begin += chunkSize) {
+    usize end = std::min(objects.size(), begin + chunkSize);
+    threadPool->Enqueue([map, &objects, movements, stepLengthInSeconds, begin, end]() {
+      for (usize i = begin; i < end; ++ i) {
+        if (IsMovingAlongPath(objects.at(i).second)) {
+          PlanUnitMovement(*map, AsUnit(objects.at(i).second), stepLengthInSeconds, &movements->at(i));
+        }
+      }
+    });
+  }
+  threadPool->WaitForAll();
+  
+  int replannedCount = 0;
+  for (usize i = 0; i < objects.size(); ++ i) {
+    if (!IsMovingAlongPath(objects.at(i).second)) {
+      continue;
+    }
+    ServerUnit* unit = AsUnit(objects.at(i).second);
+    if (!IsUnitMovementUpToDate(*map, movements->at(i))) {
+      PlanUnitMovement(*map, unit, stepLengthInSeconds, &movements->at(i));
+      ++ replannedCount;
+    }
+    ApplyUnitMovement(map, unit, movements->at(i));
+  }
+  return replannedCount;
+}
+
+/// Compares A* on the full grid with Jump Point Search (JPS), hierarchical path planning (HPA*),
+/// flow fields for group move orders, and the connected components for unreachable goals
+/// on randomly generated maps. Also compares moving many units serially and with parallel
+/// movement planning, and the network traffic of the resulting unit movement updates.
+///
+/// Usage: FreeAgeBenchmark [map_size] [query_count] [player_count] [seed] [moving_unit_count]
+int main(int argc, char** argv) {
+  // Initialize loguru.
+  loguru::g_preamble_date = false;
+  loguru::g_preamble_thread = false;
+  loguru::g_preamble_uptime = false;
+  loguru::g_stderr_verbosity = 2;
+  if (argc > 0) {
+    loguru::init(argc, argv, /*verbosity_flag*/ nullptr);
+  }
+  
+  int mapSize = (argc > 1) ? std::stoi(argv[1]) : 200;
+  int queryCount = (argc > 2) ? std::stoi(argv[2]) : 200;
+  int playerCount = (argc > 3) ? std::stoi(argv[3]) : 8;
+  int seed = (argc > 4) ? std::stoi(argv[4]) : 0;
+  int movingUnitCount = (argc > 5) ? std::stoi(argv[5]) : 2000;
+  
+  LOG(INFO) << "Generating a " << mapSize << " x " << mapSize << " map for " << playerCount << " players (seed " << seed << ") ...";
+  ServerMap map(mapSize, mapSize);
+  map.GenerateRandomMap(playerCount, seed);
+  PathfindingGrid grid = map.GetPathfindingGrid();
+  
+  // Build the abstract graph from scratch.
+  TimePoint graphBuildStartTime = Clock::now();
+  const HierarchicalPathGraph& graph = map.GetHierarchicalPathGraph();
+  double graphBuildSeconds = SecondsDuration(Clock::now() - graphBuildStartTime).count();
+  LOG(INFO) << "Built the abstract graph with " << graph.GetNodeCount() << " nodes in " << (1000 * graphBuildSeconds) << " ms";
+  
+  // Generate random queries between free tiles. Only long paths are considered, since
+  // these are the ones for which hierarchical path planning is used in the game.
+  std::mt19937 generator(seed);
+  std::uniform_int_distribution<int> coordDistribution(0, mapSize - 1);
+  auto randomFreeTile = [&]() {
+    while (true) {
+      QPoint tile(coordDistribution(generator), coordDistribution(generator));
+      if (!grid.IsOccupied(tile.x(), tile.y())) {
+        return tile;
+      }
+    }
+  };
+  constexpr float kMinQueryDistance = 2 * HierarchicalPathGraph::kClusterSize;
+  std::vector<std::pair<QPoint, QPoint>> queries;
+  while (static_cast<int>(queries.size()) < queryCount) {
+    QPoint start = randomFreeTile();
+    QPoint goal = randomFreeTile();
+    if (DiagonalDistance(goal.x() - start.x(), goal.y() - start.y()) >= kMinQueryDistance) {
+      queries.emplace_back(start, goal);
+    }
+  }
+  
+  // Run the queries with all planners.
+  AStarPathPlanner aStarPlanner;
+  PlannerStatistics aStarStatistics;
+  aStarStatistics.name = "A*  ";
+  RunQueries(grid, queries, &aStarPlanner, &aStarStatistics);
+  
+  JumpPointSearchPathPlanner jumpPointSearchPlanner;
+  PlannerStatistics jumpPointSearchStatistics;
+  jumpPointSearchStatistics.name = "JPS ";
+  RunQueries(grid, queries, &jumpPointSearchPlanner, &jumpPointSearchStatistics);
+  
+  HierarchicalPathPlanner hierarchicalPlanner;
+  hierarchicalPlanner.SetGraph(&graph);
+  PlannerStatistics hierarchicalStatistics;
+  hierarchicalStatistics.name = "HPA*";
+  RunQueries(grid, queries, &hierarchicalPlanner, &hierarchicalStatistics);
+  
+  PrintStatistics(aStarStatistics);
+  PrintStatistics(jumpPointSearchStatistics);
+  PrintStatistics(hierarchicalStatistics);
+  LOG(INFO) << "JPS path length overhead: "
+            << (100 * (jumpPointSearchStatistics.totalPathLength / std::max(1e-6, aStarStatistics.totalPathLength) - 1)) << " % (expected: 0 %)";
+  LOG(INFO) << "HPA* path length overhead: "
+            << (100 * (hierarchicalStatistics.totalPathLength / std::max(1e-6, aStarStatistics.totalPathLength) - 1)) << " %";
+  
+  // Compare planning individual paths for a group of units with a shared flow field.
+  // The units of the group start close to each other, as after a selection with the mouse.
+  constexpr int kGroupSize = 40;
+  constexpr int kGroupAreaSize = 10;
+  QPoint groupGoal = queries.front().second;
+  QPoint groupCenter = queries.front().first;
+  std::uniform_int_distribution<int> groupOffsetDistribution(-kGroupAreaSize / 2, kGroupAreaSize / 2);
+  std::vector<QPoint> groupStarts;
+  while (static_cast<int>(groupStarts.size()) < kGroupSize) {
+    QPoint start(
+        std::max(0, std::min(mapSize - 1, groupCenter.x() + groupOffsetDistribution(generator))),
+        std::max(0, std::min(mapSize - 1, groupCenter.y() + groupOffsetDistribution(generator))));
+    if (!grid.IsOccupied(start.x(), start.y())) {
+      groupStarts.push_back(start);
+    }
+  }
+  
+  TimePoint groupStartTime = Clock::now();
+  std::vector<QPoint> reverseTilePath;
+  double aStarGroupPathLength = 0;
+  for (const QPoint& start : groupStarts) {
+    bool reachedGoal;
+    if (aStarPlanner.PlanPath(grid, start, QRect(groupGoal, QSize(1, 1)), &reverseTilePath, &reachedGoal) && reachedGoal) {
+      aStarGroupPathLength += ComputePathLength(start, reverseTilePath);
+    }
+  }
+  double aStarGroupSeconds = SecondsDuration(Clock::now() - groupStartTime).count();
+  
+  groupStartTime = Clock::now();
+  FlowField flowField(groupGoal);
+  flowField.Reset(grid, map.GetOccupancyVersion());
+  double flowFieldGroupPathLength = 0;
+  for (const QPoint& start : groupStarts) {
+    if (flowField.ExtractPath(grid, start, &reverseTilePath)) {
+      flowFieldGroupPathLength += ComputePathLength(start, reverseTilePath);
+    }
+  }
+  double flowFieldGroupSeconds = SecondsDuration(Clock::now() - groupStartTime).count();
+  
+  LOG(INFO) << "Group of " << kGroupSize << " units: A* " << (1000 * aStarGroupSeconds) << " ms (total path length: " << aStarGroupPathLength << "), "
+            << "flow field " << (1000 * flowFieldGroupSeconds) << " ms (total path length: " << flowFieldGroupPathLength << ")";
+  
+  // Compare planning paths to unreachable goals with A* (which searches the whole component of the start
+  // to find the closest reachable tile) and with the connected components (which determine the closest
+  // reachable tile directly, such that A* only needs to plan a path to it).
+  const ConnectedComponents& components = map.GetConnectedComponents();
+  u32 largestComponent = ConnectedComponents::kNoComponent;
+  for (int y = 0; y < mapSize; ++ y) {
+    for (int x = 0; x < mapSize; ++ x) {
+      u32 component = components.GetComponent(QPoint(x, y));
+      if (component != ConnectedComponents::kNoComponent &&
+          (largestComponent == ConnectedComponents::kNoComponent || components.GetComponentSize(component) > components.GetComponentSize(largestComponent))) {
+        largestComponent = component;
+      }
+    }
+  }
+  std::vector<std::pair<QPoint, QPoint>> unreachableQueries;
+  for (int attempt = 0; attempt < 100 * queryCount && static_cast<int>(unreachableQueries.size()) < queryCount; ++ attempt) {
+    QPoint start = randomFreeTile();
+    QPoint goal = randomFreeTile();
+    if (components.GetComponent(start) == largestComponent && components.GetComponent(goal) != largestComponent &&
+        !components.CanReach(grid, largestComponent, QRect(goal, QSize(1, 1)))) {
+      unreachableQueries.emplace_back(start, goal);
+    }
+  }
+  
+  PlannerStatistics unreachableAStarStatistics;
+  unreachableAStarStatistics.name = "A* to unreachable goals                    ";
+  RunQueries(grid, unreachableQueries, &aStarPlanner, &unreachableAStarStatistics);
+  
+  PlannerStatistics unreachableComponentsStatistics;
+  unreachableComponentsStatistics.name = "A* to closest tile found with the components";
+  for (const auto& query : unreachableQueries) {
+    TimePoint startTime = Clock::now();
+    QRect goalRect(query.second, QSize(1, 1));
+    u32 startComponent = components.GetComponent(query.first);
+    bool reachedGoal = components.CanReach(grid, startComponent, goalRect);
+    bool success = true;
+    int expandedNodeCount = 0;
+    if (!reachedGoal) {
+      QPoint closestTile = components.FindClosestTile(startComponent, goalRect);
+      success = closestTile != query.first &&
+                aStarPlanner.PlanPath(grid, query.first, QRect(closestTile, QSize(1, 1)), &reverseTilePath, &reachedGoal);
+      expandedNodeCount = aStarPlanner.GetExpandedNodeCount();
+      reachedGoal = false;
+    }
+    double seconds = SecondsDuration(Clock::now() - startTime).count();
+    
+    ++ unreachableComponentsStatistics.queryCount;
+    unreachableComponentsStatistics.expandedNodeCount += expandedNodeCount;
+    unreachableComponentsStatistics.totalSeconds += seconds;
+    unreachableComponentsStatistics.maxSeconds = std::max(unreachableComponentsStatistics.maxSeconds, seconds);
+    if (success && reachedGoal) {
+      ++ unreachableComponentsStatistics.reachedGoalCount;
+    }
+  }
+  
+  PrintStatistics(unreachableAStarStatistics);
+  PrintStatistics(unreachableComponentsStatistics);
+  
+  // Measure the cost of incremental graph updates, as they happen when a building is placed or destroyed.
+  // The connected components are updated immediately when the occupancy changes, so their update
+  // cost is contained in the time for changing the occupancy.
+  constexpr int kNumUpdates = 100;
+  QSize houseSize = GetBuildingSize(BuildingType::House);
+  std::uniform_int_distribution<int> baseTileDistribution(0, mapSize - std::max(houseSize.width(), houseSize.height()));
+  double totalUpdateSeconds = 0;
+  double totalOccupancyChangeSeconds = 0;
+  int updateCount = 0;
+  for (int update = 0; update < kNumUpdates; ++ update) {
+    QPoint baseTile(baseTileDistribution(generator), baseTileDistribution(generator));
+    bool isFree = true;
+    for (int y = baseTile.y(); y < baseTile.y() + houseSize.height(); ++ y) {
+      for (int x = baseTile.x(); x < baseTile.x() + houseSize.width(); ++ x) {
+        isFree &= !map.occupiedForBuildingsAt(x, y);
+      }
+    }
+    if (!isFree) {
+      continue;
+    }
+    
+    TimePoint occupancyChangeStartTime = Clock::now();
+    ServerBuilding* house = map.AddBuilding(kGaiaPlayerIndex, BuildingType::House, baseTile, /*buildPercentage*/ 100);
+    totalOccupancyChangeSeconds += SecondsDuration(Clock::now() - occupancyChangeStartTime).count();
+    TimePoint updateStartTime = Clock::now();
+    map.GetHierarchicalPathGraph();
+    totalUpdateSeconds += SecondsDuration(Clock::now() - updateStartTime).count();
+    
+    occupancyChangeStartTime = Clock::now();
+    map.RemoveBuildingOccupancy(house);
+    totalOccupancyChangeSeconds += SecondsDuration(Clock::now() - occupancyChangeStartTime).count();
+    updateStartTime = Clock::now();
+    map.GetHierarchicalPathGraph();
+    totalUpdateSeconds += SecondsDuration(Clock::now() - updateStartTime).count();
+    updateCount += 2;
+  }
+  LOG(INFO) << "Incremental graph update after placing or removing a house: " << (1000 * totalUpdateSeconds / std::max(1, updateCount)) << " ms on average";
+  LOG(INFO) << "Occupancy change (including the connected components update) when placing or removing a house: " << (1000 * totalOccupancyChangeSeconds / std::max(1, updateCount)) << " ms on average";
+  
+  // Compare moving many units along their paths serially and with the parallel movement planning that
+  // Game::SimulateGameStep() uses. Both must lead to exactly the same game state after each step.
+  constexpr int kNumMovementSteps = 150;
+  constexpr float kStepLengthInSeconds = 1 / 30.f;
+  ServerMap serialMap(mapSize, mapSize);
+  serialMap.GenerateRandomMap(playerCount, seed);
+  SpawnMovingUnits(&serialMap, movingUnitCount, seed);
+  ServerMap parallelMap(mapSize, mapSize);
+  parallelMap.GenerateRandomMap(playerCount, seed);
+  SpawnMovingUnits(&parallelMap, movingUnitCount, seed);
+  
+  ThreadPool threadPool(std::thread::hardware_concurrency());
+  std::vector<UnitMovement> movements;
+  double serialMovementSeconds = 0;
+  double parallelMovementSeconds = 0;
+  i64 movementCount = 0;
+  i64 replannedCount = 0;
+  int differingHashCount = 0;
+  std::vector<u32> notifiedUnitIds;
+  i64 notificationCount = 0;
+  i64 unitMovementBytes = 0;
+  i64 unitMovementBatchBytes = 0;
+  for (int step = 0; step < kNumMovementSteps; ++ step) {
+    for (const auto& item : serialMap.GetObjects()) {
+      movementCount += IsMovingAlongPath(item.second) ? 1 : 0;
+    }
+    
+    TimePoint movementStartTime = Clock::now();
+    notifiedUnitIds.clear();
+    MoveUnitsSerially(&serialMap, kStepLengthInSeconds, &notifiedUnitIds);
+    serialMovementSeconds += SecondsDuration(Clock::now() - movementStartTime).count();
+    
+    notificationCount += notifiedUnitIds.size();
+    EncodeUnitMovements(&serialMap, notifiedUnitIds, &unitMovementBytes, &unitMovementBatchBytes);
+    
+    movementStartTime = Clock::now();
+    replannedCount += MoveUnitsInParallel(&parallelMap, kStepLengthInSeconds, &threadPool, &movements);
+    parallelMovementSeconds += SecondsDuration(Clock::now() - movementStartTime).count();
+    
+    if (serialMap.ComputeObjectStateHash() != parallelMap.ComputeObjectStateHash()) {
+      ++ differingHashCount;
+    }
+  }
+  LOG(INFO) << "Moving " << movingUnitCount << " units: serial " << (1000 * serialMovementSeconds / kNumMovementSteps) << " ms per step, "
+            << "parallel with " << threadPool.GetThreadCount() << " threads " << (1000 * parallelMovementSeconds / kNumMovementSteps) << " ms per step "
+            << "(" << (100. * replannedCount / std::max<i64>(1, movementCount)) << " % of the movements re-planned)";
+  LOG(INFO) << "Game state hashes differ after " << differingHashCount << " of " << kNumMovementSteps << " steps (expected: 0)";
+  LOG(INFO) << "Sending " << notificationCount << " unit movement updates to one client: " << unitMovementBytes << " bytes with UnitMovement messages, "
+            << unitMovementBatchBytes << " bytes with UnitMovementBatch messages (" << (100. * unitMovementBatchBytes / std::max<i64>(1, unitMovementBytes)) << " %)";
+  
+  return 0;
+}
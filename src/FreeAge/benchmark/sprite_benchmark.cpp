@@ -0,0 +1,151 @@
+// Copyright 2020 The FreeAge authors
+// This file is part of FreeAge, licensed under the new BSD license.
+// See the COPYING file in the project root for the license text.
+
+#include <algorithm>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+#include "FreeAge/common/free_age.hpp"
+#include "FreeAge/common/logging.hpp"
+#include "FreeAge/client/sprite.hpp"
+
+/// Reads the whole file into data.
+static bool ReadWholeFile(const std::filesystem::path& path, std::vector<u8>* data) {
+  FILE* file = fopen(path.string().c_str(), "rb");
+  if (!file) {
+    return false;
+  }
+  
+  fseek(file, 0, SEEK_END);
+  std::size_t size = ftell(file);
+  fseek(file, 0, SEEK_SET);
+  
+  data->resize(size);
+  bool success = fread(data->data(), 1, size, file) == size;
+  fclose(file);
+  return success;
+}
+
+/// Reads the file with one fread() call for each SMPPixel, as the SMP decoding did before
+/// the sprite files were decoded from memory. Returns the number of bytes read.
+static usize ReadFileInPixelSizedPieces(const std::filesystem::path& path) {
+  FILE* file = fopen(path.string().c_str(), "rb");
+  if (!file) {
+    return 0;
+  }
+  
+  usize size = 0;
+  SMPPixel pixel;
+  while (fread(&pixel, sizeof(SMPPixel), 1, file) == 1) {
+    size += sizeof(SMPPixel);
+  }
+  fclose(file);
+  return size;
+}
+
+static void PrintThroughput(const char* name, usize byteCount, usize frameCount, double seconds) {
+  LOG(INFO) << name << ": "
+            << (byteCount / (1024. * 1024.) / seconds) << " MiB/s, "
+            << (frameCount / seconds) << " frames/s "
+            << "(" << (1000 * seconds) << " ms in total)";
+}
+
+/// Measures the throughput of decoding .smx / .smp sprite files, both including reading the
+/// files (Sprite::LoadFromFile()) and from files that are already in memory (Sprite::LoadFromData()).
+/// For reference, it also measures only reading the files with one fread() call per SMPPixel,
+/// which is what the per-pixel reading in the previous SMP decoding amounted to.
+///
+/// Each sprite argument may be a file or a directory, of which all .smx and .smp files are used.
+///
+/// Usage: FreeAgeSpriteBenchmark palettes.conf repetition_count sprite...
+int main(int argc, char** argv) {
+  // Initialize loguru.
+  loguru::g_preamble_date = false;
+  loguru::g_preamble_thread = false;
+  loguru::g_preamble_uptime = false;
+  loguru::g_stderr_verbosity = 2;
+  if (argc > 0) {
+    loguru::init(argc, argv, /*verbosity_flag*/ nullptr);
+  }
+  
+  if (argc < 4) {
+    LOG(ERROR) << "Usage: FreeAgeSpriteBenchmark palettes.conf repetition_count sprite...";
+    return 1;
+  }
+  
+  Palettes palettes;
+  if (!ReadPalettesConf(argv[1], &palettes)) {
+    LOG(ERROR) << "Failed to load the palettes: " << argv[1];
+    return 1;
+  }
+  int repetitionCount = std::max(1, std::stoi(argv[2]));
+  
+  std::vector<std::filesystem::path> paths;
+  for (int i = 3; i < argc; ++ i) {
+    std::filesystem::path path = argv[i];
+    if (!std::filesystem::is_directory(path)) {
+      paths.push_back(path);
+      continue;
+    }
+    for (const auto& entry : std::filesystem::directory_iterator(path)) {
+      std::string extension = entry.path().extension().string();
+      std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+      if (extension == ".smx" || extension == ".smp") {
+        paths.push_back(entry.path());
+      }
+    }
+  }
+  std::sort(paths.begin(), paths.end());
+  
+  // Read all files into memory and decode each of them once, which checks that
+  // they are valid, counts their frames, and warms up the file system cache.
+  std::vector<std::vector<u8>> fileContents(paths.size());
+  usize byteCount = 0;
+  usize frameCount = 0;
+  for (usize i = 0; i < paths.size(); ++ i) {
+    Sprite sprite;
+    if (!ReadWholeFile(paths[i], &fileContents[i]) ||
+        !sprite.LoadFromData(fileContents[i].data(), fileContents[i].size(), palettes)) {
+      LOG(ERROR) << "Failed to load: " << paths[i].string();
+      return 1;
+    }
+    byteCount += fileContents[i].size();
+    frameCount += sprite.NumFrames();
+  }
+  LOG(INFO) << "Benchmarking with " << paths.size() << " sprite files (" << frameCount << " frames, "
+            << (byteCount / (1024. * 1024.)) << " MiB) and " << repetitionCount << " repetitions ...";
+  
+  // Decode the sprites from memory.
+  TimePoint startTime = Clock::now();
+  for (int repetition = 0; repetition < repetitionCount; ++ repetition) {
+    for (const std::vector<u8>& data : fileContents) {
+      Sprite sprite;
+      sprite.LoadFromData(data.data(), data.size(), palettes);
+    }
+  }
+  PrintThroughput("Decoding from memory     ", repetitionCount * byteCount, repetitionCount * frameCount, SecondsDuration(Clock::now() - startTime).count());
+  
+  // Read and decode the sprite files.
+  startTime = Clock::now();
+  for (int repetition = 0; repetition < repetitionCount; ++ repetition) {
+    for (const std::filesystem::path& path : paths) {
+      Sprite sprite;
+      sprite.LoadFromFile(path.string().c_str(), palettes);
+    }
+  }
+  PrintThroughput("Reading and decoding     ", repetitionCount * byteCount, repetitionCount * frameCount, SecondsDuration(Clock::now() - startTime).count());
+  
+  // Only read the sprite files with one fread() call per pixel.
+  startTime = Clock::now();
+  usize readByteCount = 0;
+  for (int repetition = 0; repetition < repetitionCount; ++ repetition) {
+    for (const std::filesystem::path& path : paths) {
+      readByteCount += ReadFileInPixelSizedPieces(path);
+    }
+  }
+  PrintThroughput("Reading per pixel (ref.) ", readByteCount, repetitionCount * frameCount, SecondsDuration(Clock::now() - startTime).count());
+  
+  return 0;
+}
@@ -4,6 +4,8 @@
 
 #include "FreeAge/client/building.hpp"
 
+#include <cmath>
+
 #include "FreeAge/common/logging.hpp"
 #include "FreeAge/client/map.hpp"
 #include "FreeAge/client/mod_manager.hpp"
@@ -39,12 +41,6 @@ bool ClientBuildingType::Load(BuildingType type, const std::filesystem::path& gr
     }
   }
   
-  const auto& buildingSprite = sprites[static_cast<int>(BuildingSprite::Building)]->sprite;
-  maxCenterY = 0;
-  for (int frame = 0; frame < buildingSprite.NumFrames(); ++ frame) {
-    maxCenterY = std::max(maxCenterY, buildingSprite.frame(frame).graphic.centerY);
-  }
-  
   std::filesystem::path ingameTexturesSubPath = std::filesystem::path("widgetui") / "textures" / "ingame";
   std::filesystem::path iconFilename = GetIconFilename();
   if (!iconFilename.empty()) {
@@ -56,6 +52,14 @@ bool ClientBuildingType::Load(BuildingType type, const std::filesystem::path& gr
   return true;
 }
 
+void ClientBuildingType::FinishLoading() {
+  const auto& buildingSprite = sprites[static_cast<int>(BuildingSprite::Building)]->sprite;
+  maxCenterY = 0;
+  for (int frame = 0; frame < buildingSprite.NumFrames(); ++ frame) {
+    maxCenterY = std::max(maxCenterY, buildingSprite.frame(frame).graphic.centerY);
+  }
+}
+
 ClientBuildingType::~ClientBuildingType() {
   for (SpriteAndTextures* sprite : sprites) {
     if (sprite) {
@@ -446,7 +450,30 @@ void ClientBuilding::DequeueUnit(int index) {
   
   productionQueue.erase(productionQueue.begin() + index);
   if (index == 0) {
-    productionPercentage = 0;
-    productionProgressPerSecond = 0;
+    productionStartServerTime = 0;
+    productionEndServerTime = 0;
+  }
+}
+
+void ClientBuilding::UpdateGameState(double serverTime) {
+  if (constructionPercentagePerSecond <= 0 || buildPercentage == 100) {
+    return;
   }
+  
+  // The building is only completed by the server's BuildPercentageUpdate message.
+  float percentage = std::min<double>(
+      std::nextafter(100.f, 0.f),
+      constructionPercentage + std::max(0., serverTime - constructionServerTime) * constructionPercentagePerSecond);
+  if (percentage <= buildPercentage) {
+    return;
+  }
+  
+  // Add the HP along with the build percentage, like the server does.
+  u32 maxHP = GetBuildingMaxHP(type);
+  constructionHPRemainder += (percentage - buildPercentage) / 100 * maxHP;
+  u32 addedHP = static_cast<u32>(constructionHPRemainder);
+  constructionHPRemainder -= addedHP;
+  SetHP(std::min(maxHP, GetHP() + addedHP));
+  
+  buildPercentage = percentage;
 }
@@ -4,6 +4,8 @@
 
 #pragma once
 
+#include <algorithm>
+
 #include <QSize>
 #include <QString>
 
@@ -33,6 +35,9 @@ class ClientBuildingType {
   ~ClientBuildingType();
   
   bool Load(BuildingType type, const std::filesystem::path& graphicsSubPath, const std::filesystem::path& cachePath, ColorDilationShader* colorDilationShader, const Palettes& palettes);
+  /// Computes the data that depends on the contents of the sprites that were requested by Load().
+  /// Must be called once these sprites are loaded (see SpriteManager::FinishDeferredLoading()).
+  void FinishLoading();
   
   QSize GetSize() const;
   bool UsesRandomSpriteFrame() const;
@@ -127,22 +132,36 @@ class ClientBuilding : public ClientObject {
   inline float GetBuildPercentage() const { return buildPercentage; }
   inline void SetBuildPercentage(float percentage) { buildPercentage = percentage; }
   
+  /// Sets the construction state received from the server: at the given server time, the building has the
+  /// given build percentage, which increases by percentagePerSecond from then on.
+  inline void SetConstructionState(double serverTime, float percentage, float percentagePerSecond) {
+    buildPercentage = percentage;
+    constructionServerTime = serverTime;
+    constructionPercentage = percentage;
+    constructionPercentagePerSecond = percentagePerSecond;
+    constructionHPRemainder = 0;
+  }
+  
+  /// Predicts the build percentage and HP of a building under construction for the given server time.
+  void UpdateGameState(double serverTime);
+  
   /// Adds a unit to the end of the production queue.
   inline void QueueUnit(UnitType type) { productionQueue.push_back(type); }
   void DequeueUnit(int index);
   inline const std::vector<UnitType>& GetProductionQueue() const { return productionQueue; }
   
-  inline void SetProductionState(double serverTime, float percentage, float progressPerSecond) {
-    productionStateServerTime = serverTime;
-    productionPercentage = percentage;
-    productionProgressPerSecond = progressPerSecond;
+  /// Sets the server times at which the production of the first item in the queue started and will be completed.
+  inline void SetProductionTimes(double startServerTime, double endServerTime) {
+    productionStartServerTime = startServerTime;
+    productionEndServerTime = endServerTime;
   }
   
+  /// Returns the progress on the production of the first item in the queue at the given server time, in percent.
   inline float GetProductionProgress(double serverTime) {
-    if (productionProgressPerSecond == 0) {
-      return productionPercentage;
+    if (productionEndServerTime <= productionStartServerTime) {
+      return 0;
     } else {
-      return productionPercentage + (serverTime - productionStateServerTime) * productionProgressPerSecond;
+      return std::max(0., std::min(100., 100 * (serverTime - productionStartServerTime) / (productionEndServerTime - productionStartServerTime)));
     }
   }
   
@@ -150,14 +169,18 @@ class ClientBuilding : public ClientObject {
   // TODO: Allow to queue technologies as well
   std::vector<UnitType> productionQueue;
   
-  /// The server time for which productionPercentage is valid.
-  double productionStateServerTime;
+  /// The server times at which the production of the first item in the productionQueue started and will be completed.
+  /// Both are zero if the production did not start yet.
+  double productionStartServerTime = 0;
+  double productionEndServerTime = 0;
   
-  /// The progress on the production of the first item in the productionQueue, in percent, at productionStateServerTime.
-  float productionPercentage = 0;
+  /// The construction state that was last received from the server (see SetConstructionState()).
+  double constructionServerTime = 0;
+  float constructionPercentage = 0;
+  float constructionPercentagePerSecond = 0;
   
-  /// The value that should be added per second to productionPercentage.
-  float productionProgressPerSecond = 0;
+  /// The fractional HP that the construction added, which was not added to the integer HP yet.
+  float constructionHPRemainder = 0;
   
   BuildingType type;
   
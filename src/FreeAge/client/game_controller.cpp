@@ -118,8 +118,8 @@ void GameController::ParseMessage(const QByteArray& data, ServerToClientMessage
   case ServerToClientMessage::SetCarriedResources:
     HandleSetCarriedResourcesMessage(data);
     break;
-  case ServerToClientMessage::UnitMovement:
-    HandleUnitMovementMessage(data);
+  case ServerToClientMessage::UnitMovementBatch:
+    HandleUnitMovementBatchMessage(data);
     break;
   case ServerToClientMessage::HPUpdate:
     HandleHPUpdateMessage(data);
@@ -130,6 +130,9 @@ void GameController::ParseMessage(const QByteArray& data, ServerToClientMessage
   case ServerToClientMessage::ObjectDeath:
     HandleObjectDeathMessage(data);
     break;
+  case ServerToClientMessage::ObjectLeaveView:
+    HandleObjectLeaveViewMessage(data);
+    break;
   case ServerToClientMessage::BuildPercentageUpdate:
     HandleBuildPercentageUpdate(data);
     break;
@@ -215,22 +218,50 @@ void GameController::HandleGameBeginMessage(const QByteArray& data) {
 }
 
 void GameController::HandleMapUncoverMessage(const QByteArray& data) {
-  if (data.size() < (map->GetWidth() + 1) * (map->GetHeight() + 1)) {
+  if (data.size() < 4) {
     LOG(ERROR) << "Received a too short MapUncover message";
     return;
   }
+  const char* buffer = data.data();
   
-  for (int y = 0; y <= map->GetHeight(); ++ y) {
-    for (int x = 0; x <= map->GetWidth(); ++ x) {
-      int elevation = data[x + y * (map->GetWidth() + 1)];
-      if (elevation < 0 || elevation > map->GetMaxElevation()) {
-        LOG(WARNING) << "Received invalid map elevation: " << elevation << " (should be from 0 to " << map->GetMaxElevation() << ")";
-      }
+  int minX = mango::uload16(buffer + 0) * kMapChunkSize;
+  int minY = mango::uload16(buffer + 2) * kMapChunkSize;
+  if (minX > map->GetWidth() || minY > map->GetHeight()) {
+    LOG(ERROR) << "Received a MapUncover message for an out-of-bounds map chunk";
+    return;
+  }
+  int endX = std::min(minX + kMapChunkSize, map->GetWidth() + 1);
+  int endY = std::min(minY + kMapChunkSize, map->GetHeight() + 1);
+  
+  // Decode the run-length encoded elevations, which are stored as pairs of (run length, elevation).
+  int x = minX;
+  int y = minY;
+  for (int offset = 4; offset + 1 < data.size(); offset += 2) {
+    int runLength = static_cast<u8>(buffer[offset]);
+    int elevation = static_cast<u8>(buffer[offset + 1]);
+    if (elevation > map->GetMaxElevation()) {
+      LOG(WARNING) << "Received invalid map elevation: " << elevation << " (should be from 0 to " << map->GetMaxElevation() << ")";
+    }
+    if (runLength > (endY - y) * (endX - minX) - (x - minX)) {
+      LOG(ERROR) << "Received a MapUncover message with too many elevations";
+      break;
+    }
+    
+    for (int i = 0; i < runLength; ++ i) {
       map->elevationAt(x, y) = elevation;
+      ++ x;
+      if (x == endX) {
+        x = minX;
+        ++ y;
+      }
     }
   }
+  if (y != endY) {
+    LOG(ERROR) << "Received a MapUncover message with too few elevations";
+  }
   
-  map->SetNeedsRenderResourcesUpdate(true);
+  // Only the terrain geometry of the chunk's rows needs to be updated.
+  map->ElevationChanged(minY, endY - 1);
 }
 
 void GameController::HandleAddObjectMessage(const QByteArray& data) {
@@ -345,38 +376,56 @@ void GameController::HandleObjectDeathMessage(const QByteArray& data) {
   map->GetObjects().erase(it);
 }
 
-void GameController::HandleUnitMovementMessage(const QByteArray& data) {
-  if (data.size() < 21) {
-    LOG(ERROR) << "Received a too short SetCarriedResources message";
+void GameController::HandleObjectLeaveViewMessage(const QByteArray& data) {
+  if (data.size() < 4) {
+    LOG(ERROR) << "Received a too short ObjectLeaveView message";
     return;
   }
   const char* buffer = data.data();
   
-  u32 unitId = mango::uload32(buffer + 0);
-  QPointF startPoint(
-      *reinterpret_cast<const float*>(buffer + 4),
-      *reinterpret_cast<const float*>(buffer + 8));
-  QPointF speed(
-      *reinterpret_cast<const float*>(buffer + 12),
-      *reinterpret_cast<const float*>(buffer + 16));
-  if (buffer[20] >= static_cast<int>(UnitAction::NumActions)) {
-    LOG(ERROR) << "Received UnitMovement message with invalid UnitAction";
-    return;
-  }
-  UnitAction action = static_cast<UnitAction>(buffer[20]);
-  
-  auto it = map->GetObjects().find(unitId);
+  u32 objectId = mango::uload32(buffer + 0);
+  auto it = map->GetObjects().find(objectId);
   if (it == map->GetObjects().end()) {
-    LOG(ERROR) << "Received a UnitMovement message for an object ID that is not in the map.";
+    LOG(ERROR) << "Received an ObjectLeaveView message for an object ID that is not in the map.";
     return;
   }
-  if (!it->second->isUnit()) {
-    LOG(ERROR) << "Received a UnitMovement message for an object ID that is a different type than a unit.";
+  if (it->second->GetPlayerIndex() == match->GetPlayerIndex()) {
+    LOG(ERROR) << "Received an ObjectLeaveView message for an object of the own player.";
     return;
   }
   
-  ClientUnit* unit = AsUnit(it->second);
-  unit->SetMovementSegment(currentGameStepServerTime, startPoint, speed, action, map.get(), match.get());
+  // The object is simply forgotten. It gets re-added with an AddObject message if it enters the view again.
+  delete it->second;
+  map->GetObjects().erase(it);
+}
+
+void GameController::HandleUnitMovementBatchMessage(const QByteArray& data) {
+  const char* buffer = data.data();
+  int offset = 0;
+  UnitMovementBatchEntry entry;
+  while (offset < data.size()) {
+    if (!ParseUnitMovementBatchEntry(buffer, data.size(), &offset, &entry)) {
+      LOG(ERROR) << "Received a UnitMovementBatch message with an invalid entry";
+      return;
+    }
+    
+    auto it = map->GetObjects().find(entry.unitId);
+    if (it == map->GetObjects().end()) {
+      LOG(ERROR) << "Received a UnitMovementBatch entry for an object ID that is not in the map.";
+      continue;
+    }
+    if (!it->second->isUnit()) {
+      LOG(ERROR) << "Received a UnitMovementBatch entry for an object ID that is a different type than a unit.";
+      continue;
+    }
+    
+    ClientUnit* unit = AsUnit(it->second);
+    QPoint startPointFixedPoint = unit->GetMovementReferenceCoord() + entry.coordDelta;
+    unit->SetMovementReferenceCoord(startPointFixedPoint);
+    
+    QPointF startPoint(startPointFixedPoint.x() / kUnitMovementCoordScale, startPointFixedPoint.y() / kUnitMovementCoordScale);
+    unit->SetMovementSegment(currentGameStepServerTime, startPoint, entry.speed, entry.action, map.get(), match.get());
+  }
 }
 
 void GameController::HandleGameStepTimeMessage(const QByteArray& data) {
@@ -403,7 +452,7 @@ void GameController::HandleResourcesUpdateMessage(const QByteArray& data, Resour
 }
 
 void GameController::HandleBuildPercentageUpdate(const QByteArray& data) {
-  if (data.size() < 4 + 4) {
+  if (data.size() < 4 + 4 + 4) {
     LOG(ERROR) << "Received a too short BuildPercentageUpdate message";
     return;
   }
@@ -422,6 +471,8 @@ void GameController::HandleBuildPercentageUpdate(const QByteArray& data) {
   
   float percentage;
   memcpy(&percentage, buffer + 4, 4);
+  float percentagePerSecond;
+  memcpy(&percentagePerSecond, buffer + 8, 4);
   
   ClientBuilding* building = AsBuilding(it->second);
   if (building->GetBuildPercentage() != 100 && percentage == 100) {
@@ -432,7 +483,7 @@ void GameController::HandleBuildPercentageUpdate(const QByteArray& data) {
       building->UpdateFieldOfView(map.get(), 1);
     }
   }
-  building->SetBuildPercentage(percentage);
+  building->SetConstructionState(currentGameStepServerTime, percentage, percentagePerSecond);
 }
 
 void GameController::HandleChangeUnitTypeMessage(const QByteArray& data) {
@@ -591,7 +642,7 @@ void GameController::HandleQueueUnitMessage(const QByteArray& data) {
 }
 
 void GameController::HandleUpdateProductionMessage(const QByteArray& data) {
-  if (data.size() < 4 + 4 + 4) {
+  if (data.size() < 4 + 8 + 8) {
     LOG(ERROR) << "Received a too short UpdateProduction message";
     return;
   }
@@ -608,11 +659,13 @@ void GameController::HandleUpdateProductionMessage(const QByteArray& data) {
     return;
   }
   
-  float percentage = *reinterpret_cast<const float*>(buffer + 4);
-  float progressPerSecond = *reinterpret_cast<const float*>(buffer + 8);
+  double startServerTime;
+  memcpy(&startServerTime, buffer + 4, 8);
+  double endServerTime;
+  memcpy(&endServerTime, buffer + 12, 8);
   
   ClientBuilding* building = AsBuilding(it->second);
-  building->SetProductionState(currentGameStepServerTime, percentage, progressPerSecond);
+  building->SetProductionTimes(startServerTime, endServerTime);
 }
 
 void GameController::HandleRemoveFromProductionQueueMessage(const QByteArray& data) {
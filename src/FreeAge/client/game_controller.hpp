@@ -56,7 +56,8 @@ class GameController : public QObject {
   void HandleMapUncoverMessage(const QByteArray& data);
   void HandleAddObjectMessage(const QByteArray& data);
   void HandleObjectDeathMessage(const QByteArray& data);
-  void HandleUnitMovementMessage(const QByteArray& data);
+  void HandleObjectLeaveViewMessage(const QByteArray& data);
+  void HandleUnitMovementBatchMessage(const QByteArray& data);
   void HandleGameStepTimeMessage(const QByteArray& data);
   void HandleResourcesUpdateMessage(const QByteArray& data, ResourceAmount* resources);
   void HandleBuildPercentageUpdate(const QByteArray& data);
@@ -278,6 +278,8 @@ void Map::Render(float* viewMatrix, const std::filesystem::path& graphicsSubPath
   if (needsRenderResourcesUpdate) {
     UpdateRenderResources(graphicsSubPath, f);
     needsRenderResourcesUpdate = false;
+  } else if (elevationChangeMaxY >= elevationChangeMinY) {
+    UpdateChangedGeometry(f);
   }
   if (viewCountChangeMaxX >= viewCountChangeMinX &&
       viewCountChangeMaxY >= viewCountChangeMinY) {
@@ -390,90 +392,24 @@ void Map::UpdateRenderResources(const std::filesystem::path& graphicsSubPath, QO
     f->glDeleteBuffers(1, &indexBuffer);
   }
   
-  int elementSizeInBytes = 5 * sizeof(float);
-  u8* data = new u8[(width + 1) * (height + 1) * elementSizeInBytes];
-  u8* ptr = data;
+  int vertexCount = (width + 1) * (height + 1);
+  float* data = new float[5 * vertexCount];
   for (int y = 0; y <= height; ++ y) {
     for (int x = 0; x <= width; ++ x) {
-      QPointF projectedCoord = TileCornerToProjectedCoord(x, y);
-      
-      // Estimate the vertex normal
-      // TODO: This is quite messy, it would be nice to have a proper 3D vector class for this.
-      float elevationHere = elevationAt(x, y);
-      float topLeftHeight = (kTileProjectedElevationDifference / kTileDiagonalLength) * (elevationAt(std::max(0, x - 1), y) - elevationHere);
-      float bottomRightHeight = (kTileProjectedElevationDifference / kTileDiagonalLength) * (elevationAt(std::min(width - 1, x + 1), y) - elevationHere);
-      float bottomLeftHeight = (kTileProjectedElevationDifference / kTileDiagonalLength) * (elevationAt(x, std::max(0, y - 1)) - elevationHere);
-      float topRightHeight = (kTileProjectedElevationDifference / kTileDiagonalLength) * (elevationAt(x, std::min(height - 1, y + 1)) - elevationHere);
-      
-      float normalX = topLeftHeight - bottomRightHeight;
-      float normalY = bottomLeftHeight - topRightHeight;
-      
-      float normalLength = sqrtf(normalX * normalX + normalY * normalY + 1 * 1);
-      normalX /= normalLength;
-      normalY /= normalLength;
-      float normalZ = 1 / normalLength;
-      
-      const float lightingDirectionX = 0.3f / sqrtf(0.3f * 0.3f + 0 * 0 + 0.8f * 0.8f);
-      const float lightingDirectionY = 0.f;
-      const float lightingDirectionZ = 0.8f / sqrtf(0.3f * 0.3f + 0 * 0 + 0.8f * 0.8f);
-      
-      float dot = normalX * lightingDirectionX + normalY * lightingDirectionY + normalZ * lightingDirectionZ;
-      
-      // Scale such that upright terrain gets a lighting factor of one
-      float lightingFactor = dot / lightingDirectionZ;
-      
-      // Position
-      *reinterpret_cast<float*>(ptr) = projectedCoord.x();
-      ptr += sizeof(float);
-      *reinterpret_cast<float*>(ptr) = projectedCoord.y();
-      ptr += sizeof(float);
-      
-      // Texture coordinate
-      *reinterpret_cast<float*>(ptr) = 0.1f * x;
-      ptr += sizeof(float);
-      *reinterpret_cast<float*>(ptr) = 0.1f * y;
-      ptr += sizeof(float);
-      
-      // Darkening factor for map lighting
-      // NOTE: This is passed on as part of the texture coordinates (for convenience)
-      *reinterpret_cast<float*>(ptr) = lightingFactor;
-      ptr += sizeof(float);
+      WriteTerrainVertex(x, y, data + 5 * (x + (width + 1) * y));
     }
   }
   f->glGenBuffers(1, &vertexBuffer);
   f->glBindBuffer(GL_ARRAY_BUFFER, vertexBuffer);
-  f->glBufferData(GL_ARRAY_BUFFER, (width + 1) * (height + 1) * elementSizeInBytes, data, GL_STATIC_DRAW);
+  f->glBufferData(GL_ARRAY_BUFFER, 5 * vertexCount * sizeof(float), data, GL_STATIC_DRAW);
   delete[] data;
   CHECK_OPENGL_NO_ERROR();
   
   // Build index buffer
   u32* indexData = new u32[width * height * 6];
-  u32* indexPtr = indexData;
   for (int y = 0; y < height; ++ y) {
     for (int x = 0; x < width; ++ x) {
-      int horizontalDiff = std::abs(elevationAt(x, y) - elevationAt(x + 1, y + 1));
-      int verticalDiff = std::abs(elevationAt(x + 1, y) - elevationAt(x, y + 1));
-      
-      // The special case was needed to make the elevation difference visible at all, since in this case,
-      // the left, upper, and right vertex are all at the same y-coordinate in projected coordinates.
-      bool specialCase = (horizontalDiff == 0) && ((elevationAt(x + 1, y) - elevationAt(x, y + 1)) == 1);
-      if (horizontalDiff < verticalDiff && !specialCase) {
-        *indexPtr++ = (x + 0) + (width + 1) * (y + 0);
-        *indexPtr++ = (x + 1) + (width + 1) * (y + 1);
-        *indexPtr++ = (x + 0) + (width + 1) * (y + 1);
-        
-        *indexPtr++ = (x + 0) + (width + 1) * (y + 0);
-        *indexPtr++ = (x + 1) + (width + 1) * (y + 0);
-        *indexPtr++ = (x + 1) + (width + 1) * (y + 1);
-      } else {
-        *indexPtr++ = (x + 0) + (width + 1) * (y + 0);
-        *indexPtr++ = (x + 1) + (width + 1) * (y + 0);
-        *indexPtr++ = (x + 0) + (width + 1) * (y + 1);
-        
-        *indexPtr++ = (x + 1) + (width + 1) * (y + 0);
-        *indexPtr++ = (x + 1) + (width + 1) * (y + 1);
-        *indexPtr++ = (x + 0) + (width + 1) * (y + 1);
-      }
+      WriteTerrainTileIndices(x, y, indexData + 6 * (x + width * y));
     }
   }
   f->glGenBuffers(1, &indexBuffer);
@@ -483,12 +419,123 @@ void Map::UpdateRenderResources(const std::filesystem::path& graphicsSubPath, QO
   CHECK_OPENGL_NO_ERROR();
   
   haveGeometryBuffersBeenInitialized = true;
+  elevationChangeMinY = std::numeric_limits<int>::max();
+  elevationChangeMaxY = -1;
   
   terrainShader.reset(new TerrainShader());
   
   // TODO: Un-load the render resources again on destruction
 }
 
+void Map::WriteTerrainVertex(int x, int y, float* out) const {
+  QPointF projectedCoord = TileCornerToProjectedCoord(x, y);
+  
+  // Estimate the vertex normal
+  // TODO: This is quite messy, it would be nice to have a proper 3D vector class for this.
+  float elevationHere = elevationAt(x, y);
+  float topLeftHeight = (kTileProjectedElevationDifference / kTileDiagonalLength) * (elevationAt(std::max(0, x - 1), y) - elevationHere);
+  float bottomRightHeight = (kTileProjectedElevationDifference / kTileDiagonalLength) * (elevationAt(std::min(width - 1, x + 1), y) - elevationHere);
+  float bottomLeftHeight = (kTileProjectedElevationDifference / kTileDiagonalLength) * (elevationAt(x, std::max(0, y - 1)) - elevationHere);
+  float topRightHeight = (kTileProjectedElevationDifference / kTileDiagonalLength) * (elevationAt(x, std::min(height - 1, y + 1)) - elevationHere);
+  
+  float normalX = topLeftHeight - bottomRightHeight;
+  float normalY = bottomLeftHeight - topRightHeight;
+  
+  float normalLength = sqrtf(normalX * normalX + normalY * normalY + 1 * 1);
+  normalX /= normalLength;
+  normalY /= normalLength;
+  float normalZ = 1 / normalLength;
+  
+  const float lightingDirectionX = 0.3f / sqrtf(0.3f * 0.3f + 0 * 0 + 0.8f * 0.8f);
+  const float lightingDirectionY = 0.f;
+  const float lightingDirectionZ = 0.8f / sqrtf(0.3f * 0.3f + 0 * 0 + 0.8f * 0.8f);
+  
+  float dot = normalX * lightingDirectionX + normalY * lightingDirectionY + normalZ * lightingDirectionZ;
+  
+  // Scale such that upright terrain gets a lighting factor of one
+  float lightingFactor = dot / lightingDirectionZ;
+  
+  // Position
+  out[0] = projectedCoord.x();
+  out[1] = projectedCoord.y();
+  
+  // Texture coordinate
+  out[2] = 0.1f * x;
+  out[3] = 0.1f * y;
+  
+  // Darkening factor for map lighting
+  // NOTE: This is passed on as part of the texture coordinates (for convenience)
+  out[4] = lightingFactor;
+}
+
+void Map::WriteTerrainTileIndices(int x, int y, u32* out) const {
+  int horizontalDiff = std::abs(elevationAt(x, y) - elevationAt(x + 1, y + 1));
+  int verticalDiff = std::abs(elevationAt(x + 1, y) - elevationAt(x, y + 1));
+  
+  // The special case was needed to make the elevation difference visible at all, since in this case,
+  // the left, upper, and right vertex are all at the same y-coordinate in projected coordinates.
+  bool specialCase = (horizontalDiff == 0) && ((elevationAt(x + 1, y) - elevationAt(x, y + 1)) == 1);
+  if (horizontalDiff < verticalDiff && !specialCase) {
+    *out++ = (x + 0) + (width + 1) * (y + 0);
+    *out++ = (x + 1) + (width + 1) * (y + 1);
+    *out++ = (x + 0) + (width + 1) * (y + 1);
+    
+    *out++ = (x + 0) + (width + 1) * (y + 0);
+    *out++ = (x + 1) + (width + 1) * (y + 0);
+    *out++ = (x + 1) + (width + 1) * (y + 1);
+  } else {
+    *out++ = (x + 0) + (width + 1) * (y + 0);
+    *out++ = (x + 1) + (width + 1) * (y + 0);
+    *out++ = (x + 0) + (width + 1) * (y + 1);
+    
+    *out++ = (x + 1) + (width + 1) * (y + 0);
+    *out++ = (x + 1) + (width + 1) * (y + 1);
+    *out++ = (x + 0) + (width + 1) * (y + 1);
+  }
+}
+
+void Map::UpdateChangedGeometry(QOpenGLFunctions_3_2_Core* f) {
+  // The vertex normals depend on the elevations of the neighboring corners, and the triangulation of a tile
+  // depends on the elevations of its corners. Thus, the rows next to the changed rows must be updated as well.
+  // Whole rows are updated, since they are contiguous in the buffers.
+  int minVertexY = std::max(0, elevationChangeMinY - 1);
+  int maxVertexY = std::min(height, elevationChangeMaxY + 1);
+  int vertexCount = (maxVertexY - minVertexY + 1) * (width + 1);
+  float* data = new float[5 * vertexCount];
+  float* dataPtr = data;
+  for (int y = minVertexY; y <= maxVertexY; ++ y) {
+    for (int x = 0; x <= width; ++ x) {
+      WriteTerrainVertex(x, y, dataPtr);
+      dataPtr += 5;
+    }
+  }
+  f->glBindBuffer(GL_ARRAY_BUFFER, vertexBuffer);
+  f->glBufferSubData(GL_ARRAY_BUFFER, 5 * minVertexY * (width + 1) * sizeof(float), 5 * vertexCount * sizeof(float), data);
+  delete[] data;
+  CHECK_OPENGL_NO_ERROR();
+  
+  int minTileY = std::max(0, elevationChangeMinY - 1);
+  int maxTileY = std::min(height - 1, elevationChangeMaxY);
+  if (maxTileY >= minTileY) {
+    int tileCount = (maxTileY - minTileY + 1) * width;
+    u32* indexData = new u32[6 * tileCount];
+    u32* indexPtr = indexData;
+    for (int y = minTileY; y <= maxTileY; ++ y) {
+      for (int x = 0; x < width; ++ x) {
+        WriteTerrainTileIndices(x, y, indexPtr);
+        indexPtr += 6;
+      }
+    }
+    f->glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indexBuffer);
+    f->glBufferSubData(GL_ELEMENT_ARRAY_BUFFER, 6 * minTileY * width * sizeof(u32), 6 * tileCount * sizeof(u32), indexData);
+    delete[] indexData;
+    CHECK_OPENGL_NO_ERROR();
+  }
+  
+  elevationChangeMinY = std::numeric_limits<int>::max();
+  elevationChangeMaxY = -1;
+}
+
 void Map::UpdateViewCountTexture(QOpenGLFunctions_3_2_Core* f) {
   if (!haveViewTexture) {
     f->glGenTextures(1, &viewTextureId);
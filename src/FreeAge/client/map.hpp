@@ -4,6 +4,7 @@
 
 #pragma once
 
+#include <limits>
 #include <memory>
 
 #include <QOpenGLFunctions_3_2_Core>
@@ -66,6 +67,7 @@ class Map {
   bool ProjectedCoordToMapCoord(const QPointF& projectedCoord, QPointF* mapCoord) const;
   
   /// Returns the elevation at the given tile corner.
+  /// After you make changes, you must call ElevationChanged().
   inline int& elevationAt(int cornerX, int cornerY) { return elevation[cornerY * (width + 1) + cornerX]; }
   inline const int& elevationAt(int cornerX, int cornerY) const { return elevation[cornerY * (width + 1) + cornerX]; }
   
@@ -80,6 +82,13 @@ class Map {
     viewCountChangeMaxY = std::max(viewCountChangeMaxY, maxY);
   }
   
+  /// Marks the tile corner rows from minCornerY to maxCornerY (inclusive) as changed, such that
+  /// only the terrain geometry of these rows (and their neighbors) is updated before the next rendering call.
+  inline void ElevationChanged(int minCornerY, int maxCornerY) {
+    elevationChangeMinY = std::min(elevationChangeMinY, minCornerY);
+    elevationChangeMaxY = std::max(elevationChangeMaxY, maxCornerY);
+  }
+  
   /// Writes the field-of-view of a unit or building into the viewCount.
   /// If change is 1, adds a view count, if it is -1, removes one.
   void UpdateFieldOfView(float centerMapCoordX, float centerMapCoordY, float radius, int change);
@@ -108,6 +117,13 @@ class Map {
  private:
   void UpdateRenderResources(const std::filesystem::path& graphicsSubPath, QOpenGLFunctions_3_2_Core* f);
   void UpdateViewCountTexture(QOpenGLFunctions_3_2_Core* f);
+  /// Updates the parts of the geometry buffers that depend on the elevation rows passed to ElevationChanged().
+  void UpdateChangedGeometry(QOpenGLFunctions_3_2_Core* f);
+  
+  /// Writes the 5 floats of the terrain vertex at the given tile corner to out.
+  void WriteTerrainVertex(int x, int y, float* out) const;
+  /// Writes the 6 indices of the two terrain triangles of the given tile to out.
+  void WriteTerrainTileIndices(int x, int y, u32* out) const;
   
   /// The maximum possible elevation level (the lowest is zero).
   /// This may be higher than the maximum actually existing
@@ -144,6 +160,11 @@ class Map {
   int viewCountChangeMaxX;
   int viewCountChangeMaxY;
   
+  /// The range of tile corner rows whose elevation changed since the geometry buffers were last updated.
+  /// If minY > maxY, no update is required.
+  int elevationChangeMinY = std::numeric_limits<int>::max();
+  int elevationChangeMaxY = -1;
+  
   bool haveViewTexture = false;
   GLuint viewTextureId;
   
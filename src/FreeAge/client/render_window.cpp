@@ -28,6 +28,7 @@
 #include "FreeAge/client/game_controller.hpp"
 #include "FreeAge/client/health_bar.hpp"
 #include "FreeAge/common/logging.hpp"
+#include "FreeAge/common/thread_pool.hpp"
 #include "FreeAge/client/mod_manager.hpp"
 #include "FreeAge/client/opengl.hpp"
 #include "FreeAge/client/shader_color_dilation.hpp"
@@ -349,7 +350,11 @@ bool RenderWindow::LoadResources() {
   hpDisplay.Initialize();
   carriedResourcesDisplay.Initialize();
   
-  // Load unit resources.
+  // Load unit and building resources. Their sprites are decoded in parallel on a thread pool while
+  // the types request them, and their textures are uploaded here once all sprites were requested.
+  ThreadPool spriteLoadingThreadPool(ThreadPool::GetDefaultThreadCount());
+  SpriteManager::Instance().BeginDeferredLoading(&spriteLoadingThreadPool);
+  
   LOG(1) << "LoadResource(): Starting to load units";
   
   auto& unitTypes = ClientUnitType::GetUnitTypes();
@@ -358,13 +363,11 @@ bool RenderWindow::LoadResources() {
     if (!unitTypes[unitType].Load(static_cast<UnitType>(unitType), graphicsSubPath, cachePath, colorDilationShader.get(), palettes)) {
       LOG(ERROR) << "Exiting because of a resource load error for unit " << unitType << ".";
       emit LoadingError(tr("Failed to load unit type: %1. Aborting.").arg(unitType));
+      SpriteManager::Instance().FinishDeferredLoading(colorDilationShader.get(), nullptr);
       return false;
     }
-    
-    didLoadingStep();
   }
   
-  // Load building resources.
   LOG(1) << "LoadResource(): Starting to load buildings";
   
   auto& buildingTypes = ClientBuildingType::GetBuildingTypes();
@@ -373,12 +376,39 @@ bool RenderWindow::LoadResources() {
     if (!buildingTypes[buildingType].Load(static_cast<BuildingType>(buildingType), graphicsSubPath, cachePath, colorDilationShader.get(), palettes)) {
       LOG(ERROR) << "Exiting because of a resource load error for building " << buildingType << ".";
       emit LoadingError(tr("Failed to load building type: %1. Aborting.").arg(buildingType));
+      SpriteManager::Instance().FinishDeferredLoading(colorDilationShader.get(), nullptr);
       return false;
     }
-    
+  }
+  
+  // The sprites account for one loading step per unit and building type (as when loading the types one after
+  // another), which are distributed evenly over the sprites as they complete.
+  LOG(1) << "LoadResource(): Waiting for the unit and building sprites";
+  
+  constexpr int kSpriteLoadingSteps = static_cast<int>(UnitType::NumUnits) + static_cast<int>(BuildingType::NumBuildings);
+  int spriteLoadingStepsDone = 0;
+  auto didSpriteLoadingSteps = [&](int completedSprites, int totalSprites) {
+    int steps = kSpriteLoadingSteps * completedSprites / totalSprites;
+    for (; spriteLoadingStepsDone < steps; ++ spriteLoadingStepsDone) {
+      didLoadingStep();
+    }
+  };
+  if (!SpriteManager::Instance().FinishDeferredLoading(colorDilationShader.get(), didSpriteLoadingSteps)) {
+    LOG(ERROR) << "Exiting because of a sprite load error.";
+    emit LoadingError(tr("Failed to load the unit and building sprites. Aborting."));
+    return false;
+  }
+  for (; spriteLoadingStepsDone < kSpriteLoadingSteps; ++ spriteLoadingStepsDone) {
     didLoadingStep();
   }
   
+  for (auto& unitType : unitTypes) {
+    unitType.FinishLoading();
+  }
+  for (auto& buildingType : buildingTypes) {
+    buildingType.FinishLoading();
+  }
+  
   // Load "move to" sprite.
   LOG(1) << "LoadResource(): Loading the 'move-to' sprite";
   
@@ -2426,7 +2456,7 @@ void RenderWindow::ShowMenu(bool show) {
 }
 
 struct PossibleSelectedObject {
-  inline PossibleSelectedObject(int id, float score)
+  inline PossibleSelectedObject(u32 id, float score)
       : id(id),
         score(score) {}
   
@@ -2755,9 +2785,8 @@ void RenderWindow::UpdateGameState(double displayedServerTime) {
       ClientUnit* unit = AsUnit(item.second);
       unit->UpdateGameState(displayedServerTime, map.get(), match.get());
     } else if (item.second->isBuilding()) {
-      // TODO: Is this needed?
-      // ClientBuilding* building = AsBuilding(item.second);
-      // building->UpdateGameState(displayedServerTime);
+      ClientBuilding* building = AsBuilding(item.second);
+      building->UpdateGameState(displayedServerTime);
     }
   }
   
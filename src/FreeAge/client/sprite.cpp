@@ -9,6 +9,7 @@
 #include <mango/image/image.hpp>
 
 #include "FreeAge/common/logging.hpp"
+#include "FreeAge/common/thread_pool.hpp"
 #include "FreeAge/common/timing.hpp"
 #include "FreeAge/client/opengl.hpp"
 #include "FreeAge/client/shader_color_dilation.hpp"
@@ -22,30 +23,31 @@ QImage LoadSMXGraphicLayer(
     const std::vector<SMPLayerRowEdge>& rowEdges,
     bool usesEightToFiveCompression,
     int pixelBorder,
-    const Palette& standardPalette,
-    FILE* file) {
+    const SMXColorTable& standardColorTable,
+    const SMXColorTable& playerColorTable,
+    SpriteFileReader* reader) {
   // Read the command and pixel array length
   u32 commandArrayLen;
-  if (fread(&commandArrayLen, sizeof(u32), 1, file) != 1) {
+  if (!reader->Read(&commandArrayLen)) {
     LOG(ERROR) << "Unexpected EOF while trying to read commandArrayLen";
     return QImage();
   }
   
   u32 pixelArrayLen;
-  if (fread(&pixelArrayLen, sizeof(u32), 1, file) != 1) {
+  if (!reader->Read(&pixelArrayLen)) {
     LOG(ERROR) << "Unexpected EOF while trying to read pixelArrayLen";
     return QImage();
   }
   
-  // Read the command and pixel array data
-  std::vector<u8> commandArray(commandArrayLen);
-  if (fread(commandArray.data(), sizeof(u8), commandArrayLen, file) != commandArrayLen) {
+  // Get the command and pixel array data (without copying it)
+  const u8* commandArray = reader->ReadBytes(commandArrayLen);
+  if (!commandArray) {
     LOG(ERROR) << "Unexpected EOF while trying to read commandArray";
     return QImage();
   }
   
-  std::vector<u8> pixelArray(pixelArrayLen);
-  if (fread(pixelArray.data(), sizeof(u8), pixelArrayLen, file) != pixelArrayLen) {
+  const u8* pixelArray = reader->ReadBytes(pixelArrayLen);
+  if (!pixelArray) {
     LOG(ERROR) << "Unexpected EOF while trying to read pixelArray";
     return QImage();
   }
@@ -53,8 +55,13 @@ QImage LoadSMXGraphicLayer(
   // Build the image.
   QImage graphic(layerHeader.width, layerHeader.height, QImage::Format_ARGB32);
   
-  const u8* commandPtr = commandArray.data();
-  const u8* pixelPtr = pixelArray.data();
+  const u8* commandPtr = commandArray;
+  const u8* commandEnd = commandArray + commandArrayLen;
+  const u8* pixelPtr = pixelArray;
+  const u8* pixelEnd = pixelArray + pixelArrayLen;
+  // Both compression types decode the pixels from blocks of 5 bytes.
+  // 8-to-5 compression decodes 2 pixels from each block, 4-plus-1 compression decodes 4 pixels.
+  const int pixelsPerBlock = usesEightToFiveCompression ? 2 : 4;
   int decompressionState = 0;
   for (int row = 0; row < layerHeader.height; ++ row) {
     QRgb* out = reinterpret_cast<QRgb*>(graphic.scanLine(row));
@@ -70,6 +77,10 @@ QImage LoadSMXGraphicLayer(
     }
     
     // Left edge skip
+    if (edge.leftSpace + pixelBorder > layerHeader.width) {
+      LOG(ERROR) << "Row " << row << ": The left edge exceeds the layer width";
+      return QImage();
+    }
     for (int col = 0; col < edge.leftSpace + pixelBorder; ++ col) {
       *out++ = qRgba(0, 0, 0, 0);
     }
@@ -77,6 +88,10 @@ QImage LoadSMXGraphicLayer(
     
     while (true) {
       // Check the next command.
+      if (commandPtr == commandEnd) {
+        LOG(ERROR) << "Unexpected end of commandArray in row " << row;
+        return QImage();
+      }
       u8 command = *commandPtr;
       ++ commandPtr;
       
@@ -84,26 +99,35 @@ QImage LoadSMXGraphicLayer(
       if (commandCode == 0b00) {
         // Draw *count* transparent pixels.
         u8 count = (command >> 2) + 1;
+        if (col + count > layerHeader.width) {
+          LOG(ERROR) << "Row " << row << ": The pixels exceed the layer width";
+          return QImage();
+        }
         for (int i = 0; i < count; ++ i) {
           *out++ = qRgba(0, 0, 0, 0);
         }
         col += count;
       } else if (commandCode == 0b01 || commandCode == 0b10) {
         // Choose the normal or player-color palette depending on the command.
-        const Palette* palette = (commandCode == 0b01) ? &standardPalette : nullptr;
+        const SMXColorTable& colorTable = (commandCode == 0b01) ? standardColorTable : playerColorTable;
         
         // Draw *count* pixels from that palette.
         u8 count = (command >> 2) + 1;
-        bool ignoreAlpha = true;  /*layerType == SMXLayerType::Graphic*/
-        for (int i = 0; i < count; ++ i) {
-          if (usesEightToFiveCompression) {
-            *out = DecompressNextPixel8To5(pixelPtr, decompressionState, palette, ignoreAlpha);
-          } else {
-            *out = DecompressNextPixel4Plus1(pixelPtr, decompressionState, palette, ignoreAlpha);
-          }
-          
-          ++ out;
+        if (col + count > layerHeader.width) {
+          LOG(ERROR) << "Row " << row << ": The pixels exceed the layer width";
+          return QImage();
         }
+        usize blockCount = (decompressionState + count + pixelsPerBlock - 1) / pixelsPerBlock;
+        if (5 * blockCount > static_cast<usize>(pixelEnd - pixelPtr)) {
+          LOG(ERROR) << "Unexpected end of pixelArray in row " << row;
+          return QImage();
+        }
+        if (usesEightToFiveCompression) {
+          DecompressPixels8To5(pixelPtr, decompressionState, count, colorTable, out);
+        } else {
+          DecompressPixels4Plus1(pixelPtr, decompressionState, count, colorTable, out);
+        }
+        out += count;
         col += count;
       } else if (commandCode == 0b11) {
         // End of row.
@@ -125,16 +149,16 @@ QImage LoadSMXGraphicLayer(
 QImage LoadSMXShadowLayer(
     const SMXLayerHeader& layerHeader,
     const std::vector<SMPLayerRowEdge>& rowEdges,
-    FILE* file) {
+    SpriteFileReader* reader) {
   // Read the combined command and data array
   u32 dataLen;
-  if (fread(&dataLen, sizeof(u32), 1, file) != 1) {
+  if (!reader->Read(&dataLen)) {
     LOG(ERROR) << "Unexpected EOF while trying to read dataLen";
     return QImage();
   }
   
-  std::vector<u8> data(dataLen);
-  if (fread(data.data(), sizeof(u8), dataLen, file) != dataLen) {
+  const u8* data = reader->ReadBytes(dataLen);
+  if (!data) {
     LOG(ERROR) << "Unexpected EOF while trying to read data";
     return QImage();
   }
@@ -142,7 +166,8 @@ QImage LoadSMXShadowLayer(
   // Build the image.
   QImage graphic(layerHeader.width, layerHeader.height, QImage::Format_Grayscale8);
   
-  const u8* dataPtr = data.data();
+  const u8* dataPtr = data;
+  const u8* dataEnd = data + dataLen;
   for (int row = 0; row < layerHeader.height; ++ row) {
     u8* out = graphic.scanLine(row);
     
@@ -157,6 +182,10 @@ QImage LoadSMXShadowLayer(
     }
     
     // Left edge skip
+    if (edge.leftSpace > layerHeader.width) {
+      LOG(ERROR) << "Row " << row << ": The left edge exceeds the layer width";
+      return QImage();
+    }
     for (int col = 0; col < edge.leftSpace; ++ col) {
       *out++ = 0;
     }
@@ -164,6 +193,10 @@ QImage LoadSMXShadowLayer(
     
     while (true) {
       // Check the next command.
+      if (dataPtr == dataEnd) {
+        LOG(ERROR) << "Unexpected end of data in row " << row;
+        return QImage();
+      }
       u8 command = *dataPtr;
       ++ dataPtr;
       
@@ -171,6 +204,10 @@ QImage LoadSMXShadowLayer(
       if (commandCode == 0b00) {
         // Draw *count* transparent pixels.
         u8 count = (command >> 2) + 1;
+        if (col + count > layerHeader.width) {
+          LOG(ERROR) << "Row " << row << ": The pixels exceed the layer width";
+          return QImage();
+        }
         for (int i = 0; i < count; ++ i) {
           *out++ = 0;
         }
@@ -178,6 +215,14 @@ QImage LoadSMXShadowLayer(
       } else if (commandCode == 0b01) {
         // Draw *count* pixels.
         u8 count = (command >> 2) + 1;
+        if (col + count > layerHeader.width) {
+          LOG(ERROR) << "Row " << row << ": The pixels exceed the layer width";
+          return QImage();
+        }
+        if (count > dataEnd - dataPtr) {
+          LOG(ERROR) << "Unexpected end of data in row " << row;
+          return QImage();
+        }
         for (int i = 0; i < count; ++ i) {
           *out++ = *dataPtr++;
         }
@@ -207,18 +252,18 @@ QImage LoadSMXShadowLayer(
 bool LoadSMXOutlineLayer(
     const SMXLayerHeader& layerHeader,
     const std::vector<SMPLayerRowEdge>& rowEdges,
-    FILE* file,
+    SpriteFileReader* reader,
     QImage* result) {
   // Read the combined command and data array
   u32 dataLen;
-  if (fread(&dataLen, sizeof(u32), 1, file) != 1) {
+  if (!reader->Read(&dataLen)) {
     LOG(ERROR) << "Unexpected EOF while trying to read dataLen";
     *result = QImage();
     return false;
   }
   
-  std::vector<u8> data(dataLen);
-  if (fread(data.data(), sizeof(u8), dataLen, file) != dataLen) {
+  const u8* data = reader->ReadBytes(dataLen);
+  if (!data) {
     LOG(ERROR) << "Unexpected EOF while trying to read data";
     *result = QImage();
     return false;
@@ -227,7 +272,8 @@ bool LoadSMXOutlineLayer(
   // Build the image.
   QImage graphic(layerHeader.width, layerHeader.height, QImage::Format_Grayscale8);
   
-  const u8* dataPtr = data.data();
+  const u8* dataPtr = data;
+  const u8* dataEnd = data + dataLen;
   for (int row = 0; row < layerHeader.height; ++ row) {
     u8* out = graphic.scanLine(row);
     
@@ -242,6 +288,11 @@ bool LoadSMXOutlineLayer(
     }
     
     // Left edge skip
+    if (edge.leftSpace > layerHeader.width) {
+      LOG(ERROR) << "Row " << row << ": The left edge exceeds the layer width";
+      *result = QImage();
+      return false;
+    }
     for (int col = 0; col < edge.leftSpace; ++ col) {
       *out++ = 0;
     }
@@ -249,6 +300,11 @@ bool LoadSMXOutlineLayer(
     
     while (true) {
       // Check the next command.
+      if (dataPtr == dataEnd) {
+        LOG(ERROR) << "Unexpected end of data in row " << row;
+        *result = QImage();
+        return false;
+      }
       u8 command = *dataPtr;
       ++ dataPtr;
       
@@ -256,6 +312,11 @@ bool LoadSMXOutlineLayer(
       if (commandCode == 0b00) {
         // Draw *count* transparent pixels.
         u8 count = (command >> 2) + 1;
+        if (col + count > layerHeader.width) {
+          LOG(ERROR) << "Row " << row << ": The pixels exceed the layer width";
+          *result = QImage();
+          return false;
+        }
         for (int i = 0; i < count; ++ i) {
           *out++ = 0;
         }
@@ -263,6 +324,11 @@ bool LoadSMXOutlineLayer(
       } else if (commandCode == 0b01) {
         // Draw *count* pixels.
         u8 count = (command >> 2) + 1;
+        if (col + count > layerHeader.width) {
+          LOG(ERROR) << "Row " << row << ": The pixels exceed the layer width";
+          *result = QImage();
+          return false;
+        }
         for (int i = 0; i < count; ++ i) {
           *out++ = 255;
         }
@@ -291,14 +357,15 @@ bool LoadSMXOutlineLayer(
 
 bool LoadSMXLayer(
     bool usesEightToFiveCompression,
-    const Palette& standardPalette,
+    const SMXColorTable& standardColorTable,
+    const SMXColorTable& playerColorTable,
     SMXLayerType layerType,
     Sprite::Frame::Layer* layer,
     std::vector<SMPLayerRowEdge>* rowEdges,
-    FILE* file) {
+    SpriteFileReader* reader) {
   // Read the layer header.
   SMXLayerHeader layerHeader;
-  if (fread(&layerHeader, sizeof(SMXLayerHeader), 1, file) != 1) {
+  if (!reader->Read(&layerHeader)) {
     LOG(ERROR) << "Unexpected EOF while trying to read SMXLayerHeader";
     return false;
   }
@@ -327,12 +394,9 @@ bool LoadSMXLayer(
     (*rowEdges)[rowEdges->size() - 1 - i].leftSpace = 0xFFFF;
     (*rowEdges)[rowEdges->size() - 1 - i].rightSpace = 0xFFFF;
   }
-  for (int row = 0; row < layerHeader.height - 2 * pixelBorder; ++ row) {
-    if (fread(&(*rowEdges)[row + pixelBorder], sizeof(SMPLayerRowEdge), 1, file) != 1) {
-      LOG(ERROR) << "Unexpected EOF while trying to read SMPLayerRowEdge for row " << row;
-      return false;
-    }
-    // LOG(INFO) << "Row edge: L: " << rowEdges[row].leftSpace << " R: " << rowEdges[row].rightSpace;
+  if (!reader->ReadArray(rowEdges->data() + pixelBorder, layerHeader.height - 2 * pixelBorder)) {
+    LOG(ERROR) << "Unexpected EOF while trying to read the SMPLayerRowEdges";
+    return false;
   }
   
   if (layerType == SMXLayerType::Graphic) {
@@ -341,8 +405,9 @@ bool LoadSMXLayer(
         *rowEdges,
         usesEightToFiveCompression,
         pixelBorder,
-        standardPalette,
-        file);
+        standardColorTable,
+        playerColorTable,
+        reader);
     if (layer->image.isNull()) {
       return false;
     }
@@ -350,7 +415,7 @@ bool LoadSMXLayer(
     layer->image = LoadSMXShadowLayer(
         layerHeader,
         *rowEdges,
-        file);
+        reader);
     if (layer->image.isNull()) {
       return false;
     }
@@ -358,7 +423,7 @@ bool LoadSMXLayer(
     if (!LoadSMXOutlineLayer(
         layerHeader,
         *rowEdges,
-        file,
+        reader,
         &layer->image)) {
       return false;
     }
@@ -641,11 +706,29 @@ bool Sprite::LoadFromFile(const char* path, const Palettes& palettes) {
     LOG(ERROR) << "Cannot open file: " << path;
     return false;
   }
-  std::shared_ptr<FILE> fileCloser(file, [&](FILE* file) { fclose(file); });
+  
+  // Read the whole file at once and decode it from memory, instead of reading it in many small pieces.
+  fseek(file, 0, SEEK_END);
+  std::size_t size = ftell(file);
+  fseek(file, 0, SEEK_SET);
+  
+  std::vector<u8> data(size);
+  if (fread(data.data(), 1, size, file) != size) {
+    LOG(ERROR) << "Failed to fully read file: " << path;
+    fclose(file);
+    return false;
+  }
+  fclose(file);
+  
+  return LoadFromData(data.data(), data.size(), palettes);
+}
+
+bool Sprite::LoadFromData(const u8* data, usize size, const Palettes& palettes) {
+  SpriteFileReader reader(data, size);
   
   // Read the file descriptor.
   char fileDescriptor[4];
-  if (fread(fileDescriptor, sizeof(char), 4, file) != 4) {
+  if (!reader.ReadArray(fileDescriptor, 4)) {
     LOG(ERROR) << "Unexpected EOF while trying to read file descriptor";
     return false;
   }
@@ -654,12 +737,12 @@ bool Sprite::LoadFromFile(const char* path, const Palettes& palettes) {
       fileDescriptor[1] == 'M' &&
       fileDescriptor[2] == 'P' &&
       fileDescriptor[3] == 'X') {
-    return LoadFromSMXFile(file, palettes);
+    return LoadFromSMXData(&reader, palettes);
   } else if (fileDescriptor[0] == 'S' &&
              fileDescriptor[1] == 'M' &&
              fileDescriptor[2] == 'P' &&
              fileDescriptor[3] == '$') {
-    return LoadFromSMPFile(file, palettes);
+    return LoadFromSMPData(&reader, palettes);
   } else {
     LOG(ERROR) << "Header file descriptor is not SMPX or SMP$\nActual data: "
                << fileDescriptor[0] << fileDescriptor[1] << fileDescriptor[2] << fileDescriptor[3];
@@ -667,21 +750,28 @@ bool Sprite::LoadFromFile(const char* path, const Palettes& palettes) {
   }
 }
 
-bool Sprite::LoadFromSMXFile(FILE* file, const Palettes& palettes) {
+bool Sprite::LoadFromSMXData(SpriteFileReader* reader, const Palettes& palettes) {
   // Read the header.
   SMXHeader smxHeader;
-  if (fread(&smxHeader, sizeof(SMXHeader), 1, file) != 1) {
+  if (!reader->Read(&smxHeader)) {
     LOG(ERROR) << "Unexpected EOF while trying to read SMXHeader";
     return false;
   }
   
+  // Color tables for decoding the graphic layers. The one for the frame's palette is
+  // re-initialized only if the palette differs from the one of the previous frame.
+  SMXColorTable standardColorTable;
+  int standardColorTablePaletteNumber = -1;
+  SMXColorTable playerColorTable;
+  playerColorTable.Initialize(nullptr, /*ignoreAlpha*/ true);
+  
   frames.resize(smxHeader.numFrames);
   for (int frameIdx = 0; frameIdx < smxHeader.numFrames; ++ frameIdx) {
     Frame& frame = frames[frameIdx];
     
     // Read the frame header.
     SMXFrameHeader frameHeader;
-    if (fread(&frameHeader, sizeof(SMXFrameHeader), 1, file) != 1) {
+    if (!reader->Read(&frameHeader)) {
       LOG(ERROR) << "Unexpected EOF while trying to read SMXFrameHeader";
       return false;
     }
@@ -693,22 +783,26 @@ bool Sprite::LoadFromSMXFile(FILE* file, const Palettes& palettes) {
     // LOG(INFO) << "Frame has unknown bridge flag: " << frameHeader.HasUnknownBridgeFlag();
     
     // Get the palette for the frame.
-    auto paletteIt = palettes.find(frameHeader.paletteNumber);
-    if (paletteIt == palettes.end()) {
-      LOG(ERROR) << "File references an invalid palette (number: " << frameHeader.paletteNumber << ")";
-      return false;
+    if (frameHeader.paletteNumber != standardColorTablePaletteNumber) {
+      auto paletteIt = palettes.find(frameHeader.paletteNumber);
+      if (paletteIt == palettes.end()) {
+        LOG(ERROR) << "File references an invalid palette (number: " << frameHeader.paletteNumber << ")";
+        return false;
+      }
+      standardColorTable.Initialize(&paletteIt->second, /*ignoreAlpha*/ true);
+      standardColorTablePaletteNumber = frameHeader.paletteNumber;
     }
-    const Palette& standardPalette = paletteIt->second;
     
     // Read graphic layer
     if (frameHeader.HasGraphicLayer()) {
       if (!LoadSMXLayer(
           frameHeader.UsesEightToFiveCompression(),
-          standardPalette,
+          standardColorTable,
+          playerColorTable,
           SMXLayerType::Graphic,
           &frame.graphic,
           &frame.rowEdges,
-          file)) {
+          reader)) {
         LOG(ERROR) << "Reading the graphic layer of frame " << frameIdx << " failed";
         return false;
       }
@@ -719,11 +813,12 @@ bool Sprite::LoadFromSMXFile(FILE* file, const Palettes& palettes) {
       std::vector<SMPLayerRowEdge> rowEdges;
       if (!LoadSMXLayer(
           frameHeader.UsesEightToFiveCompression(),
-          standardPalette,
+          standardColorTable,
+          playerColorTable,
           SMXLayerType::Shadow,
           &frame.shadow,
           &rowEdges,
-          file)) {
+          reader)) {
         LOG(ERROR) << "Reading the shadow layer of frame " << frameIdx << " failed";
         return false;
       }
@@ -736,11 +831,12 @@ bool Sprite::LoadFromSMXFile(FILE* file, const Palettes& palettes) {
       std::vector<SMPLayerRowEdge> rowEdges;
       if (!LoadSMXLayer(
           frameHeader.UsesEightToFiveCompression(),
-          standardPalette,
+          standardColorTable,
+          playerColorTable,
           SMXLayerType::Outline,
           &frame.outline,
           &rowEdges,
-          file)) {
+          reader)) {
         LOG(ERROR) << "Reading the outline layer of frame " << frameIdx << " failed";
         return false;
       }
@@ -753,48 +849,68 @@ bool Sprite::LoadFromSMXFile(FILE* file, const Palettes& palettes) {
   return true;
 }
 
-bool Sprite::LoadFromSMPFile(FILE* file, const Palettes& palettes) {
+bool Sprite::LoadFromSMPData(SpriteFileReader* reader, const Palettes& palettes) {
   SMPHeader smpHeader;
-  if (fread(&smpHeader, sizeof(SMPHeader), 1, file) != 1) {
+  if (!reader->Read(&smpHeader)) {
     LOG(ERROR) << "Unexpected EOF while trying to read SMPHeader";
     return false;
   }
   
   // Read frame offsets.
+  // (The counts read from the file are checked against the remaining data before allocating memory for them.)
+  if (smpHeader.numFrames > reader->GetRemainingSize() / sizeof(u32)) {
+    LOG(ERROR) << "Unexpected EOF while trying to read SMP frame offsets";
+    return false;
+  }
   std::vector<u32> frameOffsets(smpHeader.numFrames);
-  if (fread(frameOffsets.data(), sizeof(u32), smpHeader.numFrames, file) != smpHeader.numFrames) {
+  if (!reader->ReadArray(frameOffsets.data(), smpHeader.numFrames)) {
     LOG(ERROR) << "Unexpected EOF while trying to read SMP frame offsets";
     return false;
   }
   
+  // The palette that was used for the last pixel. Since consecutive pixels mostly use the same palette,
+  // this avoids most lookups in the palettes map.
+  int cachedPaletteIndex = -1;
+  const Palette* cachedPalette = nullptr;
+  
   frames.resize(smpHeader.numFrames);
   for (usize frameIdx = 0; frameIdx < smpHeader.numFrames; ++ frameIdx) {
     Frame& frame = frames[frameIdx];
-    fseek(file, frameOffsets[frameIdx], SEEK_SET);
+    if (!reader->Seek(frameOffsets[frameIdx])) {
+      LOG(ERROR) << "Invalid SMP frame offset: " << frameOffsets[frameIdx];
+      return false;
+    }
     
     // Read frame header
     u32 unused[7];
-    if (fread(unused, sizeof(u32), 7, file) != 7) {
+    if (!reader->ReadArray(unused, 7)) {
       LOG(ERROR) << "Unexpected EOF while trying to read unused data in SMP";
       return false;
     }
     
     u32 numLayers;
-    if (fread(&numLayers, sizeof(u32), 1, file) != 1) {
+    if (!reader->Read(&numLayers)) {
       LOG(ERROR) << "Unexpected EOF while trying to read SMP frameHeader";
       return false;
     }
     
     // Read layer headers
+    if (numLayers > reader->GetRemainingSize() / sizeof(SMPLayerHeader)) {
+      LOG(ERROR) << "Unexpected EOF while trying to read SMPLayerHeaders";
+      return false;
+    }
     std::vector<SMPLayerHeader> layerHeaders(numLayers);
-    if (fread(layerHeaders.data(), sizeof(SMPLayerHeader), numLayers, file) != numLayers) {
+    if (!reader->ReadArray(layerHeaders.data(), numLayers)) {
       LOG(ERROR) << "Unexpected EOF while trying to read SMPLayerHeaders";
       return false;
     }
     
     for (usize layer = 0; layer < numLayers; ++ layer) {
       const SMPLayerHeader& layerHeader = layerHeaders[layer];
-      fseek(file, frameOffsets[frameIdx] + layerHeader.outlineTableOffset, SEEK_SET);
+      if (!reader->Seek(static_cast<usize>(frameOffsets[frameIdx]) + layerHeader.outlineTableOffset)) {
+        LOG(ERROR) << "Invalid SMP outline table offset: " << layerHeader.outlineTableOffset;
+        return false;
+      }
       
       // LOG(WARNING) << "Layer width: " << layerHeader.width;
       // LOG(WARNING) << "Layer height: " << layerHeader.height;
@@ -803,6 +919,10 @@ bool Sprite::LoadFromSMPFile(FILE* file, const Palettes& palettes) {
       
       // Read the row edge data.
       constexpr int pixelBorder = 0;
+      if (layerHeader.height > reader->GetRemainingSize() / sizeof(SMPLayerRowEdge)) {
+        LOG(ERROR) << "Unexpected EOF while trying to read the SMPLayerRowEdges";
+        return false;
+      }
       std::vector<SMPLayerRowEdge> rowEdges(layerHeader.height);
       for (int i = 0; i < pixelBorder; ++ i) {
         rowEdges[i].leftSpace = 0xFFFF;
@@ -810,12 +930,9 @@ bool Sprite::LoadFromSMPFile(FILE* file, const Palettes& palettes) {
         rowEdges[rowEdges.size() - 1 - i].leftSpace = 0xFFFF;
         rowEdges[rowEdges.size() - 1 - i].rightSpace = 0xFFFF;
       }
-      for (usize row = 0; row < layerHeader.height - 2 * pixelBorder; ++ row) {
-        if (fread(&rowEdges[row + pixelBorder], sizeof(SMPLayerRowEdge), 1, file) != 1) {
-          LOG(ERROR) << "Unexpected EOF while trying to read SMPLayerRowEdge for row " << row;
-          return false;
-        }
-        // LOG(INFO) << "Row edge: L: " << rowEdges[row].leftSpace << " R: " << rowEdges[row].rightSpace;
+      if (!reader->ReadArray(rowEdges.data() + pixelBorder, layerHeader.height - 2 * pixelBorder)) {
+        LOG(ERROR) << "Unexpected EOF while trying to read the SMPLayerRowEdges";
+        return false;
       }
       
       if (layerHeader.layerType == 0x02) {
@@ -827,16 +944,21 @@ bool Sprite::LoadFromSMPFile(FILE* file, const Palettes& palettes) {
         
         // LOG(WARNING) << "Gfx layer sized " << layerHeader.width << " x " << layerHeader.height;
         
-        fseek(file, frameOffsets[frameIdx] + layerHeader.cmdTableOffset, SEEK_SET);
-        
-        std::vector<u32> smpCommandOffsets(layerHeader.height);
-        if (fread(smpCommandOffsets.data(), sizeof(u32), layerHeader.height, file) != layerHeader.height) {
-          LOG(ERROR) << "Unexpected EOF while trying to read smpCommandOffsets";
+        if (!reader->Seek(static_cast<usize>(frameOffsets[frameIdx]) + layerHeader.cmdTableOffset)) {
+          LOG(ERROR) << "Invalid SMP command table offset: " << layerHeader.cmdTableOffset;
           return false;
         }
         
         // NOTE: We only seek to the first offset and then assume that the following rows are stored sequentially.
-        fseek(file, frameOffsets[frameIdx] + smpCommandOffsets[0], SEEK_SET);
+        u32 firstCommandOffset;
+        if (!reader->Read(&firstCommandOffset)) {
+          LOG(ERROR) << "Unexpected EOF while trying to read smpCommandOffsets";
+          return false;
+        }
+        if (!reader->Seek(static_cast<usize>(frameOffsets[frameIdx]) + firstCommandOffset)) {
+          LOG(ERROR) << "Invalid SMP command offset: " << firstCommandOffset;
+          return false;
+        }
         
         constexpr bool ignoreAlpha = true;  /*layerType == SMXLayerType::Graphic*/
         
@@ -857,6 +979,10 @@ bool Sprite::LoadFromSMPFile(FILE* file, const Palettes& palettes) {
           }
           
           // Left edge skip
+          if (edge.leftSpace + pixelBorder > layerHeader.width) {
+            LOG(ERROR) << "Row " << row << ": The left edge exceeds the layer width";
+            return false;
+          }
           for (int col = 0; col < edge.leftSpace + pixelBorder; ++ col) {
             *out++ = qRgba(0, 0, 0, 0);
           }
@@ -865,7 +991,7 @@ bool Sprite::LoadFromSMPFile(FILE* file, const Palettes& palettes) {
           while (true) {
             // Read the next command.
             u8 command;
-            if (fread(&command, sizeof(u8), 1, file) != 1) {
+            if (!reader->Read(&command)) {
               LOG(ERROR) << "Unexpected EOF while trying to read SMP drawing command";
               return false;
             }
@@ -874,25 +1000,47 @@ bool Sprite::LoadFromSMPFile(FILE* file, const Palettes& palettes) {
             if (commandCode == 0b00) {
               // Draw *count* transparent pixels.
               u8 count = (command >> 2) + 1;
+              if (col + count > layerHeader.width) {
+                LOG(ERROR) << "Row " << row << ": The pixels exceed the layer width";
+                return false;
+              }
               for (int i = 0; i < count; ++ i) {
                 *out++ = qRgba(0, 0, 0, 0);
               }
               col += count;
             } else if (commandCode == 0b01 || commandCode == 0b10) {
               u8 count = (command >> 2) + 1;
+              if (col + count > layerHeader.width) {
+                LOG(ERROR) << "Row " << row << ": The pixels exceed the layer width";
+                return false;
+              }
+              
+              SMPPixel pixels[64];
+              if (!reader->ReadArray(pixels, count)) {
+                LOG(ERROR) << "Unexpected EOF while trying to read the SMPPixels";
+                return false;
+              }
               
               for (int i = 0; i < count; ++ i) {
-                SMPPixel pixel;
-                if (fread(&pixel, sizeof(SMPPixel), 1, file) != 1) {
-                  LOG(ERROR) << "Unexpected EOF while trying to read an SMPPixel";
-                  return false;
-                }
-                
+                const SMPPixel& pixel = pixels[i];
                 int paletteIndex = pixel.palette >> 2;
                 int paletteSection = pixel.palette & 0b11;
                 
-                // TODO: If we load a lot of SMPs, we might want to optimize the unordered_map access here (cache the last used palette and re-use it if it is the same for the next pixel)
-                *out = GetPalettedPixel((commandCode == 0b01) ? &palettes.at(paletteIndex) : nullptr, paletteSection, pixel.index, ignoreAlpha);
+                const Palette* palette = nullptr;
+                if (commandCode == 0b01) {
+                  if (paletteIndex != cachedPaletteIndex) {
+                    auto paletteIt = palettes.find(paletteIndex);
+                    if (paletteIt == palettes.end()) {
+                      LOG(ERROR) << "File references an invalid palette (number: " << paletteIndex << ")";
+                      return false;
+                    }
+                    cachedPaletteIndex = paletteIndex;
+                    cachedPalette = &paletteIt->second;
+                  }
+                  palette = cachedPalette;
+                }
+                
+                *out = GetPalettedPixel(palette, paletteSection, pixel.index, ignoreAlpha);
                 ++ out;
               }
               col += count;
@@ -997,6 +1145,71 @@ bool Sprite::LoadFromPNGFiles(const char* path) {
   return !frames.empty();
 }
 
+/// Upper bound for the frame and row edge counts read by Sprite::ReadMetadata(),
+/// which prevents huge allocations for corrupted files.
+static constexpr u32 kMaxMetadataCount = 1 << 20;
+
+bool Sprite::WriteMetadata(FILE* file) const {
+  u32 numFrames = frames.size();
+  if (fwrite(&numFrames, sizeof(u32), 1, file) != 1) {
+    return false;
+  }
+  
+  for (const Frame& frame : frames) {
+    u32 numRowEdges = frame.rowEdges.size();
+    if (fwrite(&numRowEdges, sizeof(u32), 1, file) != 1 ||
+        fwrite(frame.rowEdges.data(), sizeof(SMPLayerRowEdge), numRowEdges, file) != numRowEdges) {
+      return false;
+    }
+    
+    for (const Frame::Layer* layer : {&frame.graphic, &frame.shadow, &frame.outline}) {
+      i32 values[7] = {layer->imageWidth, layer->imageHeight, layer->centerX, layer->centerY, layer->atlasX, layer->atlasY, layer->rotated ? 1 : 0};
+      if (fwrite(values, sizeof(i32), 7, file) != 7) {
+        return false;
+      }
+    }
+  }
+  
+  return true;
+}
+
+bool Sprite::ReadMetadata(FILE* file) {
+  frames.clear();
+  
+  u32 numFrames;
+  if (fread(&numFrames, sizeof(u32), 1, file) != 1 || numFrames == 0 || numFrames > kMaxMetadataCount) {
+    return false;
+  }
+  frames.resize(numFrames);
+  
+  for (Frame& frame : frames) {
+    u32 numRowEdges;
+    if (fread(&numRowEdges, sizeof(u32), 1, file) != 1 || numRowEdges > kMaxMetadataCount) {
+      return false;
+    }
+    frame.rowEdges.resize(numRowEdges);
+    if (fread(frame.rowEdges.data(), sizeof(SMPLayerRowEdge), numRowEdges, file) != numRowEdges) {
+      return false;
+    }
+    
+    for (Frame::Layer* layer : {&frame.graphic, &frame.shadow, &frame.outline}) {
+      i32 values[7];
+      if (fread(values, sizeof(i32), 7, file) != 7) {
+        return false;
+      }
+      layer->imageWidth = values[0];
+      layer->imageHeight = values[1];
+      layer->centerX = values[2];
+      layer->centerY = values[3];
+      layer->atlasX = values[4];
+      layer->atlasY = values[5];
+      layer->rotated = values[6] != 0;
+    }
+  }
+  
+  return true;
+}
+
 
 SpriteAndTextures* SpriteManager::GetOrLoad(const char* path, const char* cachePath, ColorDilationShader* colorDilationShader, const Palettes& palettes) {
   auto it = loadedSprites.find(path);
@@ -1005,9 +1218,33 @@ SpriteAndTextures* SpriteManager::GetOrLoad(const char* path, const char* cacheP
     return it->second;
   }
   
-  // Load the sprite.
   SpriteAndTextures* newSprite = new SpriteAndTextures();
   newSprite->referenceCount = 1;
+  
+  // In deferred loading mode, start decoding the sprite in the background.
+  if (deferredLoadingThreadPool) {
+    DeferredSprite* deferredSprite = new DeferredSprite();
+    deferredSprite->path = path;
+    deferredSprite->cachePath = cachePath;
+    deferredSprite->palettes = &palettes;
+    deferredSprite->sprite = newSprite;
+    deferredSprites.emplace_back(deferredSprite);
+    
+    deferredLoadingThreadPool->Enqueue([this, deferredSprite]() {
+      deferredSprite->succeeded = LoadSpriteAndRenderAtlases(
+          deferredSprite->path.c_str(), deferredSprite->cachePath.c_str(), &deferredSprite->sprite->sprite,
+          &deferredSprite->graphicAtlasImage, &deferredSprite->shadowAtlasImage, &deferredSprite->loadedFromCache, *deferredSprite->palettes);
+      
+      std::unique_lock<std::mutex> lock(deferredLoadingMutex);
+      decodedDeferredSprites.push_back(deferredSprite);
+      deferredSpriteDecodedCondition.notify_one();
+    });
+    
+    loadedSprites.insert(std::make_pair(path, newSprite));
+    return newSprite;
+  }
+  
+  // Load the sprite.
   if (!LoadSpriteAndTexture(path, cachePath, GL_CLAMP_TO_EDGE, colorDilationShader, &newSprite->sprite, &newSprite->graphicTexture, &newSprite->shadowTexture, palettes)) {
     LOG(ERROR) << "Failed to load sprite: " << path;
     return nullptr;
@@ -1040,6 +1277,64 @@ void SpriteManager::Dereference(SpriteAndTextures* sprite) {
   delete sprite;
 }
 
+void SpriteManager::BeginDeferredLoading(ThreadPool* threadPool) {
+  if (deferredLoadingThreadPool) {
+    LOG(ERROR) << "SpriteManager::BeginDeferredLoading() called while deferred loading is already active";
+  }
+  deferredLoadingThreadPool = threadPool;
+}
+
+bool SpriteManager::FinishDeferredLoading(ColorDilationShader* colorDilationShader, const std::function<void(int, int)>& progressCallback) {
+  bool result = true;
+  int spriteCount = deferredSprites.size();
+  for (int completedCount = 0; completedCount < spriteCount; ++ completedCount) {
+    DeferredSprite* deferredSprite;
+    {
+      std::unique_lock<std::mutex> lock(deferredLoadingMutex);
+      deferredSpriteDecodedCondition.wait(lock, [&]() { return completedCount < static_cast<int>(decodedDeferredSprites.size()); });
+      deferredSprite = decodedDeferredSprites[completedCount];
+    }
+    
+    if (deferredSprite->succeeded) {
+      SpriteAndTextures* sprite = deferredSprite->sprite;
+      UploadSpriteAtlases(deferredSprite->graphicAtlasImage, deferredSprite->shadowAtlasImage, deferredSprite->loadedFromCache, GL_CLAMP_TO_EDGE, colorDilationShader, &sprite->graphicTexture, &sprite->shadowTexture);
+      
+      // If the sprite was decoded, read back its dilated graphic atlas and write the sprite cache file in the background.
+      if (!deferredSprite->loadedFromCache) {
+        QImage dilatedGraphicAtlasImage = sprite->graphicTexture.Download();
+        QImage shadowAtlasImage = deferredSprite->shadowAtlasImage;
+        deferredLoadingThreadPool->Enqueue([deferredSprite, dilatedGraphicAtlasImage, shadowAtlasImage]() {
+          if (!SaveSpriteCache(deferredSprite->path.c_str(), deferredSprite->cachePath.c_str(), deferredSprite->sprite->sprite,
+                               dilatedGraphicAtlasImage, shadowAtlasImage, *deferredSprite->palettes)) {
+            LOG(WARNING) << "Failed to save sprite cache file for: " << deferredSprite->path;
+          }
+        });
+      }
+      
+      // Free the atlas images early, since they take a lot of memory.
+      deferredSprite->graphicAtlasImage = QImage();
+      deferredSprite->shadowAtlasImage = QImage();
+    } else {
+      LOG(ERROR) << "Failed to load sprite: " << deferredSprite->path;
+      result = false;
+    }
+    
+    if (progressCallback) {
+      progressCallback(completedCount + 1, spriteCount);
+    }
+  }
+  
+  // Wait for the sprite cache files to be written, since this accesses the deferred sprites.
+  if (deferredLoadingThreadPool) {
+    deferredLoadingThreadPool->WaitForAll();
+  }
+  
+  deferredLoadingThreadPool = nullptr;
+  deferredSprites.clear();
+  decodedDeferredSprites.clear();
+  return result;
+}
+
 SpriteManager::~SpriteManager() {
   for (const auto& item : loadedSprites) {
     LOG(ERROR) << "Sprite still loaded on SpriteManager destruction: " << item.first << " (references: " << item.second->referenceCount << ")";
@@ -1105,8 +1400,184 @@ bool DilateColorsIntoTransparentRegions(const Texture& srcTexture, int wrapMode,
 }
 
 
-bool LoadSpriteAndTexture(const char* path, const char* cachePath, int wrapMode, ColorDilationShader* colorDilationShader, Sprite* sprite, Texture* graphicTexture, Texture* shadowTexture, const Palettes& palettes) {
-  // TODO magFilter and minFilter are unused here
+/// Identifies sprite cache files (see SaveSpriteCache()).
+static const char kSpriteCacheMagic[4] = {'F', 'A', 'S', 'C'};
+
+/// Version of the sprite cache file format. This must be increased whenever the format or the
+/// sprite decoding changes, such that outdated sprite cache files get discarded.
+static constexpr u32 kSpriteCacheVersion = 1;
+
+/// Upper bound for the atlas image sizes read from sprite cache files.
+static constexpr int kMaxCachedAtlasSize = 1 << 15;
+
+/// Identifies the inputs that a sprite cache file was created from.
+struct SpriteCacheKey {
+  u64 sourceFileSize;
+  i64 sourceModificationTime;
+  u64 palettesHash;
+};
+
+/// Determines the cache key for the sprite file at path. Returns false if the file cannot be accessed
+/// (for example, since path is a pattern for PNG files), in which case the sprite cache is not used.
+static bool GetSpriteCacheKey(const char* path, const Palettes& palettes, SpriteCacheKey* key) {
+  std::error_code errorCode;
+  key->sourceFileSize = std::filesystem::file_size(path, errorCode);
+  if (errorCode) {
+    return false;
+  }
+  key->sourceModificationTime = std::filesystem::last_write_time(path, errorCode).time_since_epoch().count();
+  if (errorCode) {
+    return false;
+  }
+  
+  // Hash each palette with FNV-1a (on 32-bit words) and sum up the hashes,
+  // which does not depend on the iteration order of the palettes.
+  key->palettesHash = 0;
+  for (const auto& item : palettes) {
+    u64 hash = 14695981039346656037ull ^ static_cast<u64>(item.first);
+    for (QRgb color : item.second) {
+      hash = (hash ^ color) * 1099511628211ull;
+    }
+    key->palettesHash += hash;
+  }
+  return true;
+}
+
+/// Writes the size and pixels of an atlas image to the file. Null images are written with size zero.
+static bool WriteAtlasImage(const QImage& image, FILE* file) {
+  i32 size[2] = {image.isNull() ? 0 : image.width(), image.isNull() ? 0 : image.height()};
+  if (fwrite(size, sizeof(i32), 2, file) != 2) {
+    return false;
+  }
+  
+  usize bytesPerRow = size[0] * ((image.format() == QImage::Format_ARGB32) ? 4 : 1);
+  for (int y = 0; y < size[1]; ++ y) {
+    if (fwrite(image.scanLine(y), 1, bytesPerRow, file) != bytesPerRow) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/// Reads an atlas image written by WriteAtlasImage() with the given format.
+static bool ReadAtlasImage(FILE* file, QImage::Format format, QImage* image) {
+  i32 size[2];
+  if (fread(size, sizeof(i32), 2, file) != 2) {
+    return false;
+  }
+  if (size[0] == 0 && size[1] == 0) {
+    *image = QImage();
+    return true;
+  }
+  if (size[0] <= 0 || size[1] <= 0 || size[0] > kMaxCachedAtlasSize || size[1] > kMaxCachedAtlasSize) {
+    return false;
+  }
+  
+  *image = QImage(size[0], size[1], format);
+  if (image->isNull()) {
+    return false;
+  }
+  
+  // Read the pixels directly into the image. If the image's rows are not padded, this can be done with a single call.
+  usize bytesPerRow = size[0] * ((format == QImage::Format_ARGB32) ? 4 : 1);
+  if (static_cast<usize>(image->bytesPerLine()) == bytesPerRow) {
+    return fread(image->bits(), bytesPerRow, size[1], file) == static_cast<usize>(size[1]);
+  }
+  for (int y = 0; y < size[1]; ++ y) {
+    if (fread(image->scanLine(y), 1, bytesPerRow, file) != bytesPerRow) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/// Attempts to load the sprite's metadata and its final atlas images from the sprite cache file.
+/// Returns false if the cache file does not exist, is outdated, or is invalid.
+static bool LoadSpriteCache(const char* path, const char* cachePath, Sprite* sprite, QImage* graphicAtlasImage, QImage* shadowAtlasImage, const Palettes& palettes) {
+  std::string cacheFilePath = std::string(cachePath) + ".sprite";
+  FILE* file = fopen(cacheFilePath.c_str(), "rb");
+  if (!file) {
+    return false;
+  }
+  std::shared_ptr<FILE> fileCloser(file, [](FILE* file) { fclose(file); });
+  
+  char magic[4];
+  u32 version;
+  SpriteCacheKey cachedKey;
+  if (fread(magic, 1, 4, file) != 4 ||
+      memcmp(magic, kSpriteCacheMagic, 4) != 0 ||
+      fread(&version, sizeof(u32), 1, file) != 1 ||
+      version != kSpriteCacheVersion ||
+      fread(&cachedKey, sizeof(SpriteCacheKey), 1, file) != 1) {
+    LOG(WARNING) << "Discarding sprite cache file with an unknown format: " << cacheFilePath;
+    return false;
+  }
+  
+  SpriteCacheKey key;
+  if (!GetSpriteCacheKey(path, palettes, &key) ||
+      key.sourceFileSize != cachedKey.sourceFileSize ||
+      key.sourceModificationTime != cachedKey.sourceModificationTime ||
+      key.palettesHash != cachedKey.palettesHash) {
+    LOG(INFO) << "Discarding outdated sprite cache file: " << cacheFilePath;
+    return false;
+  }
+  
+  if (!sprite->ReadMetadata(file) ||
+      !ReadAtlasImage(file, QImage::Format_ARGB32, graphicAtlasImage) ||
+      !ReadAtlasImage(file, QImage::Format_Grayscale8, shadowAtlasImage) ||
+      graphicAtlasImage->isNull() ||
+      sprite->HasShadow() == shadowAtlasImage->isNull()) {
+    LOG(WARNING) << "Discarding invalid sprite cache file: " << cacheFilePath;
+    *sprite = Sprite();
+    *graphicAtlasImage = QImage();
+    *shadowAtlasImage = QImage();
+    return false;
+  }
+  
+  return true;
+}
+
+bool SaveSpriteCache(const char* path, const char* cachePath, const Sprite& sprite, const QImage& dilatedGraphicAtlasImage, const QImage& shadowAtlasImage, const Palettes& palettes) {
+  SpriteCacheKey key;
+  if (!GetSpriteCacheKey(path, palettes, &key)) {
+    return false;
+  }
+  
+  // Write to a temporary file first and rename it afterwards, such that an
+  // interrupted write does not leave a truncated cache file behind.
+  std::string cacheFilePath = std::string(cachePath) + ".sprite";
+  std::string temporaryFilePath = cacheFilePath + ".tmp";
+  FILE* file = fopen(temporaryFilePath.c_str(), "wb");
+  if (!file) {
+    return false;
+  }
+  
+  bool success =
+      fwrite(kSpriteCacheMagic, 1, 4, file) == 4 &&
+      fwrite(&kSpriteCacheVersion, sizeof(u32), 1, file) == 1 &&
+      fwrite(&key, sizeof(SpriteCacheKey), 1, file) == 1 &&
+      sprite.WriteMetadata(file) &&
+      WriteAtlasImage(dilatedGraphicAtlasImage, file) &&
+      WriteAtlasImage(shadowAtlasImage, file);
+  success = (fclose(file) == 0) && success;
+  
+  std::error_code errorCode;
+  if (success) {
+    std::filesystem::rename(temporaryFilePath, cacheFilePath, errorCode);
+  }
+  if (!success || errorCode) {
+    std::filesystem::remove(temporaryFilePath, errorCode);
+    return false;
+  }
+  return true;
+}
+
+bool LoadSpriteAndRenderAtlases(const char* path, const char* cachePath, Sprite* sprite, QImage* graphicAtlasImage, QImage* shadowAtlasImage, bool* loadedFromCache, const Palettes& palettes) {
+  // If the sprite cache file is up to date, skip decoding the sprite and rendering the atlases.
+  *loadedFromCache = LoadSpriteCache(path, cachePath, sprite, graphicAtlasImage, shadowAtlasImage, palettes);
+  if (*loadedFromCache) {
+    return true;
+  }
   
   if (!sprite->LoadFromFile(path, palettes)) {
     LOG(ERROR) << "Failed to load sprite from " << path;
@@ -1121,104 +1592,104 @@ bool LoadSpriteAndTexture(const char* path, const char* cachePath, int wrapMode,
       continue;
     }
     SpriteAtlas::Mode mode = (graphicOrShadow == 0) ? SpriteAtlas::Mode::Graphic : SpriteAtlas::Mode::Shadow;
-    Texture* texture = (graphicOrShadow == 0) ? graphicTexture : shadowTexture;
+    QImage* atlasImage = (graphicOrShadow == 0) ? graphicAtlasImage : shadowAtlasImage;
     
     SpriteAtlas atlas(mode);
     atlas.AddSprite(sprite);
     
     constexpr int pixelBorder = 0;
     
-    std::string cacheFilePath = std::string(cachePath) + ((graphicOrShadow == 0) ? ".graphic" : ".shadow");
-    bool loaded = false;
-    if (std::filesystem::exists(cacheFilePath)) {
-      // Attempt to load the atlas from the cache.
-      // TODO: Add some mechanism which discards the cache in case the sprite file has changed
-      loaded = atlas.Load(cacheFilePath.c_str(), sprite->NumFrames());
-      if (loaded) {
-        // Check whether the loaded atlas is compatible with the sprite.
-        // If not, discard the atlas.
-        if (!atlas.IsConsistent()) {
-          LOG(WARNING) << "Discarding cached sprite atlas since it is not consistent: " << cacheFilePath;
-          loaded = false;
-        }
-      }
-    }
-    
-    if (!loaded) {
-      int chosenWidth = -1;
-      int chosenHeight = -1;
-      if (sprite->NumFrames() == 1) {
-        // Special case for a single frame: Use the sprite size (plus the border) directly as texture size.
-        Sprite::Frame::Layer& layer = ((graphicOrShadow == 0) ? sprite->frame(0).graphic : sprite->frame(0).shadow);
-        chosenWidth = layer.image.width() + 2 * pixelBorder;
-        chosenHeight = layer.image.height() + 2 * pixelBorder;
-      } else {
-        int textureSize = 2048;
-        int largestTooSmallSize = -1;
-        int smallestAcceptableSize = -1;
-        for (int attempt = 0; attempt < 8; ++ attempt) {
-          if (!atlas.BuildAtlas(textureSize, textureSize, pixelBorder)) {
-            // The size is too small.
-            // LOG(INFO) << "Size " << textureSize << " is too small.";
-            largestTooSmallSize = textureSize;
-            if (smallestAcceptableSize >= 0) {
-              textureSize = (largestTooSmallSize + smallestAcceptableSize) / 2;
-            } else {
-              textureSize = 2 * largestTooSmallSize;
-            }
+    int chosenWidth = -1;
+    int chosenHeight = -1;
+    if (sprite->NumFrames() == 1) {
+      // Special case for a single frame: Use the sprite size (plus the border) directly as texture size.
+      Sprite::Frame::Layer& layer = ((graphicOrShadow == 0) ? sprite->frame(0).graphic : sprite->frame(0).shadow);
+      chosenWidth = layer.image.width() + 2 * pixelBorder;
+      chosenHeight = layer.image.height() + 2 * pixelBorder;
+    } else {
+      int textureSize = 2048;
+      int largestTooSmallSize = -1;
+      int smallestAcceptableSize = -1;
+      for (int attempt = 0; attempt < 8; ++ attempt) {
+        if (!atlas.BuildAtlas(textureSize, textureSize, pixelBorder)) {
+          // The size is too small.
+          // LOG(INFO) << "Size " << textureSize << " is too small.";
+          largestTooSmallSize = textureSize;
+          if (smallestAcceptableSize >= 0) {
+            textureSize = (largestTooSmallSize + smallestAcceptableSize) / 2;
           } else {
-            // The size is large enough.
-            // LOG(INFO) << "Size " << textureSize << " is okay.";
-            smallestAcceptableSize = textureSize;
-            if (smallestAcceptableSize >= 0) {
-              textureSize = (largestTooSmallSize + smallestAcceptableSize) / 2;
-            } else {
-              textureSize = smallestAcceptableSize / 2;
-            }
+            textureSize = 2 * largestTooSmallSize;
+          }
+        } else {
+          // The size is large enough.
+          // LOG(INFO) << "Size " << textureSize << " is okay.";
+          smallestAcceptableSize = textureSize;
+          if (smallestAcceptableSize >= 0) {
+            textureSize = (largestTooSmallSize + smallestAcceptableSize) / 2;
+          } else {
+            textureSize = smallestAcceptableSize / 2;
           }
         }
-        chosenWidth = smallestAcceptableSize;
-        chosenHeight = smallestAcceptableSize;
-      }
-      if (chosenWidth <= 0 || chosenHeight <= 0) {
-        LOG(ERROR) << "Unable to find a texture size which all animation frames can be packed into.";
-        return false;
-      }
-      LOG(INFO) << "Atlas for " << path << " uses size: " << chosenWidth << " x " << chosenHeight;
-      
-      if (!atlas.BuildAtlas(chosenWidth, chosenHeight, pixelBorder)) {
-        LOG(ERROR) << "Unexpected error while building an atlas image (1).";
-        return false;
       }
+      chosenWidth = smallestAcceptableSize;
+      chosenHeight = smallestAcceptableSize;
     }
-    
-    QImage atlasImage = atlas.RenderAtlas();
-    if (atlasImage.isNull()) {
-      LOG(ERROR) << "Unexpected error while building an atlas image (2).";
+    if (chosenWidth <= 0 || chosenHeight <= 0) {
+      LOG(ERROR) << "Unable to find a texture size which all animation frames can be packed into.";
       return false;
     }
-    if (!loaded) {
-      if (!atlas.Save(cacheFilePath.c_str())) {
-        LOG(WARNING) << "Failed to save atlas cache file: " << cacheFilePath;
-      }
+    LOG(INFO) << "Atlas for " << path << " uses size: " << chosenWidth << " x " << chosenHeight;
+    
+    if (!atlas.BuildAtlas(chosenWidth, chosenHeight, pixelBorder)) {
+      LOG(ERROR) << "Unexpected error while building an atlas image (1).";
+      return false;
     }
     
-    // Transfer the atlasImage to the GPU.
-    if (graphicOrShadow == 0) {
-      // For graphic sprites, dilate the colors by one pixel into transparent areas
-      // to prevent the rendering interpolating the colors towards black at the sprite boundary.
-      Texture temporaryTexture;
-      temporaryTexture.Load(atlasImage, wrapMode, GL_NEAREST, GL_NEAREST);
-      
-      DilateColorsIntoTransparentRegions(temporaryTexture, wrapMode, GL_NEAREST, GL_NEAREST, colorDilationShader, texture);
-    } else {
-      texture->Load(atlasImage, wrapMode, GL_LINEAR, GL_LINEAR);
+    *atlasImage = atlas.RenderAtlas();
+    if (atlasImage->isNull()) {
+      LOG(ERROR) << "Unexpected error while building an atlas image (2).";
+      return false;
     }
   }
   
   return true;
 }
 
+void UploadSpriteAtlases(const QImage& graphicAtlasImage, const QImage& shadowAtlasImage, bool graphicAtlasIsDilated, int wrapMode, ColorDilationShader* colorDilationShader, Texture* graphicTexture, Texture* shadowTexture) {
+  // TODO magFilter and minFilter are unused here
+  
+  if (graphicAtlasIsDilated) {
+    graphicTexture->Load(graphicAtlasImage, wrapMode, GL_NEAREST, GL_NEAREST);
+  } else {
+    // For graphic sprites, dilate the colors by one pixel into transparent areas
+    // to prevent the rendering interpolating the colors towards black at the sprite boundary.
+    Texture temporaryTexture;
+    temporaryTexture.Load(graphicAtlasImage, wrapMode, GL_NEAREST, GL_NEAREST);
+    
+    DilateColorsIntoTransparentRegions(temporaryTexture, wrapMode, GL_NEAREST, GL_NEAREST, colorDilationShader, graphicTexture);
+  }
+  
+  if (!shadowAtlasImage.isNull()) {
+    shadowTexture->Load(shadowAtlasImage, wrapMode, GL_LINEAR, GL_LINEAR);
+  }
+}
+
+bool LoadSpriteAndTexture(const char* path, const char* cachePath, int wrapMode, ColorDilationShader* colorDilationShader, Sprite* sprite, Texture* graphicTexture, Texture* shadowTexture, const Palettes& palettes) {
+  QImage graphicAtlasImage;
+  QImage shadowAtlasImage;
+  bool loadedFromCache;
+  if (!LoadSpriteAndRenderAtlases(path, cachePath, sprite, &graphicAtlasImage, &shadowAtlasImage, &loadedFromCache, palettes)) {
+    return false;
+  }
+  
+  UploadSpriteAtlases(graphicAtlasImage, shadowAtlasImage, loadedFromCache, wrapMode, colorDilationShader, graphicTexture, shadowTexture);
+  
+  if (!loadedFromCache && !SaveSpriteCache(path, cachePath, *sprite, graphicTexture->Download(), shadowAtlasImage, palettes)) {
+    LOG(WARNING) << "Failed to save sprite cache file for: " << path;
+  }
+  return true;
+}
+
 void DrawSprite(
     const Sprite& sprite,
     Texture& texture,
@@ -4,8 +4,12 @@
 
 #pragma once
 
+#include <condition_variable>
+#include <cstring>
 #include <filesystem>
-#include <iostream>
+#include <functional>
+#include <memory>
+#include <mutex>
 #include <QImage>
 #include <QOpenGLFunctions_3_2_Core>
 #include <QRgb>
@@ -14,15 +18,16 @@
 
 #include "FreeAge/common/free_age.hpp"
 #include "FreeAge/common/logging.hpp"
+#include "FreeAge/client/sprite_decoding.hpp"
 #include "FreeAge/client/texture.hpp"
 
 class ColorDilationShader;
+class SpriteFileReader;
 class SpriteShader;
 class Texture;
+class ThreadPool;
 
 
-typedef std::vector<QRgb> Palette;
-
 typedef std::unordered_map<int, Palette> Palettes;
 
 
@@ -48,9 +53,9 @@ class Sprite {
       int centerY = -1;
       
       // The layer's position in the texture atlas.
-      int atlasX;
-      int atlasY;
-      bool rotated;
+      int atlasX = 0;
+      int atlasY = 0;
+      bool rotated = false;
     };
     
     /// Vector of size graphic.imageHeight, giving the row edges (distance from left/right
@@ -64,8 +69,19 @@ class Sprite {
   
   Sprite() = default;
   
+  /// Loads the sprite from an .smx, .smp, or .png file. For .smx and .smp files,
+  /// the whole file is read at once and decoded with LoadFromData().
   bool LoadFromFile(const char* path, const Palettes& palettes);
   
+  /// Decodes the sprite from the contents of an .smx or .smp file that are already in memory.
+  bool LoadFromData(const u8* data, usize size, const Palettes& palettes);
+  
+  /// Writes the metadata of all frames (everything except for the layer images) to the file.
+  bool WriteMetadata(FILE* file) const;
+  
+  /// Reads the metadata written by WriteMetadata(), replacing all frames. The layer images stay null.
+  bool ReadMetadata(FILE* file);
+  
   inline bool HasShadow() const { return frames.front().shadow.centerX >= 0; }
   inline bool HasOutline() const { return frames.front().outline.centerX >= 0; }
   
@@ -80,8 +96,8 @@ class Sprite {
   }
   
  private:
-  bool LoadFromSMXFile(FILE* file, const Palettes& palettes);
-  bool LoadFromSMPFile(FILE* file, const Palettes& palettes);
+  bool LoadFromSMXData(SpriteFileReader* reader, const Palettes& palettes);
+  bool LoadFromSMPData(SpriteFileReader* reader, const Palettes& palettes);
   bool LoadFromPNGFiles(const char* path);
   
   std::vector<Frame> frames;
@@ -114,16 +130,70 @@ class SpriteManager {
   /// Must be called once the sprite is not needed anymore. Once all references are gone, the sprite is unloaded.
   void Dereference(SpriteAndTextures* sprite);
   
+  /// Makes GetOrLoad() only start the CPU part of loading new sprites (decoding, shadow inpainting, and atlas
+  /// rendering; see LoadSpriteAndRenderAtlases()) as a task on the given thread pool, such that many sprites
+  /// are decoded in parallel. GetOrLoad() then returns the sprites before they are loaded; they must not be
+  /// used before FinishDeferredLoading() returns. The palettes passed to GetOrLoad() must stay valid until then.
+  void BeginDeferredLoading(ThreadPool* threadPool);
+  
+  /// Waits for the sprites that were requested since BeginDeferredLoading() and uploads their textures
+  /// in the current OpenGL context as soon as each of them is decoded. Calls progressCallback (if given) with the
+  /// number of completed sprites and the total number of sprites after each sprite. Returns false if any sprite failed to load.
+  bool FinishDeferredLoading(ColorDilationShader* colorDilationShader, const std::function<void(int, int)>& progressCallback);
+  
  private:
+  /// A sprite whose loading was deferred (see BeginDeferredLoading()).
+  struct DeferredSprite {
+    std::string path;
+    std::string cachePath;
+    const Palettes* palettes;
+    SpriteAndTextures* sprite;
+    
+    /// The results of the CPU part of loading the sprite.
+    bool succeeded = false;
+    bool loadedFromCache = false;
+    QImage graphicAtlasImage;
+    QImage shadowAtlasImage;
+  };
+  
   SpriteManager() = default;
   ~SpriteManager();
   
   std::unordered_map<std::string, SpriteAndTextures*> loadedSprites;
+  
+  /// The thread pool that the CPU part of loading runs on. Null if loading is not deferred.
+  ThreadPool* deferredLoadingThreadPool = nullptr;
+  
+  /// The sprites requested since BeginDeferredLoading().
+  std::vector<std::unique_ptr<DeferredSprite>> deferredSprites;
+  
+  /// The deferred sprites whose CPU part finished, in the order of completion. Protected by deferredLoadingMutex.
+  std::vector<DeferredSprite*> decodedDeferredSprites;
+  std::mutex deferredLoadingMutex;
+  std::condition_variable deferredSpriteDecodedCondition;
 };
 
 
+/// Loads a sprite and renders texture atlas images (just) for it. Attempts to find a good texture size automatically.
+/// The atlas layouts are cached in files starting with cachePath. This does not use OpenGL, so it may run on any thread.
+/// shadowAtlasImage stays null if the sprite does not have a shadow.
+///
+/// If the sprite cache file written by SaveSpriteCache() is up to date, the sprite's metadata and the final atlas
+/// images are read from it instead of decoding the sprite, and loadedFromCache is set to true. The graphic atlas image
+/// is then already dilated (see UploadSpriteAtlases()).
+bool LoadSpriteAndRenderAtlases(const char* path, const char* cachePath, Sprite* sprite, QImage* graphicAtlasImage, QImage* shadowAtlasImage, bool* loadedFromCache, const Palettes& palettes);
+
+/// Creates the textures for atlas images returned by LoadSpriteAndRenderAtlases() in the current OpenGL context.
+/// Unless graphicAtlasIsDilated is true, the colors of the graphic atlas are dilated into its transparent regions first.
+void UploadSpriteAtlases(const QImage& graphicAtlasImage, const QImage& shadowAtlasImage, bool graphicAtlasIsDilated, int wrapMode, ColorDilationShader* colorDilationShader, Texture* graphicTexture, Texture* shadowTexture);
+
+/// Writes the sprite cache file for a sprite that was loaded from path, which contains the sprite's metadata and its
+/// final atlas images, such that LoadSpriteAndRenderAtlases() can skip decoding the sprite the next time.
+/// The cache file is keyed by the source file's size and modification time and by a hash of the palettes.
+bool SaveSpriteCache(const char* path, const char* cachePath, const Sprite& sprite, const QImage& dilatedGraphicAtlasImage, const QImage& shadowAtlasImage, const Palettes& palettes);
+
 /// Convenience function which loads a sprite and creates a texture atlas (just) for it.
-/// Attempts to find a good texture size automatically.
+/// Combines LoadSpriteAndRenderAtlases() and UploadSpriteAtlases().
 bool LoadSpriteAndTexture(const char* path, const char* cachePath, int wrapMode, ColorDilationShader* colorDilationShader, Sprite* sprite, Texture* graphicTexture, Texture* shadowTexture, const Palettes& palettes);
 
 void DrawSprite(
@@ -244,62 +314,58 @@ struct SMPPixel {
 #pragma pack(pop)
 
 
-inline QRgb GetPalettedPixel(const Palette* palette, u8 paletteSection, u8 colorIndex, bool ignoreAlpha) {
-  std::size_t finalIndex = 256 * paletteSection + colorIndex;
+/// Cursor for reading the contents of a sprite file from memory.
+/// All reads are bounds-checked: they fail (returning false or nullptr) instead of reading past the end of the data.
+class SpriteFileReader {
+ public:
+  inline SpriteFileReader(const u8* data, usize size)
+      : data(data),
+        size(size) {}
   
-  if (palette == nullptr) {
-    // Encode the index in the pixel value.
-    // Set the alpha to the magic value of 254, which the shader will interpret as player color marking.
-    CHECK_LT(finalIndex, 65536);
-    return qRgba(finalIndex & 0xff, (finalIndex >> 8) & 0xff, 0, 254);
-  } else if (finalIndex < palette->size()) {
-    const QRgb& rgba = (*palette)[finalIndex];
-    return qRgba(qRed(rgba), qGreen(rgba), qBlue(rgba), ignoreAlpha ? 255 : qAlpha(rgba));
-  } else {
-    std::cout << "AddPalettedPixel(): Index (" << finalIndex << ") is larger than the palette size (" << palette->size() << ")\n";
-    return qRgba(0, 0, 0, 0);
+  /// Reads a value (for example, one of the packed structs above) and advances past it.
+  template <typename T>
+  inline bool Read(T* value) {
+    return ReadArray(value, 1);
   }
-}
-
-inline QRgb DecompressNextPixel8To5(const u8*& pixelPtr, int& decompressionState, const Palette* palette, bool ignoreAlpha) {
-  QRgb result;
-  if (decompressionState == 0) {
-    const u8& colorIndex = pixelPtr[0];
-    const u8 paletteSection = pixelPtr[1] & 0b11;
-    // TODO: Extract and store damage modifiers
-    
-    result = GetPalettedPixel(palette, paletteSection, colorIndex, ignoreAlpha);
-  } else {  // if (decompressionState == 1)
-    const u8& colorIndex = ((pixelPtr[2] & 0b11) << 6) | (pixelPtr[1] >> 2);
-    const u8 paletteSection = (pixelPtr[2] >> 2) & 0b11;
-    // TODO: Extract and store damage modifiers
-    
-    result = GetPalettedPixel(palette, paletteSection, colorIndex, ignoreAlpha);
-    pixelPtr += 5;
+  
+  /// Reads count consecutive values and advances past them.
+  template <typename T>
+  inline bool ReadArray(T* values, usize count) {
+    if (count > (size - offset) / sizeof(T)) {
+      return false;
+    }
+    memcpy(values, data + offset, count * sizeof(T));
+    offset += count * sizeof(T);
+    return true;
   }
   
-  decompressionState = (decompressionState + 1) % 2;
-  return result;
-}
-
-inline QRgb DecompressNextPixel4Plus1(const u8*& pixelPtr, int& decompressionState, const Palette* palette, bool ignoreAlpha) {
-  const u8& paletteSections = pixelPtr[4];
+  /// Returns a pointer to the next byteCount bytes (without copying them) and advances past them.
+  inline const u8* ReadBytes(usize byteCount) {
+    if (byteCount > size - offset) {
+      return nullptr;
+    }
+    const u8* result = data + offset;
+    offset += byteCount;
+    return result;
+  }
   
-  QRgb result;
-  if (decompressionState == 0) {
-    result = GetPalettedPixel(palette, (paletteSections >> 0) & 0b11, pixelPtr[0], ignoreAlpha);
-  } else if (decompressionState == 1) {
-    result = GetPalettedPixel(palette, (paletteSections >> 2) & 0b11, pixelPtr[1], ignoreAlpha);
-  } else if (decompressionState == 2) {
-    result = GetPalettedPixel(palette, (paletteSections >> 4) & 0b11, pixelPtr[2], ignoreAlpha);
-  } else {  // if (decompressionState == 3)
-    result = GetPalettedPixel(palette, paletteSections >> 6, pixelPtr[3], ignoreAlpha);
-    pixelPtr += 5;
+  /// Moves the cursor to the given offset from the start of the data.
+  inline bool Seek(usize newOffset) {
+    if (newOffset > size) {
+      return false;
+    }
+    offset = newOffset;
+    return true;
   }
   
-  decompressionState = (decompressionState + 1) % 4;
-  return result;
-}
+  inline usize GetOffset() const { return offset; }
+  inline usize GetRemainingSize() const { return size - offset; }
+  
+ private:
+  const u8* data;
+  usize size;
+  usize offset = 0;
+};
 
 
 Palette LoadPalette(const std::filesystem::path& path);
@@ -60,101 +60,6 @@ bool SpriteAtlas::BuildAtlas(int width, int height, int borderPixels) {
   return rects.empty();
 }
 
-bool SpriteAtlas::Save(const char* path) {
-  FILE* file = fopen(path, "wb");
-  if (!file) {
-    return false;
-  }
-  
-  fwrite(&atlasWidth, sizeof(int), 1, file);
-  fwrite(&atlasHeight, sizeof(int), 1, file);
-  fwrite(&atlasBorderPixels, sizeof(int), 1, file);
-  int numRects = packedRects.size();
-  fwrite(&numRects, sizeof(int), 1, file);
-  
-  for (int i = 0; i < numRects; ++ i) {
-    const rbp::Rect& rect = packedRects[i];
-    fwrite(&rect.x, sizeof(int), 1, file);
-    fwrite(&rect.y, sizeof(int), 1, file);
-    fwrite(&rect.width, sizeof(int), 1, file);
-    fwrite(&rect.height, sizeof(int), 1, file);
-    fwrite(&packedRectIndices[i], sizeof(int), 1, file);
-  }
-  
-  fclose(file);
-  return true;
-}
-
-bool SpriteAtlas::Load(const char* path, int expectedNumRects) {
-  FILE* file = fopen(path, "rb");
-  if (!file) {
-    return false;
-  }
-  
-  if (fread(&atlasWidth, sizeof(int), 1, file) != 1) { fclose(file); return false; }
-  if (fread(&atlasHeight, sizeof(int), 1, file) != 1) { fclose(file); return false; }
-  if (fread(&atlasBorderPixels, sizeof(int), 1, file) != 1) { fclose(file); return false; }
-  int numRects;
-  if (fread(&numRects, sizeof(int), 1, file) != 1) { fclose(file); return false; }
-  if (numRects != expectedNumRects) {
-    return false;
-  }
-  packedRects.resize(numRects);
-  packedRectIndices.resize(numRects);
-  
-  for (int i = 0; i < numRects; ++ i) {
-    rbp::Rect& rect = packedRects[i];
-    if (fread(&rect.x, sizeof(int), 1, file) != 1) { fclose(file); return false; }
-    if (fread(&rect.y, sizeof(int), 1, file) != 1) { fclose(file); return false; }
-    if (fread(&rect.width, sizeof(int), 1, file) != 1) { fclose(file); return false; }
-    if (fread(&rect.height, sizeof(int), 1, file) != 1) { fclose(file); return false; }
-    if (fread(&packedRectIndices[i], sizeof(int), 1, file) != 1) { fclose(file); return false; }
-  }
-  
-  fclose(file);
-  return true;
-}
-
-bool SpriteAtlas::IsConsistent() {
-  // Invert packedRectIndices
-  std::vector<int> originalToPackedIndex(packedRects.size());
-  for (std::size_t i = 0; i < packedRectIndices.size(); ++ i) {
-    int index = packedRectIndices[i];
-    if (index < 0 || index >= static_cast<int>(originalToPackedIndex.size())) {
-      return false;
-    }
-    originalToPackedIndex[index] = i;
-  }
-  
-  int index = 0;
-  for (Sprite* sprite : sprites) {
-    for (int frameIdx = 0; frameIdx < sprite->NumFrames(); ++ frameIdx) {
-      Sprite::Frame::Layer& layer =
-          (mode == Mode::Graphic) ?
-          sprite->frame(frameIdx).graphic :
-          sprite->frame(frameIdx).shadow;
-      QImage& image = layer.image;
-      const Rect& packedRect = packedRects[originalToPackedIndex[index]];
-      
-      int packedWidthWithoutBorder = packedRect.width - 2 * atlasBorderPixels;
-      int packedHeightWithoutBorder = packedRect.height - 2 * atlasBorderPixels;
-      
-      if (packedWidthWithoutBorder == image.width() && packedHeightWithoutBorder == image.height()) {
-        // ok
-      } else if (packedWidthWithoutBorder == image.height() && packedHeightWithoutBorder == image.width()) {
-        // NOTE: We currently do not support frame rotation
-        return false;
-      } else {
-        return false;
-      }
-      
-      ++ index;
-    }
-  }
-  
-  return true;
-}
-
 QImage SpriteAtlas::RenderAtlas() {
   Timer paintTimer("SpriteAtlas::BuildAtlas rendering");
   
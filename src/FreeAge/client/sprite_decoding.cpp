@@ -0,0 +1,124 @@
+// Copyright 2020 The FreeAge authors
+// This file is part of FreeAge, licensed under the new BSD license.
+// See the COPYING file in the project root for the license text.
+
+#include "FreeAge/client/sprite_decoding.hpp"
+
+#include <cstring>
+
+#include <emmintrin.h>
+
+/// Loads 4 bytes from a possibly unaligned address.
+static inline u32 LoadU32(const u8* ptr) {
+  u32 value;
+  memcpy(&value, ptr, sizeof(u32));
+  return value;
+}
+
+/// Loads 2 bytes from a possibly unaligned address.
+static inline u16 LoadU16(const u8* ptr) {
+  u16 value;
+  memcpy(&value, ptr, sizeof(u16));
+  return value;
+}
+
+void SMXColorTable::Initialize(const Palette* palette, bool ignoreAlpha) {
+  for (int value = 0; value < kSMXPixelValueCount; ++ value) {
+    if (palette != nullptr && static_cast<usize>(value) >= palette->size()) {
+      colors[value] = qRgba(0, 0, 0, 0);
+    } else {
+      colors[value] = GetPalettedPixel(palette, value >> 8, value & 0xff, ignoreAlpha);
+    }
+  }
+}
+
+void DecompressPixels8To5(const u8*& pixelPtr, int& decompressionState, int count, const SMXColorTable& colorTable, QRgb* out) {
+  // Each 5-byte block contains two pixels. As a little-endian 32-bit value, the block's first 4 bytes
+  // contain the value of the first pixel in bits 0 to 9 and the value of the second pixel in bits 10 to 19.
+  
+  // Decode a second pixel whose block was started by the previous run.
+  if (count > 0 && decompressionState == 1) {
+    *out++ = colorTable.colors[(LoadU16(pixelPtr + 1) >> 2) & 0x3ff];
+    pixelPtr += 5;
+    decompressionState = 0;
+    -- count;
+  }
+  
+  // Decode 4 blocks (8 pixels) at a time: the values of both pixels of a block are moved into
+  // the two 16-bit halves of a 32-bit lane, which yields the 8 pixel values in order.
+  const __m128i valueMask = _mm_set1_epi32(0x3ff);
+  const __m128i secondValueMask = _mm_set1_epi32(0x3ff << 16);
+  alignas(16) u16 values[8];
+  for (; count >= 8; count -= 8) {
+    __m128i blocks = _mm_set_epi32(LoadU32(pixelPtr + 15), LoadU32(pixelPtr + 10), LoadU32(pixelPtr + 5), LoadU32(pixelPtr));
+    __m128i firstValues = _mm_and_si128(blocks, valueMask);
+    __m128i secondValues = _mm_and_si128(_mm_slli_epi32(blocks, 6), secondValueMask);
+    _mm_store_si128(reinterpret_cast<__m128i*>(values), _mm_or_si128(firstValues, secondValues));
+    
+    for (int i = 0; i < 8; ++ i) {
+      out[i] = colorTable.colors[values[i]];
+    }
+    out += 8;
+    pixelPtr += 4 * 5;
+  }
+  
+  // Decode the remaining pixels.
+  for (; count >= 2; count -= 2) {
+    u32 block = LoadU32(pixelPtr);
+    *out++ = colorTable.colors[block & 0x3ff];
+    *out++ = colorTable.colors[(block >> 10) & 0x3ff];
+    pixelPtr += 5;
+  }
+  if (count > 0) {
+    *out = colorTable.colors[LoadU16(pixelPtr) & 0x3ff];
+    decompressionState = 1;
+  }
+}
+
+void DecompressPixels4Plus1(const u8*& pixelPtr, int& decompressionState, int count, const SMXColorTable& colorTable, QRgb* out) {
+  // Each 5-byte block contains the color indices of four pixels in its first 4 bytes,
+  // and the palette sections of these pixels (2 bits each) in its last byte.
+  
+  // Decode the pixels of a block that was started by the previous run.
+  while (count > 0 && decompressionState != 0) {
+    *out++ = colorTable.colors[(((pixelPtr[4] >> (2 * decompressionState)) & 0b11) << 8) | pixelPtr[decompressionState]];
+    -- count;
+    if (decompressionState == 3) {
+      pixelPtr += 5;
+      decompressionState = 0;
+    } else {
+      ++ decompressionState;
+    }
+  }
+  
+  // Decode 2 blocks (8 pixels) at a time, with one pixel in each 16-bit lane:
+  // the color index is zero-extended, and the block's section byte is multiplied with
+  // a power of two such that the pixel's section ends up in bits 8 and 9.
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i sectionShifts = _mm_set_epi16(1 << 2, 1 << 4, 1 << 6, 1 << 8, 1 << 2, 1 << 4, 1 << 6, 1 << 8);
+  const __m128i sectionMask = _mm_set1_epi16(0b11 << 8);
+  alignas(16) u16 values[8];
+  for (; count >= 8; count -= 8) {
+    __m128i colorIndices = _mm_unpacklo_epi8(_mm_set_epi32(0, 0, LoadU32(pixelPtr + 5), LoadU32(pixelPtr)), zero);
+    __m128i sections = _mm_set_epi16(pixelPtr[9], pixelPtr[9], pixelPtr[9], pixelPtr[9], pixelPtr[4], pixelPtr[4], pixelPtr[4], pixelPtr[4]);
+    sections = _mm_and_si128(_mm_mullo_epi16(sections, sectionShifts), sectionMask);
+    _mm_store_si128(reinterpret_cast<__m128i*>(values), _mm_or_si128(colorIndices, sections));
+    
+    for (int i = 0; i < 8; ++ i) {
+      out[i] = colorTable.colors[values[i]];
+    }
+    out += 8;
+    pixelPtr += 2 * 5;
+  }
+  
+  // Decode the remaining pixels.
+  for (; count > 0; -- count) {
+    *out++ = colorTable.colors[(((pixelPtr[4] >> (2 * decompressionState)) & 0b11) << 8) | pixelPtr[decompressionState]];
+    if (decompressionState == 3) {
+      pixelPtr += 5;
+      decompressionState = 0;
+    } else {
+      ++ decompressionState;
+    }
+  }
+}
@@ -0,0 +1,105 @@
+// Copyright 2020 The FreeAge authors
+// This file is part of FreeAge, licensed under the new BSD license.
+// See the COPYING file in the project root for the license text.
+
+#pragma once
+
+#include <iostream>
+#include <vector>
+
+#include <QRgb>
+
+#include "FreeAge/common/free_age.hpp"
+#include "FreeAge/common/logging.hpp"
+
+typedef std::vector<QRgb> Palette;
+
+
+// Scalar functions for decoding single pixels of SMX graphic layers.
+// They serve as the reference for the functions that decode runs of pixels below.
+
+inline QRgb GetPalettedPixel(const Palette* palette, u8 paletteSection, u8 colorIndex, bool ignoreAlpha) {
+  std::size_t finalIndex = 256 * paletteSection + colorIndex;
+  
+  if (palette == nullptr) {
+    // Encode the index in the pixel value.
+    // Set the alpha to the magic value of 254, which the shader will interpret as player color marking.
+    CHECK_LT(finalIndex, 65536);
+    return qRgba(finalIndex & 0xff, (finalIndex >> 8) & 0xff, 0, 254);
+  } else if (finalIndex < palette->size()) {
+    const QRgb& rgba = (*palette)[finalIndex];
+    return qRgba(qRed(rgba), qGreen(rgba), qBlue(rgba), ignoreAlpha ? 255 : qAlpha(rgba));
+  } else {
+    std::cout << "AddPalettedPixel(): Index (" << finalIndex << ") is larger than the palette size (" << palette->size() << ")\n";
+    return qRgba(0, 0, 0, 0);
+  }
+}
+
+inline QRgb DecompressNextPixel8To5(const u8*& pixelPtr, int& decompressionState, const Palette* palette, bool ignoreAlpha) {
+  QRgb result;
+  if (decompressionState == 0) {
+    const u8& colorIndex = pixelPtr[0];
+    const u8 paletteSection = pixelPtr[1] & 0b11;
+    // TODO: Extract and store damage modifiers
+    
+    result = GetPalettedPixel(palette, paletteSection, colorIndex, ignoreAlpha);
+  } else {  // if (decompressionState == 1)
+    const u8& colorIndex = ((pixelPtr[2] & 0b11) << 6) | (pixelPtr[1] >> 2);
+    const u8 paletteSection = (pixelPtr[2] >> 2) & 0b11;
+    // TODO: Extract and store damage modifiers
+    
+    result = GetPalettedPixel(palette, paletteSection, colorIndex, ignoreAlpha);
+    pixelPtr += 5;
+  }
+  
+  decompressionState = (decompressionState + 1) % 2;
+  return result;
+}
+
+inline QRgb DecompressNextPixel4Plus1(const u8*& pixelPtr, int& decompressionState, const Palette* palette, bool ignoreAlpha) {
+  const u8& paletteSections = pixelPtr[4];
+  
+  QRgb result;
+  if (decompressionState == 0) {
+    result = GetPalettedPixel(palette, (paletteSections >> 0) & 0b11, pixelPtr[0], ignoreAlpha);
+  } else if (decompressionState == 1) {
+    result = GetPalettedPixel(palette, (paletteSections >> 2) & 0b11, pixelPtr[1], ignoreAlpha);
+  } else if (decompressionState == 2) {
+    result = GetPalettedPixel(palette, (paletteSections >> 4) & 0b11, pixelPtr[2], ignoreAlpha);
+  } else {  // if (decompressionState == 3)
+    result = GetPalettedPixel(palette, paletteSections >> 6, pixelPtr[3], ignoreAlpha);
+    pixelPtr += 5;
+  }
+  
+  decompressionState = (decompressionState + 1) % 4;
+  return result;
+}
+
+
+// Functions for decoding runs of pixels of SMX graphic layers.
+// They decode the pixel values (palette section in bits 8 and 9, color index in bits 0 to 7) of
+// several pixels at once with SSE2, and then look up the colors for these values in an SMXColorTable.
+
+/// Number of distinct pixel values in SMX graphic layers: 4 palette sections with 256 colors each.
+constexpr int kSMXPixelValueCount = 4 * 256;
+
+/// Lookup table from the pixel values of SMX graphic layers to their colors, which avoids
+/// GetPalettedPixel()'s branches for each pixel.
+struct SMXColorTable {
+  /// Sets the colors to those that GetPalettedPixel() returns for the given palette (which is nullptr for
+  /// player-color pixels). Pixel values beyond the end of the palette map to transparent, like in
+  /// GetPalettedPixel(), but are not reported.
+  void Initialize(const Palette* palette, bool ignoreAlpha);
+  
+  QRgb colors[kSMXPixelValueCount];
+};
+
+/// Decodes count consecutive pixels that use 8-to-5 compression into out.
+/// This is equivalent to calling DecompressNextPixel8To5() count times with the palette of the color table.
+/// The 5-byte blocks that the pixels are decoded from must be completely within the pixel array.
+void DecompressPixels8To5(const u8*& pixelPtr, int& decompressionState, int count, const SMXColorTable& colorTable, QRgb* out);
+
+/// Decodes count consecutive pixels that use 4-plus-1 compression into out.
+/// This is equivalent to calling DecompressNextPixel4Plus1() count times with the palette of the color table.
+/// The 5-byte blocks that the pixels are decoded from must be completely within the pixel array.
+void DecompressPixels4Plus1(const u8*& pixelPtr, int& decompressionState, int count, const SMXColorTable& colorTable, QRgb* out);
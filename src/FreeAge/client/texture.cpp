@@ -183,3 +183,17 @@ bool Texture::Load(const std::filesystem::path& path, int wrapMode, int magFilte
   CHECK_OPENGL_NO_ERROR();
   return true;
 }
+
+QImage Texture::Download() const {
+  QOpenGLFunctions_3_2_Core* f = QOpenGLContext::currentContext()->versionFunctions<QOpenGLFunctions_3_2_Core>();
+  
+  QImage image(width, height, QImage::Format_ARGB32);
+  f->glBindTexture(GL_TEXTURE_2D, textureId);
+  
+  // QImage scan lines are aligned to multiples of 4 bytes. Ensure that OpenGL writes this correctly.
+  f->glPixelStorei(GL_PACK_ALIGNMENT, 4);
+  f->glGetTexImage(GL_TEXTURE_2D, 0, GL_BGRA, GL_UNSIGNED_BYTE, image.bits());
+  
+  CHECK_OPENGL_NO_ERROR();
+  return image;
+}
@@ -99,6 +99,10 @@ class Texture {
   /// The file is assumed to have 8 bits per color channel, with 4 channels in total.
   bool Load(const std::filesystem::path& path, int wrapMode, int magFilter, int minFilter);
   
+  /// Reads the contents of the texture back from GPU memory, for textures with 4 channels
+  /// (such as those created with CreateEmpty()).
+  QImage Download() const;
+  
   /// Returns the OpenGL texture Id.
   GLuint GetId() const { return textureId; }
   
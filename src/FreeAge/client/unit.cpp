@@ -7,6 +7,7 @@
 #include <cmath>
 
 #include "FreeAge/common/logging.hpp"
+#include "FreeAge/common/messages.hpp"
 #include "FreeAge/client/map.hpp"
 #include "FreeAge/client/match.hpp"
 #include "FreeAge/client/mod_manager.hpp"
@@ -158,20 +159,20 @@ bool ClientUnitType::Load(UnitType type, const std::filesystem::path& graphicsSu
       if (!ok) {
         return false;
       }
-      
-      // For extracting attack durations.
-      // TODO: Remove this once we get those in a better way.
-      if (animationType == UnitAnimation::Attack) {
-        LOG(INFO) << "Attack animation " << animationVariants[variant] << " has " << (animations[static_cast<int>(animationType)][variant]->sprite.NumFrames() / kNumFacingDirections) << " frames per facing direction";
-      }
     }
   }
   
   // Load the icon.
   iconTexture = TextureManager::Instance().GetOrLoad(GetModdedPath(iconSubPath), TextureManager::Loader::Mango, GL_CLAMP_TO_EDGE, GL_LINEAR, GL_LINEAR);
   
-  if (!ok) {
-    return false;
+  return ok;
+}
+
+void ClientUnitType::FinishLoading() {
+  // For extracting attack durations.
+  // TODO: Remove this once we get those in a better way.
+  for (const SpriteAndTextures* animation : animations[static_cast<int>(UnitAnimation::Attack)]) {
+    LOG(INFO) << "Attack animation has " << (animation->sprite.NumFrames() / kNumFacingDirections) << " frames per facing direction";
   }
   
   maxCenterY = 0;
@@ -182,8 +183,6 @@ bool ClientUnitType::Load(UnitType type, const std::filesystem::path& graphicsSu
       maxCenterY = std::max(maxCenterY, animation->sprite.frame(frame).graphic.centerY);
     }
   }
-  
-  return true;
 }
 
 int ClientUnitType::GetHealthBarHeightAboveCenter() const {
@@ -210,7 +209,8 @@ ClientUnit::ClientUnit(int playerIndex, UnitType type, const QPointF& mapCoord,
       currentAnimation(UnitAnimation::Idle),
       currentAnimationVariant(0),
       lastAnimationStartTime(-1),
-      movementSegment(-1, mapCoord, QPointF(0, 0), UnitAction::Idle) {}
+      movementSegment(-1, mapCoord, QPointF(0, 0), UnitAction::Idle),
+      movementReferenceCoord(QuantizeUnitMovementCoord(mapCoord)) {}
 
 QPointF ClientUnit::GetCenterProjectedCoord(Map* map) {
   return map->MapCoordToProjectedCoord(mapCoord);
@@ -41,6 +41,9 @@ class ClientUnitType {
   ~ClientUnitType();
   
   bool Load(UnitType type, const std::filesystem::path& graphicsSubPath, const std::filesystem::path& cachePath, ColorDilationShader* colorDilationShader, const Palettes& palettes);
+  /// Computes the data that depends on the contents of the sprites that were requested by Load().
+  /// Must be called once these sprites are loaded (see SpriteManager::FinishDeferredLoading()).
+  void FinishLoading();
   
   int GetHealthBarHeightAboveCenter() const;
   
@@ -121,6 +124,11 @@ class ClientUnit : public ClientObject {
   
   void SetMovementSegment(double serverTime, const QPointF& startPoint, const QPointF& speed, UnitAction action, Map* map, Match* match);
   
+  /// The start point of the last received movement (or the initial map coord), quantized with
+  /// QuantizeUnitMovementCoord(). UnitMovementBatch messages give start points relative to this.
+  inline const QPoint& GetMovementReferenceCoord() const { return movementReferenceCoord; }
+  inline void SetMovementReferenceCoord(const QPoint& coord) { movementReferenceCoord = coord; }
+  
   inline void SetCarriedResources(ResourceType type, u8 amount) {
     carriedResourceType = type;
     carriedResourceAmount = amount;
@@ -186,6 +194,9 @@ class ClientUnit : public ClientObject {
   ///       we only store one segment at a time?
   MovementSegment movementSegment;
   
+  /// See GetMovementReferenceCoord().
+  QPoint movementReferenceCoord;
+  
   // For villagers: carried resource type.
   ResourceType carriedResourceType = ResourceType::NumTypes;
   // For villagers: carried resource amount.
@@ -0,0 +1,111 @@
+// Copyright 2020 The FreeAge authors
+// This file is part of FreeAge, licensed under the new BSD license.
+// See the COPYING file in the project root for the license text.
+
+#include "FreeAge/common/message_buffer.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+#include <QIODevice>
+
+MessageBuffer::MessageBuffer(usize initialCapacity) {
+  usize capacity = 1;
+  while (capacity < initialCapacity) {
+    capacity *= 2;
+  }
+  buffer.resize(capacity);
+}
+
+usize MessageBuffer::ReadFrom(QIODevice* device) {
+  usize totalReadCount = 0;
+  
+  while (true) {
+    qint64 available = device->bytesAvailable();
+    if (available <= 0) {
+      break;
+    }
+    Reserve(size + available);
+    
+    // Read into the free part of the ring buffer, which consists of at most two contiguous segments.
+    usize writeIndex = (readIndex + size) & (buffer.size() - 1);
+    usize segmentSize = std::min<usize>(available, buffer.size() - writeIndex);
+    qint64 readCount = device->read(buffer.data() + writeIndex, segmentSize);
+    if (readCount <= 0) {
+      break;
+    }
+    size += readCount;
+    totalReadCount += readCount;
+  }
+  
+  return totalReadCount;
+}
+
+void MessageBuffer::Append(const char* bytes, usize count) {
+  Reserve(size + count);
+  
+  usize writeIndex = (readIndex + size) & (buffer.size() - 1);
+  usize firstSegmentSize = std::min(count, buffer.size() - writeIndex);
+  memcpy(buffer.data() + writeIndex, bytes, firstSegmentSize);
+  memcpy(buffer.data(), bytes + firstSegmentSize, count - firstSegmentSize);
+  size += count;
+}
+
+bool MessageBuffer::GetNextMessage(MessageView* message) {
+  if (size < kHeaderSize) {
+    return false;
+  }
+  
+  // The length is stored in the same byte order as with mango::ustore16() by the sender.
+  u16 messageLength;
+  char lengthBytes[2] = {GetByte(1), GetByte(2)};
+  memcpy(&messageLength, lengthBytes, 2);
+  
+  if (size < messageLength) {
+    return false;
+  }
+  
+  // Make sure that at least the header can be accessed in case of an invalid length.
+  usize viewSize = std::max<usize>(messageLength, kHeaderSize);
+  if (readIndex + viewSize <= buffer.size()) {
+    *message = MessageView(buffer.data() + readIndex, messageLength);
+  } else {
+    wrappedMessage.resize(viewSize);
+    for (usize i = 0; i < viewSize; ++ i) {
+      wrappedMessage[i] = GetByte(i);
+    }
+    *message = MessageView(wrappedMessage.data(), messageLength);
+  }
+  return true;
+}
+
+void MessageBuffer::PopMessage(const MessageView& message) {
+  usize removedSize = std::min<usize>(size, std::max(message.GetSize(), kHeaderSize));
+  readIndex = (readIndex + removedSize) & (buffer.size() - 1);
+  size -= removedSize;
+  
+  // Restart at the beginning if the buffer became empty, which makes wrap-arounds less likely.
+  if (size == 0) {
+    readIndex = 0;
+  }
+}
+
+void MessageBuffer::Reserve(usize minCapacity) {
+  if (minCapacity <= buffer.size()) {
+    return;
+  }
+  
+  usize newCapacity = buffer.size();
+  while (newCapacity < minCapacity) {
+    newCapacity *= 2;
+  }
+  
+  // Copy the buffered bytes to the start of the new buffer.
+  std::vector<char> newBuffer(newCapacity);
+  usize firstSegmentSize = std::min(size, buffer.size() - readIndex);
+  memcpy(newBuffer.data(), buffer.data() + readIndex, firstSegmentSize);
+  memcpy(newBuffer.data() + firstSegmentSize, buffer.data(), size - firstSegmentSize);
+  
+  buffer.swap(newBuffer);
+  readIndex = 0;
+}
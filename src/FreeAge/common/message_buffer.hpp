@@ -0,0 +1,127 @@
+// Copyright 2020 The FreeAge authors
+// This file is part of FreeAge, licensed under the new BSD license.
+// See the COPYING file in the project root for the license text.
+
+#pragma once
+
+#include <algorithm>
+#include <vector>
+
+#include <QByteArray>
+
+#include "FreeAge/common/free_age.hpp"
+
+class QIODevice;
+
+/// Non-owning view onto one received message, including its 3-byte header
+/// (the message type as u8 and the message length in bytes as u16).
+///
+/// The view is only valid until the next call to MessageBuffer::PopMessage()
+/// or any other function that modifies the MessageBuffer it was obtained from.
+class MessageView {
+ public:
+  inline MessageView()
+      : data(nullptr),
+        size(0) {}
+  
+  inline MessageView(const char* data, int size)
+      : data(data),
+        size(size) {}
+  
+  /// Returns the message type byte. Must only be called if GetSize() >= 1.
+  inline u8 GetType() const { return static_cast<u8>(data[0]); }
+  
+  /// Returns a pointer to the start of the message, i.e., to its header.
+  inline const char* GetData() const { return data; }
+  
+  /// Returns the message length in bytes (including the header), as given in the header.
+  inline int GetSize() const { return size; }
+  
+  /// Returns a copy of len bytes of the message, starting at pos (like QByteArray::mid()).
+  /// The range is clamped to the message.
+  inline QByteArray Mid(int pos, int len) const {
+    if (pos >= size || len <= 0) {
+      return QByteArray();
+    }
+    return QByteArray(data + pos, std::min(len, size - pos));
+  }
+  
+ private:
+  const char* data;
+  int size;
+};
+
+/// Ring buffer for the bytes received over a connection, which splits them into messages.
+///
+/// In contrast to appending the received bytes to a QByteArray and removing each parsed message
+/// from its front, neither receiving data nor consuming messages moves the remaining bytes
+/// (except for growing the buffer, which happens rarely). Complete messages are returned as
+/// MessageViews that point into the buffer. Only if a message wraps around the end of the
+/// ring buffer, it is copied to make it contiguous.
+///
+/// Usage:
+/// ```
+/// buffer.ReadFrom(socket);
+/// MessageView message;
+/// while (buffer.GetNextMessage(&message)) {
+///   // Handle the message ...
+///   buffer.PopMessage(message);
+/// }
+/// ```
+class MessageBuffer {
+ public:
+  /// Creates a buffer with the given initial capacity, which is rounded up to a power of two.
+  MessageBuffer(usize initialCapacity = 4096);
+  
+  /// Reads all bytes that are available from the given device and appends them to the buffer.
+  /// Returns the number of bytes that were read.
+  usize ReadFrom(QIODevice* device);
+  
+  /// Appends the given bytes to the buffer.
+  void Append(const char* bytes, usize count);
+  
+  /// If the buffer starts with a complete message, returns true and sets *message to view it.
+  /// Otherwise, returns false. Note that the size of the returned message may be smaller than
+  /// the header size if the sender specified an invalid length.
+  bool GetNextMessage(MessageView* message);
+  
+  /// Removes the given message, which must have been returned by the last call to GetNextMessage(),
+  /// from the buffer. At least the header is removed even if the message length is invalid,
+  /// such that parsing always makes progress.
+  void PopMessage(const MessageView& message);
+  
+  /// Removes all bytes from the buffer.
+  inline void Clear() {
+    readIndex = 0;
+    size = 0;
+  }
+  
+  /// Returns the number of bytes in the buffer.
+  inline usize GetSize() const { return size; }
+  
+  /// Returns whether the buffer is empty.
+  inline bool IsEmpty() const { return size == 0; }
+  
+  /// Size of the header at the start of each message.
+  static constexpr int kHeaderSize = 3;
+  
+ private:
+  /// Returns the byte at the given offset from the start of the buffered data.
+  inline char GetByte(usize offset) const { return buffer[(readIndex + offset) & (buffer.size() - 1)]; }
+  
+  /// Grows the buffer (if necessary) such that it can hold at least the given number of bytes.
+  void Reserve(usize minCapacity);
+  
+  
+  /// The ring buffer. Its size is always a power of two.
+  std::vector<char> buffer;
+  
+  /// Index of the first buffered byte in buffer.
+  usize readIndex = 0;
+  
+  /// Number of buffered bytes.
+  usize size = 0;
+  
+  /// Contiguous copy of the current message in case it wraps around the end of the ring buffer.
+  std::vector<char> wrappedMessage;
+};
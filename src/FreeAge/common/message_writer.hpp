@@ -0,0 +1,91 @@
+// Copyright 2020 The FreeAge authors
+// This file is part of FreeAge, licensed under the new BSD license.
+// See the COPYING file in the project root for the license text.
+
+#pragma once
+
+#include <algorithm>
+
+#include <QByteArray>
+#include <QIODevice>
+
+#include <mango/core/endian.hpp>
+
+#include "FreeAge/common/free_age.hpp"
+
+/// Buffer for outgoing messages, into which the messages are serialized in place.
+///
+/// In contrast to creating a QByteArray for each message and appending it to another QByteArray,
+/// this avoids the allocation and the copy for each message. The buffer is meant to be reused:
+/// Clear() keeps its memory allocated.
+///
+/// Optionally, a fixed number of bytes at the start of the buffer is reserved for a prefix
+/// that is only filled in when the messages are sent (e.g., a message with the server time
+/// that the messages belong to). This avoids moving the messages in order to prepend it.
+///
+/// Usage:
+/// ```
+/// MessageWriter writer;
+/// WriteObjectDeathMessage(&writer, objectId);
+/// writer.Append(sharedMessage);
+/// writer.WriteTo(socket);
+/// ```
+class MessageWriter {
+ public:
+  /// Creates a writer that reserves prefixSize bytes for a prefix, with memory for initialCapacity bytes.
+  inline MessageWriter(int prefixSize = 0, int initialCapacity = 1024)
+      : prefixSize(prefixSize) {
+    buffer.reserve(std::max(prefixSize, initialCapacity));
+    buffer.resize(prefixSize);
+  }
+  
+  /// Appends a message with the given type and a payload of payloadSize bytes, and sets its
+  /// 3-byte header (the message type as u8 and the message length in bytes as u16).
+  /// Returns a pointer to the start of the message (i.e., to its header), where the caller
+  /// has to fill in the payload starting at offset 3. The pointer is only valid until the
+  /// next call that modifies the writer.
+  inline char* AppendMessage(u8 type, int payloadSize) {
+    int offset = buffer.size();
+    buffer.resize(offset + 3 + payloadSize);
+    char* data = buffer.data() + offset;
+    data[0] = static_cast<char>(type);
+    mango::ustore16(data + 1, 3 + payloadSize);
+    return data;
+  }
+  
+  /// Appends already serialized messages. This allows to serialize a message that is sent
+  /// to multiple recipients only once.
+  inline void Append(const QByteArray& messages) { buffer.append(messages); }
+  inline void Append(const MessageWriter& other) { buffer.append(other.GetMessages(), other.GetMessagesSize()); }
+  
+  /// Removes all messages. The prefix is kept reserved.
+  inline void Clear() { buffer.resize(prefixSize); }
+  
+  /// Returns a pointer to the reserved prefix.
+  inline char* GetPrefix() { return buffer.data(); }
+  
+  /// Returns a pointer to the messages (excluding the prefix).
+  inline const char* GetMessages() const { return buffer.constData() + prefixSize; }
+  
+  /// Returns the size of the messages in bytes (excluding the prefix).
+  inline int GetMessagesSize() const { return buffer.size() - prefixSize; }
+  
+  /// Returns whether no messages have been written since the last Clear().
+  inline bool IsEmpty() const { return buffer.size() == prefixSize; }
+  
+  /// Returns the buffer containing the prefix and the messages. This is for functions that modify
+  /// messages that were written before (see AppendUnitMovementBatchEntry()).
+  inline QByteArray* GetBuffer() { return &buffer; }
+  
+  /// Writes the prefix and the messages to the given device, and clears the writer.
+  inline void WriteTo(QIODevice* device) {
+    device->write(buffer.constData(), buffer.size());
+    Clear();
+  }
+  
+ private:
+  /// The prefix, followed by the messages.
+  QByteArray buffer;
+  
+  int prefixSize;
+};
@@ -4,6 +4,9 @@
 
 #include "FreeAge/common/messages.hpp"
 
+#include <cstring>
+#include <limits>
+
 #include <mango/core/endian.hpp>
 #include <QString>
 
@@ -213,6 +216,10 @@ static inline QByteArray CreateServerToClientMessageHeader(int dataSize, ServerT
   return msg;
 }
 
+static inline char* AppendServerToClientMessage(MessageWriter* writer, int dataSize, ServerToClientMessage type) {
+  return writer->AppendMessage(static_cast<u8>(type), dataSize);
+}
+
 QByteArray CreateWelcomeMessage() {
   QByteArray msg = CreateServerToClientMessageHeader(4, ServerToClientMessage::Welcome);
   char* data = msg.data();
@@ -287,73 +294,184 @@ QByteArray CreateGameBeginMessage(
   return msg;
 }
 
-QByteArray CreateGameStepTimeMessage(double gameStepServerTime) {
-  QByteArray msg = CreateServerToClientMessageHeader(8, ServerToClientMessage::GameStepTime);
-  char* data = msg.data();
+void WriteGameStepTimeMessage(char* data, double gameStepServerTime) {
+  data[0] = static_cast<char>(ServerToClientMessage::GameStepTime);
+  mango::ustore16(data + 1, kGameStepTimeMessageSize);
   memcpy(data + 3, &gameStepServerTime, 8);
-  return msg;
 }
 
-QByteArray CreateUnitMovementMessage(u32 unitId, const QPointF& startPoint, const QPointF& speed, UnitAction action) {
-  QByteArray msg = CreateServerToClientMessageHeader(21, ServerToClientMessage::UnitMovement);
-  char* data = msg.data();
-  mango::ustore32(data + 3, unitId);
-  *reinterpret_cast<float*>(data + 7) = startPoint.x();
-  *reinterpret_cast<float*>(data + 11) = startPoint.y();
-  *reinterpret_cast<float*>(data + 15) = speed.x();
-  *reinterpret_cast<float*>(data + 19) = speed.y();
-  data[23] = static_cast<u8>(action);
-  return msg;
+/// Movement speeds (in tiles per second) that can be encoded with a table index in UnitMovementBatch messages.
+/// This covers the speeds of all units (see ServerUnit::GetMoveSpeed()); index 0 means that the unit does not move.
+static constexpr float kUnitMovementSpeedTable[] = {0.f, 1.f, 2.f};
+static constexpr int kUnitMovementSpeedTableSize = sizeof(kUnitMovementSpeedTable) / sizeof(kUnitMovementSpeedTable[0]);
+static constexpr int kUnitMovementExplicitSpeedIndex = 15;
+
+static inline void AppendVarint(QByteArray* buffer, u32 value) {
+  while (value >= 0x80) {
+    buffer->append(static_cast<char>((value & 0x7f) | 0x80));
+    value >>= 7;
+  }
+  buffer->append(static_cast<char>(value));
+}
+
+static inline bool ParseVarint(const char* data, int size, int* offset, u32* value) {
+  *value = 0;
+  for (int shift = 0; shift < 35; shift += 7) {
+    if (*offset >= size) {
+      return false;
+    }
+    u8 byte = data[(*offset)++];
+    *value |= static_cast<u32>(byte & 0x7f) << shift;
+    if (!(byte & 0x80)) {
+      return true;
+    }
+  }
+  return false;
 }
 
-QByteArray CreateResourcesUpdateMessage(const ResourceAmount& amount) {
-  QByteArray msg = CreateServerToClientMessageHeader(16, ServerToClientMessage::ResourcesUpdate);
-  char* data = msg.data();
+static inline u32 ZigzagEncode(int value) {
+  return (static_cast<u32>(value) << 1) ^ static_cast<u32>(value >> 31);
+}
+
+static inline int ZigzagDecode(u32 value) {
+  return static_cast<int>(value >> 1) ^ -static_cast<int>(value & 1);
+}
+
+void AppendUnitMovementBatchEntry(MessageWriter* writer, int* batchOffset, u32 unitId, const QPoint& coordDelta, const QPointF& speed, UnitAction action) {
+  constexpr int kMaxEntrySize = 5 + 2 * 5 + 1 + 2 + 4;
+  QByteArray* buffer = writer->GetBuffer();
+  
+  // Start a new batch if necessary.
+  bool continueBatch =
+      *batchOffset >= 0 &&
+      *batchOffset + 3 <= buffer->size() &&
+      static_cast<ServerToClientMessage>(buffer->data()[*batchOffset]) == ServerToClientMessage::UnitMovementBatch &&
+      *batchOffset + mango::uload16(buffer->data() + *batchOffset + 1) == buffer->size() &&
+      buffer->size() - *batchOffset + kMaxEntrySize <= std::numeric_limits<u16>::max();
+  if (!continueBatch) {
+    *batchOffset = buffer->size();
+    AppendServerToClientMessage(writer, 0, ServerToClientMessage::UnitMovementBatch);
+  }
+  
+  // Determine the speed and direction encoding.
+  float speedMagnitude = std::sqrt(speed.x() * speed.x() + speed.y() * speed.y());
+  int speedIndex = kUnitMovementExplicitSpeedIndex;
+  for (int i = 0; i < kUnitMovementSpeedTableSize; ++ i) {
+    if (std::abs(speedMagnitude - kUnitMovementSpeedTable[i]) < 1e-4f) {
+      speedIndex = i;
+      break;
+    }
+  }
+  
+  // Append the entry.
+  AppendVarint(buffer, unitId);
+  AppendVarint(buffer, ZigzagEncode(coordDelta.x()));
+  AppendVarint(buffer, ZigzagEncode(coordDelta.y()));
+  buffer->append(static_cast<char>(static_cast<u8>(action) | (speedIndex << 4)));
+  if (speedIndex != 0) {
+    constexpr double kDirectionScale = 65536 / (2 * M_PI);
+    double angle = std::atan2(speed.y(), speed.x());
+    u16 directionIndex = static_cast<u16>(static_cast<int>(std::round(angle * kDirectionScale)) & 0xffff);
+    buffer->append(2, 0);
+    mango::ustore16(buffer->data() + buffer->size() - 2, directionIndex);
+  }
+  if (speedIndex == kUnitMovementExplicitSpeedIndex) {
+    buffer->append(reinterpret_cast<const char*>(&speedMagnitude), sizeof(float));
+  }
+  
+  // Update the batch length in its header.
+  mango::ustore16(buffer->data() + *batchOffset + 1, buffer->size() - *batchOffset);
+}
+
+bool ParseUnitMovementBatchEntry(const char* data, int size, int* offset, UnitMovementBatchEntry* entry) {
+  u32 deltaX;
+  u32 deltaY;
+  if (!ParseVarint(data, size, offset, &entry->unitId) ||
+      !ParseVarint(data, size, offset, &deltaX) ||
+      !ParseVarint(data, size, offset, &deltaY) ||
+      *offset >= size) {
+    return false;
+  }
+  entry->coordDelta = QPoint(ZigzagDecode(deltaX), ZigzagDecode(deltaY));
+  
+  u8 actionAndSpeed = data[(*offset)++];
+  int actionIndex = actionAndSpeed & 0xf;
+  int speedIndex = actionAndSpeed >> 4;
+  if (actionIndex >= static_cast<int>(UnitAction::NumActions) ||
+      (speedIndex >= kUnitMovementSpeedTableSize && speedIndex != kUnitMovementExplicitSpeedIndex)) {
+    return false;
+  }
+  entry->action = static_cast<UnitAction>(actionIndex);
+  
+  if (speedIndex == 0) {
+    entry->speed = QPointF(0, 0);
+    return true;
+  }
+  
+  if (*offset + 2 > size) {
+    return false;
+  }
+  constexpr double kDirectionScale = (2 * M_PI) / 65536;
+  double angle = mango::uload16(data + *offset) * kDirectionScale;
+  *offset += 2;
+  
+  float speedMagnitude;
+  if (speedIndex == kUnitMovementExplicitSpeedIndex) {
+    if (*offset + static_cast<int>(sizeof(float)) > size) {
+      return false;
+    }
+    memcpy(&speedMagnitude, data + *offset, sizeof(float));
+    *offset += sizeof(float);
+  } else {
+    speedMagnitude = kUnitMovementSpeedTable[speedIndex];
+  }
+  
+  entry->speed = QPointF(speedMagnitude * std::cos(angle), speedMagnitude * std::sin(angle));
+  return true;
+}
+
+void WriteResourcesUpdateMessage(MessageWriter* writer, const ResourceAmount& amount) {
+  char* data = AppendServerToClientMessage(writer, 16, ServerToClientMessage::ResourcesUpdate);
   mango::ustore32(data + 3, amount.wood());
   mango::ustore32(data + 7, amount.food());
   mango::ustore32(data + 11, amount.gold());
   mango::ustore32(data + 15, amount.stone());
-  return msg;
 }
 
-QByteArray CreateBuildPercentageUpdateMessage(u32 buildingId, float progress) {
-  QByteArray msg = CreateServerToClientMessageHeader(4 + 4, ServerToClientMessage::BuildPercentageUpdate);
-  char* data = msg.data();
+void WriteBuildPercentageUpdateMessage(MessageWriter* writer, u32 buildingId, float percentage, float percentagePerSecond) {
+  char* data = AppendServerToClientMessage(writer, 4 + 4 + 4, ServerToClientMessage::BuildPercentageUpdate);
   mango::ustore32(data + 3, buildingId);
-  memcpy(data + 3 + 4, &progress, 4);
-  return msg;
+  memcpy(data + 3 + 4, &percentage, 4);
+  memcpy(data + 3 + 8, &percentagePerSecond, 4);
 }
 
-QByteArray CreateChangeUnitTypeMessage(u32 unitId, UnitType type) {
-  QByteArray msg = CreateServerToClientMessageHeader(4 + 2, ServerToClientMessage::ChangeUnitType);
-  char* data = msg.data();
+void WriteChangeUnitTypeMessage(MessageWriter* writer, u32 unitId, UnitType type) {
+  char* data = AppendServerToClientMessage(writer, 4 + 2, ServerToClientMessage::ChangeUnitType);
   mango::ustore32(data + 3, unitId);
   mango::ustore16(data + 7, static_cast<u16>(type));
-  return msg;
 }
 
-QByteArray CreateSetCarriedResourcesMessage(u32 unitId, ResourceType type, u8 amount) {
-  QByteArray msg = CreateServerToClientMessageHeader(6, ServerToClientMessage::SetCarriedResources);
-  char* data = msg.data();
+void WriteSetCarriedResourcesMessage(MessageWriter* writer, u32 unitId, ResourceType type, u8 amount) {
+  char* data = AppendServerToClientMessage(writer, 6, ServerToClientMessage::SetCarriedResources);
   mango::ustore32(data + 3, unitId);
   data[7] = static_cast<u8>(type);
   data[8] = amount;
-  return msg;
 }
 
-QByteArray CreateHPUpdateMessage(u32 objectId, u32 newHP) {
-  QByteArray msg = CreateServerToClientMessageHeader(8, ServerToClientMessage::HPUpdate);
-  char* data = msg.data();
+void WriteHPUpdateMessage(MessageWriter* writer, u32 objectId, u32 newHP) {
+  char* data = AppendServerToClientMessage(writer, 8, ServerToClientMessage::HPUpdate);
   mango::ustore32(data + 3, objectId);
   mango::ustore32(data + 7, newHP);
-  return msg;
 }
 
-QByteArray CreateObjectDeathMessage(u32 objectId) {
-  QByteArray msg = CreateServerToClientMessageHeader(4, ServerToClientMessage::ObjectDeath);
-  char* data = msg.data();
+void WriteObjectDeathMessage(MessageWriter* writer, u32 objectId) {
+  char* data = AppendServerToClientMessage(writer, 4, ServerToClientMessage::ObjectDeath);
+  mango::ustore32(data + 3, objectId);
+}
+
+void WriteObjectLeaveViewMessage(MessageWriter* writer, u32 objectId) {
+  char* data = AppendServerToClientMessage(writer, 4, ServerToClientMessage::ObjectLeaveView);
   mango::ustore32(data + 3, objectId);
-  return msg;
 }
 
 QByteArray CreatePlayerLeaveBroadcastMessage(u8 playerIndex, PlayerExitReason reason) {
@@ -364,33 +482,26 @@ QByteArray CreatePlayerLeaveBroadcastMessage(u8 playerIndex, PlayerExitReason re
   return msg;
 }
 
-QByteArray CreateQueueUnitMessage(u32 buildingId, u16 unitType) {
-  QByteArray msg = CreateServerToClientMessageHeader(6, ServerToClientMessage::QueueUnit);
-  char* data = msg.data();
+void WriteQueueUnitMessage(MessageWriter* writer, u32 buildingId, u16 unitType) {
+  char* data = AppendServerToClientMessage(writer, 6, ServerToClientMessage::QueueUnit);
   mango::ustore32(data + 3, buildingId);
   mango::ustore16(data + 7, unitType);
-  return msg;
 }
 
-QByteArray CreateUpdateProductionMessage(u32 buildingId, float progressValue, float progressPerSecond) {
-  QByteArray msg = CreateServerToClientMessageHeader(4 + 4 + 4, ServerToClientMessage::UpdateProduction);
-  char* data = msg.data();
+void WriteUpdateProductionMessage(MessageWriter* writer, u32 buildingId, double startServerTime, double endServerTime) {
+  char* data = AppendServerToClientMessage(writer, 4 + 8 + 8, ServerToClientMessage::UpdateProduction);
   mango::ustore32(data + 3, buildingId);
-  *reinterpret_cast<float*>(data + 7) = progressValue;
-  *reinterpret_cast<float*>(data + 11) = progressPerSecond;
-  return msg;
+  memcpy(data + 7, &startServerTime, 8);
+  memcpy(data + 15, &endServerTime, 8);
 }
 
-QByteArray CreateRemoveFromProductionQueueMessage(u32 buildingId, u8 queueIndex) {
-  QByteArray msg = CreateServerToClientMessageHeader(5, ServerToClientMessage::RemoveFromProductionQueue);
-  char* data = msg.data();
+void WriteRemoveFromProductionQueueMessage(MessageWriter* writer, u32 buildingId, u8 queueIndex) {
+  char* data = AppendServerToClientMessage(writer, 5, ServerToClientMessage::RemoveFromProductionQueue);
   mango::ustore32(data + 3, buildingId);
   data[7] = queueIndex;
-  return msg;
 }
 
-QByteArray CreateSetHousedMessage(bool housed) {
-  QByteArray msg = CreateServerToClientMessageHeader(1, ServerToClientMessage::SetHoused);
-  msg.data()[3] = housed ? 1 : 0;
-  return msg;
+void WriteSetHousedMessage(MessageWriter* writer, bool housed) {
+  char* data = AppendServerToClientMessage(writer, 1, ServerToClientMessage::SetHoused);
+  data[3] = housed ? 1 : 0;
 }
@@ -4,12 +4,15 @@
 
 #pragma once
 
+#include <cmath>
 #include <vector>
 
 #include <QByteArray>
+#include <QPoint>
 #include <QPointF>
 
 #include "FreeAge/common/building_types.hpp"
+#include "FreeAge/common/message_writer.hpp"
 #include "FreeAge/common/free_age.hpp"
 #include "FreeAge/common/unit_types.hpp"
 
@@ -24,10 +27,13 @@ struct ResourceAmount;
 // # when connecting to a server with a        #
 // # different version.                        #
 // #############################################
-static constexpr u32 networkProtocolVersion = 1;
+static constexpr u32 networkProtocolVersion = 6;
 
 static constexpr int hostTokenLength = 6;
 
+/// Size of the chunks in which the map is sent to the clients (in tile corners per dimension).
+static constexpr int kMapChunkSize = 32;
+
 
 /// Types of messages sent by clients to the server.
 enum class ClientToServerMessage {
@@ -183,6 +189,8 @@ enum class ServerToClientMessage {
   // --- In-game messages ---
   
   /// A portion of the map is uncovered. The server tells the client about the map content there.
+  /// Each message contains the elevations of one chunk of kMapChunkSize x kMapChunkSize tile corners,
+  /// run-length encoded. The server sends the chunks close to the player's view first.
   MapUncover,
   
   /// A new map object (building or unit) is created respectively enters the client's view.
@@ -192,14 +200,12 @@ enum class ServerToClientMessage {
   /// step time, until the next GameStepTime message is received.
   GameStepTime,
   
-  /// Tells the client about the start point and speed of a unit's movement.
-  /// The speed may be zero, which indicates that the unit has stopped moving.
-  UnitMovement,
-  
   /// Tells the client about updates to its game resource amounts (wood, food, etc.)
   ResourcesUpdate,
   
-  /// Tells the client about a new build percentage of a building being constructed.
+  /// Tells the client about the build percentage of a building being constructed at the current
+  /// game step time, and the rate (in percent per second) at which it increases from then on.
+  /// This is only sent when the construction rate changes.
   BuildPercentageUpdate,
   
   /// Tells the client that an existing unit seen by the client changed its UnitType.
@@ -226,7 +232,8 @@ enum class ServerToClientMessage {
   /// Sent when a unit is successfully queued in a production building.
   QueueUnit,
   
-  /// Tells the client about the current state of the production of the first queued unit/technology in a building.
+  /// Tells the client about the production of the first queued unit/technology in a building:
+  /// the server times at which the production started and at which it will be completed.
   UpdateProduction,
   
   /// Tells the client to remove the first item of a building's production queue,
@@ -239,6 +246,15 @@ enum class ServerToClientMessage {
   ///       client behaves the same way as the server in this regard. And the amount of additional
   ///       transmitted data should be completely irrelevant.
   SetHoused,
+  
+  /// A unit left the client's view. The client removes it (without a death animation), since it does not
+  /// receive updates for the unit anymore. Once the unit enters the view again, it is re-sent with AddObject.
+  ObjectLeaveView,
+  
+  /// Tells the client about the start point and speed of the movements of a batch of units.
+  /// The speed may be zero, which indicates that the unit has stopped moving.
+  /// See AppendUnitMovementBatchEntry() for the format of the entries.
+  UnitMovementBatch,
 };
 
 QByteArray CreateWelcomeMessage();
@@ -263,25 +279,66 @@ QByteArray CreateGameBeginMessage(
     u16 mapWidth,
     u16 mapHeight);
 
-QByteArray CreateGameStepTimeMessage(double gameStepServerTime);
+/// Size of a GameStepTime message in bytes. The server reserves this as a prefix in
+/// the MessageWriter for each client, see WriteGameStepTimeMessage().
+static constexpr int kGameStepTimeMessageSize = 3 + 8;
+
+/// Writes a GameStepTime message (of size kGameStepTimeMessageSize) to data.
+void WriteGameStepTimeMessage(char* data, double gameStepServerTime);
+
+
+/// Resolution of the fixed-point map coordinates in UnitMovementBatch messages (in steps per tile).
+static constexpr float kUnitMovementCoordScale = 256;
+
+/// Converts a map coordinate to the fixed-point representation used in UnitMovementBatch messages.
+/// The server and the client must obtain the same result for the same mapCoord.
+inline QPoint QuantizeUnitMovementCoord(const QPointF& mapCoord) {
+  return QPoint(static_cast<int>(std::round(mapCoord.x() * kUnitMovementCoordScale)),
+                static_cast<int>(std::round(mapCoord.y() * kUnitMovementCoordScale)));
+}
+
+/// Appends a movement entry for the given unit to a UnitMovementBatch message at the end of the writer.
+/// *batchOffset is the offset of the last batch that was started in writer->GetBuffer(), or -1 if there is none.
+/// If this batch is not at the end anymore (since other messages were appended after it), or if it
+/// is full, a new batch is started at the end and *batchOffset is set to it.
+///
+/// coordDelta is the unit's start point, quantized with QuantizeUnitMovementCoord(), minus the
+/// quantized start point of the previous movement that was sent for the unit (or of its AddObject
+/// message if there was none since). Each entry consists of:
+/// * The unit ID as a varint.
+/// * The x and y components of coordDelta as zigzag-encoded varints.
+/// * A byte containing the UnitAction (low 4 bits) and the index of the speed in a fixed speed
+///   table (high 4 bits). Index 0 means that the unit does not move, index 15 that the speed is
+///   not in the table.
+/// * If the unit moves: its movement direction as u16, mapping [0, 2 pi) to [0, 65536).
+/// * If the speed is not in the table: the speed as float.
+void AppendUnitMovementBatchEntry(MessageWriter* writer, int* batchOffset, u32 unitId, const QPoint& coordDelta, const QPointF& speed, UnitAction action);
+
+/// A decoded entry of a UnitMovementBatch message. See AppendUnitMovementBatchEntry().
+struct UnitMovementBatchEntry {
+  u32 unitId;
+  QPoint coordDelta;
+  QPointF speed;
+  UnitAction action;
+};
+
+/// Decodes the UnitMovementBatch entry that starts at *offset within the message data (excluding the header),
+/// and advances *offset to the next entry. Returns false if the entry is invalid.
+bool ParseUnitMovementBatchEntry(const char* data, int size, int* offset, UnitMovementBatchEntry* entry);
 
-QByteArray CreateUnitMovementMessage(
-    u32 unitId,
-    const QPointF& startPoint,
-    const QPointF& speed,
-    UnitAction action);
+void WriteResourcesUpdateMessage(MessageWriter* writer, const ResourceAmount& amount);
 
-QByteArray CreateResourcesUpdateMessage(const ResourceAmount& amount);
+void WriteBuildPercentageUpdateMessage(MessageWriter* writer, u32 buildingId, float percentage, float percentagePerSecond);
 
-QByteArray CreateBuildPercentageUpdateMessage(u32 buildingId, float progress);
+void WriteChangeUnitTypeMessage(MessageWriter* writer, u32 unitId, UnitType type);
 
-QByteArray CreateChangeUnitTypeMessage(u32 unitId, UnitType type);
+void WriteSetCarriedResourcesMessage(MessageWriter* writer, u32 unitId, ResourceType type, u8 amount);
 
-QByteArray CreateSetCarriedResourcesMessage(u32 unitId, ResourceType type, u8 amount);
+void WriteHPUpdateMessage(MessageWriter* writer, u32 objectId, u32 newHP);
 
-QByteArray CreateHPUpdateMessage(u32 objectId, u32 newHP);
+void WriteObjectDeathMessage(MessageWriter* writer, u32 objectId);
 
-QByteArray CreateObjectDeathMessage(u32 objectId);
+void WriteObjectLeaveViewMessage(MessageWriter* writer, u32 objectId);
 
 enum class PlayerExitReason {
   Resign = 0,
@@ -291,10 +348,10 @@ enum class PlayerExitReason {
 
 QByteArray CreatePlayerLeaveBroadcastMessage(u8 playerIndex, PlayerExitReason reason);
 
-QByteArray CreateQueueUnitMessage(u32 buildingId, u16 unitType);
+void WriteQueueUnitMessage(MessageWriter* writer, u32 buildingId, u16 unitType);
 
-QByteArray CreateUpdateProductionMessage(u32 buildingId, float progressValue, float progressPerSecond);
+void WriteUpdateProductionMessage(MessageWriter* writer, u32 buildingId, double startServerTime, double endServerTime);
 
-QByteArray CreateRemoveFromProductionQueueMessage(u32 buildingId, u8 queueIndex);
+void WriteRemoveFromProductionQueueMessage(MessageWriter* writer, u32 buildingId, u8 queueIndex);
 
-QByteArray CreateSetHousedMessage(bool housed);
+void WriteSetHousedMessage(MessageWriter* writer, bool housed);
@@ -0,0 +1,70 @@
+// Copyright 2020 The FreeAge authors
+// This file is part of FreeAge, licensed under the new BSD license.
+// See the COPYING file in the project root for the license text.
+
+#include "FreeAge/common/thread_pool.hpp"
+
+#include <algorithm>
+
+ThreadPool::ThreadPool(int threadCount) {
+  threadCount = std::max(1, threadCount);
+  threads.reserve(threadCount);
+  for (int i = 0; i < threadCount; ++ i) {
+    threads.emplace_back(&ThreadPool::WorkerMain, this);
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  WaitForAll();
+  
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    exitRequested = true;
+  }
+  tasksAvailableCondition.notify_all();
+  
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+}
+
+void ThreadPool::Enqueue(std::function<void()>&& task) {
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    tasks.push_back(std::move(task));
+  }
+  tasksAvailableCondition.notify_one();
+}
+
+void ThreadPool::WaitForAll() {
+  std::unique_lock<std::mutex> lock(mutex);
+  allTasksDoneCondition.wait(lock, [&]() { return tasks.empty() && runningTaskCount == 0; });
+}
+
+int ThreadPool::GetDefaultThreadCount() {
+  return std::max<int>(1, static_cast<int>(std::thread::hardware_concurrency()) - 1);
+}
+
+void ThreadPool::WorkerMain() {
+  std::unique_lock<std::mutex> lock(mutex);
+  while (true) {
+    tasksAvailableCondition.wait(lock, [&]() { return exitRequested || !tasks.empty(); });
+    if (tasks.empty()) {
+      // exitRequested is true.
+      return;
+    }
+    
+    std::function<void()> task = std::move(tasks.front());
+    tasks.pop_front();
+    ++ runningTaskCount;
+    
+    lock.unlock();
+    task();
+    lock.lock();
+    
+    -- runningTaskCount;
+    if (tasks.empty() && runningTaskCount == 0) {
+      allTasksDoneCondition.notify_all();
+    }
+  }
+}
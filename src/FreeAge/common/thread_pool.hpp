@@ -0,0 +1,63 @@
+// Copyright 2020 The FreeAge authors
+// This file is part of FreeAge, licensed under the new BSD license.
+// See the COPYING file in the project root for the license text.
+
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "FreeAge/common/free_age.hpp"
+
+/// A fixed number of worker threads which execute tasks from a FIFO queue.
+///
+/// Tasks may be enqueued from any thread. The tasks themselves must not
+/// call WaitForAll() on the pool that they run in.
+class ThreadPool {
+ public:
+  /// Starts threadCount worker threads (at least one).
+  explicit ThreadPool(int threadCount);
+  
+  /// Waits for all enqueued tasks to finish, then stops the worker threads.
+  ~ThreadPool();
+  
+  /// Enqueues a task to be run by one of the worker threads.
+  void Enqueue(std::function<void()>&& task);
+  
+  /// Blocks until all tasks that were enqueued so far have finished.
+  void WaitForAll();
+  
+  inline int GetThreadCount() const { return threads.size(); }
+  
+  /// Returns the number of worker threads to use for background work if the
+  /// thread that creates the pool stays busy: all hardware threads except one, but at least one.
+  static int GetDefaultThreadCount();
+  
+ private:
+  void WorkerMain();
+  
+  
+  std::vector<std::thread> threads;
+  
+  /// Tasks that have not been started yet.
+  std::deque<std::function<void()>> tasks;
+  
+  /// Number of tasks that have been taken from the queue but have not finished yet.
+  int runningTaskCount = 0;
+  
+  /// Set to true in the destructor to make the worker threads exit.
+  bool exitRequested = false;
+  
+  /// Protects all of the members above (except threads).
+  std::mutex mutex;
+  
+  /// Notified when a task is enqueued or the threads should exit.
+  std::condition_variable tasksAvailableCondition;
+  
+  /// Notified when the last task finishes.
+  std::condition_variable allTasksDoneCondition;
+};
@@ -8,6 +8,8 @@
 
 #include <QPointF>
 
+#include "FreeAge/common/free_age.hpp"
+
 // Since we use QPointF as a class for vectors, we define some additional common functions for them here.
 
 inline float SquaredLength(const QPointF& vector) {
@@ -27,3 +29,16 @@ inline float SquaredDistance(const QPointF& a, const QPointF& b) {
 inline float Distance(const QPointF& a, const QPointF& b) {
   return sqrtf(SquaredDistance(a, b));
 }
+
+/// Initial value for hashes computed with HashValue().
+constexpr u64 kInitialHashValue = 14695981039346656037ull;
+
+/// Adds the bytes of the given value to a 64-bit FNV-1a hash.
+/// This is used to compare the game state between different ways of simulating the game.
+template <typename T>
+inline void HashValue(const T& value, u64* hash) {
+  const u8* bytes = reinterpret_cast<const u8*>(&value);
+  for (usize i = 0; i < sizeof(T); ++ i) {
+    *hash = (*hash ^ bytes[i]) * 1099511628211ull;
+  }
+}
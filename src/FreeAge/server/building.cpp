@@ -9,7 +9,7 @@
 
 ServerBuilding::ServerBuilding(int playerIndex, BuildingType type, const QPoint& baseTile, float buildPercentage)
     : ServerObject(ObjectType::Building, playerIndex),
-      productionPercentage(0),
+      constructionStarted(buildPercentage > 0),
       type(type),
       baseTile(baseTile),
       buildPercentage(buildPercentage) {
@@ -50,7 +50,7 @@ void ServerBuilding::RemoveCurrentItemFromQueue() {
   }
   productionQueue.erase(productionQueue.begin());
   
-  productionPercentage = 0;
+  isProducing = false;
 }
 
 UnitType ServerBuilding::RemoveItemFromQueue(int index) {
@@ -62,7 +62,7 @@ UnitType ServerBuilding::RemoveItemFromQueue(int index) {
   UnitType type = productionQueue[index];
   productionQueue.erase(productionQueue.begin() + index);
   if (index == 0) {
-    productionPercentage = 0;
+    isProducing = false;
   }
   return type;
 }
@@ -40,8 +40,46 @@ class ServerBuilding : public ServerObject {
   
   inline const std::vector<UnitType>& GetProductionQueue() const { return productionQueue; }
   
-  inline float GetProductionPercentage() const { return productionPercentage; }
-  inline void SetProductionPercentage(float percentage) { productionPercentage = percentage; }
+  /// Returns whether the production of the first item in the production queue has started.
+  /// This may be delayed by the player being housed.
+  inline bool IsProducing() const { return isProducing; }
+  /// The game step in which the current production completes. Only valid if IsProducing().
+  inline u32 GetProductionEndStep() const { return productionEndStep; }
+  inline void StartProduction(u32 endStep) { isProducing = true; productionEndStep = endStep; }
+  
+  /// Whether the building is in the game's list of buildings that wait to start producing
+  /// the first item in their queue (see Game::productionWaitList).
+  inline bool IsWaitingForProduction() const { return isWaitingForProduction; }
+  inline void SetWaitingForProduction(bool waiting) { isWaitingForProduction = waiting; }
+  
+  /// Returns whether a villager started to construct the building, which added its occupancy to the map.
+  /// Before that, the building is a foundation that only its owner knows about.
+  inline bool HasConstructionStarted() const { return constructionStarted; }
+  inline void SetConstructionStarted() { constructionStarted = true; }
+  
+  /// The construction progress is not added in every game step. Instead, GetBuildPercentage() and the HP are valid
+  /// for the start of the game step GetConstructionUpdateStep(), and increase by GetConstructionPercentagePerStep()
+  /// per game step from then on (see Game::UpdateConstructionProgress()).
+  inline u32 GetConstructionUpdateStep() const { return constructionUpdateStep; }
+  inline void SetConstructionUpdateStep(u32 step) { constructionUpdateStep = step; }
+  
+  /// The number of villagers that construct the building, and the resulting progress per game step in percent.
+  inline int GetBuilderCount() const { return builderCount; }
+  inline float GetConstructionPercentagePerStep() const { return constructionPercentagePerStep; }
+  inline void SetBuilders(int count, float percentagePerStep) { builderCount = count; constructionPercentagePerStep = percentagePerStep; }
+  
+  /// The number of villagers that constructed the building in the current game step so far.
+  inline int GetBuilderCountInCurrentStep() const { return builderCountInCurrentStep; }
+  inline void AddBuilderInCurrentStep() { ++ builderCountInCurrentStep; }
+  inline void ResetBuilderCountInCurrentStep() { builderCountInCurrentStep = 0; }
+  
+  /// The game step in which the construction completes with the current builders. Only valid if GetBuilderCount() > 0.
+  inline u32 GetConstructionEndStep() const { return constructionEndStep; }
+  inline void SetConstructionEndStep(u32 step) { constructionEndStep = step; }
+  
+  /// Whether the building is in the game's list of buildings under construction (see Game::constructionList).
+  inline bool IsInConstructionList() const { return isInConstructionList; }
+  inline void SetInConstructionList(bool inList) { isInConstructionList = inList; }
   
   inline BuildingType GetBuildingType() const { return type; }
   inline const QPoint& GetBaseTile() const { return baseTile; }
@@ -53,8 +91,33 @@ class ServerBuilding : public ServerObject {
   // TODO: Allow to queue technologies as well
   std::vector<UnitType> productionQueue;
   
-  /// The progress on the production of the first item in the productionQueue, in percent.
-  float productionPercentage;
+  /// See IsProducing().
+  bool isProducing = false;
+  
+  /// See GetProductionEndStep().
+  u32 productionEndStep = 0;
+  
+  /// See IsWaitingForProduction().
+  bool isWaitingForProduction = false;
+  
+  /// See HasConstructionStarted().
+  bool constructionStarted;
+  
+  /// See GetConstructionUpdateStep().
+  u32 constructionUpdateStep = 0;
+  
+  /// See GetBuilderCount().
+  int builderCount = 0;
+  float constructionPercentagePerStep = 0;
+  
+  /// See GetBuilderCountInCurrentStep().
+  int builderCountInCurrentStep = 0;
+  
+  /// See GetConstructionEndStep().
+  u32 constructionEndStep = 0;
+  
+  /// See IsInConstructionList().
+  bool isInConstructionList = false;
   
   BuildingType type;
   
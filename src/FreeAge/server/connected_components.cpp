@@ -0,0 +1,450 @@
+// Copyright 2020 The FreeAge authors
+// This file is part of FreeAge, licensed under the new BSD license.
+// See the COPYING file in the project root for the license text.
+
+#include "FreeAge/server/connected_components.hpp"
+
+#include <algorithm>
+#include <limits>
+#include <utility>
+
+void ConnectedComponents::Initialize(const PathfindingGrid& grid) {
+  width = grid.width;
+  height = grid.height;
+  
+  ++ changeCount;
+  blocksX = (width + kChangeBlockSize - 1) / kChangeBlockSize;
+  blockChangeCounts.assign(blocksX * ((height + kChangeBlockSize - 1) / kChangeBlockSize), changeCount);
+  
+  labels.assign(width * height, kNoComponent);
+  componentSizes.assign(1, 0);  // label 0 is kNoComponent
+  unusedLabels.clear();
+  
+  visitStamp.assign(width * height, 0);
+  currentVisitStamp = 0;
+  visitOwner.resize(width * height);
+  
+  for (int index = 0; index < width * height; ++ index) {
+    if (labels[index] == kNoComponent && !grid.occupied[index]) {
+      FloodFill(grid, index, AllocateLabel());
+    }
+  }
+}
+
+void ConnectedComponents::Update(const PathfindingGrid& grid, const QRect& changedRect) {
+  QRect rect = changedRect.intersected(QRect(0, 0, width, height));
+  if (rect.isEmpty()) {
+    return;
+  }
+  int minX = rect.x();
+  int minY = rect.y();
+  int maxX = rect.x() + rect.width() - 1;
+  int maxY = rect.y() + rect.height() - 1;
+  
+  ++ changeCount;
+  
+  // Remove the tiles that became occupied from their components.
+  bool anyTileOccupied = false;
+  for (int y = minY; y <= maxY; ++ y) {
+    for (int x = minX; x <= maxX; ++ x) {
+      int index = y * width + x;
+      if (grid.occupied[index] && labels[index] != kNoComponent) {
+        RemoveFromComponent(labels[index], 1);
+        SetLabel(index, kNoComponent);
+        anyTileOccupied = true;
+      }
+    }
+  }
+  
+  if (anyTileOccupied) {
+    // Only tiles adjacent to the rect may have been connected via tiles within the rect, or via diagonal
+    // movements that required a tile within the rect to be free. Walk around the rect and find the runs
+    // of consecutive free tiles on this ring. The tiles of a run are connected with each other, so if there
+    // is only one run, nothing can have become disconnected. Otherwise, the runs of each component might
+    // have been separated.
+    std::vector<QPoint> ring;
+    ring.reserve(2 * (rect.width() + rect.height()) + 4);
+    for (int x = minX - 1; x <= maxX + 1; ++ x) { ring.emplace_back(x, minY - 1); }
+    for (int y = minY; y <= maxY + 1; ++ y) { ring.emplace_back(maxX + 1, y); }
+    for (int x = maxX; x >= minX - 1; -- x) { ring.emplace_back(x, maxY + 1); }
+    for (int y = maxY; y >= minY; -- y) { ring.emplace_back(minX - 1, y); }
+    
+    // Start walking at an occupied tile (if any), such that no run wraps around the end of the ring.
+    int ringSize = ring.size();
+    int firstRingIndex = 0;
+    while (firstRingIndex < ringSize && IsFree(grid, ring[firstRingIndex].x(), ring[firstRingIndex].y())) {
+      ++ firstRingIndex;
+    }
+    
+    if (firstRingIndex < ringSize) {
+      // Collect the first tile of each run, grouped by component.
+      std::vector<std::pair<u32, int>> runStarts;
+      bool previousFree = false;
+      for (int i = 0; i < ringSize; ++ i) {
+        const QPoint& tile = ring[(firstRingIndex + i) % ringSize];
+        bool free = IsFree(grid, tile.x(), tile.y());
+        if (free && !previousFree) {
+          int index = tile.y() * width + tile.x();
+          runStarts.emplace_back(labels[index], index);
+        }
+        previousFree = free;
+      }
+      std::sort(runStarts.begin(), runStarts.end(), [](const std::pair<u32, int>& a, const std::pair<u32, int>& b) {
+        return a.first < b.first;
+      });
+      
+      std::vector<int> seeds;
+      for (usize i = 0; i < runStarts.size(); ) {
+        usize end = i + 1;
+        while (end < runStarts.size() && runStarts[end].first == runStarts[i].first) {
+          ++ end;
+        }
+        if (end - i > 1) {
+          seeds.clear();
+          for (usize k = i; k < end; ++ k) {
+            seeds.push_back(runStarts[k].second);
+          }
+          SplitIfDisconnected(grid, seeds);
+        }
+        i = end;
+      }
+    }
+  }
+  
+  // Merge the tiles that became free into the components that they connect.
+  for (int y = minY; y <= maxY; ++ y) {
+    for (int x = minX; x <= maxX; ++ x) {
+      int index = y * width + x;
+      if (!grid.occupied[index] && labels[index] == kNoComponent) {
+        MergeAt(grid, index);
+      }
+    }
+  }
+}
+
+bool ConnectedComponents::CanReach(const PathfindingGrid& grid, u32 component, const QRect& goalRect) const {
+  QRect rect = goalRect.intersected(QRect(0, 0, width, height));
+  if (rect.isEmpty()) {
+    return false;
+  }
+  int minX = rect.x();
+  int minY = rect.y();
+  int maxX = rect.x() + rect.width() - 1;
+  int maxY = rect.y() + rect.height() - 1;
+  
+  // Is a free tile within the goal rect part of the component?
+  for (int y = minY; y <= maxY; ++ y) {
+    for (int x = minX; x <= maxX; ++ x) {
+      if (labels[y * width + x] == component) {
+        return true;
+      }
+    }
+  }
+  
+  // Can a unit step into the goal rect from a tile of the component?
+  auto isFreeOrGoal = [&](int x, int y) {
+    return grid.IsInside(x, y) && (!grid.IsOccupied(x, y) || rect.contains(x, y));
+  };
+  for (int y = std::max(0, minY - 1), endY = std::min(height - 1, maxY + 1); y <= endY; ++ y) {
+    for (int x = std::max(0, minX - 1), endX = std::min(width - 1, maxX + 1); x <= endX; ++ x) {
+      if (rect.contains(x, y) || labels[y * width + x] != component) {
+        continue;
+      }
+      int goalX = std::max(minX, std::min(maxX, x));
+      int goalY = std::max(minY, std::min(maxY, y));
+      if (goalX == x || goalY == y) {
+        // Straight movement into the goal rect.
+        return true;
+      }
+      // Diagonal movement into the goal rect corner. This requires the two adjacent tiles to be free.
+      if (isFreeOrGoal(goalX, y) && isFreeOrGoal(x, goalY)) {
+        return true;
+      }
+    }
+  }
+  
+  return false;
+}
+
+QPoint ConnectedComponents::FindClosestTile(u32 component, const QRect& goalRect) const {
+  QPoint bestTile(-1, -1);
+  float bestDistance = std::numeric_limits<float>::infinity();
+  
+  int minX = goalRect.x();
+  int minY = goalRect.y();
+  int maxX = goalRect.x() + goalRect.width() - 1;
+  int maxY = goalRect.y() + goalRect.height() - 1;
+  
+  auto consider = [&](int x, int y) {
+    if (labels[y * width + x] == component) {
+      QPoint tile(x, y);
+      float distance = DiagonalDistanceToRect(tile, goalRect);
+      if (distance < bestDistance) {
+        bestDistance = distance;
+        bestTile = tile;
+      }
+    }
+  };
+  
+  // All tiles on ring r (the border of the goal rect enlarged by r) have a diagonal distance of at least r
+  // to the goal rect, so the search can stop once r exceeds the best distance found so far.
+  int maxRing = std::max({minX, minY, width - 1 - maxX, height - 1 - maxY});
+  for (int r = 0; r <= maxRing && r <= bestDistance; ++ r) {
+    int ringMinX = minX - r;
+    int ringMinY = minY - r;
+    int ringMaxX = maxX + r;
+    int ringMaxY = maxY + r;
+    int clampedMinX = std::max(0, ringMinX);
+    int clampedMaxX = std::min(width - 1, ringMaxX);
+    int clampedMinY = std::max(0, ringMinY);
+    int clampedMaxY = std::min(height - 1, ringMaxY);
+    
+    if (r == 0) {
+      for (int y = clampedMinY; y <= clampedMaxY; ++ y) {
+        for (int x = clampedMinX; x <= clampedMaxX; ++ x) {
+          consider(x, y);
+        }
+      }
+      continue;
+    }
+    
+    // Top and bottom rows
+    if (ringMinY >= 0) {
+      for (int x = clampedMinX; x <= clampedMaxX; ++ x) { consider(x, ringMinY); }
+    }
+    if (ringMaxY < height) {
+      for (int x = clampedMinX; x <= clampedMaxX; ++ x) { consider(x, ringMaxY); }
+    }
+    // Left and right columns, without the corners
+    if (ringMinX >= 0) {
+      for (int y = std::max(clampedMinY, ringMinY + 1); y <= std::min(clampedMaxY, ringMaxY - 1); ++ y) { consider(ringMinX, y); }
+    }
+    if (ringMaxX < width) {
+      for (int y = std::max(clampedMinY, ringMinY + 1); y <= std::min(clampedMaxY, ringMaxY - 1); ++ y) { consider(ringMaxX, y); }
+    }
+  }
+  
+  return bestTile;
+}
+
+void ConnectedComponents::CopyChangesFrom(const ConnectedComponents& source) {
+  if (width != source.width || height != source.height) {
+    width = source.width;
+    height = source.height;
+    blocksX = source.blocksX;
+    labels = source.labels;
+    blockChangeCounts = source.blockChangeCounts;
+  } else {
+    for (usize block = 0; block < blockChangeCounts.size(); ++ block) {
+      if (source.blockChangeCounts[block] <= changeCount) {
+        continue;
+      }
+      blockChangeCounts[block] = source.blockChangeCounts[block];
+      
+      int minX = (block % blocksX) * kChangeBlockSize;
+      int minY = (block / blocksX) * kChangeBlockSize;
+      int blockWidth = std::min(kChangeBlockSize, width - minX);
+      for (int y = minY, endY = std::min(height, minY + kChangeBlockSize); y < endY; ++ y) {
+        std::copy_n(source.labels.data() + y * width + minX, blockWidth, labels.data() + y * width + minX);
+      }
+    }
+  }
+  
+  componentSizes = source.componentSizes;
+  unusedLabels = source.unusedLabels;
+  changeCount = source.changeCount;
+}
+
+u32 ConnectedComponents::AllocateLabel() {
+  if (!unusedLabels.empty()) {
+    u32 label = unusedLabels.back();
+    unusedLabels.pop_back();
+    return label;
+  }
+  componentSizes.push_back(0);
+  return componentSizes.size() - 1;
+}
+
+void ConnectedComponents::RemoveFromComponent(u32 component, int count) {
+  componentSizes[component] -= count;
+  if (componentSizes[component] == 0) {
+    unusedLabels.push_back(component);
+  }
+}
+
+void ConnectedComponents::FloodFill(const PathfindingGrid& grid, int startIndex, u32 label) {
+  queue.clear();
+  auto relabel = [&](int index) {
+    if (labels[index] != kNoComponent) {
+      RemoveFromComponent(labels[index], 1);
+    }
+    SetLabel(index, label);
+    ++ componentSizes[label];
+    queue.push_back(index);
+  };
+  
+  relabel(startIndex);
+  for (usize head = 0; head < queue.size(); ++ head) {
+    int index = queue[head];
+    ForEachNeighbor(grid, index % width, index / width, [&](int x, int y) {
+      int neighborIndex = y * width + x;
+      if (labels[neighborIndex] != label) {
+        relabel(neighborIndex);
+      }
+    });
+  }
+}
+
+void ConnectedComponents::MergeAt(const PathfindingGrid& grid, int tileIndex) {
+  // Find all unlabeled free tiles that are connected to the given one,
+  // and the labels of all components that they touch.
+  BeginVisit();
+  queue.clear();
+  queue.push_back(tileIndex);
+  visitStamp[tileIndex] = currentVisitStamp;
+  u32 largestComponent = kNoComponent;
+  for (usize head = 0; head < queue.size(); ++ head) {
+    int index = queue[head];
+    ForEachNeighbor(grid, index % width, index / width, [&](int x, int y) {
+      int neighborIndex = y * width + x;
+      u32 neighborLabel = labels[neighborIndex];
+      if (neighborLabel == kNoComponent) {
+        if (visitStamp[neighborIndex] != currentVisitStamp) {
+          visitStamp[neighborIndex] = currentVisitStamp;
+          queue.push_back(neighborIndex);
+        }
+      } else if (largestComponent == kNoComponent ||
+                 componentSizes[neighborLabel] > componentSizes[largestComponent]) {
+        largestComponent = neighborLabel;
+      }
+    });
+  }
+  
+  // The largest touched component keeps its label, everything else that is connected to it gets relabeled.
+  FloodFill(grid, tileIndex, (largestComponent == kNoComponent) ? AllocateLabel() : largestComponent);
+}
+
+void ConnectedComponents::SplitIfDisconnected(const PathfindingGrid& grid, const std::vector<int>& seeds) {
+  int partCount = seeds.size();
+  u32 oldLabel = labels[seeds.front()];
+  
+  // Run a breadth-first search from each seed. The tiles visited by a search are stored in its
+  // list, which also serves as its queue. The searches advance in turns, one tile each, such
+  // that the work is bounded by the size of the smaller parts. Parts whose searches meet are
+  // connected, which is tracked with a union-find structure.
+  std::vector<std::vector<int>> visited(partCount);
+  std::vector<usize> heads(partCount, 0);
+  std::vector<int> partParent(partCount);
+  auto findRoot = [&](int part) {
+    while (partParent[part] != part) {
+      part = partParent[part] = partParent[partParent[part]];
+    }
+    return part;
+  };
+  
+  BeginVisit();
+  for (int part = 0; part < partCount; ++ part) {
+    partParent[part] = part;
+    int seed = seeds[part];
+    visitStamp[seed] = currentVisitStamp;
+    visitOwner[seed] = part;
+    visited[part].push_back(seed);
+  }
+  
+  std::vector<u8> groupOpen(partCount);
+  while (true) {
+    // Count the groups of connected parts, and those whose searches have not finished yet.
+    int groupCount = 0;
+    int openGroupCount = 0;
+    std::fill(groupOpen.begin(), groupOpen.end(), 0);
+    for (int part = 0; part < partCount; ++ part) {
+      int root = findRoot(part);
+      if (root == part) {
+        ++ groupCount;
+      }
+      if (heads[part] < visited[part].size()) {
+        groupOpen[root] = 1;
+      }
+    }
+    for (int part = 0; part < partCount; ++ part) {
+      openGroupCount += groupOpen[part];
+    }
+    if (groupCount == 1) {
+      // Everything is still connected.
+      return;
+    }
+    if (openGroupCount <= 1) {
+      // All groups but (at most) one have been fully explored, so they are separate components.
+      break;
+    }
+    
+    for (int part = 0; part < partCount; ++ part) {
+      if (heads[part] == visited[part].size()) {
+        continue;
+      }
+      int index = visited[part][heads[part]];
+      ++ heads[part];
+      ForEachNeighbor(grid, index % width, index / width, [&](int x, int y) {
+        int neighborIndex = y * width + x;
+        if (visitStamp[neighborIndex] != currentVisitStamp) {
+          visitStamp[neighborIndex] = currentVisitStamp;
+          visitOwner[neighborIndex] = part;
+          visited[part].push_back(neighborIndex);
+        } else {
+          int root = findRoot(part);
+          int neighborRoot = findRoot(visitOwner[neighborIndex]);
+          if (root != neighborRoot) {
+            partParent[neighborRoot] = root;
+          }
+        }
+      });
+    }
+  }
+  
+  // Determine the group that keeps the old label: the one that is still open (and thus likely
+  // the largest), or if all groups were fully explored, the one with the most tiles.
+  std::vector<usize> groupSizes(partCount, 0);
+  for (int part = 0; part < partCount; ++ part) {
+    groupSizes[findRoot(part)] += visited[part].size();
+  }
+  int keptGroup = -1;
+  for (int part = 0; part < partCount; ++ part) {
+    if (findRoot(part) != part) {
+      continue;
+    }
+    if (groupOpen[part]) {
+      keptGroup = part;
+      break;
+    }
+    if (keptGroup < 0 || groupSizes[part] > groupSizes[keptGroup]) {
+      keptGroup = part;
+    }
+  }
+  
+  // Relabel the other groups.
+  std::vector<u32> groupLabels(partCount, kNoComponent);
+  for (int part = 0; part < partCount; ++ part) {
+    int root = findRoot(part);
+    if (root == keptGroup) {
+      continue;
+    }
+    if (groupLabels[root] == kNoComponent) {
+      groupLabels[root] = AllocateLabel();
+    }
+    u32 newLabel = groupLabels[root];
+    for (int index : visited[part]) {
+      SetLabel(index, newLabel);
+    }
+    componentSizes[newLabel] += visited[part].size();
+    RemoveFromComponent(oldLabel, visited[part].size());
+  }
+}
+
+void ConnectedComponents::BeginVisit() {
+  ++ currentVisitStamp;
+  if (currentVisitStamp == 0) {
+    // The stamp wrapped around. Reset all tiles such that no stale state is considered valid.
+    std::fill(visitStamp.begin(), visitStamp.end(), 0);
+    currentVisitStamp = 1;
+  }
+}
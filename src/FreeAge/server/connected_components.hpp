@@ -0,0 +1,141 @@
+// Copyright 2020 The FreeAge authors
+// This file is part of FreeAge, licensed under the new BSD license.
+// See the COPYING file in the project root for the license text.
+
+#pragma once
+
+#include <vector>
+
+#include <QPoint>
+#include <QRect>
+
+#include "FreeAge/common/free_age.hpp"
+#include "FreeAge/server/pathfinding.hpp"
+
+/// Labels the connected components of the free tiles of a PathfindingGrid, using the
+/// movement rules of GridPathPlanner. Two free tiles have the same label if and only if
+/// a unit can walk from one to the other. This allows to detect unreachable goals without
+/// running a search that exhausts the start's component.
+///
+/// The labels are updated incrementally when the occupancy of an area changes:
+/// * If tiles become free, only the components that are merged by this are relabeled
+///   (except for the largest of them, which keeps its label).
+/// * If tiles become occupied, the free tiles around the area are checked for whether they
+///   are still connected. In the common case that they are connected around the area,
+///   nothing needs to be done. Otherwise, searches are run from the separated parts in
+///   parallel until all but one of them are exhausted, and only the exhausted (smaller)
+///   parts are relabeled.
+class ConnectedComponents {
+ public:
+  /// Label of occupied tiles.
+  static constexpr u32 kNoComponent = 0;
+  
+  /// Side length (in tiles) of the square blocks in which changes of the labels are tracked for CopyChangesFrom().
+  static constexpr int kChangeBlockSize = 16;
+  
+  /// Labels all tiles of the given grid from scratch.
+  void Initialize(const PathfindingGrid& grid);
+  
+  /// Updates the labels after the occupancy of some tiles within changedRect has changed.
+  /// The grid must have the same size as the one passed to Initialize().
+  void Update(const PathfindingGrid& grid, const QRect& changedRect);
+  
+  /// Returns the label of the component that contains the given tile, or kNoComponent if the tile is occupied.
+  inline u32 GetComponent(const QPoint& tile) const { return labels[tile.y() * width + tile.x()]; }
+  
+  /// Returns the number of tiles in the given component.
+  inline int GetComponentSize(u32 component) const { return componentSizes[component]; }
+  
+  /// Returns whether a unit within the given component can reach goalRect, where the tiles
+  /// within goalRect are treated as free (as in GridPathPlanner::PlanPath()).
+  /// This is cheap, as only the tiles within and around goalRect are checked.
+  bool CanReach(const PathfindingGrid& grid, u32 component, const QRect& goalRect) const;
+  
+  /// Returns the tile of the given (non-empty) component that is closest to goalRect according
+  /// to DiagonalDistanceToRect(). This is the tile that GridPathPlanner::PlanPath() leads to if
+  /// goalRect is not reachable. The tiles are searched in rings of increasing distance around goalRect.
+  QPoint FindClosestTile(u32 component, const QRect& goalRect) const;
+  
+  /// Brings this object up-to-date with source, which must always be the same object. Only the labels of the blocks
+  /// that changed since the last call are copied. The scratch state for the incremental updates is not copied,
+  /// so the copy may only be used for queries. This is used to keep copies for other threads cheaply.
+  void CopyChangesFrom(const ConnectedComponents& source);
+  
+ private:
+  /// Sets the label of a tile and records the change of its block.
+  inline void SetLabel(int index, u32 label) {
+    labels[index] = label;
+    blockChangeCounts[((index / width) / kChangeBlockSize) * blocksX + (index % width) / kChangeBlockSize] = changeCount;
+  }
+  
+  inline bool IsFree(const PathfindingGrid& grid, int x, int y) const {
+    return grid.IsInside(x, y) && !grid.IsOccupied(x, y);
+  }
+  
+  /// Calls callback(x, y) for all free tiles that a unit can move to from tile (x, y) in one step.
+  template <typename Callback>
+  inline void ForEachNeighbor(const PathfindingGrid& grid, int x, int y, Callback callback) const {
+    bool freeLeft = IsFree(grid, x - 1, y);
+    bool freeRight = IsFree(grid, x + 1, y);
+    bool freeTop = IsFree(grid, x, y - 1);
+    bool freeBottom = IsFree(grid, x, y + 1);
+    
+    if (freeLeft) { callback(x - 1, y); }
+    if (freeRight) { callback(x + 1, y); }
+    if (freeTop) { callback(x, y - 1); }
+    if (freeBottom) { callback(x, y + 1); }
+    // Diagonal movements require the two adjacent tiles to be free.
+    if (freeLeft && freeTop && IsFree(grid, x - 1, y - 1)) { callback(x - 1, y - 1); }
+    if (freeRight && freeTop && IsFree(grid, x + 1, y - 1)) { callback(x + 1, y - 1); }
+    if (freeLeft && freeBottom && IsFree(grid, x - 1, y + 1)) { callback(x - 1, y + 1); }
+    if (freeRight && freeBottom && IsFree(grid, x + 1, y + 1)) { callback(x + 1, y + 1); }
+  }
+  
+  /// Returns an unused label with a component size of zero.
+  u32 AllocateLabel();
+  
+  /// Subtracts count tiles from the size of the given component and releases its label if it becomes empty.
+  void RemoveFromComponent(u32 component, int count);
+  
+  /// Assigns label to all tiles that are reachable from the given tile and do not have this label yet.
+  void FloodFill(const PathfindingGrid& grid, int startIndex, u32 label);
+  
+  /// Handles free tiles that have no label yet (because they were occupied before):
+  /// merges them and all components that they connect into a single component.
+  void MergeAt(const PathfindingGrid& grid, int tileIndex);
+  
+  /// Given one seed tile for each part of a component that might have been separated from the
+  /// other parts, determines which parts are actually separated and relabels all but one of them.
+  void SplitIfDisconnected(const PathfindingGrid& grid, const std::vector<int>& seeds);
+  
+  /// Prepares visitStamp for a new traversal.
+  void BeginVisit();
+  
+  
+  int width = 0;
+  int height = 0;
+  
+  /// The component label of each tile, or kNoComponent for occupied tiles.
+  /// An element (x, y) has index: [y * width + x].
+  std::vector<u32> labels;
+  
+  /// Number of tiles of each component, indexed by label. Labels with a size of zero are unused.
+  std::vector<int> componentSizes;
+  
+  /// Labels that have been used before, but whose components are empty now.
+  std::vector<u32> unusedLabels;
+  
+  /// Counter that is incremented by each call to Initialize() or Update(), and for each block of
+  /// kChangeBlockSize x kChangeBlockSize tiles, the value of the counter when a label in it was last set.
+  /// For copies made by CopyChangesFrom(), changeCount is the source's counter at the time of the copy.
+  u32 changeCount = 0;
+  int blocksX = 0;
+  std::vector<u32> blockChangeCounts;
+  
+  // Scratch state for the traversals, which is kept to avoid reallocations.
+  // A tile has been visited by the current traversal if its visitStamp equals currentVisitStamp.
+  std::vector<u32> visitStamp;
+  u32 currentVisitStamp = 0;
+  std::vector<int> visitOwner;
+  std::vector<int> queue;
+};
@@ -0,0 +1,88 @@
+// Copyright 2020 The FreeAge authors
+// This file is part of FreeAge, licensed under the new BSD license.
+// See the COPYING file in the project root for the license text.
+
+#include "FreeAge/server/drop_off_points.hpp"
+
+#include <algorithm>
+#include <limits>
+
+#include "FreeAge/common/logging.hpp"
+#include "FreeAge/common/util.hpp"
+
+void DropOffPointIndex::Initialize(int mapWidth, int mapHeight) {
+  cellsX = std::max(1, (mapWidth + kCellSize - 1) / kCellSize);
+  cellsY = std::max(1, (mapHeight + kCellSize - 1) / kCellSize);
+  cells.clear();
+  cells.resize(cellsX * cellsY);
+  size = 0;
+}
+
+void DropOffPointIndex::Add(u32 buildingId, const QPointF& center) {
+  int cellX, cellY;
+  GetCell(center, &cellX, &cellY);
+  cells[cellY * cellsX + cellX].push_back({buildingId, center});
+  ++ size;
+}
+
+void DropOffPointIndex::Remove(u32 buildingId, const QPointF& center) {
+  int cellX, cellY;
+  GetCell(center, &cellX, &cellY);
+  std::vector<Entry>& cell = cells[cellY * cellsX + cellX];
+  for (usize i = 0; i < cell.size(); ++ i) {
+    if (cell[i].buildingId == buildingId) {
+      cell.erase(cell.begin() + i);
+      -- size;
+      return;
+    }
+  }
+  LOG(ERROR) << "DropOffPointIndex::Remove() did not find the building to remove";
+}
+
+bool DropOffPointIndex::FindClosest(const QPointF& mapCoord, u32* buildingId) const {
+  if (size == 0) {
+    return false;
+  }
+  
+  int centerCellX, centerCellY;
+  GetCell(mapCoord, &centerCellX, &centerCellY);
+  
+  float bestSquaredDistance = std::numeric_limits<float>::infinity();
+  int maxRing = std::max(std::max(centerCellX, cellsX - 1 - centerCellX), std::max(centerCellY, cellsY - 1 - centerCellY));
+  for (int ring = 0; ring <= maxRing; ++ ring) {
+    // All cells in this ring and beyond are at least (ring - 1) cells away from the cell containing mapCoord.
+    // (This lower bound also holds for query points outside of the grid, since they get clamped to the closest cell.)
+    float minRingDistance = std::max(0, ring - 1) * kCellSize;
+    if (minRingDistance * minRingDistance > bestSquaredDistance) {
+      break;
+    }
+    
+    int minCellY = std::max(0, centerCellY - ring);
+    int maxCellY = std::min(cellsY - 1, centerCellY + ring);
+    for (int cellY = minCellY; cellY <= maxCellY; ++ cellY) {
+      // Only visit the cells on the border of the ring's square.
+      bool isTopOrBottomRow = (cellY == centerCellY - ring || cellY == centerCellY + ring);
+      int step = isTopOrBottomRow ? 1 : (2 * ring);
+      for (int cellX = centerCellX - ring; cellX <= centerCellX + ring; cellX += std::max(1, step)) {
+        if (cellX < 0 || cellX >= cellsX) {
+          continue;
+        }
+        
+        for (const Entry& entry : cells[cellY * cellsX + cellX]) {
+          float squaredDistance = SquaredDistance(entry.center, mapCoord);
+          if (squaredDistance < bestSquaredDistance) {
+            bestSquaredDistance = squaredDistance;
+            *buildingId = entry.buildingId;
+          }
+        }
+      }
+    }
+  }
+  
+  return true;
+}
+
+void DropOffPointIndex::GetCell(const QPointF& mapCoord, int* cellX, int* cellY) const {
+  *cellX = std::max(0, std::min(cellsX - 1, static_cast<int>(mapCoord.x() / kCellSize)));
+  *cellY = std::max(0, std::min(cellsY - 1, static_cast<int>(mapCoord.y() / kCellSize)));
+}
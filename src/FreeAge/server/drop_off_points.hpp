@@ -0,0 +1,59 @@
+// Copyright 2020 The FreeAge authors
+// This file is part of FreeAge, licensed under the new BSD license.
+// See the COPYING file in the project root for the license text.
+
+#pragma once
+
+#include <vector>
+
+#include <QPointF>
+
+#include "FreeAge/common/free_age.hpp"
+
+/// Spatial index of the completed drop-off buildings of one player for one resource type,
+/// which finds the closest drop-off point for a villager without iterating over all map objects.
+///
+/// The buildings are sorted into the cells of a coarse grid according to their center.
+/// A query visits the cells in rings of increasing distance around the query point and
+/// stops as soon as no unvisited cell can contain a closer building.
+///
+/// TODO: The distance is the straight-line distance to the building's center. Ideally, it would be
+///       the distance that the villager has to walk to the edge of the building.
+class DropOffPointIndex {
+ public:
+  /// Prepares the index for the given map size. Removes all buildings.
+  void Initialize(int mapWidth, int mapHeight);
+  
+  /// Adds a building with the given center.
+  void Add(u32 buildingId, const QPointF& center);
+  
+  /// Removes a building that was added with the given center.
+  void Remove(u32 buildingId, const QPointF& center);
+  
+  /// Finds the building whose center is closest to mapCoord. Returns false if the index is empty.
+  bool FindClosest(const QPointF& mapCoord, u32* buildingId) const;
+  
+  /// Returns the number of buildings in the index.
+  inline usize GetSize() const { return size; }
+  
+  /// Side length of the grid cells in tiles.
+  static constexpr int kCellSize = 16;
+  
+ private:
+  struct Entry {
+    u32 buildingId;
+    QPointF center;
+  };
+  
+  /// Determines the cell that contains the given map coordinate (clamped to the grid).
+  void GetCell(const QPointF& mapCoord, int* cellX, int* cellY) const;
+  
+  
+  int cellsX = 0;
+  int cellsY = 0;
+  
+  /// The buildings in each cell, indexed by [cellY * cellsX + cellX].
+  std::vector<std::vector<Entry>> cells;
+  
+  usize size = 0;
+};
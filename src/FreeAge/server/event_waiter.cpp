@@ -0,0 +1,31 @@
+// Copyright 2020 The FreeAge authors
+// This file is part of FreeAge, licensed under the new BSD license.
+// See the COPYING file in the project root for the license text.
+
+#include "FreeAge/server/event_waiter.hpp"
+
+#include <thread>
+
+#include <QApplication>
+
+EventWaiter::EventWaiter() {
+  wakeUpTimer.setTimerType(Qt::PreciseTimer);
+  wakeUpTimer.setSingleShot(true);
+}
+
+void EventWaiter::ProcessEventsUntil(const TimePoint& deadline) {
+  // Wait in the event loop only if the deadline is far enough in the future for the timer's millisecond
+  // resolution. Since the timer may fire up to a millisecond late, it is set to fire one millisecond early.
+  constexpr double kTimerResolutionMilliseconds = 1;
+  double remainingMilliseconds = MillisecondsDuration(deadline - Clock::now()).count();
+  if (remainingMilliseconds > 2 * kTimerResolutionMilliseconds) {
+    wakeUpTimer.start(static_cast<int>(remainingMilliseconds - kTimerResolutionMilliseconds));
+    qApp->processEvents(QEventLoop::WaitForMoreEvents);
+    wakeUpTimer.stop();
+    return;
+  }
+  
+  // Close to the deadline, only handle the pending events and sleep for the rest of the time.
+  qApp->processEvents(QEventLoop::AllEvents);
+  std::this_thread::sleep_until(deadline);
+}
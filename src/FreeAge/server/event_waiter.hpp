@@ -0,0 +1,32 @@
+// Copyright 2020 The FreeAge authors
+// This file is part of FreeAge, licensed under the new BSD license.
+// See the COPYING file in the project root for the license text.
+
+#pragma once
+
+#include <QTimer>
+
+#include "FreeAge/common/free_age.hpp"
+
+/// Processes Qt events for the server's loops without busy waiting.
+///
+/// Instead of polling the sockets and sleeping for short, fixed amounts of time, ProcessEventsUntil()
+/// blocks in the Qt event loop until an event arrives (e.g., incoming data, a new connection, or a
+/// disconnect, which Qt detects with socket readiness notifications), or until a deadline is reached.
+/// This keeps the CPU load near zero while the server is idle.
+///
+/// Since QTimer only has millisecond resolution, the wait for the deadline is split: the timer
+/// wakes up slightly early, and the remaining time is slept precisely. This way, game steps
+/// start with sub-millisecond precision.
+class EventWaiter {
+ public:
+  EventWaiter();
+  
+  /// Processes the pending Qt events. If there are none, blocks until new events arrive,
+  /// but at most until the given deadline.
+  void ProcessEventsUntil(const TimePoint& deadline);
+  
+ private:
+  /// Single-shot timer that wakes up the event loop shortly before the deadline.
+  QTimer wakeUpTimer;
+};
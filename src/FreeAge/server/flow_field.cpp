@@ -0,0 +1,167 @@
+// Copyright 2020 The FreeAge authors
+// This file is part of FreeAge, licensed under the new BSD license.
+// See the COPYING file in the project root for the license text.
+
+#include "FreeAge/server/flow_field.hpp"
+
+#include <algorithm>
+#include <functional>
+#include <limits>
+
+void FlowField::Reset(const PathfindingGrid& grid, u32 occupancyVersion) {
+  cost.assign(grid.width * grid.height, std::numeric_limits<float>::infinity());
+  settled.assign(grid.width * grid.height, 0);
+  openList.clear();
+  expandedNodeCount = 0;
+  
+  blocksX = (grid.width + kBlockSize - 1) / kBlockSize;
+  searchDependsOnBlock.assign(blocksX * ((grid.height + kBlockSize - 1) / kBlockSize), 0);
+  
+  int goalIndex = goalTile.y() * grid.width + goalTile.x();
+  cost[goalIndex] = 0;
+  openList.emplace_back(0.f, goalIndex);
+  
+  this->occupancyVersion = occupancyVersion;
+  initialized = true;
+}
+
+void FlowField::Update(const PathfindingGrid& grid, u32 occupancyVersion, const std::vector<u32>& occupancyBlockVersions) {
+  if (!initialized || cost.size() != static_cast<usize>(grid.width * grid.height)) {
+    Reset(grid, occupancyVersion);
+    return;
+  }
+  
+  // The settled tiles, the costs of the tiles around them, and the open list only depend on the occupancy
+  // of the settled tiles and their neighbors. If none of these changed, a restarted search would arrive at
+  // exactly the same state, so the search can continue from its current state.
+  for (usize block = 0; block < occupancyBlockVersions.size(); ++ block) {
+    if (occupancyBlockVersions[block] > this->occupancyVersion && searchDependsOnBlock[block]) {
+      Reset(grid, occupancyVersion);
+      return;
+    }
+  }
+  this->occupancyVersion = occupancyVersion;
+}
+
+void FlowField::Settle(const PathfindingGrid& grid, int tileIndex) {
+  auto greater = std::greater<std::pair<float, int>>();
+  
+  while (!settled[tileIndex] && !openList.empty()) {
+    std::pop_heap(openList.begin(), openList.end(), greater);
+    std::pair<float, int> current = openList.back();
+    openList.pop_back();
+    if (settled[current.second]) {
+      // Outdated entry.
+      continue;
+    }
+    settled[current.second] = 1;
+    ++ expandedNodeCount;
+    
+    int x = current.second % grid.width;
+    int y = current.second / grid.width;
+    
+    // Expanding the tile depends on the occupancy of the tile and its neighbors.
+    for (int blockY = std::max(0, y - 1) / kBlockSize, maxBlockY = std::min(grid.height - 1, y + 1) / kBlockSize; blockY <= maxBlockY; ++ blockY) {
+      for (int blockX = std::max(0, x - 1) / kBlockSize, maxBlockX = std::min(grid.width - 1, x + 1) / kBlockSize; blockX <= maxBlockX; ++ blockX) {
+        searchDependsOnBlock[blockY * blocksX + blockX] = 1;
+      }
+    }
+    
+    bool freeLeft = IsFree(grid, x - 1, y);
+    bool freeRight = IsFree(grid, x + 1, y);
+    bool freeTop = IsFree(grid, x, y - 1);
+    bool freeBottom = IsFree(grid, x, y + 1);
+    
+    auto relax = [&](int nextX, int nextY, float stepCost) {
+      int nextIndex = nextY * grid.width + nextX;
+      float newCost = current.first + stepCost;
+      if (newCost < cost[nextIndex]) {
+        cost[nextIndex] = newCost;
+        openList.emplace_back(newCost, nextIndex);
+        std::push_heap(openList.begin(), openList.end(), greater);
+      }
+    };
+    
+    constexpr float sqrt2 = 1.41421356237310f;
+    if (freeLeft) { relax(x - 1, y, 1); }
+    if (freeRight) { relax(x + 1, y, 1); }
+    if (freeTop) { relax(x, y - 1, 1); }
+    if (freeBottom) { relax(x, y + 1, 1); }
+    // Diagonal movements require the two adjacent tiles to be free.
+    if (freeLeft && freeTop && IsFree(grid, x - 1, y - 1)) { relax(x - 1, y - 1, sqrt2); }
+    if (freeRight && freeTop && IsFree(grid, x + 1, y - 1)) { relax(x + 1, y - 1, sqrt2); }
+    if (freeLeft && freeBottom && IsFree(grid, x - 1, y + 1)) { relax(x - 1, y + 1, sqrt2); }
+    if (freeRight && freeBottom && IsFree(grid, x + 1, y + 1)) { relax(x + 1, y + 1, sqrt2); }
+  }
+}
+
+bool FlowField::ExtractPath(const PathfindingGrid& grid, const QPoint& startTile, std::vector<QPoint>* reverseTilePath) {
+  reverseTilePath->clear();
+  
+  // Make sure that the costs around the start tile are final. The start tile itself may be
+  // occupied (if the unit stands partly on it), in which case its cost is infinite, but the
+  // unit may still be able to step to a free neighbor.
+  float currentCost;
+  if (IsFree(grid, startTile.x(), startTile.y())) {
+    int startIndex = startTile.y() * grid.width + startTile.x();
+    Settle(grid, startIndex);
+    currentCost = cost[startIndex];
+  } else {
+    for (int y = startTile.y() - 1; y <= startTile.y() + 1; ++ y) {
+      for (int x = startTile.x() - 1; x <= startTile.x() + 1; ++ x) {
+        if (IsFree(grid, x, y)) {
+          Settle(grid, y * grid.width + x);
+        }
+      }
+    }
+    currentCost = std::numeric_limits<float>::infinity();
+  }
+  
+  // Repeatedly step to the neighbor with the lowest cost. Since the costs were computed by a
+  // Dijkstra search from the goal with the same movement rules, every reachable tile has a
+  // neighbor with lower cost, so this always ends at the goal. All tiles with a lower cost
+  // than a settled tile are settled as well, so only final costs are compared here.
+  QPoint current = startTile;
+  while (current != goalTile) {
+    int x = current.x();
+    int y = current.y();
+    
+    bool freeLeft = IsFree(grid, x - 1, y);
+    bool freeRight = IsFree(grid, x + 1, y);
+    bool freeTop = IsFree(grid, x, y - 1);
+    bool freeBottom = IsFree(grid, x, y + 1);
+    
+    QPoint best;
+    float bestCost = currentCost;
+    auto consider = [&](int nextX, int nextY) {
+      float nextCost = cost[nextY * grid.width + nextX];
+      if (nextCost < bestCost) {
+        best = QPoint(nextX, nextY);
+        bestCost = nextCost;
+      }
+    };
+    
+    if (freeLeft) { consider(x - 1, y); }
+    if (freeRight) { consider(x + 1, y); }
+    if (freeTop) { consider(x, y - 1); }
+    if (freeBottom) { consider(x, y + 1); }
+    // Diagonal movements require the two adjacent tiles to be free.
+    if (freeLeft && freeTop && IsFree(grid, x - 1, y - 1)) { consider(x - 1, y - 1); }
+    if (freeRight && freeTop && IsFree(grid, x + 1, y - 1)) { consider(x + 1, y - 1); }
+    if (freeLeft && freeBottom && IsFree(grid, x - 1, y + 1)) { consider(x - 1, y + 1); }
+    if (freeRight && freeBottom && IsFree(grid, x + 1, y + 1)) { consider(x + 1, y + 1); }
+    
+    if (bestCost >= currentCost) {
+      // The goal is not reachable from here.
+      reverseTilePath->clear();
+      return false;
+    }
+    
+    reverseTilePath->push_back(best);
+    current = best;
+    currentCost = bestCost;
+  }
+  
+  std::reverse(reverseTilePath->begin(), reverseTilePath->end());
+  return true;
+}
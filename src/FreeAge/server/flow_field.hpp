@@ -0,0 +1,102 @@
+// Copyright 2020 The FreeAge authors
+// This file is part of FreeAge, licensed under the new BSD license.
+// See the COPYING file in the project root for the license text.
+
+#pragma once
+
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#include <QPoint>
+#include <QRect>
+
+#include "FreeAge/common/free_age.hpp"
+#include "FreeAge/server/pathfinding.hpp"
+
+/// Flow field for moving a group of units to the same goal tile.
+///
+/// Stores the path cost from the tiles of the map to the goal (the "integration field"),
+/// which is computed by a single Dijkstra search from the goal that is shared by all units
+/// of the group. A unit obtains its path by following the decreasing costs from its own tile,
+/// which is linear in the path length. This makes the cost of a group move order mostly
+/// independent of the number of units in the group.
+///
+/// The Dijkstra search is run lazily: it only proceeds until the tiles of the units that
+/// queried the field so far are reached, and is resumed when a unit further away queries it.
+/// Since the search proceeds in the same order regardless of when it is paused, the resulting
+/// paths do not depend on the order of the queries.
+///
+/// Movement rules are the same as for GridPathPlanner. The goal tile is treated as free
+/// even if it is occupied, like the goal rect of GridPathPlanner.
+///
+/// The field is used by the path planning worker threads (see PathRequestScheduler),
+/// which must hold the lock returned by GetMutex() while they use it.
+class FlowField {
+ public:
+  /// Side length (in tiles) of the square blocks in which the field records the tiles that its search depends on.
+  /// This must match ServerMap::kOccupancyBlockSize.
+  static constexpr int kBlockSize = 16;
+  
+  inline FlowField(const QPoint& goalTile)
+      : goalTile(goalTile) {}
+  
+  /// Discards all costs computed so far and restarts the search on the given grid.
+  /// occupancyVersion must be the ServerMap::GetOccupancyVersion() that corresponds to the grid.
+  void Reset(const PathfindingGrid& grid, u32 occupancyVersion);
+  
+  /// Brings the field up-to-date with the given grid, whose occupancy version and occupancy block versions
+  /// are given (see ServerMap::GetOccupancyBlockVersions()). The search is only restarted if the occupancy
+  /// changed in a block that contains or borders a tile that the search has settled already. Otherwise,
+  /// it continues where it paused, which yields exactly the same costs as restarting it.
+  void Update(const PathfindingGrid& grid, u32 occupancyVersion, const std::vector<u32>& occupancyBlockVersions);
+  
+  /// Returns the tile path from startTile to the goal tile in reverse order (in the same format as
+  /// GridPathPlanner::PlanPath()). Returns false if the goal is not reachable from startTile.
+  /// The grid must be the one that was passed to Reset().
+  bool ExtractPath(const PathfindingGrid& grid, const QPoint& startTile, std::vector<QPoint>* reverseTilePath);
+  
+  inline const QPoint& GetGoalTile() const { return goalTile; }
+  inline QRect GetGoalRect() const { return QRect(goalTile, QSize(1, 1)); }
+  
+  /// Returns the total number of nodes expanded since the last Reset().
+  inline int GetExpandedNodeCount() const { return expandedNodeCount; }
+  
+  inline std::mutex& GetMutex() { return mutex; }
+  
+ private:
+  inline bool IsFree(const PathfindingGrid& grid, int x, int y) const {
+    return grid.IsInside(x, y) &&
+           (!grid.IsOccupied(x, y) || (x == goalTile.x() && y == goalTile.y()));
+  }
+  
+  /// Continues the Dijkstra search until the cost of the given tile is final
+  /// (or until it turns out that the tile is not reachable).
+  void Settle(const PathfindingGrid& grid, int tileIndex);
+  
+  
+  QPoint goalTile;
+  
+  /// Cost to the goal for each tile. For tiles that are not settled yet,
+  /// this is an upper bound (or infinity if the tile was not reached yet).
+  std::vector<float> cost;
+  
+  /// Whether the cost of each tile is final.
+  std::vector<u8> settled;
+  
+  /// Heap of (cost, tile index) used as priority queue of the paused Dijkstra search.
+  std::vector<std::pair<float, int>> openList;
+  
+  /// For each block of kBlockSize x kBlockSize tiles (in row-major order), whether it contains
+  /// a settled tile or a neighbor of one, i.e., whether the search depends on its occupancy.
+  int blocksX = 0;
+  std::vector<u8> searchDependsOnBlock;
+  
+  int expandedNodeCount = 0;
+  
+  u32 occupancyVersion = 0;
+  bool initialized = false;
+  
+  /// See GetMutex().
+  std::mutex mutex;
+};
@@ -4,18 +4,18 @@
 
 #include "FreeAge/server/game.hpp"
 
-#include <iostream>
-#include <queue>
+#include <algorithm>
+#include <cmath>
+#include <thread>
 
 #include <QApplication>
-#include <QImage>
-#include <QThread>
 
 #include "FreeAge/common/logging.hpp"
 #include "FreeAge/common/messages.hpp"
 #include "FreeAge/common/timing.hpp"
 #include "FreeAge/common/util.hpp"
 #include "FreeAge/server/building.hpp"
+#include "FreeAge/server/event_waiter.hpp"
 #include "FreeAge/server/unit.hpp"
 
 // TODO (puzzlepaint): For some reason, this include needed to be after the Qt includes on my laptop
@@ -23,25 +23,35 @@
 #include <mango/core/endian.hpp>
 
 void PlayerInGame::RemoveFromGame() {
-  unparsedBuffer.clear();
+  unparsedBuffer.Clear();
   isConnected = false;
 }
 
 
 Game::Game(ServerSettings* settings)
-    : settings(settings) {}
+    : pathRequestScheduler(ThreadPool::GetDefaultThreadCount(), kMaxPathRequestsPerGameStep, settings->pathPlanner),
+      settings(settings) {
+  // The main thread waits while the unit step intents are computed, so all hardware threads can be used for this.
+  int simulationThreadCount = settings->simulationThreadCount;
+  if (simulationThreadCount <= 0) {
+    simulationThreadCount = std::thread::hardware_concurrency();
+  }
+  if (simulationThreadCount > 1) {
+    simulationThreadPool.reset(new ThreadPool(simulationThreadCount));
+  }
+}
 
 void Game::RunGameLoop(std::vector<std::shared_ptr<PlayerInGame>>* playersInGame) {
-  constexpr float kTargetFPS = 30;
-  constexpr float kSimulationTimeInterval = 1 / kTargetFPS;
+  SetPlayersInGame(playersInGame);
+  bool firstLoopIteration = true;
   
-  accumulatedMessages.resize(playersInGame->size());
-  for (usize playerIndex = 0; playerIndex < playersInGame->size(); ++ playerIndex) {
-    accumulatedMessages[playerIndex].reserve(1024);
-  }
+  // Records how late the game steps start compared to their scheduled time.
+  usize stepStartJitterHandle = Timing::getHandle("Game step start jitter");
   
-  this->playersInGame = playersInGame;
-  bool firstLoopIteration = true;
+  // The simulation time of each game step, for reporting the percentiles at the end.
+  std::vector<float> stepSimulationSeconds;
+  
+  EventWaiter eventWaiter;
   
   while (!shouldExit) {
     // Read data from player connections and handle broken connections.
@@ -54,12 +64,11 @@ void Game::RunGameLoop(std::vector<std::shared_ptr<PlayerInGame>>* playersInGame
       }
       
       // Read new data from the connection.
-      int prevSize = player->unparsedBuffer.size();
-      player->unparsedBuffer += player->socket->readAll();
+      usize readCount = player->unparsedBuffer.ReadFrom(player->socket);
       
       bool removePlayer = false;
-      if (player->unparsedBuffer.size() > prevSize ||
-          (firstLoopIteration && !player->unparsedBuffer.isEmpty())) {
+      if (readCount > 0 ||
+          (firstLoopIteration && !player->unparsedBuffer.IsEmpty())) {
         ParseMessagesResult parseResult = TryParseClientMessages(player.get(), *playersInGame);
         removePlayer = parseResult == ParseMessagesResult::PlayerLeftOrShouldBeDisconnected;
       }
@@ -75,55 +84,154 @@ void Game::RunGameLoop(std::vector<std::shared_ptr<PlayerInGame>>* playersInGame
       }
     }
     
-    // Process Qt events.
-    qApp->processEvents(QEventLoop::AllEvents);
-    
     // Simulate a game step if it is due.
     // TODO: Do we need to consider the possibility of falling behind more and more with the simulation?
     //       I guess that the game would break anyway then.
+    TimePoint wakeUpTime;
     if (map) {
       double serverTime = GetCurrentServerTime();
       while (serverTime >= lastSimulationTime + kSimulationTimeInterval) {
+        Timing::addTime(stepStartJitterHandle, serverTime - (lastSimulationTime + kSimulationTimeInterval));
+        
         /// Simulate one game step.
+        Timer simulationTimer("Game step simulation");
         SimulateGameStep(lastSimulationTime + kSimulationTimeInterval, kSimulationTimeInterval);
+        stepSimulationSeconds.push_back(simulationTimer.Stop());
         
         lastSimulationTime += kSimulationTimeInterval;
+        if (replayRecorder) {
+          replayRecorder->Flush(gameStepCount);
+        }
+        serverTime = GetCurrentServerTime();
       }
       
-      // If the next game step is due far enough in the future, sleep a bit to avoid "busy waiting" and reduce the CPU load.
-      // However, we must not sleep for the whole time, since we should keep handling client messages
-      // and processing Qt events in the meantime.
-      constexpr double kMaxSleepTimeSeconds = 0.0005;  // 0.5 milliseconds
-      double nextIterationTime = lastSimulationTime + kSimulationTimeInterval;
-      serverTime = GetCurrentServerTime();
-      double sleepTimeSeconds = std::min(kMaxSleepTimeSeconds, nextIterationTime - serverTime);
-      if (sleepTimeSeconds > 0) {
-        constexpr double kSecondsToMicroseconds = 1000 * 1000;
-        QThread::usleep(kSecondsToMicroseconds * sleepTimeSeconds + 0.5);
-      }
+      wakeUpTime = settings->serverStartTime + std::chrono::duration_cast<Clock::duration>(SecondsDuration(lastSimulationTime + kSimulationTimeInterval));
     } else {
-      QThread::msleep(1);
+      // While the game is loading, there is nothing to do except for handling the client messages (which wake
+      // up the event loop). Still wake up regularly to detect ping timeouts.
+      constexpr int kIdleWakeUpIntervalMilliseconds = 100;
+      wakeUpTime = Clock::now() + std::chrono::milliseconds(kIdleWakeUpIntervalMilliseconds);
     }
     
+    // Process Qt events, and wait without using the CPU until new events arrive or the next game step is due.
+    // Incoming data on the player connections is one of these events, so it is handled without delay.
+    eventWaiter.ProcessEventsUntil(wakeUpTime);
+    
     firstLoopIteration = false;
   }
   
+  // Record the commands of players that left after the last game step.
+  if (replayRecorder) {
+    replayRecorder->Flush(gameStepCount);
+  }
+  
+  LOG(INFO) << "Server timing statistics:\n" << Timing::print(kSortByTotal);
+  LogStepTimePercentiles(&stepSimulationSeconds);
+  
   // Before exiting, continue processing events for a bit.
   // This is an attempt to ensure that all of the messages that were sent do actually get sent.
   // TODO: Is this really necessary, and if yes, is there a better way to do it?
-  for (int i = 0; i < 200; ++ i) {
-    qApp->processEvents(QEventLoop::AllEvents);
-    QThread::msleep(1);
+  constexpr int kFinalEventProcessingMilliseconds = 200;
+  TimePoint finalEventProcessingEnd = Clock::now() + std::chrono::milliseconds(kFinalEventProcessingMilliseconds);
+  while (Clock::now() < finalEventProcessingEnd) {
+    eventWaiter.ProcessEventsUntil(finalEventProcessingEnd);
+  }
+}
+
+void Game::RunReplay(std::vector<std::shared_ptr<PlayerInGame>>* playersInGame, ReplayReader* reader, const ReplayHeader& header) {
+  SetPlayersInGame(playersInGame);
+  for (auto& player : *playersInGame) {
+    player->finishedLoading = true;
+  }
+  
+  // The game steps must have the same server times as in the recorded game, since the simulation depends on them.
+  StartGame(header.gameBeginServerTime);
+  
+  u32 commandGameStep;
+  u8 commandPlayerIndex;
+  MessageView command;
+  bool haveCommand = reader->ReadNextCommand(&commandGameStep, &commandPlayerIndex, &command);
+  
+  std::vector<float> stepSimulationSeconds;
+  TimePoint replayStartTime = Clock::now();
+  
+  while (!shouldExit) {
+    // Apply the commands that were handled before this game step in the recorded game.
+    while (haveCommand && commandGameStep == gameStepCount) {
+      if (commandPlayerIndex >= playersInGame->size()) {
+        LOG(ERROR) << "Server: The replay log contains a command of an invalid player index: " << static_cast<int>(commandPlayerIndex);
+      } else if (static_cast<ClientToServerMessage>(command.GetType()) == ClientToServerMessage::Leave) {
+        RemovePlayer(commandPlayerIndex, PlayerExitReason::Resign);
+      } else {
+        HandleGameCommand(command, playersInGame->at(commandPlayerIndex).get());
+      }
+      haveCommand = reader->ReadNextCommand(&commandGameStep, &commandPlayerIndex, &command);
+    }
+    if (shouldExit) {
+      break;
+    }
+    if (!haveCommand) {
+      // After the last command, simulate the game steps up to the end of the recording.
+      u32 endGameStep;
+      if (!reader->GetEndGameStep(&endGameStep) || gameStepCount >= endGameStep) {
+        break;
+      }
+    } else if (commandGameStep < gameStepCount) {
+      LOG(ERROR) << "Server: The replay log contains a command for game step " << commandGameStep << " after one for game step " << gameStepCount;
+      break;
+    }
+    
+    Timer simulationTimer("Game step simulation");
+    SimulateGameStep(lastSimulationTime + kSimulationTimeInterval, kSimulationTimeInterval);
+    stepSimulationSeconds.push_back(simulationTimer.Stop());
+    
+    lastSimulationTime += kSimulationTimeInterval;
+    if (replayRecorder) {
+      replayRecorder->Flush(gameStepCount);
+    }
   }
+  
+  double replaySeconds = SecondsDuration(Clock::now() - replayStartTime).count();
+  LOG(INFO) << "Server: Replayed " << gameStepCount << " game steps in " << replaySeconds << " seconds ("
+            << (gameStepCount / kTargetFPS) << " seconds of game time, " << (gameStepCount / std::max(1e-9, replaySeconds)) << " game steps per second)";
+  LOG(INFO) << "Server timing statistics:\n" << Timing::print(kSortByTotal);
+  LogStepTimePercentiles(&stepSimulationSeconds);
+}
+
+void Game::SetPlayersInGame(std::vector<std::shared_ptr<PlayerInGame>>* playersInGame) {
+  accumulatedMessages.clear();
+  for (usize playerIndex = 0; playerIndex < playersInGame->size(); ++ playerIndex) {
+    accumulatedMessages.emplace_back(kGameStepTimeMessageSize);
+  }
+  movementBatchOffsets.resize(playersInGame->size(), -1);
+  
+  this->playersInGame = playersInGame;
 }
 
-void Game::HandleLoadingProgress(const QByteArray& msg, PlayerInGame* player, const std::vector<std::shared_ptr<PlayerInGame>>& players) {
-  if (msg.size() < 4) {
+void Game::LogStepTimePercentiles(std::vector<float>* stepSimulationSeconds) {
+  if (stepSimulationSeconds->empty()) {
+    return;
+  }
+  
+  std::sort(stepSimulationSeconds->begin(), stepSimulationSeconds->end());
+  auto percentileMilliseconds = [&](float percentile) {
+    usize index = std::min<usize>(stepSimulationSeconds->size() - 1, percentile / 100 * stepSimulationSeconds->size());
+    return 1000 * stepSimulationSeconds->at(index);
+  };
+  LOG(INFO) << "Server: Game step simulation time percentiles over " << stepSimulationSeconds->size() << " steps:"
+            << " 50%: " << percentileMilliseconds(50) << " ms,"
+            << " 90%: " << percentileMilliseconds(90) << " ms,"
+            << " 99%: " << percentileMilliseconds(99) << " ms,"
+            << " max: " << (1000 * stepSimulationSeconds->back()) << " ms";
+}
+
+void Game::HandleLoadingProgress(const MessageView& msg, PlayerInGame* player, const std::vector<std::shared_ptr<PlayerInGame>>& players) {
+  if (msg.GetSize() < 4) {
     LOG(ERROR) << "Received a too short LoadingProgress message";
     return;
   }
   
-  u8 percentage = msg.data()[3];
+  u8 percentage = msg.GetData()[3];
   
   // Broadcast the loading progress to all other clients.
   QByteArray broadcastMsg = CreateLoadingProgressBroadcastMessage(player->index, percentage);
@@ -150,7 +258,8 @@ void Game::HandleLoadingFinished(PlayerInGame* player, const std::vector<std::sh
   
   if (allPlayersFinishedLoading) {
     // Start the game.
-    StartGame();
+    constexpr double kGameBeginOffsetSeconds = 0.2;  // give some time for the initial messages to arrive and be processed
+    StartGame(GetCurrentServerTime() + kGameBeginOffsetSeconds);
   }
 }
 
@@ -166,8 +275,8 @@ void Game::SendChatBroadcast(u16 sendingPlayerIndex, const QString& text, const
 }
 
 // TODO: This is duplicated from match_setup.cpp, de-duplicate this
-void Game::HandleChat(const QByteArray& msg, PlayerInGame* player, u32 len, const std::vector<std::shared_ptr<PlayerInGame>>& players) {
-  QString text = QString::fromUtf8(msg.mid(3, len - 3));
+void Game::HandleChat(const MessageView& msg, PlayerInGame* player, const std::vector<std::shared_ptr<PlayerInGame>>& players) {
+  QString text = QString::fromUtf8(msg.Mid(3, msg.GetSize() - 3));
   
   // Determine the index of the sending player.
   int sendingPlayerIndex = 0;
@@ -183,13 +292,13 @@ void Game::HandleChat(const QByteArray& msg, PlayerInGame* player, u32 len, cons
 }
 
 // TODO: This is duplicated from match_setup.cpp, de-duplicate this
-void Game::HandlePing(const QByteArray& msg, PlayerInGame* player) {
-  if (msg.size() < 3 + 8) {
+void Game::HandlePing(const MessageView& msg, PlayerInGame* player) {
+  if (msg.GetSize() < 3 + 8) {
     LOG(ERROR) << "Received a too short Ping message";
     return;
   }
   
-  u64 number = mango::uload64(msg.data() + 3);
+  u64 number = mango::uload64(msg.GetData() + 3);
   
   TimePoint pingHandleTime = Clock::now();
   player->lastPingTime = pingHandleTime;
@@ -203,20 +312,20 @@ void Game::HandlePing(const QByteArray& msg, PlayerInGame* player) {
   player->socket->flush();
 }
 
-void Game::HandleMoveToMapCoordMessage(const QByteArray& msg, PlayerInGame* player, u32 len) {
+void Game::HandleMoveToMapCoordMessage(const MessageView& msg, PlayerInGame* player) {
   // Parse message
-  if (len < 13 + 4) {
+  if (msg.GetSize() < 13 + 4) {
     LOG(ERROR) << "Server: Erroneous MoveToMapCoord message (1)";
     return;
   }
-  const char* data = msg.data();
+  const char* data = msg.GetData();
   
   QPointF targetMapCoord(
       *reinterpret_cast<const float*>(data + 3),
       *reinterpret_cast<const float*>(data + 7));
   
   usize selectedUnitIdsSize = mango::uload16(data + 11);
-  if (len != 13 + 4 * selectedUnitIdsSize) {
+  if (msg.GetSize() != 13 + 4 * selectedUnitIdsSize) {
     LOG(ERROR) << "Server: Erroneous MoveToMapCoord message (2)";
     return;
   }
@@ -228,6 +337,8 @@ void Game::HandleMoveToMapCoordMessage(const QByteArray& msg, PlayerInGame* play
   }
   
   // Handle move command (for all IDs which are actually units of the sending client)
+  std::vector<ServerUnit*> units;
+  units.reserve(selectedUnitIds.size());
   for (u32 id : selectedUnitIds) {
     auto it = map->GetObjects().find(id);
     if (it == map->GetObjects().end() ||
@@ -238,16 +349,26 @@ void Game::HandleMoveToMapCoordMessage(const QByteArray& msg, PlayerInGame* play
     
     ServerUnit* unit = AsUnit(it->second);
     unit->SetMoveToTarget(targetMapCoord);
+    ActivateUnit(id, unit);
+    units.push_back(unit);
+  }
+  
+  // For groups of units, use a shared flow field instead of planning a path for each unit individually.
+  if (units.size() >= kMinFlowFieldGroupSize) {
+    std::shared_ptr<FlowField> flowField = GetOrCreateFlowField(GetTileOfMapCoord(targetMapCoord));
+    for (ServerUnit* unit : units) {
+      unit->SetFlowField(flowField);
+    }
   }
 }
 
-void Game::HandleSetTargetMessage(const QByteArray& msg, PlayerInGame* player, u32 len) {
+void Game::HandleSetTargetMessage(const MessageView& msg, PlayerInGame* player) {
   // Parse message
-  if (len < 9 + 4) {
+  if (msg.GetSize() < 9 + 4) {
     LOG(ERROR) << "Server: Erroneous SetTarget message (1)";
     return;
   }
-  const char* data = msg.data();
+  const char* data = msg.GetData();
   
   u32 targetId = mango::uload32(data + 3);
   auto targetIt = map->GetObjects().find(targetId);
@@ -257,7 +378,7 @@ void Game::HandleSetTargetMessage(const QByteArray& msg, PlayerInGame* player, u
   }
   
   usize selectedUnitIdsSize = mango::uload16(data + 7);
-  if (len != 9 + 4 * selectedUnitIdsSize) {
+  if (msg.GetSize() != 9 + 4 * selectedUnitIdsSize) {
     LOG(ERROR) << "Server: Erroneous SetTarget message (2)";
     return;
   }
@@ -272,12 +393,12 @@ void Game::HandleSetTargetMessage(const QByteArray& msg, PlayerInGame* player, u
   SetUnitTargets(unitIds, player->index, targetId, targetIt->second, true);
 }
 
-void Game::HandleProduceUnitMessage(const QByteArray& msg, PlayerInGame* player) {
-  if (msg.size() < 3 + 6) {
+void Game::HandleProduceUnitMessage(const MessageView& msg, PlayerInGame* player) {
+  if (msg.GetSize() < 3 + 6) {
     LOG(ERROR) << "Received a too short ProduceUnit message";
     return;
   }
-  const char* data = msg.data();
+  const char* data = msg.GetData();
   
   u32 buildingId = mango::uload32(data + 3);
   UnitType unitType = static_cast<UnitType>(mango::uload16(data + 7));
@@ -324,15 +445,16 @@ void Game::HandleProduceUnitMessage(const QByteArray& msg, PlayerInGame* player)
   
   // Add the unit to the production queue.
   productionBuilding->QueueUnit(unitType);
-  accumulatedMessages[player->index] += CreateQueueUnitMessage(buildingId, static_cast<u16>(unitType));
+  AddToProductionWaitList(buildingId, productionBuilding);
+  WriteQueueUnitMessage(&accumulatedMessages[player->index], buildingId, static_cast<u16>(unitType));
 }
 
-void Game::HandlePlaceBuildingFoundationMessage(const QByteArray& msg, PlayerInGame* player) {
-  if (msg.size() < 3 + 8) {
+void Game::HandlePlaceBuildingFoundationMessage(const MessageView& msg, PlayerInGame* player) {
+  if (msg.GetSize() < 3 + 8) {
     LOG(ERROR) << "Received a too short PlaceBuildingFoundation message (1)";
     return;
   }
-  const char* data = msg.data();
+  const char* data = msg.GetData();
   
   BuildingType type = static_cast<BuildingType>(mango::uload16(data + 3));
   // TODO: Check whether the player is allowed to build this type of building
@@ -348,7 +470,7 @@ void Game::HandlePlaceBuildingFoundationMessage(const QByteArray& msg, PlayerInG
   }
   
   u16 villagerIdsSize = mango::uload16(data + 9);
-  if (msg.size() < 3 + 8 + 4 * villagerIdsSize) {
+  if (msg.GetSize() < 3 + 8 + 4 * villagerIdsSize) {
     LOG(ERROR) << "Received a too short PlaceBuildingFoundation message (2)";
     return;
   }
@@ -406,20 +528,20 @@ void Game::HandlePlaceBuildingFoundationMessage(const QByteArray& msg, PlayerInG
   // Add the foundation and tell the sending player that it has been added.
   u32 newBuildingId;
   ServerBuilding* newBuildingFoundation = map->AddBuilding(player->index, type, baseTile, /*buildPercentage*/ 0, &newBuildingId, /*addOccupancy*/ false);
+  player->objectCount += 1;
   
-  QByteArray addObjectMsg = CreateAddObjectMessage(newBuildingId, newBuildingFoundation);
-  accumulatedMessages[player->index] += addObjectMsg;
+  WriteAddObjectMessage(&accumulatedMessages[player->index], newBuildingId, newBuildingFoundation);
   
   // For all given villagers, set the target to the new foundation.
   SetUnitTargets(villagerIds, player->index, newBuildingId, newBuildingFoundation, true);
 }
 
-void Game::HandleDeleteObjectMessage(const QByteArray& msg, PlayerInGame* player) {
-  if (msg.size() < 3 + 4) {
+void Game::HandleDeleteObjectMessage(const MessageView& msg, PlayerInGame* player) {
+  if (msg.GetSize() < 3 + 4) {
     LOG(ERROR) << "Received a too short DeleteObject message";
     return;
   }
-  const char* data = msg.data();
+  const char* data = msg.GetData();
   
   u32 objectId = mango::uload32(data + 3);
   
@@ -438,12 +560,12 @@ void Game::HandleDeleteObjectMessage(const QByteArray& msg, PlayerInGame* player
   DeleteObject(objectId, true);
 }
 
-void Game::HandleDequeueProductionQueueItemMessage(const QByteArray& msg, PlayerInGame* player) {
-  if (msg.size() < 3 + 4 + 1) {
+void Game::HandleDequeueProductionQueueItemMessage(const MessageView& msg, PlayerInGame* player) {
+  if (msg.GetSize() < 3 + 4 + 1) {
     LOG(ERROR) << "Received a too short DequeueProductionQueueItem message";
     return;
   }
-  const char* data = msg.data();
+  const char* data = msg.GetData();
   
   u32 objectId = mango::uload32(data + 3);
   
@@ -473,68 +595,81 @@ void Game::HandleDequeueProductionQueueItemMessage(const QByteArray& msg, Player
   u8 queueIndex = building->GetProductionQueue().size() - 1 - queueIndexFromBack;
   
   // Adjust population count (if relevant).
-  if (queueIndex == 0 && building->GetProductionPercentage() > 0) {
+  if (queueIndex == 0 && building->IsProducing()) {
     playersInGame->at(building->GetPlayerIndex())->populationIncludingInProduction -= 1;
   }
   
-  // Remove the item from the queue.
+  // Remove the item from the queue. If it was in production, the next item starts to be produced instead.
   UnitType removedType = building->RemoveItemFromQueue(queueIndex);
+  if (queueIndex == 0 && !building->GetProductionQueue().empty()) {
+    AddToProductionWaitList(objectId, building);
+  }
   
   // Refund the resources for the item.
   player->resources.Add(GetUnitCost(removedType));
   
   // Tell the client about the successful removal.
-  accumulatedMessages[player->index] += CreateRemoveFromProductionQueueMessage(objectId, queueIndex);
+  WriteRemoveFromProductionQueueMessage(&accumulatedMessages[player->index], objectId, queueIndex);
+}
+
+void Game::HandleGameCommand(const MessageView& msg, PlayerInGame* player) {
+  if (replayRecorder) {
+    replayRecorder->RecordCommand(gameStepCount, player->index, msg);
+  }
+  
+  switch (static_cast<ClientToServerMessage>(msg.GetType())) {
+  case ClientToServerMessage::MoveToMapCoord:
+    HandleMoveToMapCoordMessage(msg, player);
+    break;
+  case ClientToServerMessage::SetTarget:
+    HandleSetTargetMessage(msg, player);
+    break;
+  case ClientToServerMessage::ProduceUnit:
+    HandleProduceUnitMessage(msg, player);
+    break;
+  case ClientToServerMessage::PlaceBuildingFoundation:
+    HandlePlaceBuildingFoundationMessage(msg, player);
+    break;
+  case ClientToServerMessage::DequeueProductionQueueItem:
+    HandleDequeueProductionQueueItemMessage(msg, player);
+    break;
+  case ClientToServerMessage::DeleteObject:
+    HandleDeleteObjectMessage(msg, player);
+    break;
+  default:
+    LOG(ERROR) << "Server: HandleGameCommand() called for a message that is not a game command: " << static_cast<int>(msg.GetType());
+    break;
+  }
 }
 
 Game::ParseMessagesResult Game::TryParseClientMessages(PlayerInGame* player, const std::vector<std::shared_ptr<PlayerInGame>>& players) {
-  while (true) {
-    if (player->unparsedBuffer.size() < 3) {
-      return ParseMessagesResult::NoAction;
-    }
-    
-    char* data = player->unparsedBuffer.data();
-    u16 msgLength = mango::uload16(data + 1);
-    
-    if (player->unparsedBuffer.size() < msgLength) {
-      return ParseMessagesResult::NoAction;
-    }
-    
-    if (msgLength < 3) {
-      LOG(ERROR) << "Received a too short message. The received message length is (should be at least 3): " << msgLength;
+  MessageView msg;
+  while (player->unparsedBuffer.GetNextMessage(&msg)) {
+    if (msg.GetSize() < 3) {
+      LOG(ERROR) << "Received a too short message. The received message length is (should be at least 3): " << msg.GetSize();
     } else {
-      ClientToServerMessage msgType = static_cast<ClientToServerMessage>(data[0]);
+      ClientToServerMessage msgType = static_cast<ClientToServerMessage>(msg.GetType());
       
       switch (msgType) {
       case ClientToServerMessage::MoveToMapCoord:
-        HandleMoveToMapCoordMessage(player->unparsedBuffer, player, msgLength);
-        break;
       case ClientToServerMessage::SetTarget:
-        HandleSetTargetMessage(player->unparsedBuffer, player, msgLength);
-        break;
       case ClientToServerMessage::ProduceUnit:
-        HandleProduceUnitMessage(player->unparsedBuffer, player);
-        break;
       case ClientToServerMessage::PlaceBuildingFoundation:
-        HandlePlaceBuildingFoundationMessage(player->unparsedBuffer, player);
-        break;
       case ClientToServerMessage::DequeueProductionQueueItem:
-        HandleDequeueProductionQueueItemMessage(player->unparsedBuffer, player);
-        break;
       case ClientToServerMessage::DeleteObject:
-        HandleDeleteObjectMessage(player->unparsedBuffer, player);
+        HandleGameCommand(msg, player);
         break;
       case ClientToServerMessage::Chat:
-        HandleChat(player->unparsedBuffer, player, msgLength, players);
+        HandleChat(msg, player, players);
         break;
       case ClientToServerMessage::Ping:
-        HandlePing(player->unparsedBuffer, player);
+        HandlePing(msg, player);
         break;
       case ClientToServerMessage::Leave:
         LOG(INFO) << "Server: Got leave message from player " << player->name.toStdString() << " (index " << player->index << ")";
         return ParseMessagesResult::PlayerLeftOrShouldBeDisconnected;
       case ClientToServerMessage::LoadingProgress:
-        HandleLoadingProgress(player->unparsedBuffer, player, players);
+        HandleLoadingProgress(msg, player, players);
         break;
       case ClientToServerMessage::LoadingFinished:
         HandleLoadingFinished(player, players);
@@ -545,43 +680,88 @@ Game::ParseMessagesResult Game::TryParseClientMessages(PlayerInGame* player, con
       }
     }
     
-    player->unparsedBuffer.remove(0, msgLength);
+    player->unparsedBuffer.PopMessage(msg);
   }
+  
+  return ParseMessagesResult::NoAction;
 }
 
-QByteArray Game::CreateMapUncoverMessage() {
-  int width = map->GetWidth();
-  int height = map->GetHeight();
-  
-  // TODO: Support large maps. If the message is too large, split it up into two or more messages.
-  CHECK_LE(1 + 2 + (width + 1) * (height + 1), std::numeric_limits<u16>::max());
-  
-  // Create buffer
-  QByteArray msg(1 + 2 + (width + 1) * (height + 1), Qt::Initialization::Uninitialized);
+QByteArray Game::CreateMapUncoverMessage(const QPoint& chunk) {
+  int minX = chunk.x() * kMapChunkSize;
+  int minY = chunk.y() * kMapChunkSize;
+  int endX = std::min(minX + kMapChunkSize, map->GetWidth() + 1);
+  int endY = std::min(minY + kMapChunkSize, map->GetHeight() + 1);
+  
+  // Create buffer with the header (3 bytes) and the chunk coordinates (4 bytes).
+  // The run-length encoded data takes at most 2 bytes per tile corner.
+  QByteArray msg(3 + 4, Qt::Initialization::Uninitialized);
+  msg.reserve(3 + 4 + 2 * kMapChunkSize * kMapChunkSize);
   char* data = msg.data();
-  
-  // Set buffer header (3 bytes)
   data[0] = static_cast<char>(ServerToClientMessage::MapUncover);
-  mango::ustore16(data + 1, msg.size());
-  
-  // Fill buffer
-  for (int y = 0; y <= height; ++ y) {
-    for (int x = 0; x <= width; ++ x) {
-      data[3 + x + y * (width + 1)] = map->elevationAt(x, y);
+  mango::ustore16(data + 3, chunk.x());
+  mango::ustore16(data + 5, chunk.y());
+  
+  // Append the elevations of the chunk's tile corners in row-major order, as pairs of (run length, elevation).
+  // Neighboring corners mostly have the same elevation, so this compresses well.
+  int runElevation = -1;
+  int runLength = 0;
+  auto appendRun = [&]() {
+    if (runLength > 0) {
+      msg.append(static_cast<char>(runLength));
+      msg.append(static_cast<char>(runElevation));
+    }
+  };
+  for (int y = minY; y < endY; ++ y) {
+    for (int x = minX; x < endX; ++ x) {
+      int elevation = map->elevationAt(x, y);
+      if (elevation == runElevation && runLength < std::numeric_limits<u8>::max()) {
+        ++ runLength;
+      } else {
+        appendRun();
+        runElevation = elevation;
+        runLength = 1;
+      }
     }
   }
+  appendRun();
   
+  mango::ustore16(msg.data() + 1, msg.size());
   return msg;
 }
 
-QByteArray Game::CreateAddObjectMessage(u32 objectId, ServerObject* object) {
-  // Create buffer
-  QByteArray msg(object->isBuilding() ? 23 : 23, Qt::Initialization::Uninitialized);
-  char* data = msg.data();
+void Game::PrioritizeMapChunks(PlayerInGame* player, const QPointF& viewCenter) {
+  int chunkCountX = (map->GetWidth() + 1 + kMapChunkSize - 1) / kMapChunkSize;
+  int chunkCountY = (map->GetHeight() + 1 + kMapChunkSize - 1) / kMapChunkSize;
   
-  // Set buffer header (3 bytes)
-  data[0] = static_cast<char>(ServerToClientMessage::AddObject);
-  mango::ustore16(data + 1, msg.size());
+  player->pendingMapChunks.clear();
+  player->pendingMapChunks.reserve(chunkCountX * chunkCountY);
+  for (int chunkY = 0; chunkY < chunkCountY; ++ chunkY) {
+    for (int chunkX = 0; chunkX < chunkCountX; ++ chunkX) {
+      player->pendingMapChunks.emplace_back(chunkX, chunkY);
+    }
+  }
+  
+  auto squaredDistanceToView = [&](const QPoint& chunk) {
+    return SquaredDistance(viewCenter, QPointF((chunk.x() + 0.5f) * kMapChunkSize, (chunk.y() + 0.5f) * kMapChunkSize));
+  };
+  std::sort(player->pendingMapChunks.begin(), player->pendingMapChunks.end(), [&](const QPoint& a, const QPoint& b) {
+    return squaredDistanceToView(a) > squaredDistanceToView(b);
+  });
+}
+
+void Game::SendPendingMapChunks(PlayerInGame* player, int maxBytes) {
+  int sentBytes = 0;
+  while (sentBytes < maxBytes && !player->pendingMapChunks.empty()) {
+    QByteArray msg = CreateMapUncoverMessage(player->pendingMapChunks.back());
+    player->pendingMapChunks.pop_back();
+    player->socket->write(msg);
+    sentBytes += msg.size();
+  }
+}
+
+void Game::WriteAddObjectMessage(MessageWriter* writer, u32 objectId, ServerObject* object) {
+  // Append the message with its header (3 bytes)
+  char* data = writer->AppendMessage(static_cast<u8>(ServerToClientMessage::AddObject), object->isBuilding() ? 20 : 20);
   
   // Fill buffer
   data[3] = static_cast<u8>(object->GetObjectType());  // TODO: Currently unneeded since this could be derived from the message length
@@ -601,11 +781,9 @@ QByteArray Game::CreateAddObjectMessage(u32 objectId, ServerObject* object) {
     *reinterpret_cast<float*>(data + 15) = unit->GetMapCoord().x();
     *reinterpret_cast<float*>(data + 19) = unit->GetMapCoord().y();
   }
-  
-  return msg;
 }
 
-void Game::StartGame() {
+void Game::StartGame(double gameBeginServerTime) {
   LOG(INFO) << "Server: Generating map ...";
   
   // Generate the map.
@@ -617,11 +795,26 @@ void Game::StartGame() {
   // Send a start message with the server time at which the game starts,
   // including the initial view center for each player (on its initial TC),
   // the player's initial resources, and the map size.
-  constexpr double kGameBeginOffsetSeconds = 0.2;  // give some time for the initial messages to arrive and be processed
-  double serverTime = GetCurrentServerTime();
-  gameBeginServerTime = serverTime + kGameBeginOffsetSeconds;
+  this->gameBeginServerTime = gameBeginServerTime;
   lastSimulationTime = gameBeginServerTime;
   
+  if (!settings->recordReplayPath.isEmpty()) {
+    ReplayHeader replayHeader;
+    replayHeader.mapSize = settings->mapSize;
+    replayHeader.pathPlanner = settings->pathPlanner;
+    replayHeader.gameBeginServerTime = gameBeginServerTime;
+    for (const auto& player : *playersInGame) {
+      replayHeader.initialResources.push_back(player->resources);
+    }
+    
+    replayRecorder.reset(new ReplayRecorder());
+    if (replayRecorder->Open(settings->recordReplayPath, replayHeader)) {
+      LOG(INFO) << "Server: Recording the game to: " << settings->recordReplayPath.toStdString();
+    } else {
+      replayRecorder.reset();
+    }
+  }
+  
   for (auto& player : *playersInGame) {
     // Find the player's town center and start with it in the center of the view.
     // If the player does not have a town center, find any villager and center on it instead.
@@ -660,33 +853,68 @@ void Game::StartGame() {
         map->GetWidth(),
         map->GetHeight());
     player->socket->write(gameBeginMsg);
+    
+    // Send the map content around the initial view right away. The remaining map
+    // chunks are streamed along with the messages of the first game steps.
+    constexpr int kInitialMapChunkBytes = 64 * 1024;
+    PrioritizeMapChunks(player.get(), initialViewCenter);
+    SendPendingMapChunks(player.get(), kInitialMapChunkBytes);
   }
   
-  // Send a message with the initial visible map content
-  QByteArray mapUncoverMsg = CreateMapUncoverMessage();
-  for (auto& player : *playersInGame) {
-    player->socket->write(mapUncoverMsg);
+  // Determine the tiles that each player sees.
+  CHECK_LE(playersInGame->size(), 32u) << "The bitmasks in ServerUnit::GetVisibleToPlayers() support at most 32 players";
+  playerVisibility.assign(playersInGame->size(), PlayerVisibility(map->GetWidth(), map->GetHeight()));
+  dropOffPoints.resize(playersInGame->size());
+  for (auto& playerDropOffPoints : dropOffPoints) {
+    for (DropOffPointIndex& index : playerDropOffPoints) {
+      index.Initialize(map->GetWidth(), map->GetHeight());
+    }
   }
-  
-  // Send creation messages for the initial map objects and count initial population
   const auto& objects = map->GetObjects();
+  for (const auto& item : objects) {
+    UpdateFieldOfView(item.second);
+  }
+  
+  // Send creation messages for the initial map objects and count the initial objects and population.
+  // Units are only sent to the players that see them.
   for (const auto& item : objects) {
     ServerObject* object = item.second;
     
-    QByteArray addObjectMsg = CreateAddObjectMessage(item.first, object);
+    ServerUnit* unit = object->isUnit() ? AsUnit(object) : nullptr;
+    if (unit) {
+      unit->SetVisibleToPlayers(ComputeVisibleToPlayers(unit));
+      unit->SetMovementReferenceCoord(QuantizeUnitMovementCoord(unit->GetMapCoord()));
+    }
+    
+    sharedMessage.Clear();
+    WriteAddObjectMessage(&sharedMessage, item.first, object);
     for (auto& player : *playersInGame) {
-      player->socket->write(addObjectMsg);
+      if (!unit || unit->IsVisibleToPlayer(player->index)) {
+        player->socket->write(sharedMessage.GetMessages(), sharedMessage.GetMessagesSize());
+      }
     }
     
+    if (object->GetPlayerIndex() != kGaiaPlayerIndex) {
+      playersInGame->at(object->GetPlayerIndex())->objectCount += 1;
+    }
     if (object->isBuilding()) {
       ServerBuilding* building = AsBuilding(object);
       if (building->GetPlayerIndex() != kGaiaPlayerIndex) {
         playersInGame->at(building->GetPlayerIndex())->availablePopulationSpace += GetBuildingProvidedPopulationSpace(building->GetBuildingType());
+        if (building->GetBuildPercentage() == 100) {
+          AddDropOffPoint(item.first, building);
+        }
       }
     } else if (object->isUnit()) {
       playersInGame->at(object->GetPlayerIndex())->populationIncludingInProduction += 1;
     }
   }
+  
+  // All units' visibility was computed above, so the changed tiles need not be visited in the first game step.
+  for (PlayerVisibility& visibility : playerVisibility) {
+    visibility.ClearChangedTiles();
+  }
+  
   for (auto& player : *playersInGame) {
     player->socket->flush();
   }
@@ -700,31 +928,88 @@ void Game::SimulateGameStep(double gameStepServerTime, float stepLengthInSeconds
     player->isHoused = false;
   }
   
-  // Iterate over all game objects to update their state.
-  auto end = map->GetObjects().end();
-  for (auto it = map->GetObjects().begin(); it != end; ++ it) {
-    const u32& objectId = it->first;
-    ServerObject* object = it->second;
-    
-    if (object->isUnit()) {
-      ServerUnit* unit = AsUnit(object);
-      SimulateGameStepForUnit(objectId, unit, gameStepServerTime, stepLengthInSeconds);
-    } else if (object->isBuilding()) {
-      ServerBuilding* building = AsBuilding(object);
-      SimulateGameStepForBuilding(objectId, building, stepLengthInSeconds);
+  // Apply the paths whose planning results are due in this game step.
+  ApplyPlannedPaths();
+  
+  // If there are many active units, first compute the outcomes of the units' steps that only
+  // consist of moving along their paths in parallel. Each of these intents is committed in
+  // the serial loop below if the map state that it depends on has not changed up to this point,
+  // which yields exactly the same result as simulating all steps serially.
+  auto& objects = map->GetObjects();
+  bool useUnitStepIntents = simulationThreadPool && activeUnitIds.size() >= kMinUnitsForParallelSimulation;
+  if (useUnitStepIntents) {
+    ComputeUnitStepIntents(stepLengthInSeconds);
+  }
+  
+  // Simulate the active units. Units that get activated during the iteration are appended
+  // to activeUnitIds and only simulated from the next step on. Object deletion is delayed
+  // until after the loop, so all units in the list still exist here.
+  for (usize i = 0, size = activeUnitIds.size(); i < size; ++ i) {
+    const u32 unitId = activeUnitIds[i];
+    ServerUnit* unit = AsUnit(objects.find(unitId)->second);
+    if (!useUnitStepIntents || !TryCommitUnitStepIntent(unitId, unit, unitStepIntents[i])) {
+      SimulateGameStepForUnit(unitId, unit, gameStepServerTime, stepLengthInSeconds);
     }
   }
   
+  // Update the construction rates and complete constructions. Buildings that are not being constructed are not visited.
+  UpdateConstructions(stepLengthInSeconds);
+  constructionTimers.Advance(&dueConstructions);
+  for (u32 buildingId : dueConstructions) {
+    CompleteConstruction(buildingId);
+  }
+  dueConstructions.clear();
+  
+  // Start and complete the unit productions in buildings. Buildings that do not produce anything are not visited.
+  StartWaitingProductions(gameStepServerTime, stepLengthInSeconds);
+  productionTimers.Advance(&dueProductions);
+  for (u32 buildingId : dueProductions) {
+    CompleteProduction(buildingId);
+  }
+  dueProductions.clear();
+  
   // Handle delayed object deletion.
   for (u32 id : objectDeleteList) {
     auto it = map->GetObjects().find(id);
     if (it != map->GetObjects().end()) {
-      delete it->second;
-      map->GetObjects().erase(it);
+      RemoveFieldOfView(it->second);
     }
+    map->DeleteObject(id);
   }
   objectDeleteList.clear();
   
+  // Tell the players about the units that they started or stopped seeing in this step.
+  // This is timed separately since it is the only part of the step that also visits inactive units.
+  Timer visibilityTimer("Game step visibility");
+  UpdateVisibility();
+  visibilityTimer.Stop();
+  
+  // Remove the units that are idle or were deleted from the active units.
+  usize activeUnitCount = 0;
+  for (u32 unitId : activeUnitIds) {
+    auto it = objects.find(unitId);
+    if (it == objects.end()) {
+      continue;
+    }
+    ServerUnit* unit = AsUnit(it->second);
+    if (unit->IsIdle()) {
+      unit->SetActive(false);
+      continue;
+    }
+    activeUnitIds[activeUnitCount] = unitId;
+    ++ activeUnitCount;
+  }
+  activeUnitIds.resize(activeUnitCount);
+  
+  ++ gameStepCount;
+  if (settings->logStateHashes) {
+    LOG(INFO) << "Server: State hash after game step " << gameStepCount << ": " << std::hex << ComputeStateHash() << std::dec;
+  }
+  
+  // Start planning the paths that were requested during this game step. This happens in the background;
+  // the results are applied a fixed number of game steps later (see PathRequestScheduler::kResultDelaySteps).
+  pathRequestScheduler.Dispatch(map.get(), gameStepCount);
+  
   // Check whether we need to send "housed" messages to clients.
   for (usize playerIndex = 0; playerIndex < playersInGame->size(); ++ playerIndex) {
     auto& player = (*playersInGame)[playerIndex];
@@ -733,7 +1018,7 @@ void Game::SimulateGameStep(double gameStepServerTime, float stepLengthInSeconds
     }
     
     if (player->isHoused != player->wasHousedBefore) {
-      accumulatedMessages[playerIndex] += CreateSetHousedMessage(player->isHoused);
+      WriteSetHousedMessage(&accumulatedMessages[playerIndex], player->isHoused);
       
       player->wasHousedBefore = player->isHoused;
     }
@@ -747,21 +1032,34 @@ void Game::SimulateGameStep(double gameStepServerTime, float stepLengthInSeconds
   for (usize playerIndex = 0; playerIndex < playersInGame->size(); ++ playerIndex) {
     auto& player = (*playersInGame)[playerIndex];
     if (!player->isConnected) {
-      accumulatedMessages[playerIndex].clear();
+      accumulatedMessages[playerIndex].Clear();
+      movementBatchOffsets[playerIndex] = -1;
       continue;
     }
     
     // Does the player need to be notified about a changed amount of resources?
     if (player->resources != player->lastResources) {
-      accumulatedMessages[playerIndex] += CreateResourcesUpdateMessage(player->resources);
+      WriteResourcesUpdateMessage(&accumulatedMessages[playerIndex], player->resources);
       player->lastResources = player->resources;
     }
     
-    if (!accumulatedMessages[playerIndex].isEmpty()) {
-      player->socket->write(
-          CreateGameStepTimeMessage(gameStepServerTime) +
-          accumulatedMessages[playerIndex]);
-      accumulatedMessages[playerIndex].clear();
+    bool wroteMessages = false;
+    if (!accumulatedMessages[playerIndex].IsEmpty()) {
+      WriteGameStepTimeMessage(accumulatedMessages[playerIndex].GetPrefix(), gameStepServerTime);
+      accumulatedMessages[playerIndex].WriteTo(player->socket);
+      movementBatchOffsets[playerIndex] = -1;
+      wroteMessages = true;
+    }
+    
+    // Continue streaming the map. The amount of map data per game step is limited such that
+    // it does not delay the game step messages much.
+    if (!player->pendingMapChunks.empty()) {
+      constexpr int kMapChunkBytesPerGameStep = 16 * 1024;
+      SendPendingMapChunks(player.get(), kMapChunkBytesPerGameStep);
+      wroteMessages = true;
+    }
+    
+    if (wroteMessages) {
       player->socket->flush();
     }
   }
@@ -802,50 +1100,18 @@ static bool IsFoundationFree(ServerBuilding* foundation, ServerMap* map) {
   }
   
   // Check whether units are on top of the foundation
-  for (const auto& item : map->GetObjects()) {
-    if (item.second->isUnit()) {
-      ServerUnit* unit = AsUnit(item.second);
-      if (DoesUnitTouchBuildingArea(unit, unit->GetMapCoord(), foundation, 0.01f)) {
-        return false;
-      }
-    }
-  }
-  
-  return true;
-}
-
-static bool TryEvadeUnit(ServerUnit* unit, float moveDistance, const QPointF& newMapCoord, ServerUnit* collidingUnit, QPointF* evadeMapCoord) {
-  // Intersect a circle of radius "moveDistance", centered at unit->GetMapCoord(),
-  // with a circle of radius GetUnitRadius(unit->GetUnitType()) + GetUnitRadius(collidingUnit->GetUnitType()), centered at collidingUnit->GetMapCoord().
-  constexpr float kErrorTolerance = 1e-3f;
-  
-  const QPointF unitCenter = unit->GetMapCoord();
-  float unitMoveRadius = moveDistance;
-  
-  const QPointF obstacleCenter = collidingUnit->GetMapCoord();
-  float obstacleRadius = GetUnitRadius(unit->GetUnitType()) + GetUnitRadius(collidingUnit->GetUnitType()) + kErrorTolerance;
-  
-  QPointF unitToObstacle = obstacleCenter - unitCenter;
-  float centerDistance = Length(unitToObstacle);
-  QPointF unitToObstacleDir = unitToObstacle / std::max(1e-5f, centerDistance);
-  
-  float a = (unitMoveRadius * unitMoveRadius - obstacleRadius * obstacleRadius + centerDistance * centerDistance) / (2 * centerDistance);
-  float termInSqrt = unitMoveRadius * unitMoveRadius - a * a;
-  if (termInSqrt <= 0) {
-    return false;
-  }
-  float h = sqrtf(termInSqrt);
-  
-  QPointF basePoint = unitCenter + a * unitToObstacleDir;
-  
-  QPointF intersection1 = basePoint + h * QPointF(unitToObstacleDir.y(), -unitToObstacleDir.x());
-  QPointF intersection2 = basePoint - h * QPointF(unitToObstacleDir.y(), -unitToObstacleDir.x());
-  
-  float squaredDistance1 = SquaredDistance(newMapCoord, intersection1);
-  float squaredDistance2 = SquaredDistance(newMapCoord, intersection2);
+  bool isFree = true;
+  map->ForEachUnitInArea(
+      baseTile.x(), baseTile.y(), baseTile.x() + foundationSize.width(), baseTile.y() + foundationSize.height(),
+      [&](ServerUnit* unit) {
+        if (DoesUnitTouchBuildingArea(unit, unit->GetMapCoord(), foundation, 0.01f)) {
+          isFree = false;
+          return false;
+        }
+        return true;
+      });
   
-  *evadeMapCoord = (squaredDistance1 < squaredDistance2) ? intersection1 : intersection2;
-  return true;
+  return isFree;
 }
 
 void Game::SimulateGameStepForUnit(u32 unitId, ServerUnit* unit, double gameStepServerTime, float stepLengthInSeconds) {
@@ -879,11 +1145,12 @@ void Game::SimulateGameStepForUnit(u32 unitId, ServerUnit* unit, double gameStep
     }
   }
   
-  // If the unit's goal has been updated, plan a path towards the goal.
+  // If the unit's goal has been updated, request a path towards the goal.
   if (unit->HasMoveToTarget() && !unit->HasPath()) {
-    PlanUnitPath(unit);
-    unitMovementChanged = true;
-  } else if (unit->HasMoveToTarget() && unit->GetTargetObjectId() != kInvalidObjectId) {
+    if (unit->GetPendingPathRequestId() == 0) {
+      RequestUnitPath(unitId, unit);
+    }
+  } else if (unit->HasMoveToTarget() && unit->GetTargetObjectId() != kInvalidObjectId && unit->GetPendingPathRequestId() == 0) {
     // Check whether we target a moving object. If yes and the target has moved too much,
     // re-plan our path to the target.
     auto targetIt = map->GetObjects().find(unit->GetTargetObjectId());
@@ -892,12 +1159,10 @@ void Game::SimulateGameStepForUnit(u32 unitId, ServerUnit* unit, double gameStep
     } else if (targetIt->second->isUnit()) {
       ServerUnit* targetUnit = AsUnit(targetIt->second);
       
-      constexpr float kReplanThresholdDistance = 0.1f * 0.1f;
       if (SquaredDistance(targetUnit->GetMapCoord(), unit->GetMoveToTargetMapCoord()) > kReplanThresholdDistance) {
-        // Since we keep the target here, there is no need to use SetUnitTargets() since the unit's type will never change.
-        unit->SetTarget(unit->GetTargetObjectId(), targetUnit, false);
-        PlanUnitPath(unit);
-        unitMovementChanged = true;
+        // Keep following the current path until the new one has been planned.
+        unit->UpdateMoveToTargetMapCoord(targetUnit->GetMapCoord());
+        RequestUnitPath(unitId, unit);
       }
     }
   }
@@ -922,7 +1187,7 @@ void Game::SimulateGameStepForUnit(u32 unitId, ServerUnit* unit, double gameStep
             InteractionType interaction = GetInteractionType(unit, targetBuilding);
             
             if (interaction == InteractionType::Construct) {
-              SimulateBuildingConstruction(stepLengthInSeconds, unit, targetObjectId, targetBuilding, &unitMovementChanged, &stayInPlace);
+              SimulateBuildingConstruction(unit, targetObjectId, targetBuilding, &unitMovementChanged, &stayInPlace);
             } else if (interaction == InteractionType::CollectBerries ||
                        interaction == InteractionType::CollectWood ||
                        interaction == InteractionType::CollectGold ||
@@ -948,256 +1213,287 @@ void Game::SimulateGameStepForUnit(u32 unitId, ServerUnit* unit, double gameStep
     }
     
     if (!stayInPlace && unit->HasPath()) {
-      // Test whether the current goal was reached.
-      QPointF toGoal = unit->GetNextPathTarget() - unit->GetMapCoord();
-      float squaredDistanceToGoal = SquaredLength(toGoal);
-      float directionDotToGoal =
-          unit->GetMovementDirection().x() * toGoal.x() +
-          unit->GetMovementDirection().y() * toGoal.y();
-      
-      if (squaredDistanceToGoal <= moveDistance * moveDistance || directionDotToGoal <= 0) {
-        // The goal was reached.
-        if (!map->DoesUnitCollide(unit, unit->GetNextPathTarget())) {
-          unit->SetMapCoord(unit->GetNextPathTarget());
-        }
-        
-        // Continue with the next part of the path if any, or stop if the path was completed.
-        unit->PathSegmentCompleted();
-        if (unit->HasPath()) {
-          // Continue with the next path segment.
-          // TODO: This is a duplicate of the code at the end of PlanUnitPath()
-          QPointF direction = unit->GetNextPathTarget() - unit->GetMapCoord();
-          direction = direction / std::max(1e-4f, Length(direction));
-          unit->SetMovementDirection(direction);
-        } else {
-          // Completed the path.
-          unit->StopMovement();
-        }
-        
+      UnitMovement movement;
+      PlanUnitMovement(*map, unit, stepLengthInSeconds, &movement);
+      if (ApplyUnitMovement(map.get(), unit, movement)) {
         unitMovementChanged = true;
-      } else {
-        // Move the unit if the path is free.
-        ServerUnit* collidingUnit;
-        if (map->DoesUnitCollide(unit, newMapCoord, &collidingUnit)) {
-          bool evaded = false;
-          if (collidingUnit != nullptr) {
-            // Try to evade the unit by moving alongside it.
-            QPointF evadeMapCoord;
-            if (TryEvadeUnit(unit, moveDistance, newMapCoord, collidingUnit, &evadeMapCoord) &&
-                !map->DoesUnitCollide(unit, evadeMapCoord, &collidingUnit)) {
-              // Successfully found a side step to avoid bumping into the other unit.
-              // Test whether this would still bring us closer to our goal.
-              if (SquaredDistance(unit->GetNextPathTarget(), evadeMapCoord) <
-                  SquaredDistance(unit->GetNextPathTarget(), unit->GetMapCoord())) {
-                // Use the evade step.
-                // Change our movement direction in order to still face the next path goal.
-                unit->SetMapCoord(evadeMapCoord);
-                
-                QPointF direction = unit->GetNextPathTarget() - unit->GetMapCoord();
-                direction = direction / std::max(1e-4f, Length(direction));
-                unit->SetMovementDirection(direction);
-                
-                if (unit->GetCurrentAction() != UnitAction::Moving) {
-                  unit->SetCurrentAction(UnitAction::Moving);
-                }
-                
-                unitMovementChanged = true;
-                evaded = true;
-              }
-            }
-          }
-          
-          if (!evaded && unit->GetCurrentAction() != UnitAction::Idle) {
-            unit->PauseMovement();
-            unitMovementChanged = true;
-          }
-        } else {
-          unit->SetMapCoord(newMapCoord);
-          
-          if (unit->GetCurrentAction() != UnitAction::Moving) {
-            unitMovementChanged = true;
-            unit->SetCurrentAction(UnitAction::Moving);
-          }
-        }
       }
     }
   }
   
   if (unitMovementChanged) {
-    // Notify all clients that see the unit about its new movement / animation.
-    for (usize playerIndex = 0; playerIndex < playersInGame->size(); ++ playerIndex) {
-      // TODO: Only do this if the player sees the unit.
-      
-      accumulatedMessages[playerIndex] +=
-          CreateUnitMovementMessage(
-              unitId,
-              unit->GetMapCoord(),
-              unit->GetMoveSpeed() * unit->GetMovementDirection(),
-              unit->GetCurrentAction());
-    }
+    SendUnitMovementMessage(unitId, unit);
   }
 }
 
-/// Tests whether the unit could walk from p0 to p1 (or vice versa) without colliding
-/// with a building. Notice that this function does not check whether the start and
-/// end points themselves are (fully) free, it only checks the space between them.
-bool Game::IsPathFree(float unitRadius, const QPointF& p0, const QPointF& p1, const QRect& openRect) {
-  // Obtain the points to the right and left of p0 and p1.
-  constexpr float kErrorEpsilon = 1e-3f;
-  
-  QPointF p0ToP1 = p1 - p0;
-  QPointF right(
-      -p0ToP1.y(),
-      p0ToP1.x());
-  right *= (unitRadius + kErrorEpsilon) / std::max(1e-4f, Length(right));
-  
-  QPointF p0Right = p0 + right;
-  QPointF p0Left = p0 - right;
-  QPointF p1Right = p1 + right;
-  QPointF p1Left = p1 - right;
-  
-  // Rasterize the polygon defined by all the points into the map grid.
-  int minRow = std::numeric_limits<int>::max();
-  int maxRow = 0;
-  std::vector<std::pair<int, int>> rowRanges(map->GetHeight(), std::make_pair(std::numeric_limits<int>::max(), 0));
-  
-  auto rasterize = [&](int x, int y) {
-    // For safety, clamp the coordinate to the map area.
-    x = std::max(0, std::min(map->GetWidth() - 1, x));
-    y = std::max(0, std::min(map->GetHeight() - 1, y));
-    
-    minRow = std::min(minRow, y);
-    maxRow = std::max(maxRow, y);
-    
-    auto& rowRange = rowRanges[y];
-    rowRange.first = std::min(rowRange.first, x);
-    rowRange.second = std::max(rowRange.second, x);
+void Game::ActivateUnit(u32 unitId, ServerUnit* unit) {
+  if (!unit->IsActive()) {
+    unit->SetActive(true);
+    activeUnitIds.push_back(unitId);
+  }
+}
+
+void Game::ComputeUnitStepIntents(float stepLengthInSeconds) {
+  const auto& objects = map->GetObjects();
+  unitStepIntents.resize(activeUnitIds.size());
+  unitStepIntentsUnitsVersion = map->GetUnitsVersion();
+  
+  auto computeIntents = [this, &objects, stepLengthInSeconds](usize begin, usize end) {
+    for (usize i = begin; i < end; ++ i) {
+      ServerUnit* unit = AsUnit(objects.find(activeUnitIds[i])->second);
+      ComputeUnitStepIntent(unit, stepLengthInSeconds, &unitStepIntents[i]);
+    }
   };
   
-  auto rasterizeLine = [&](const QPointF& start, const QPointF& end) {
-    QPointF cur = start;
-    QPointF remaining = end - start;
-    
-    int x = static_cast<int>(cur.x());
-    int y = static_cast<int>(cur.y());
-    
-    int endX = static_cast<int>(end.x());
-    int endY = static_cast<int>(end.y());
+  // Use more chunks than threads, since the cost per unit varies a lot.
+  usize chunkCount = 4 * simulationThreadPool->GetThreadCount();
+  usize chunkSize = (activeUnitIds.size() + chunkCount - 1) / chunkCount;
+  for (usize begin = 0; begin < activeUnitIds.size(); begin += chunkSize) {
+    usize end = std::min(activeUnitIds.size(), begin + chunkSize);
+    simulationThreadPool->Enqueue([computeIntents, begin, end]() { computeIntents(begin, end); });
+  }
+  simulationThreadPool->WaitForAll();
+}
+
+void Game::ComputeUnitStepIntent(ServerUnit* unit, float stepLengthInSeconds, UnitStepIntent* intent) {
+  // This mirrors SimulateGameStepForUnit(), but bails out as soon as the step would do anything
+  // other than moving the unit along its path (such as attacking, requesting a path, or interacting
+  // with its target), since these steps modify other objects or shared state.
+  const ServerMap& constMap = *map;
+  intent->isMovementOnly = false;
+  intent->hasMovement = false;
+  intent->targetUnitTile = QRect();
+  
+  if (unit->GetCurrentAction() == UnitAction::Attack) {
+    return;
+  }
+  
+  if (unit->HasMoveToTarget() && !unit->HasPath()) {
+    if (unit->GetPendingPathRequestId() == 0) {
+      return;
+    }
+  } else if (unit->HasMoveToTarget() && unit->GetTargetObjectId() != kInvalidObjectId && unit->GetPendingPathRequestId() == 0) {
+    auto targetIt = constMap.GetObjects().find(unit->GetTargetObjectId());
+    if (targetIt == constMap.GetObjects().end()) {
+      return;
+    } else if (targetIt->second->isUnit()) {
+      ServerUnit* targetUnit = AsUnit(targetIt->second);
+      if (SquaredDistance(targetUnit->GetMapCoord(), unit->GetMoveToTargetMapCoord()) > kReplanThresholdDistance) {
+        return;
+      }
+      intent->targetUnitTile = constMap.GetUnitTile(targetUnit->GetMapCoord());
+    }
+  }
+  
+  if (unit->GetMovementDirection() != QPointF(0, 0)) {
+    float moveDistance = unit->GetMoveSpeed() * stepLengthInSeconds;
     
-    int sx = (remaining.x() > 0) ? 1 : -1;
-    int sy = (remaining.y() > 0) ? 1 : -1;
+    QPointF newMapCoord = unit->GetMapCoord() + moveDistance * unit->GetMovementDirection();
     
-    while (true) {
-      rasterize(x, y);
-      
-      float fx = cur.x() - x;
-      float fy = cur.y() - y;
-      
-      float xToBorder = (sx > 0) ? (1 - fx) : fx;
-      float yToBorder = (sy > 0) ? (1 - fy) : fy;
-      
-      if (fabs(remaining.x()) <= xToBorder &&
-          fabs(remaining.y()) <= yToBorder) {
-        // The goal is in the current square.
-        break;
-      }
-      if ((endX - x) * sx <= 0 &&
-          (endY - y) * sy <= 0) {
-        // We somehow surpassed the end without noticing.
-        LOG(WARNING) << "Emergency exit.";
-        break;
+    u32 targetObjectId = unit->GetTargetObjectId();
+    if (targetObjectId != kInvalidObjectId) {
+      auto targetIt = constMap.GetObjects().find(targetObjectId);
+      if (targetIt == constMap.GetObjects().end()) {
+        return;
       }
-      
-      float diffX, diffY;
-      if (fabs(remaining.x()) / std::max<float>(1e-5f, fabs(remaining.y())) >
-          xToBorder / std::max(1e-5f, yToBorder)) {
-        // Go in x direction
-        if (sx > 0) {
-          // Go to the right.
-          diffX = - (1 - fx);
-        } else {
-          // Go to the left.
-          diffX = fx;
+      ServerObject* targetObject = targetIt->second;
+      if (targetObject->isBuilding()) {
+        if (DoesUnitTouchBuildingArea(unit, newMapCoord, AsBuilding(targetObject), 0)) {
+          return;
         }
-        diffY = remaining.y() * ((remaining.x() + diffX) / remaining.x() - 1);
-        x += sx;
-      } else {
-        // Go in y direction
-        if (sy > 0) {
-          // Go to the bottom.
-          diffY = - (1 - fy);
-        } else {
-          // Go to the top.
-          diffY = fy;
+      } else if (targetObject->isUnit()) {
+        ServerUnit* targetUnit = AsUnit(targetObject);
+        if (DoUnitsTouch(unit, newMapCoord, targetUnit, 0)) {
+          return;
         }
-        diffX = remaining.x() * ((remaining.y() + diffY) / remaining.y() - 1);
-        y += sy;
+        intent->targetUnitTile = constMap.GetUnitTile(targetUnit->GetMapCoord());
       }
-      
-      remaining.setX(remaining.x() + diffX);
-      remaining.setY(remaining.y() + diffY);
-      cur.setX(cur.x() - diffX);
-      cur.setY(cur.y() - diffY);
     }
-  };
-  
-  rasterizeLine(p0Right, p1Right);
-  rasterizeLine(p0Left, p1Left);
-  rasterizeLine(p0Right, p0Left);
-  rasterizeLine(p1Right, p1Left);
-  
-  // Test whether any tile within the boundaries of the rasterized area is occupied.
-  // If yes, the path is blocked.
-  constexpr bool kDebugRasterization = false;
-  constexpr const char* kDebugImagePath = "/tmp/FreeAge_pathFree_debug.png";
-  if (kDebugRasterization) {
-    QImage debugImage(map->GetWidth(), map->GetHeight(), QImage::Format_RGB32);
-    debugImage.fill(qRgb(255, 255, 255));
     
-    for (int row = minRow; row <= maxRow; ++ row) {
-      auto& rowRange = rowRanges[row];
-      for (int col = rowRange.first; col <= rowRange.second; ++ col) {
-        if (map->occupiedForUnitsAt(col, row) && !openRect.contains(col, row, false)) {
-          debugImage.setPixelColor(col, row, qRgb(255, 0, 0));
-        } else {
-          debugImage.setPixelColor(col, row, qRgb(0, 255, 0));
-        }
-      }
+    if (unit->HasPath()) {
+      intent->hasMovement = true;
+      PlanUnitMovement(constMap, unit, stepLengthInSeconds, &intent->movement);
     }
-    
-    LOG(WARNING) << "Saving IsPathFree() debug image to " << kDebugImagePath;
-    debugImage.save(kDebugImagePath);
-    
-    char dummy;
-    std::cin >> dummy;
   }
   
-  for (int row = minRow; row <= maxRow; ++ row) {
-    auto& rowRange = rowRanges[row];
-    for (int col = rowRange.first; col <= rowRange.second; ++ col) {
-      if (map->occupiedForUnitsAt(col, row) && !openRect.contains(col, row, false)) {
-        return false;
+  intent->isMovementOnly = true;
+}
+
+bool Game::TryCommitUnitStepIntent(u32 unitId, ServerUnit* unit, const UnitStepIntent& intent) {
+  if (!intent.isMovementOnly ||
+      map->HaveUnitsChangedSince(intent.targetUnitTile, unitStepIntentsUnitsVersion) ||
+      (intent.hasMovement && !IsUnitMovementUpToDate(*map, intent.movement))) {
+    return false;
+  }
+  
+  if (intent.hasMovement && ApplyUnitMovement(map.get(), unit, intent.movement)) {
+    SendUnitMovementMessage(unitId, unit);
+  }
+  return true;
+}
+
+void Game::SendUnitMovementMessage(u32 unitId, ServerUnit* unit) {
+  // Notify all clients that see the unit about its new movement / animation.
+  // The start point is sent relative to the previous one, which all of these clients know.
+  QPoint coord = QuantizeUnitMovementCoord(unit->GetMapCoord());
+  QPoint coordDelta = coord - unit->GetMovementReferenceCoord();
+  for (usize playerIndex = 0; playerIndex < playersInGame->size(); ++ playerIndex) {
+    if (unit->IsVisibleToPlayer(playerIndex)) {
+      AppendUnitMovement(playerIndex, unitId, unit, coordDelta);
+    }
+  }
+  unit->SetMovementReferenceCoord(coord);
+}
+
+void Game::AppendUnitMovement(usize playerIndex, u32 unitId, ServerUnit* unit, const QPoint& coordDelta) {
+  AppendUnitMovementBatchEntry(
+      &accumulatedMessages[playerIndex],
+      &movementBatchOffsets[playerIndex],
+      unitId,
+      coordDelta,
+      unit->GetMoveSpeed() * unit->GetMovementDirection(),
+      unit->GetCurrentAction());
+}
+
+void Game::SendToPlayersThatSee(ServerUnit* unit, const MessageWriter& msg) {
+  for (usize playerIndex = 0; playerIndex < playersInGame->size(); ++ playerIndex) {
+    if (unit->IsVisibleToPlayer(playerIndex)) {
+      accumulatedMessages[playerIndex].Append(msg);
+    }
+  }
+}
+
+void Game::UpdateFieldOfView(ServerObject* object) {
+  // Determine the object's current field of view, in the same way as the client does.
+  QPointF center(0, 0);
+  float radius = 0;
+  if (object->GetPlayerIndex() != kGaiaPlayerIndex) {
+    if (object->isUnit()) {
+      ServerUnit* unit = AsUnit(object);
+      QPoint tile = GetTileOfMapCoord(unit->GetMapCoord());
+      center = QPointF(tile.x() + 0.5f, tile.y() + 0.5f);
+      radius = GetUnitLineOfSight(unit->GetUnitType());
+    } else if (object->isBuilding()) {
+      ServerBuilding* building = AsBuilding(object);
+      if (building->GetBuildPercentage() == 100) {
+        QSize buildingSize = GetBuildingSize(building->GetBuildingType());
+        center = QPointF(building->GetBaseTile().x() + 0.5f * buildingSize.width(),
+                         building->GetBaseTile().y() + 0.5f * buildingSize.height());
+        radius = GetBuildingLineOfSight(building->GetBuildingType());
       }
     }
   }
   
-  return true;
+  if (center == object->GetFieldOfViewCenter() && radius == object->GetFieldOfViewRadius()) {
+    return;
+  }
+  
+  RemoveFieldOfView(object);
+  if (radius > 0) {
+    playerVisibility[object->GetPlayerIndex()].UpdateFieldOfView(center.x(), center.y(), radius, 1);
+  }
+  object->SetFieldOfView(center, radius);
+}
+
+void Game::RemoveFieldOfView(ServerObject* object) {
+  if (object->GetFieldOfViewRadius() > 0) {
+    const QPointF& center = object->GetFieldOfViewCenter();
+    playerVisibility[object->GetPlayerIndex()].UpdateFieldOfView(center.x(), center.y(), object->GetFieldOfViewRadius(), -1);
+  }
+  object->SetFieldOfView(QPointF(0, 0), 0);
 }
 
-void Game::PlanUnitPath(ServerUnit* unit) {
-  constexpr bool kOutputPathfindingDebugMessages = false;
+u32 Game::ComputeVisibleToPlayers(ServerUnit* unit) {
+  QPoint tile = GetTileOfMapCoord(unit->GetMapCoord());
   
-  Timer pathPlanningTimer;
+  u32 mask = 0;
+  for (usize playerIndex = 0; playerIndex < playerVisibility.size(); ++ playerIndex) {
+    if (static_cast<int>(playerIndex) == unit->GetPlayerIndex() ||
+        playerVisibility[playerIndex].IsTileVisible(tile.x(), tile.y())) {
+      mask |= 1u << playerIndex;
+    }
+  }
+  return mask;
+}
+
+void Game::UpdateVisibleToPlayers(ServerUnit* unit) {
+  u32 oldMask = unit->GetVisibleToPlayers();
+  u32 newMask = ComputeVisibleToPlayers(unit);
+  if (newMask == oldMask) {
+    return;
+  }
+  unit->SetVisibleToPlayers(newMask);
   
-  typedef float CostT;
+  // Players that start seeing the unit get to know about its current state, since they did not
+  // receive any updates for it while it was out of view. Players that stop seeing it remove it.
+  // The clients that keep seeing the unit get its current position too, such that all clients
+  // that see it have the same movement reference coord afterwards.
+  u32 enteringPlayers = newMask & ~oldMask;
+  QPoint coord = QuantizeUnitMovementCoord(unit->GetMapCoord());
+  QPoint coordDelta = coord - unit->GetMovementReferenceCoord();
+  sharedMessage.Clear();
+  for (usize playerIndex = 0; playerIndex < playersInGame->size(); ++ playerIndex) {
+    u32 playerBit = 1u << playerIndex;
+    if (enteringPlayers & playerBit) {
+      if (sharedMessage.IsEmpty()) {
+        WriteAddObjectMessage(&sharedMessage, unit->GetId(), unit);
+      }
+      accumulatedMessages[playerIndex].Append(sharedMessage);
+      AppendUnitMovement(playerIndex, unit->GetId(), unit, QPoint(0, 0));
+    } else if (enteringPlayers && (newMask & playerBit)) {
+      AppendUnitMovement(playerIndex, unit->GetId(), unit, coordDelta);
+    } else if (!(newMask & playerBit) && (oldMask & playerBit)) {
+      WriteObjectLeaveViewMessage(&accumulatedMessages[playerIndex], unit->GetId());
+    }
+  }
+  if (enteringPlayers) {
+    unit->SetMovementReferenceCoord(coord);
+  }
+}
+
+void Game::UpdateVisibility() {
+  // Only active units can move or change their line of sight (by changing their type).
+  auto& objects = map->GetObjects();
+  for (u32 unitId : activeUnitIds) {
+    auto it = objects.find(unitId);
+    if (it != objects.end()) {
+      UpdateFieldOfView(it->second);
+    }
+  }
   
-  int mapWidth = map->GetWidth();
-  int mapHeight = map->GetHeight();
+  // Units only change their visibility if they move, or if the visibility of their tile changes.
+  for (u32 unitId : activeUnitIds) {
+    auto it = objects.find(unitId);
+    if (it != objects.end()) {
+      UpdateVisibleToPlayers(AsUnit(it->second));
+    }
+  }
   
+  for (PlayerVisibility& visibility : playerVisibility) {
+    for (int tileIndex : visibility.GetChangedTiles()) {
+      int x = tileIndex % visibility.GetWidth();
+      int y = tileIndex / visibility.GetWidth();
+      map->ForEachUnitInArea(x, y, x + 1, y + 1, [&](ServerUnit* unit) {
+        // The active units were handled above.
+        if (!unit->IsActive() && GetTileOfMapCoord(unit->GetMapCoord()) == QPoint(x, y)) {
+          UpdateVisibleToPlayers(unit);
+        }
+        return true;
+      });
+    }
+    visibility.ClearChangedTiles();
+  }
+}
+
+QPoint Game::GetTileOfMapCoord(const QPointF& mapCoord) {
+  return QPoint(
+      std::max(0, std::min(map->GetWidth() - 1, static_cast<int>(mapCoord.x()))),
+      std::max(0, std::min(map->GetHeight() - 1, static_cast<int>(mapCoord.y()))));
+}
+
+void Game::RequestUnitPath(u32 unitId, ServerUnit* unit) {
   // Determine the tile that the unit stands on. This will be the start tile.
-  QPoint start(
-      std::max(0, std::min(mapWidth - 1, static_cast<int>(unit->GetMapCoord().x()))),
-      std::max(0, std::min(mapHeight - 1, static_cast<int>(unit->GetMapCoord().y()))));
+  QPoint start = GetTileOfMapCoord(unit->GetMapCoord());
   
   // Determine the goal tiles and treat them as open even if they are occupied.
   // This is done for the tiles taken up by the unit's target.
@@ -1217,330 +1513,70 @@ void Game::PlanUnitPath(ServerUnit* unit) {
     }
   }
   if (goalRect.isNull()) {
-    goalRect = QRect(
-        std::max(0, std::min(mapWidth - 1, static_cast<int>(unit->GetMoveToTargetMapCoord().x()))),
-        std::max(0, std::min(mapHeight - 1, static_cast<int>(unit->GetMoveToTargetMapCoord().y()))),
-        1,
-        1);
-  }
-  
-  // Use A* to plan a path from the start to the goal tile.
-  // * Treat unit-occupied tiles as obstacles.
-  // * Treat tiles that are occupied by the unit's target building (if any) as free,
-  //   such that the algorithm can plan a path "into" the goal.
-  // * If the goal is not reachable, return the path that leads to the reachable
-  //   position that is closest to the goal.
-  struct Location {
-    QPoint loc;
-    float priority;
-    
-    inline Location(const QPoint& loc, float priority)
-        : loc(loc),
-          priority(priority) {}
-    
-    inline bool operator> (const Location& other) const {
-      return priority > other.priority;
-    }
-  };
-  
-  std::priority_queue<Location, std::vector<Location>, std::greater<Location>> priorityQueue;
-  
-  priorityQueue.emplace(start, 0.f);
-  
-  std::vector<CostT> costSoFar(mapWidth * mapHeight);
-  // TODO: Perhaps some potential overhead of this may be reduced by doing a memset() to zero instead,
-  //       using "negative zero" for the start node, and later comparing to "positive zero" as a special case using std::signbit()?
-  std::fill(std::begin(costSoFar), std::end(costSoFar), std::numeric_limits<float>::infinity());
-  costSoFar[start.x() + mapWidth * start.y()] = 0;
-  
-  // Directions are encoded as row-major indices of grid cells in a 4x4 grid,
-  // with (1, 1) being the origin of movement. A 3x3 grid would suffice,
-  // however, with a 4x4 grid, computations are faster. So, for example,
-  // the value 0 corresponds to cell (0, 0) in the grid, which has an offset of (-1, -1)
-  // from the movement origin. So, the movement came from (-1, -1).
-  // Second example: The value 4 corresponds to cell (0, 1) with movement (-1, 0).
-  // The value 5 corresponds to zero movement, this is used for the start and for initialization.
-  constexpr u8 cameFromUninitializedValue = 5;
-  std::vector<u8> cameFrom(mapWidth * mapHeight);
-  memset(cameFrom.data(), cameFromUninitializedValue, mapWidth * mapHeight);
-  
-  CostT smallestReachedHeuristicValue = std::numeric_limits<CostT>::max();
-  QPoint smallestReachedHeuristicTile(-1, -1);
-  
-  static int numNeighborsToCheckArray[11] = {
-    3,
-    7,
-    3,
-    0,  // no valid direction
-    7,
-    8,
-    7,
-    0,  // no valid direction
-    3,
-    7,
-    3,
-  };
-  static QPoint neighborsToCheckArray[11][8] = {
-    {QPoint(1, 0), QPoint(0, 1), /*dependent on previous being free*/ QPoint(1, 1)},
-    {QPoint(0, 1), /*occ. test*/ QPoint(1, -1), QPoint(1, 0), QPoint(1, 1), /*occ. test*/ QPoint(-1, -1), QPoint(-1, 0), QPoint(-1, 1)},
-    {QPoint(-1, 0), QPoint(0, 1), /*dependent on previous being free*/ QPoint(-1, 1)},
-    {},
-    {QPoint(1, 0), /*occ. test*/ QPoint(-1, -1), QPoint(0, -1), QPoint(1, -1), /*occ. test*/ QPoint(-1, 1), QPoint(0, 1), QPoint(1, 1)},
-    {QPoint(0, -1), QPoint(-1, 0), QPoint(1, 0), QPoint(0, 1), QPoint(1, 1), QPoint(-1, -1), QPoint(1, -1), QPoint(-1, 1)},
-    {QPoint(-1, 0), /*occ. test*/ QPoint(1, -1), QPoint(0, -1), QPoint(-1, -1), /*occ. test*/ QPoint(1, 1), QPoint(0, 1), QPoint(-1, 1)},
-    {},
-    {QPoint(0, -1), QPoint(1, 0), /*dependent on previous being free*/ QPoint(1, -1)},
-    {QPoint(0, -1), /*occ. test*/ QPoint(1, 1), QPoint(1, 0), QPoint(1, -1), /*occ. test*/ QPoint(-1, 1), QPoint(-1, 0), QPoint(-1, -1)},
-    {QPoint(-1, 0), QPoint(0, -1), /*dependent on previous being free*/ QPoint(-1, -1)},
-  };
-  // Here we encode that diagonal movements require the two adjacent tiles to be free.
-  static u8 neighborsRequireFreeTiles[11][8] = {
-    {0, 0, 0b11},
-    {0, /*occ. test*/ 0, 0, 0b101, /*occ. test*/ 0, 0, 0b100001},
-    {0, 0, 0b11},
-    {},
-    {0, /*occ. test*/ 0, 0, 0b101, /*occ. test*/ 0, 0, 0b100001},
-    {0, 0, 0, 0, 0b1100, 0b0011, 0b0101, 0b1010},
-    {0, /*occ. test*/ 0, 0, 0b101, /*occ. test*/ 0, 0, 0b100001},
-    {},
-    {0, 0, 0b11},
-    {0, /*occ. test*/ 0, 0, 0b101, /*occ. test*/ 0, 0, 0b100001},
-    {0, 0, 0b11},
-  };
-  
-  int debugConsideredNodesCount = 0;
-  
-  // Set this to true to have a debug image written to /tmp/FreeAge_pathfinding_debug.png.
-  // Legend:
-  // * Black: Occupied tiles.
-  // * Dark green: open rect.
-  // * White: Free tiles, never considered by pathfinding.
-  // * Light red: Free tiles, considered by pathfinding.
-  // * Light yellow: Free tiles, added to the priority queue as a neighbor but not directly considered.
-  // * Green: Free tiles that are part of the final path.
-  constexpr bool kOutputDebugImage = false;
-  constexpr const char* kDebugImagePath = "/tmp/FreeAge_pathfinding_debug.png";
-  QImage debugImage;
-  if (kOutputDebugImage) {
-    debugImage = QImage(mapWidth, mapHeight, QImage::Format_RGB32);
-    for (int y = 0; y < mapHeight; ++ y) {
-      for (int x = 0; x < mapWidth; ++ x) {
-        if (map->occupiedForUnitsAt(x, y)) {
-          debugImage.setPixel(x, y, qRgb(0, 0, 0));
-        } else {
-          debugImage.setPixel(x, y, qRgb(255, 255, 255));
-        }
-      }
-    }
-    for (int y = goalRect.y(); y < goalRect.bottom(); ++ y) {
-      for (int x = goalRect.x(); x < goalRect.right(); ++ x) {
-        debugImage.setPixel(x, y, qRgb(0, 100, 0));
-      }
-    }
-  }
+    goalRect = QRect(GetTileOfMapCoord(unit->GetMoveToTargetMapCoord()), QSize(1, 1));
+  }
+  
+  u32 requestId = pathRequestScheduler.RequestPath(
+      unitId,
+      GetUnitRadius(unit->GetUnitType()),
+      unit->GetMapCoord(),
+      start,
+      goalRect,
+      unit->GetMoveToTargetMapCoord(),
+      unit->GetFlowField());
+  unit->SetPendingPathRequestId(requestId);
+}
+
+void Game::ApplyPlannedPaths() {
+  pathRequestScheduler.TakeResults(gameStepCount, &plannedPaths);
   
-  QPoint reachedGoalTile(-1, -1);
-  while (!priorityQueue.empty()) {
-    Location current = priorityQueue.top();
-    priorityQueue.pop();
-    
-    ++ debugConsideredNodesCount;
-    if (kOutputDebugImage) {
-      debugImage.setPixel(current.loc.x(), current.loc.y(), qRgb(255, 127, 127));
+  for (const PathResult& result : plannedPaths) {
+    auto unitIt = map->GetObjects().find(result.unitId);
+    if (unitIt == map->GetObjects().end()) {
+      // The unit has been deleted in the meantime.
+      continue;
     }
-    
-    if (goalRect.contains(current.loc, false)) {
-      reachedGoalTile = current.loc;
-      break;
+    ServerUnit* unit = AsUnit(unitIt->second);
+    if (unit->GetPendingPathRequestId() != result.requestId) {
+      // The unit has been given another command in the meantime.
+      continue;
     }
+    unit->SetPendingPathRequestId(0);
     
-    int currentGridIndex = current.loc.x() + mapWidth * current.loc.y();
-    CostT currentCost = costSoFar[currentGridIndex];
-    int currentCameFrom = cameFrom[currentGridIndex];
-    
-    int numNeighborsToCheck = numNeighborsToCheckArray[currentCameFrom];
-    QPoint* neighbors = neighborsToCheckArray[currentCameFrom];
-    u8 freeNeighbors = 0;  // bitmask with a 1 for each free neighbor
-    
-    for (int neighborIdx = 0; neighborIdx < numNeighborsToCheck; ++ neighborIdx) {
-      QPoint neighborDir = neighbors[neighborIdx];
-      QPoint nextTile = current.loc + neighborDir;
-      int nextGridIndex = nextTile.x() + mapWidth * nextTile.y();
-      
-      // Special case:
-      // For straight movements, numNeighborsToCheck is 7. It contains two sets of directions preceded by an occupancy check.
-      // This means that we only consider those directions if the occupancy-checked tile is occupied.
-      // The occupancy check is at neighbor indices 1 and 4 and each applies to the two following neighbors.
-      int skipLenght = 0;
-      if (numNeighborsToCheck == 7 &&
-          (neighborIdx == 1 || neighborIdx == 4)) {
-        // This neighbor is an occupancy check. If it is occupied, we need to consider the following
-        // two neighbors, otherwise we can skip them.
-        skipLenght = 2;
-      } else {
-        u8 requiredFreeNeighbors = neighborsRequireFreeTiles[currentCameFrom][neighborIdx];
-        if ((freeNeighbors & requiredFreeNeighbors) != requiredFreeNeighbors) {
-          // The required previous free neighbors are not free.
-          continue;
-        }
-      }
-      
-      // Skip neighbor if it is outside of the map.
-      if (nextTile.x() < 0 || nextTile.y() < 0 ||
-          nextTile.x() >= mapWidth || nextTile.y() >= mapHeight) {
-        neighborIdx += skipLenght;
-        continue;
-      }
-      // Skip neighbor if it is occupied.
-      if (map->occupiedForUnitsAt(nextTile.x(), nextTile.y()) && !goalRect.contains(nextTile, false)) {
-        // Continue while not skipping over possible neighbors depending on this as an occupancy check (since the check returned true).
-        continue;
-      }
-      
-      freeNeighbors |= 1 << neighborIdx;
-      
-      // Skip this if it is a failed occupancy check (instead of an actual neighbor).
-      if (skipLenght > 0) {
-        // If this was an occupancy check, but the tile is free, continue while skipping over the dependent neighbors.
-        neighborIdx += skipLenght;
-        continue;
-      }
-      
-      // Compute the cost to reach this neighbor from the start.
-      constexpr float sqrt2 = 1.41421356237310f;
-      CostT newCost = currentCost + ((neighborDir.manhattanLength() == 2) ? sqrt2 : 1);
-      
-      // If the cost is better than the best cost known so far, expand the path to this neighbor.
-      CostT* nextCostSoFar = &costSoFar[nextGridIndex];
-      if (newCost < *nextCostSoFar) {
-        *nextCostSoFar = newCost;
-        
-        // Compute the "diagonal distance" as a heuristic for the remaining path length to the goal.
-        // This is a distance metric on the grid while allowing diagonal movements.
-        int goalX = std::max(goalRect.x(), std::min(goalRect.x() + goalRect.width() - 1, nextTile.x()));
-        int goalY = std::max(goalRect.y(), std::min(goalRect.y() + goalRect.height() - 1, nextTile.y()));
-        int xDiff = std::abs(nextTile.x() - goalX);
-        int yDiff = std::abs(nextTile.y() - goalY);
-        int minDiff = std::min(xDiff, yDiff);
-        int maxDiff = std::max(xDiff, yDiff);
-        CostT heuristic = minDiff * sqrt2 + (maxDiff - minDiff) * 1;
-        
-        // Remember the closest tile to the goal that we found. This becomes important
-        // in case we cannot reach the goal at all.
-        if (heuristic < smallestReachedHeuristicValue) {
-          smallestReachedHeuristicValue = heuristic;
-          smallestReachedHeuristicTile = nextTile;
-        }
-        
-        priorityQueue.emplace(nextTile, newCost + heuristic);
-        cameFrom[nextGridIndex] = ((-neighborDir.x()) + 1) + 4 * ((-neighborDir.y()) + 1);
-        
-        if (kOutputDebugImage) {
-          debugImage.setPixel(nextTile.x(), nextTile.y(), qRgb(255, 255, 127));
-        }
-      }
-    }
-  }
-  
-  if (kOutputPathfindingDebugMessages) {
-    LOG(1) << "Pathfinding: considered " << debugConsideredNodesCount << " nodes (max possible: " << (mapWidth * mapHeight) << ")";
-  }
-  
-  // Did we find a path to the goal or only to some other tile that is close to the goal?
-  QPoint targetTile;
-  if (reachedGoalTile.x() < 0) {
-    // No path to the goal was found. Go to the reachable node that is closest to the goal.
-    if (smallestReachedHeuristicTile.x() >= 0) {
-      if (kOutputPathfindingDebugMessages) {
-        LOG(1) << "Pathfinding: Goal not reached; going as close as possible";
-      }
-      targetTile = smallestReachedHeuristicTile;
-    } else {
-      if (kOutputPathfindingDebugMessages) {
-        LOG(1) << "Pathfinding: Goal not reached and there is no better tile than the initial one. Stopping.";
-      }
+    if (!result.success) {
       unit->StopMovement();
+    } else {
+      SetUnitPath(unit, result.reversePath);
     }
-  } else {
-    if (kOutputPathfindingDebugMessages) {
-      LOG(1) << "Pathfinding: Goal reached";
-    }
-    targetTile = reachedGoalTile;
-  }
-  
-  // Reconstruct the path, tracking back from "targetTile" using "cameFrom".
-  // We leave out the start tile since the unit is already within that tile.
-  std::vector<QPointF> reversePath;
-  QPoint currentTile = targetTile;
-  while (currentTile != start) {
-    reversePath.push_back(QPointF(currentTile.x() + 0.5f, currentTile.y() + 0.5f));
-    
-    if (kOutputDebugImage) {
-      debugImage.setPixel(currentTile.x(), currentTile.y(), qRgb(0, 255, 0));
-    }
-    
-    int cameFromDirection = cameFrom[currentTile.x() + mapWidth * currentTile.y()];
-    if (cameFromDirection >= 11 || numNeighborsToCheckArray[cameFromDirection] == 0 || cameFromDirection == 5) {
-      LOG(ERROR) << "Erroneous value in cameFrom[] while reconstructing path: " << cameFromDirection;
-      break;
-    }
-    
-    int cameFromX = (cameFromDirection % 4) - 1;
-    currentTile.setX(currentTile.x() + cameFromX);
     
-    int cameFromY = (cameFromDirection / 4) - 1;
-    currentTile.setY(currentTile.y() + cameFromY);
+    SendUnitMovementMessage(result.unitId, unit);
   }
-  if (kOutputDebugImage) {
-    debugImage.setPixel(start.x(), start.y(), qRgb(0, 255, 0));
-    
-    LOG(WARNING) << "Writing pathfinding debug image to: " << kDebugImagePath;
-    debugImage.save(kDebugImagePath);
-  }
-  
-  // Replace the last point with the exact goal location (if we can reach the goal)
-  // TODO: If we can't reach the goal, maybe append a point here that makes the unit walk into the obstacle?
-  if (reachedGoalTile.x() >= 0) {
-    if (reversePath.empty()) {
-      reversePath.push_back(unit->GetMoveToTargetMapCoord());
-    } else if (goalRect.width() == 1 && goalRect.height() == 1) {
-      reversePath[0] = unit->GetMoveToTargetMapCoord();
+}
+
+std::shared_ptr<FlowField> Game::GetOrCreateFlowField(const QPoint& goalTile) {
+  std::shared_ptr<FlowField> result;
+  for (usize i = 0; i < flowFields.size(); ) {
+    std::shared_ptr<FlowField> flowField = flowFields[i].lock();
+    if (!flowField) {
+      // No unit uses this flow field anymore.
+      flowFields.erase(flowFields.begin() + i);
+      continue;
     }
-  }
-  
-  if (kOutputPathfindingDebugMessages) {
-    LOG(1) << "Pathfinding: Non-smoothed path length is " << reversePath.size();
-  }
-  
-  // Smooth the planned path by attempting to drop corners.
-  float unitRadius = GetUnitRadius(unit->GetUnitType());
-  for (usize i = 1; i < reversePath.size(); ++ i) {
-    const QPointF& p0 = (i == reversePath.size() - 1) ? unit->GetMapCoord() : reversePath[i + 1];
-    const QPointF& p1 = reversePath[i - 1];
-    
-    if (IsPathFree(unitRadius, p0, p1, goalRect)) {
-      reversePath.erase(reversePath.begin() + i);
-      -- i;
+    if (flowField->GetGoalTile() == goalTile) {
+      result = flowField;
     }
+    ++ i;
   }
   
-  if (kOutputPathfindingDebugMessages) {
-    LOG(1) << "Pathfinding: Smoothed path length is " << reversePath.size();
-    LOG(1) << "Pathfinding: Took " << pathPlanningTimer.Stop(false) << " s" << (kOutputDebugImage ? " (not accurate since kOutputDebugImage is true!)" : "");
+  if (!result) {
+    result = std::make_shared<FlowField>(goalTile);
+    flowFields.push_back(result);
   }
-  
-  // Assign the path to the unit.
-  unit->SetPath(reversePath);
-  
-  // Start traversing the path:
-  // Set the unit's movement direction to the first segment of the path.
-  QPointF direction = unit->GetNextPathTarget() - unit->GetMapCoord();
-  direction = direction / std::max(1e-4f, Length(direction));
-  unit->SetMovementDirection(direction);
+  return result;
 }
 
-void Game::SimulateBuildingConstruction(float stepLengthInSeconds, ServerUnit* villager, u32 targetObjectId, ServerBuilding* targetBuilding, bool* unitMovementChanged, bool* stayInPlace) {
-  // Special case for the start: If the foundation has 0 percent build progress,
+void Game::SimulateBuildingConstruction(ServerUnit* villager, u32 targetObjectId, ServerBuilding* targetBuilding, bool* unitMovementChanged, bool* stayInPlace) {
+  // Special case for the start: If the construction of the foundation has not started yet,
   // we must first verify that the foundation space is free. If yes:
   // * Add the foundation's occupancy to the map.
   // * Tell all clients that observe the foundation about it (except the client which
@@ -1549,18 +1585,20 @@ void Game::SimulateBuildingConstruction(float stepLengthInSeconds, ServerUnit* v
   // TODO: In the latter case, if only allied units obstruct the foundation, we should first
   //       try to make these units move off of the foudation. Only if this fails then the construction should halt.
   bool canConstruct = true;
-  if (targetBuilding->GetBuildPercentage() == 0) {
+  if (!targetBuilding->HasConstructionStarted()) {
     if (IsFoundationFree(targetBuilding, map.get())) {
       // Add the foundation's occupancy to the map.
       // TODO: The foundation's occupancy may differ from the final building's occupancy, e.g., for town centers. Handle this case properly.
       map->AddBuildingOccupancy(targetBuilding);
+      targetBuilding->SetConstructionStarted();
       
       // Tell all clients that observe the foundation about it (except the client which
       // is constructing it, which already knows it).
-      QByteArray addObjectMsg = CreateAddObjectMessage(targetObjectId, targetBuilding);
+      sharedMessage.Clear();
+      WriteAddObjectMessage(&sharedMessage, targetObjectId, targetBuilding);
       for (auto& player : *playersInGame) {
         if (player->index != targetBuilding->GetPlayerIndex()) {
-          accumulatedMessages[player->index] += addObjectMsg;
+          accumulatedMessages[player->index].Append(sharedMessage);
         }
       }
     } else {
@@ -1574,37 +1612,14 @@ void Game::SimulateBuildingConstruction(float stepLengthInSeconds, ServerUnit* v
     }
   }
   
-  // Add progress to the construction.
-  // TODO: In the original game, two villagers building does not result in twice the speed. Account for this.
+  // Count the villager as a builder in this game step. The construction progress is only
+  // added by UpdateConstructions() at the end of the game step, depending on the number of builders.
   if (canConstruct) {
-    double constructionTime = GetBuildingConstructionTime(targetBuilding->GetBuildingType());
-    double constructionStepAmount = stepLengthInSeconds / constructionTime;
-    
-    double newPercentage = std::min<double>(100, targetBuilding->GetBuildPercentage() + 100 * constructionStepAmount);
-    if (newPercentage == 100 && targetBuilding->GetBuildPercentage() != 100) {
-      // Building completed.
-      if (targetBuilding->GetPlayerIndex() != kGaiaPlayerIndex) {
-        playersInGame->at(targetBuilding->GetPlayerIndex())->availablePopulationSpace += GetBuildingProvidedPopulationSpace(targetBuilding->GetBuildingType());
-      }
-    }
-    targetBuilding->SetBuildPercentage(newPercentage);
-    
-    // Tell all clients that see the building about the new build percentage.
-    // TODO: Group those updates together for each frame (together with the build speed handling in case multiple villagers are building at the same time)
-    QByteArray msg = CreateBuildPercentageUpdateMessage(targetObjectId, targetBuilding->GetBuildPercentage());
-    for (auto& player : *playersInGame) {
-      accumulatedMessages[player->index] += msg;
-    }
-    
-    u32 maxHP = GetBuildingMaxHP(targetBuilding->GetBuildingType());
-    double addedHP = constructionStepAmount * maxHP;
-    targetBuilding->SetHP(std::min<float>(targetBuilding->GetHPInternalFloat() + addedHP, maxHP));
-    
-    // TODO: Would it make sense to batch these together in case there are multiple updates to an object's HP in the same time step?
-    QByteArray msg2 = CreateHPUpdateMessage(targetObjectId, targetBuilding->GetHP());
-    for (auto& player : *playersInGame) {
-      accumulatedMessages[player->index] += msg2;
+    if (!targetBuilding->IsInConstructionList()) {
+      targetBuilding->SetInConstructionList(true);
+      constructionList.push_back(targetObjectId);
     }
+    targetBuilding->AddBuilderInCurrentStep();
     
     if (villager->GetCurrentAction() != UnitAction::Task) {
       *unitMovementChanged = true;
@@ -1657,39 +1672,15 @@ void Game::SimulateResourceGathering(float stepLengthInSeconds, u32 villagerId,
   
   if (resourcesDropped || currentIntegerAmount != previousIntegerAmount) {
     // Notify the client that owns the villager about its new carry amount
-    accumulatedMessages[villager->GetPlayerIndex()] += CreateSetCarriedResourcesMessage(villagerId, gatheredType, currentIntegerAmount);
+    WriteSetCarriedResourcesMessage(&accumulatedMessages[villager->GetPlayerIndex()], villagerId, gatheredType, currentIntegerAmount);
   }
   
   // Make the villager target a resource drop-off point if its carrying capacity is reached.
   if (villager->GetCarriedResourceAmount() == carryCapacity) {
-    // TODO: Speed up this search?
-    float bestSquaredDistance = std::numeric_limits<float>::infinity();
-    u32 bestDropOffPointId;
-    ServerBuilding* bestDropOffPoint = nullptr;
-    
-    for (auto& item : map->GetObjects()) {
-      if (item.second->GetPlayerIndex() == villager->GetPlayerIndex() &&
-          item.second->isBuilding()) {
-        ServerBuilding* candidateDropOffPoint = AsBuilding(item.second);
-        if (IsDropOffPointForResource(candidateDropOffPoint->GetBuildingType(), villager->GetCarriedResourceType())) {
-          // TODO: Improve the distance computation. Ideally we would use the distance that the
-          //       villager has to walk to the edge of the building, not the straight-line distance to its center.
-          QSize candidateSize = GetBuildingSize(candidateDropOffPoint->GetBuildingType());
-          QPointF candidateCenter = candidateDropOffPoint->GetBaseTile() + 0.5f * QPointF(candidateSize.width(), candidateSize.height());
-          
-          float squaredDistance = SquaredDistance(candidateCenter, villager->GetMapCoord());
-          
-          if (squaredDistance < bestSquaredDistance) {
-            bestSquaredDistance = squaredDistance;
-            bestDropOffPoint = candidateDropOffPoint;
-            bestDropOffPointId = item.first;
-          }
-        }
-      }
-    }
-    
-    if (bestDropOffPoint) {
-      SetUnitTargets({villagerId}, villager->GetPlayerIndex(), bestDropOffPointId, bestDropOffPoint, false);
+    u32 dropOffPointId;
+    if (dropOffPoints[villager->GetPlayerIndex()][static_cast<int>(villager->GetCarriedResourceType())].FindClosest(villager->GetMapCoord(), &dropOffPointId)) {
+      ServerObject* dropOffPoint = map->GetObjects().find(dropOffPointId)->second;
+      SetUnitTargets({villagerId}, villager->GetPlayerIndex(), dropOffPointId, dropOffPoint, false);
     } else {
       // TODO: Should we explicitly stop the gathering action here?
     }
@@ -1708,7 +1699,7 @@ void Game::SimulateResourceDropOff(u32 villagerId, ServerUnit* villager, bool* u
   (*playersInGame)[villager->GetPlayerIndex()]->resources.Add(amount);
   
   villager->SetCarriedResourceAmount(0);
-  accumulatedMessages[villager->GetPlayerIndex()] += CreateSetCarriedResourcesMessage(villagerId, villager->GetCarriedResourceType(), 0);
+  WriteSetCarriedResourcesMessage(&accumulatedMessages[villager->GetPlayerIndex()], villagerId, villager->GetCarriedResourceType(), 0);
   
   // If the villager was originally tasked onto a resource, make it return to this resource.
   if (villager->GetManuallyTargetedObjectId() != villager->GetTargetObjectId()) {
@@ -1727,55 +1718,207 @@ void Game::SimulateResourceDropOff(u32 villagerId, ServerUnit* villager, bool* u
   }
 }
 
-void Game::SimulateGameStepForBuilding(u32 buildingId, ServerBuilding* building, float stepLengthInSeconds) {
-  // If the building's production queue is non-empty, add progress on the item that is currently being produced / researched.
-  UnitType unitInProduction;
-  if (building->IsUnitQueued(&unitInProduction)) {
-    auto& player = *playersInGame->at(building->GetPlayerIndex());
+/// Returns the point that is used to determine the closest drop-off point for a villager.
+static QPointF GetDropOffPointCenter(ServerBuilding* building) {
+  QSize size = GetBuildingSize(building->GetBuildingType());
+  return building->GetBaseTile() + 0.5f * QPointF(size.width(), size.height());
+}
+
+void Game::AddDropOffPoint(u32 buildingId, ServerBuilding* building) {
+  for (int type = 0; type < static_cast<int>(ResourceType::NumTypes); ++ type) {
+    if (IsDropOffPointForResource(building->GetBuildingType(), static_cast<ResourceType>(type))) {
+      dropOffPoints[building->GetPlayerIndex()][type].Add(buildingId, GetDropOffPointCenter(building));
+    }
+  }
+}
+
+void Game::RemoveDropOffPoint(u32 buildingId, ServerBuilding* building) {
+  for (int type = 0; type < static_cast<int>(ResourceType::NumTypes); ++ type) {
+    if (IsDropOffPointForResource(building->GetBuildingType(), static_cast<ResourceType>(type))) {
+      dropOffPoints[building->GetPlayerIndex()][type].Remove(buildingId, GetDropOffPointCenter(building));
+    }
+  }
+}
+
+void Game::UpdateConstructionProgress(ServerBuilding* building, u32 step) {
+  u32 steps = step - building->GetConstructionUpdateStep();
+  building->SetConstructionUpdateStep(step);
+  if (steps == 0 || building->GetBuilderCount() == 0) {
+    return;
+  }
+  
+  // The construction only completes in CompleteConstruction(). Make sure that rounding does not reach 100 percent earlier.
+  float addedPercentage = steps * building->GetConstructionPercentagePerStep();
+  building->SetBuildPercentage(std::min(std::nextafter(100.f, 0.f), building->GetBuildPercentage() + addedPercentage));
+  
+  float maxHP = GetBuildingMaxHP(building->GetBuildingType());
+  building->SetHP(std::min(building->GetHPInternalFloat() + addedPercentage / 100 * maxHP, maxHP));
+}
+
+void Game::UpdateConstructions(float stepLengthInSeconds) {
+  usize keptCount = 0;
+  for (u32 buildingId : constructionList) {
+    auto it = map->GetObjects().find(buildingId);
+    if (it == map->GetObjects().end()) {
+      continue;
+    }
+    ServerBuilding* building = AsBuilding(it->second);
     
-    bool canProduce = true;
-    float previousPercentage = building->GetProductionPercentage();
-    if (previousPercentage == 0) {
-      // Only start producing the unit if population space is available.
-      canProduce = player.populationIncludingInProduction < player.availablePopulationSpace;
-      if (!canProduce) {
-        player.isHoused = true;
-      }
+    int builderCount = building->GetBuilderCountInCurrentStep();
+    building->ResetBuilderCountInCurrentStep();
+    if (building->GetBuildPercentage() == 100) {
+      building->SetInConstructionList(false);
+      continue;
     }
     
-    if (canProduce) {
-      float productionTime = GetUnitProductionTime(unitInProduction);
-      float timeStepPercentage = 100 * stepLengthInSeconds / productionTime;
-      float newPercentage = building->GetProductionPercentage() + timeStepPercentage;
+    // If the number of builders changed, continue the construction from the current progress with the new rate.
+    // This way, the clients only need to be notified about the construction when the rate changes.
+    // TODO: In the original game, two villagers building does not result in twice the speed. Account for this.
+    if (builderCount != building->GetBuilderCount()) {
+      UpdateConstructionProgress(building, gameStepCount);
       
-      bool completed = false;
-      if (newPercentage >= 100) {
-        // Remove the population count for the unit in production.
-        player.populationIncludingInProduction -= 1;
-        
-        // Special case for UnitType::MaleVillager: Randomly decide whether to produce a male or female.
-        if (unitInProduction == UnitType::MaleVillager) {
-          unitInProduction = (rand() % 2 == 0) ? UnitType::MaleVillager : UnitType::FemaleVillager;
-        }
-        
-        // Create the unit.
-        ProduceUnit(building, unitInProduction);
-        building->RemoveCurrentItemFromQueue();
-        
-        newPercentage = 0;
-        completed = true;
-        accumulatedMessages[building->GetPlayerIndex()] += CreateRemoveFromProductionQueueMessage(buildingId, 0);
+      float percentagePerStep = builderCount * 100 * stepLengthInSeconds / GetBuildingConstructionTime(building->GetBuildingType());
+      building->SetBuilders(builderCount, percentagePerStep);
+      
+      // Schedule the completion of the construction. The progress of the current game step is included.
+      if (builderCount > 0) {
+        u32 remainingSteps = std::max(1, static_cast<int>(std::ceil((100 - building->GetBuildPercentage()) / percentagePerStep - 1e-3f)));
+        u32 endStep = gameStepCount + remainingSteps - 1;
+        building->SetConstructionEndStep(endStep);
+        constructionTimers.Schedule(endStep, buildingId);
       }
       
-      building->SetProductionPercentage(newPercentage);
-      if (!completed && previousPercentage == 0) {
-        // If the production just starts, notify the client about it.
-        accumulatedMessages[building->GetPlayerIndex()] += CreateUpdateProductionMessage(buildingId, building->GetProductionPercentage(), 100.f / productionTime);
-        
-        // Add the population count for the unit in production.
-        player.populationIncludingInProduction += 1;
+      // Tell all clients that see the building about the new construction rate, and the HP from which it continues.
+      sharedMessage.Clear();
+      WriteBuildPercentageUpdateMessage(&sharedMessage, buildingId, building->GetBuildPercentage(), percentagePerStep / stepLengthInSeconds);
+      WriteHPUpdateMessage(&sharedMessage, buildingId, building->GetHP());
+      for (auto& player : *playersInGame) {
+        accumulatedMessages[player->index].Append(sharedMessage);
       }
     }
+    
+    if (builderCount == 0) {
+      building->SetInConstructionList(false);
+      continue;
+    }
+    constructionList[keptCount] = buildingId;
+    ++ keptCount;
+  }
+  constructionList.resize(keptCount);
+}
+
+void Game::CompleteConstruction(u32 buildingId) {
+  // The event is outdated if the building was deleted, or if its number of builders changed since it was scheduled.
+  auto it = map->GetObjects().find(buildingId);
+  if (it == map->GetObjects().end()) {
+    return;
+  }
+  ServerBuilding* building = AsBuilding(it->second);
+  if (building->GetBuilderCount() == 0 ||
+      building->GetBuildPercentage() == 100 ||
+      building->GetConstructionEndStep() != gameStepCount) {
+    return;
+  }
+  
+  // Add the progress including the current game step, which completes the building.
+  UpdateConstructionProgress(building, gameStepCount + 1);
+  building->SetBuildPercentage(100);
+  building->SetBuilders(0, 0);
+  UpdateFieldOfView(building);
+  
+  if (building->GetPlayerIndex() != kGaiaPlayerIndex) {
+    playersInGame->at(building->GetPlayerIndex())->availablePopulationSpace += GetBuildingProvidedPopulationSpace(building->GetBuildingType());
+    AddDropOffPoint(buildingId, building);
+  }
+  
+  // Tell all clients that see the building about its completion.
+  sharedMessage.Clear();
+  WriteBuildPercentageUpdateMessage(&sharedMessage, buildingId, 100, 0);
+  WriteHPUpdateMessage(&sharedMessage, buildingId, building->GetHP());
+  for (auto& player : *playersInGame) {
+    accumulatedMessages[player->index].Append(sharedMessage);
+  }
+}
+
+void Game::AddToProductionWaitList(u32 buildingId, ServerBuilding* building) {
+  if (!building->IsWaitingForProduction()) {
+    building->SetWaitingForProduction(true);
+    productionWaitList.push_back(buildingId);
+  }
+}
+
+void Game::StartWaitingProductions(double gameStepServerTime, float stepLengthInSeconds) {
+  usize waitingCount = 0;
+  for (u32 buildingId : productionWaitList) {
+    auto it = map->GetObjects().find(buildingId);
+    if (it == map->GetObjects().end()) {
+      continue;
+    }
+    ServerBuilding* building = AsBuilding(it->second);
+    
+    UnitType unitInProduction;
+    if (building->IsProducing() || !building->IsUnitQueued(&unitInProduction)) {
+      building->SetWaitingForProduction(false);
+      continue;
+    }
+    
+    // Only start producing the unit if population space is available.
+    auto& player = *playersInGame->at(building->GetPlayerIndex());
+    if (player.populationIncludingInProduction >= player.availablePopulationSpace) {
+      player.isHoused = true;
+      productionWaitList[waitingCount] = buildingId;
+      ++ waitingCount;
+      continue;
+    }
+    
+    // Schedule the completion of the production. Round the production time up to whole game steps.
+    float productionTime = GetUnitProductionTime(unitInProduction);
+    u32 productionSteps = std::max(1, static_cast<int>(std::ceil(productionTime / stepLengthInSeconds - 1e-3f)));
+    u32 endStep = gameStepCount + productionSteps;
+    building->StartProduction(endStep);
+    building->SetWaitingForProduction(false);
+    productionTimers.Schedule(endStep, buildingId);
+    
+    // Add the population count for the unit in production.
+    player.populationIncludingInProduction += 1;
+    
+    // Notify the client about the start and end time of the production.
+    WriteUpdateProductionMessage(&accumulatedMessages[building->GetPlayerIndex()], buildingId, gameStepServerTime, gameStepServerTime + productionSteps * stepLengthInSeconds);
+  }
+  productionWaitList.resize(waitingCount);
+}
+
+void Game::CompleteProduction(u32 buildingId) {
+  // The event is outdated if the building was deleted, or if its production was cancelled
+  // (in which case it may have started another production in the meantime).
+  auto it = map->GetObjects().find(buildingId);
+  if (it == map->GetObjects().end()) {
+    return;
+  }
+  ServerBuilding* building = AsBuilding(it->second);
+  UnitType unitInProduction;
+  if (!building->IsProducing() ||
+      building->GetProductionEndStep() != gameStepCount ||
+      !building->IsUnitQueued(&unitInProduction)) {
+    return;
+  }
+  
+  // Remove the population count for the unit in production.
+  playersInGame->at(building->GetPlayerIndex())->populationIncludingInProduction -= 1;
+  
+  // Special case for UnitType::MaleVillager: Randomly decide whether to produce a male or female.
+  if (unitInProduction == UnitType::MaleVillager) {
+    unitInProduction = (rand() % 2 == 0) ? UnitType::MaleVillager : UnitType::FemaleVillager;
+  }
+  
+  // Create the unit.
+  ProduceUnit(building, unitInProduction);
+  building->RemoveCurrentItemFromQueue();
+  WriteRemoveFromProductionQueueMessage(&accumulatedMessages[building->GetPlayerIndex()], buildingId, 0);
+  
+  // Start producing the next item in the queue from the next game step on.
+  if (!building->GetProductionQueue().empty()) {
+    AddToProductionWaitList(buildingId, building);
   }
 }
 
@@ -1813,17 +1956,30 @@ bool Game::SimulateMeleeAttack(u32 /*unitId*/, ServerUnit* unit, u32 targetId, S
     
     int totalDamage = std::max(1, meleeDamage);
     
-    // Do the attack damage.
+    // Do the attack damage. For buildings under construction, first add the HP from the construction progress.
+    if (target->isBuilding() && AsBuilding(target)->GetBuilderCount() > 0) {
+      UpdateConstructionProgress(AsBuilding(target), gameStepCount);
+    }
     float oldHP = target->GetHPInternalFloat();
     float hp = target->GetHPInternalFloat() - totalDamage;
     if (hp > 0.5f) {
       target->SetHP(hp);
       
+      // Wake up attacked units, such that they get simulated in case they react to the attack.
+      if (target->isUnit()) {
+        ActivateUnit(targetId, AsUnit(target));
+      }
+      
       // Notify all clients that see the target about its HP change
       // TODO: Would it make sense to batch these together in case there are multiple updates to an object's HP in the same time step?
-      QByteArray msg = CreateHPUpdateMessage(targetId, target->GetHP());
-      for (auto& player : *playersInGame) {
-        accumulatedMessages[player->index] += msg;
+      sharedMessage.Clear();
+      WriteHPUpdateMessage(&sharedMessage, targetId, target->GetHP());
+      if (target->isUnit()) {
+        SendToPlayersThatSee(AsUnit(target), sharedMessage);
+      } else {
+        for (auto& player : *playersInGame) {
+          accumulatedMessages[player->index].Append(sharedMessage);
+        }
       }
     } else if (oldHP > 0.5f) {
       // Remove the target.
@@ -1844,6 +2000,7 @@ void Game::ProduceUnit(ServerBuilding* building, UnitType unitInProduction) {
   // Create the unit object.
   u32 newUnitId;
   ServerUnit* newUnit = map->AddUnit(building->GetPlayerIndex(), unitInProduction, QPointF(-999, -999), &newUnitId);
+  playersInGame->at(building->GetPlayerIndex())->objectCount += 1;
   
   // Look for a free space to place the unit next to the building.
   float unitRadius = GetUnitRadius(unitInProduction);
@@ -1917,16 +2074,18 @@ void Game::ProduceUnit(ServerBuilding* building, UnitType unitInProduction) {
   }
   
   if (foundFreeSpace) {
-    newUnit->SetMapCoord(freeSpace);
+    map->SetUnitMapCoord(newUnit, freeSpace);
   } else {
     // TODO: Garrison the unit in the building
   }
   
   // Send messages to clients that see the new unit
-  QByteArray addObjectMsg = CreateAddObjectMessage(newUnitId, newUnit);
-  for (auto& player : *playersInGame) {
-    accumulatedMessages[player->index] += addObjectMsg;
-  }
+  UpdateFieldOfView(newUnit);
+  newUnit->SetVisibleToPlayers(ComputeVisibleToPlayers(newUnit));
+  newUnit->SetMovementReferenceCoord(QuantizeUnitMovementCoord(newUnit->GetMapCoord()));
+  sharedMessage.Clear();
+  WriteAddObjectMessage(&sharedMessage, newUnitId, newUnit);
+  SendToPlayersThatSee(newUnit, sharedMessage);
   
   // Handle population counting
   playersInGame->at(newUnit->GetPlayerIndex())->populationIncludingInProduction += 1;
@@ -1946,27 +2105,18 @@ void Game::SetUnitTargets(const std::vector<u32>& unitIds, int playerIndex, u32
     UnitType oldUnitType = unit->GetUnitType();
     
     unit->SetTarget(targetId, targetObject, isManualTargeting);
+    ActivateUnit(id, unit);
     
     if (oldUnitType != unit->GetUnitType()) {
       // Notify all clients that see the unit about its change of type.
-      QByteArray msg = CreateChangeUnitTypeMessage(id, unit->GetUnitType());
-      for (auto& player : *playersInGame) {
-        accumulatedMessages[player->index] += msg;
-      }
+      sharedMessage.Clear();
+      WriteChangeUnitTypeMessage(&sharedMessage, id, unit->GetUnitType());
+      SendToPlayersThatSee(unit, sharedMessage);
     }
   }
 }
 
 void Game::DeleteObject(u32 objectId, bool deletedManually) {
-  // Objects are deleted lazily. This means that for example if multiple
-  // militia hit a 1-HP house in the same time step, it could be deleted twice.
-  // This e.g., causes inconsitencies regarding population count. Prevent this.
-  for (u32 id : objectDeleteList) {
-    if (id == objectId) {
-      return;
-    }
-  }
-  
   // TODO: Convert the object into some other form to remember
   //       the potential destroy / death animation and rubble / decay sprite.
   //       We need to store this so we can tell other clients about its existence
@@ -1979,23 +2129,36 @@ void Game::DeleteObject(u32 objectId, bool deletedManually) {
   }
   ServerObject* object = it->second;
   
+  // Objects are deleted lazily. This means that for example if multiple
+  // militia hit a 1-HP house in the same time step, it could be deleted twice.
+  // This e.g., causes inconsitencies regarding population count. Prevent this.
+  if (object->IsPendingDelete()) {
+    return;
+  }
+  object->SetPendingDelete();
+  
   bool sendObjectDeathToOwningPlayerOnly = false;
   if (object->isBuilding()) {
     ServerBuilding* building = AsBuilding(object);
-    if (building->GetBuildPercentage() == 0) {
+    if (!building->HasConstructionStarted()) {
       // For building foundations, only the player that owns them knows about the object.
       // So we only need to send the object death message to this player.
       sendObjectDeathToOwningPlayerOnly = true;
     }
   }
   
-  QByteArray msg = CreateObjectDeathMessage(objectId);
+  sharedMessage.Clear();
+  WriteObjectDeathMessage(&sharedMessage, objectId);
   for (auto& player : *playersInGame) {
     if (sendObjectDeathToOwningPlayerOnly && player->index != object->GetPlayerIndex()) {
       continue;
     }
+    // Units are only known to the players that see them.
+    if (object->isUnit() && !AsUnit(object)->IsVisibleToPlayer(player->index)) {
+      continue;
+    }
     
-    accumulatedMessages[player->index] += msg;
+    accumulatedMessages[player->index].Append(sharedMessage);
   }
   
   objectDeleteList.push_back(objectId);
@@ -2007,9 +2170,10 @@ void Game::DeleteObject(u32 objectId, bool deletedManually) {
   //   and "refund" the population space for any unit currently being produced
   if (object->isBuilding()) {
     ServerBuilding* building = AsBuilding(object);
-    if (building->GetBuildPercentage() > 0) {
+    if (building->HasConstructionStarted()) {
       map->RemoveBuildingOccupancy(building);
     }
+    UpdateConstructionProgress(building, gameStepCount);
     if (deletedManually && building->GetBuildPercentage() < 100) {
       float remainingResourceAmount = 1 - building->GetBuildPercentage() / 100.f;
       
@@ -2019,7 +2183,7 @@ void Game::DeleteObject(u32 objectId, bool deletedManually) {
     for (usize queueIndex = 0; queueIndex < building->GetProductionQueue().size(); ++ queueIndex) {
       playersInGame->at(building->GetPlayerIndex())->resources.Add(GetUnitCost(building->GetProductionQueue()[queueIndex]));
     }
-    if (building->GetProductionPercentage() > 0) {
+    if (building->IsProducing()) {
       playersInGame->at(object->GetPlayerIndex())->populationIncludingInProduction -= 1;
     }
   }
@@ -2030,6 +2194,7 @@ void Game::DeleteObject(u32 objectId, bool deletedManually) {
     if (building->GetPlayerIndex() != kGaiaPlayerIndex &&
         building->GetBuildPercentage() == 100) {
       playersInGame->at(building->GetPlayerIndex())->availablePopulationSpace -= GetBuildingProvidedPopulationSpace(building->GetBuildingType());
+      RemoveDropOffPoint(objectId, building);
     }
   } else if (object->isUnit()) {
     playersInGame->at(object->GetPlayerIndex())->populationIncludingInProduction -= 1;
@@ -2037,16 +2202,9 @@ void Game::DeleteObject(u32 objectId, bool deletedManually) {
   
   // If all objects of a player are gone, the player gets defeated.
   if (object->GetPlayerIndex() != kGaiaPlayerIndex) {
-    bool playerHasRemainingObject = false;
-    for (const auto& item : map->GetObjects()) {
-      if (item.second->GetPlayerIndex() == object->GetPlayerIndex() &&
-          item.first != it->first) {
-        playerHasRemainingObject = true;
-        break;
-      }
-    }
-    
-    if (!playerHasRemainingObject) {
+    auto& player = playersInGame->at(object->GetPlayerIndex());
+    player->objectCount -= 1;
+    if (player->objectCount == 0) {
       RemovePlayer(object->GetPlayerIndex(), PlayerExitReason::Defeat);
     }
   }
@@ -2068,6 +2226,12 @@ void Game::RemovePlayer(int playerIndex, PlayerExitReason reason) {
   LOG(WARNING) << "Removing player: " << player->name.toStdString() << " (index " << player->index << "). Reason: " << reasonString.toStdString();
   player->RemoveFromGame();
   
+  // Defeats result from the simulation itself, so only record the players that leave by themselves.
+  if (replayRecorder && reason != PlayerExitReason::Defeat) {
+    QByteArray leaveMsg = CreateLeaveMessage();
+    replayRecorder->RecordCommand(gameStepCount, player->index, MessageView(leaveMsg.constData(), leaveMsg.size()));
+  }
+  
   // Notify the remaining players about the player's exit
   // TODO: For these messages and the one sent below, clients may think
   //       that they receive them late since they are not preceded by a game time message.
@@ -2100,3 +2264,14 @@ void Game::RemovePlayer(int playerIndex, PlayerExitReason reason) {
     shouldExit = true;
   }
 }
+
+u64 Game::ComputeStateHash() {
+  u64 hash = map->ComputeObjectStateHash();
+  for (const auto& player : *playersInGame) {
+    HashValue(player->resources, &hash);
+    HashValue(player->availablePopulationSpace, &hash);
+    HashValue(player->populationIncludingInProduction, &hash);
+    HashValue(player->isHoused, &hash);
+  }
+  return hash;
+}
@@ -4,18 +4,30 @@
 
 #pragma once
 
+#include <array>
 #include <memory>
 #include <vector>
 
 #include <QByteArray>
+#include <QPoint>
 #include <QString>
 #include <QTcpSocket>
 
 #include "FreeAge/common/free_age.hpp"
+#include "FreeAge/common/message_buffer.hpp"
+#include "FreeAge/common/message_writer.hpp"
 #include "FreeAge/common/messages.hpp"
 #include "FreeAge/common/resources.hpp"
+#include "FreeAge/common/thread_pool.hpp"
+#include "FreeAge/server/drop_off_points.hpp"
+#include "FreeAge/server/flow_field.hpp"
 #include "FreeAge/server/map.hpp"
+#include "FreeAge/server/path_request_scheduler.hpp"
+#include "FreeAge/server/replay.hpp"
 #include "FreeAge/server/settings.hpp"
+#include "FreeAge/server/timer_wheel.hpp"
+#include "FreeAge/server/unit_movement.hpp"
+#include "FreeAge/server/visibility.hpp"
 
 class ServerBuilding;
 class ServerUnit;
@@ -33,7 +45,7 @@ struct PlayerInGame {
   
   /// Buffer for bytes that have been received from the client, but could not
   /// be parsed yet (because only a partial message was received so far).
-  QByteArray unparsedBuffer;
+  MessageBuffer unparsedBuffer;
   
   /// The player name as provided by the client.
   QString name;
@@ -66,6 +78,10 @@ struct PlayerInGame {
   /// and it is different from the population count shown to the client.
   int populationIncludingInProduction = 0;
   
+  /// The number of objects of this player that are on the map and not pending deletion.
+  /// If this drops to zero, the player is defeated.
+  int objectCount = 0;
+  
   /// Whether the player is currently housed.
   /// This is reset to false at the beginning of each game step and set to true
   /// if any of the player's buildings cannot produce something due to lack of population space.
@@ -74,6 +90,10 @@ struct PlayerInGame {
   /// Whether the player was housed in the last game step.
   /// Used to determine whether an update of the housed state needs to be sent to the client.
   bool wasHousedBefore = false;
+  
+  /// The map chunks (see kMapChunkSize) that have not been sent to the player yet.
+  /// Sorted by decreasing distance to the player's initial view, such that the next chunk to send is at the back.
+  std::vector<QPoint> pendingMapChunks;
 };
 
 class Game {
@@ -82,42 +102,130 @@ class Game {
   
   void RunGameLoop(std::vector<std::shared_ptr<PlayerInGame>>* playersInGame);
   
+  /// Replays a game that was recorded with ReplayRecorder, simulating the game steps as fast as
+  /// possible instead of in real time. The players must be set up according to the replay header
+  /// and use DiscardingSockets. The replay ends when the game ended or all game steps of the log were simulated.
+  void RunReplay(std::vector<std::shared_ptr<PlayerInGame>>* playersInGame, ReplayReader* reader, const ReplayHeader& header);
+  
  private:
   enum class ParseMessagesResult {
     NoAction = 0,
     PlayerLeftOrShouldBeDisconnected
   };
   
-  void HandleLoadingProgress(const QByteArray& msg, PlayerInGame* player, const std::vector<std::shared_ptr<PlayerInGame>>& players);
+  /// The outcome of a unit's game step as computed by ComputeUnitStepIntent().
+  struct UnitStepIntent {
+    /// Whether the step at most moves the unit along its path. Only such steps are computed
+    /// in advance; all others must be simulated with SimulateGameStepForUnit().
+    bool isMovementOnly;
+    
+    /// Whether the unit moves. If false (and isMovementOnly is true), the step does nothing.
+    bool hasMovement;
+    UnitMovement movement;
+    
+    /// The tile of the unit's target unit if the step depends on the target's position, an empty rect otherwise.
+    QRect targetUnitTile;
+  };
+  
+  /// Sets the players and prepares the per-player message buffers.
+  void SetPlayersInGame(std::vector<std::shared_ptr<PlayerInGame>>* playersInGame);
+  
+  /// Logs the percentiles of the given game step simulation times (and sorts them for that).
+  /// The load test (FreeAgeLoadTest) reports this line.
+  void LogStepTimePercentiles(std::vector<float>* stepSimulationSeconds);
+  
+  void HandleLoadingProgress(const MessageView& msg, PlayerInGame* player, const std::vector<std::shared_ptr<PlayerInGame>>& players);
   void HandleLoadingFinished(PlayerInGame* player, const std::vector<std::shared_ptr<PlayerInGame>>& players);
   void SendChatBroadcast(u16 sendingPlayerIndex, const QString& text, const std::vector<std::shared_ptr<PlayerInGame>>& players);
-  void HandleChat(const QByteArray& msg, PlayerInGame* player, u32 len, const std::vector<std::shared_ptr<PlayerInGame>>& players);
-  void HandlePing(const QByteArray& msg, PlayerInGame* player);
-  void HandleMoveToMapCoordMessage(const QByteArray& msg, PlayerInGame* player, u32 len);
-  void HandleSetTargetMessage(const QByteArray& msg, PlayerInGame* player, u32 len);
-  void HandleProduceUnitMessage(const QByteArray& msg, PlayerInGame* player);
-  void HandlePlaceBuildingFoundationMessage(const QByteArray& msg, PlayerInGame* player);
-  void HandleDeleteObjectMessage(const QByteArray& msg, PlayerInGame* player);
-  void HandleDequeueProductionQueueItemMessage(const QByteArray& msg, PlayerInGame* player);
+  void HandleChat(const MessageView& msg, PlayerInGame* player, const std::vector<std::shared_ptr<PlayerInGame>>& players);
+  void HandlePing(const MessageView& msg, PlayerInGame* player);
+  void HandleMoveToMapCoordMessage(const MessageView& msg, PlayerInGame* player);
+  void HandleSetTargetMessage(const MessageView& msg, PlayerInGame* player);
+  void HandleProduceUnitMessage(const MessageView& msg, PlayerInGame* player);
+  void HandlePlaceBuildingFoundationMessage(const MessageView& msg, PlayerInGame* player);
+  void HandleDeleteObjectMessage(const MessageView& msg, PlayerInGame* player);
+  void HandleDequeueProductionQueueItemMessage(const MessageView& msg, PlayerInGame* player);
+  /// Handles a client message that is a game command (i.e., that changes the game state), and records it if a replay is recorded.
+  void HandleGameCommand(const MessageView& msg, PlayerInGame* player);
   ParseMessagesResult TryParseClientMessages(PlayerInGame* player, const std::vector<std::shared_ptr<PlayerInGame>>& players);
   
-  // TODO: Right now, this creates a message containing the whole map content.
-  //       Later, only the areas seen by a client (and a small border around them)
-  //       should be sent to the client.
-  QByteArray CreateMapUncoverMessage();
-  QByteArray CreateAddObjectMessage(u32 objectId, ServerObject* object);
+  /// Creates a MapUncover message for the map chunk with the given chunk coordinates.
+  QByteArray CreateMapUncoverMessage(const QPoint& chunk);
+  /// Sets up the player's pendingMapChunks, sorted by their distance to the given map coordinate.
+  void PrioritizeMapChunks(PlayerInGame* player, const QPointF& viewCenter);
+  /// Sends the player's pending map chunks until about maxBytes have been sent or no chunks are pending anymore.
+  void SendPendingMapChunks(PlayerInGame* player, int maxBytes);
+  void WriteAddObjectMessage(MessageWriter* writer, u32 objectId, ServerObject* object);
   
   inline double GetCurrentServerTime() { return SecondsDuration(Clock::now() - settings->serverStartTime).count(); }
   
-  void StartGame();
+  /// Generates the map and sends the initial game state to the players. The game steps start at the given server time.
+  void StartGame(double gameBeginServerTime);
   void SimulateGameStep(double gameStepServerTime, float stepLengthInSeconds);
   void SimulateGameStepForUnit(u32 unitId, ServerUnit* unit, double gameStepServerTime, float stepLengthInSeconds);
-  bool IsPathFree(float unitRadius, const QPointF& p0, const QPointF& p1, const QRect& openRect);
-  void PlanUnitPath(ServerUnit* unit);
-  void SimulateBuildingConstruction(float stepLengthInSeconds, ServerUnit* villager, u32 targetObjectId, ServerBuilding* targetBuilding, bool* unitMovementChanged, bool* stayInPlace);
+  /// Adds the unit to activeUnitIds if it is not in there yet, such that it gets simulated from the next game step on.
+  void ActivateUnit(u32 unitId, ServerUnit* unit);
+  /// Computes the intents of all active units for the coming game step in parallel.
+  void ComputeUnitStepIntents(float stepLengthInSeconds);
+  /// Determines the outcome of the unit's game step in advance, if possible, without modifying anything.
+  /// This relies on the steps of other units not modifying the unit (except for its HP), such that
+  /// the outcome only depends on the map state that UnitStepIntent records as dependencies.
+  void ComputeUnitStepIntent(ServerUnit* unit, float stepLengthInSeconds, UnitStepIntent* intent);
+  /// Applies the given intent if it is still up-to-date, which yields the same result as
+  /// SimulateGameStepForUnit(). Returns false if the unit's step must be simulated instead.
+  bool TryCommitUnitStepIntent(u32 unitId, ServerUnit* unit, const UnitStepIntent& intent);
+  void SendUnitMovementMessage(u32 unitId, ServerUnit* unit);
+  /// Appends the unit's movement, with the given start point relative to the player's reference
+  /// (see ServerUnit::GetMovementReferenceCoord()), to the player's UnitMovementBatch.
+  void AppendUnitMovement(usize playerIndex, u32 unitId, ServerUnit* unit, const QPoint& coordDelta);
+  /// Appends the given messages to the accumulated messages of all players that see the unit.
+  void SendToPlayersThatSee(ServerUnit* unit, const MessageWriter& msg);
+  /// Updates the field of view that the object adds to its player's PlayerVisibility, in case it changed.
+  void UpdateFieldOfView(ServerObject* object);
+  /// Removes the field of view of the object from its player's PlayerVisibility.
+  void RemoveFieldOfView(ServerObject* object);
+  /// Returns the players that see the given unit, as a bitmask (see ServerUnit::GetVisibleToPlayers()).
+  u32 ComputeVisibleToPlayers(ServerUnit* unit);
+  /// Updates which players see the given unit.
+  /// Players that start seeing the unit are sent its current state, players that stop seeing it are told to remove it.
+  void UpdateVisibleToPlayers(ServerUnit* unit);
+  /// Updates the fields of view of the active units, and which players see the units that may have changed
+  /// their visibility: the active units and the units on tiles that became visible or invisible for any player.
+  /// This must be called before the idle units are removed from activeUnitIds, since units that stopped in the
+  /// current step may still have moved. Buildings update their fields of view when they are completed.
+  void UpdateVisibility();
+  /// Queues a request to plan a path for the unit to its move-to target. If the unit has a
+  /// flow field, the path is taken from it on the worker threads if the target is reachable.
+  /// The path is assigned to the unit by ApplyPlannedPaths() PathRequestScheduler::kResultDelaySteps steps after the next game step.
+  void RequestUnitPath(u32 unitId, ServerUnit* unit);
+  void ApplyPlannedPaths();
+  /// Returns the flow field for the given goal tile. If there is no such flow field
+  /// that is still in use by some units, a new one is created.
+  std::shared_ptr<FlowField> GetOrCreateFlowField(const QPoint& goalTile);
+  /// Returns the tile that contains the given map coordinate, clamped to the map area.
+  QPoint GetTileOfMapCoord(const QPointF& mapCoord);
+  void SimulateBuildingConstruction(ServerUnit* villager, u32 targetObjectId, ServerBuilding* targetBuilding, bool* unitMovementChanged, bool* stayInPlace);
   void SimulateResourceGathering(float stepLengthInSeconds, u32 villagerId, ServerUnit* villager, ServerBuilding* targetBuilding, bool* unitMovementChanged, bool* stayInPlace);
   void SimulateResourceDropOff(u32 villagerId, ServerUnit* villager, bool* unitMovementChanged);
-  void SimulateGameStepForBuilding(u32 buildingId, ServerBuilding* building, float stepLengthInSeconds);
+  /// Adds the given completed building to the drop-off point indices of its player (for the resource types that it accepts).
+  void AddDropOffPoint(u32 buildingId, ServerBuilding* building);
+  /// Removes the given completed building from the drop-off point indices of its player.
+  void RemoveDropOffPoint(u32 buildingId, ServerBuilding* building);
+  /// Adds the construction progress of the building for the game steps before the given step to its
+  /// build percentage and HP (see ServerBuilding::GetConstructionUpdateStep()).
+  void UpdateConstructionProgress(ServerBuilding* building, u32 step);
+  /// Updates the construction rate of the buildings in constructionList whose number of builders changed in
+  /// the current game step, tells the clients about it, and schedules the completion in constructionTimers.
+  void UpdateConstructions(float stepLengthInSeconds);
+  /// Handles a due event of constructionTimers: completes the building if the event is still valid.
+  void CompleteConstruction(u32 buildingId);
+  /// Adds the building to productionWaitList if it is not in there yet.
+  void AddToProductionWaitList(u32 buildingId, ServerBuilding* building);
+  /// Starts the production in the buildings of productionWaitList for which population space is available,
+  /// and schedules the completion of these productions in productionTimers.
+  void StartWaitingProductions(double gameStepServerTime, float stepLengthInSeconds);
+  /// Handles a due event of productionTimers: creates the produced unit if the production is still valid.
+  void CompleteProduction(u32 buildingId);
   /// Returns true if the attack is still in progress, false if it finished.
   bool SimulateMeleeAttack(u32 unitId, ServerUnit* unit, u32 targetId, ServerObject* target, double gameStepServerTime, float stepLengthInSeconds, bool* unitMovementChanged, bool* stayInPlace);
   
@@ -129,6 +237,10 @@ class Game {
   
   void RemovePlayer(int playerIndex, PlayerExitReason reason);
   
+  /// Returns a hash of the game state (objects and players' economies). If the game is
+  /// simulated with different numbers of threads, this must be the same after each game step.
+  u64 ComputeStateHash();
+  
   
   /// Stores the game map and the objects on it.
   std::shared_ptr<ServerMap> map;
@@ -146,19 +258,114 @@ class Game {
   
   /// Stores the object IDs that should be deleted at the end of the current
   /// game step. This list is required since we generally cannot directly delete
-  //  arbitrary objects during the game step simulation. This is because
-  /// this consists of iterating over the objects list, and direct deletion of arbitrary
-  /// elements could invalidate the iterator.
+  /// arbitrary objects during the game step simulation. This is because
+  /// this consists of iterating over the objects list, and deleting an element
+  /// from the slot map moves another element into its place.
+  /// Since the IDs are slot map handles, IDs that were already deleted are simply
+  /// detected as stale when processing this list.
   std::vector<u32> objectDeleteList;
   
+  /// The buildings that have items in their production queue, but did not start to produce the first
+  /// item yet. This is the case for one game step after a unit was queued or completed, and while the
+  /// building's player is housed. These buildings are checked in each game step.
+  std::vector<u32> productionWaitList;
+  
+  /// Schedules the completion of the productions that are in progress, with the building IDs as events.
+  /// Its current step is kept equal to gameStepCount. This way, buildings are only touched when their
+  /// production starts or completes instead of in every game step.
+  TimerWheel<u32> productionTimers;
+  
+  /// Buffer for the due events of productionTimers, kept to avoid reallocations.
+  std::vector<u32> dueProductions;
+  
+  /// The buildings that villagers constructed in the current or in the previous game step. At the end of each
+  /// game step, their number of builders is compared to the previous step to detect changes of the construction rate.
+  std::vector<u32> constructionList;
+  
+  /// Schedules the completion of the constructions that are in progress, with the building IDs as events.
+  /// Like productionTimers, its current step is kept equal to gameStepCount.
+  TimerWheel<u32> constructionTimers;
+  
+  /// Buffer for the due events of constructionTimers, kept to avoid reallocations.
+  std::vector<u32> dueConstructions;
+  
   /// For each player, stores accumulated messages that will be sent out
   /// upon the next conclusion of a game simulation step. Accumulating
   /// messages helps to reduce the overhead that many individual messages
   /// would have. In addition, as a convenience feature, each batch of
   /// accumulated messages gets prefixed by a GameStepTime message, such
   /// that other individual messages do not need to repeat the current server
-  /// time in each message.
-  std::vector<QByteArray> accumulatedMessages;
+  /// time in each message. The space for this GameStepTime message is reserved as
+  /// the prefix of each MessageWriter, such that the messages are serialized into
+  /// these buffers directly and sent without further copies.
+  std::vector<MessageWriter> accumulatedMessages;
+  
+  /// Scratch buffer for messages that are sent to multiple players. Such messages are
+  /// serialized once into this buffer and then appended to each player's accumulatedMessages.
+  MessageWriter sharedMessage;
+  
+  /// For each player, the offset of the last UnitMovementBatch message in accumulatedMessages
+  /// (or -1), which further unit movements are appended to if it is still at the end.
+  std::vector<int> movementBatchOffsets;
+  
+  /// The tiles that each player sees, indexed by the player index.
+  std::vector<PlayerVisibility> playerVisibility;
+  
+  /// For each player, the completed drop-off buildings for each resource type,
+  /// indexed by [playerIndex][static_cast<int>(ResourceType)].
+  std::vector<std::array<DropOffPointIndex, static_cast<int>(ResourceType::NumTypes)>> dropOffPoints;
+  
+  /// Plans unit paths on background threads.
+  PathRequestScheduler pathRequestScheduler;
+  
+  /// Buffer for the results of pathRequestScheduler, kept to avoid reallocations.
+  std::vector<PathResult> plannedPaths;
+  
+  /// Maximum number of path requests that are planned per game step.
+  /// Further requests are delayed to the following game steps. This is a fixed count
+  /// rather than a time budget to keep the simulation deterministic.
+  static constexpr int kMaxPathRequestsPerGameStep = 64;
+  
+  /// Flow fields of active group move orders. They are owned by the units that
+  /// follow them, such that they get released once all of these units got another
+  /// command or arrived.
+  std::vector<std::weak_ptr<FlowField>> flowFields;
+  
+  /// Minimum number of units that must be given the same move command in order to use a flow field for them.
+  static constexpr usize kMinFlowFieldGroupSize = 4;
+  
+  /// Squared distance by which a target unit must move away from where a unit's path leads
+  /// to such that the path is re-planned.
+  static constexpr float kReplanThresholdDistance = 0.1f * 0.1f;
+  
+  /// Computes the unit step intents in parallel. Null if the game is simulated on a single thread.
+  std::unique_ptr<ThreadPool> simulationThreadPool;
+  
+  /// The intents computed by ComputeUnitStepIntents(), indexed like activeUnitIds.
+  std::vector<UnitStepIntent> unitStepIntents;
+  
+  /// The value of map->GetUnitsVersion() at the time the unit step intents were computed.
+  u64 unitStepIntentsUnitsVersion;
+  
+  /// Minimum number of active units for computing the unit step intents in parallel.
+  /// For fewer units, the overhead of distributing the work is not worth it.
+  static constexpr usize kMinUnitsForParallelSimulation = 256;
+  
+  /// The IDs of the units that are simulated in each game step, in the order in which they are simulated.
+  /// Units are added with ActivateUnit() when something may make them non-idle (a command, a target, or
+  /// being attacked), and are removed at the end of a game step once they are idle (see ServerUnit::IsIdle())
+  /// or deleted. This way, idle units do not cost anything per game step.
+  std::vector<u32> activeUnitIds;
+  
+  /// Number of game steps per second, and the corresponding game step length in seconds.
+  static constexpr float kTargetFPS = 30;
+  static constexpr float kSimulationTimeInterval = 1 / kTargetFPS;
+  
+  /// Records the client commands if --record-replay is used. Created when the game starts.
+  std::unique_ptr<ReplayRecorder> replayRecorder;
+  
+  /// Number of game steps simulated so far.
+  u32 gameStepCount = 0;
   
   bool shouldExit = false;
   
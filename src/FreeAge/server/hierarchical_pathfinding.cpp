@@ -0,0 +1,495 @@
+// Copyright 2020 The FreeAge authors
+// This file is part of FreeAge, licensed under the new BSD license.
+// See the COPYING file in the project root for the license text.
+
+#include "FreeAge/server/hierarchical_pathfinding.hpp"
+
+#include <algorithm>
+#include <functional>
+
+#include "FreeAge/common/logging.hpp"
+
+void AreaDijkstra::Run(const PathfindingGrid& grid, const QRect& area, const std::vector<QPoint>& sources, const QRect& openRect) {
+  this->area = area;
+  int areaWidth = area.width();
+  cost.assign(areaWidth * area.height(), std::numeric_limits<float>::infinity());
+  openList.clear();
+  expandedNodeCount = 0;
+  
+  auto greater = std::greater<std::pair<float, int>>();
+  for (const QPoint& source : sources) {
+    int localIndex = (source.y() - area.y()) * areaWidth + (source.x() - area.x());
+    cost[localIndex] = 0;
+    openList.emplace_back(0.f, localIndex);
+  }
+  std::make_heap(openList.begin(), openList.end(), greater);
+  
+  auto isFree = [&](int x, int y) {
+    return area.contains(x, y, false) &&
+           (!grid.IsOccupied(x, y) || openRect.contains(x, y, false));
+  };
+  
+  while (!openList.empty()) {
+    std::pop_heap(openList.begin(), openList.end(), greater);
+    std::pair<float, int> current = openList.back();
+    openList.pop_back();
+    if (current.first > cost[current.second]) {
+      // Outdated entry.
+      continue;
+    }
+    ++ expandedNodeCount;
+    
+    int x = area.x() + current.second % areaWidth;
+    int y = area.y() + current.second / areaWidth;
+    
+    bool freeLeft = isFree(x - 1, y);
+    bool freeRight = isFree(x + 1, y);
+    bool freeTop = isFree(x, y - 1);
+    bool freeBottom = isFree(x, y + 1);
+    
+    auto relax = [&](int nextX, int nextY, float stepCost) {
+      int nextIndex = (nextY - area.y()) * areaWidth + (nextX - area.x());
+      float newCost = current.first + stepCost;
+      if (newCost < cost[nextIndex]) {
+        cost[nextIndex] = newCost;
+        openList.emplace_back(newCost, nextIndex);
+        std::push_heap(openList.begin(), openList.end(), greater);
+      }
+    };
+    
+    constexpr float sqrt2 = 1.41421356237310f;
+    if (freeLeft) { relax(x - 1, y, 1); }
+    if (freeRight) { relax(x + 1, y, 1); }
+    if (freeTop) { relax(x, y - 1, 1); }
+    if (freeBottom) { relax(x, y + 1, 1); }
+    // Diagonal movements require the two adjacent tiles to be free.
+    if (freeLeft && freeTop && isFree(x - 1, y - 1)) { relax(x - 1, y - 1, sqrt2); }
+    if (freeRight && freeTop && isFree(x + 1, y - 1)) { relax(x + 1, y - 1, sqrt2); }
+    if (freeLeft && freeBottom && isFree(x - 1, y + 1)) { relax(x - 1, y + 1, sqrt2); }
+    if (freeRight && freeBottom && isFree(x + 1, y + 1)) { relax(x + 1, y + 1, sqrt2); }
+  }
+}
+
+
+void HierarchicalPathGraph::Initialize(int width, int height) {
+  this->width = width;
+  this->height = height;
+  
+  clustersX = (width + kClusterSize - 1) / kClusterSize;
+  clustersY = (height + kClusterSize - 1) / kClusterSize;
+  
+  clusters.resize(clustersX * clustersY);
+  for (int clusterY = 0; clusterY < clustersY; ++ clusterY) {
+    for (int clusterX = 0; clusterX < clustersX; ++ clusterX) {
+      Cluster& cluster = clusters[clusterY * clustersX + clusterX];
+      int minX = clusterX * kClusterSize;
+      int minY = clusterY * kClusterSize;
+      cluster.area = QRect(
+          minX,
+          minY,
+          std::min(kClusterSize, width - minX),
+          std::min(kClusterSize, height - minY));
+      cluster.nodes.clear();
+      cluster.dirty = true;
+    }
+  }
+  
+  rightBorderTransitions.assign(clusters.size(), std::vector<std::pair<QPoint, QPoint>>());
+  bottomBorderTransitions.assign(clusters.size(), std::vector<std::pair<QPoint, QPoint>>());
+  nodeAtTile.assign(width * height, -1);
+  clusterFirstNode.assign(clusters.size(), 0);
+  nodeCluster.clear();
+  clusterUpdateCounts.assign(clusters.size(), 0);
+  
+  anyClusterDirty = true;
+}
+
+void HierarchicalPathGraph::MarkAreaChanged(const QRect& tileRect) {
+  int minClusterX = std::max(0, tileRect.left() / kClusterSize);
+  int minClusterY = std::max(0, tileRect.top() / kClusterSize);
+  int maxClusterX = std::min(clustersX - 1, tileRect.right() / kClusterSize);
+  int maxClusterY = std::min(clustersY - 1, tileRect.bottom() / kClusterSize);
+  
+  for (int clusterY = minClusterY; clusterY <= maxClusterY; ++ clusterY) {
+    for (int clusterX = minClusterX; clusterX <= maxClusterX; ++ clusterX) {
+      clusters[clusterY * clustersX + clusterX].dirty = true;
+      anyClusterDirty = true;
+    }
+  }
+}
+
+void HierarchicalPathGraph::Update(const PathfindingGrid& grid) {
+  if (!anyClusterDirty) {
+    return;
+  }
+  
+  // Recompute the transitions on all borders of dirty clusters. This affects the nodes
+  // of the neighboring clusters as well, so those need to be rebuilt too.
+  std::vector<u8> rebuildCluster(clusters.size(), 0);
+  for (int clusterY = 0; clusterY < clustersY; ++ clusterY) {
+    for (int clusterX = 0; clusterX < clustersX; ++ clusterX) {
+      int clusterIndex = clusterY * clustersX + clusterX;
+      if (!clusters[clusterIndex].dirty) {
+        continue;
+      }
+      
+      rebuildCluster[clusterIndex] = 1;
+      if (clusterX + 1 < clustersX) {
+        ComputeBorderTransitions(grid, clusterIndex, /*vertical*/ true);
+        rebuildCluster[clusterIndex + 1] = 1;
+      }
+      if (clusterX > 0) {
+        ComputeBorderTransitions(grid, clusterIndex - 1, /*vertical*/ true);
+        rebuildCluster[clusterIndex - 1] = 1;
+      }
+      if (clusterY + 1 < clustersY) {
+        ComputeBorderTransitions(grid, clusterIndex, /*vertical*/ false);
+        rebuildCluster[clusterIndex + clustersX] = 1;
+      }
+      if (clusterY > 0) {
+        ComputeBorderTransitions(grid, clusterIndex - clustersX, /*vertical*/ false);
+        rebuildCluster[clusterIndex - clustersX] = 1;
+      }
+    }
+  }
+  
+  ++ updateCount;
+  for (usize clusterIndex = 0; clusterIndex < clusters.size(); ++ clusterIndex) {
+    if (rebuildCluster[clusterIndex]) {
+      RebuildCluster(grid, clusterIndex);
+      clusterUpdateCounts[clusterIndex] = updateCount;
+    }
+    clusters[clusterIndex].dirty = false;
+  }
+  
+  // Update the global node indexing.
+  nodeCluster.clear();
+  for (usize clusterIndex = 0; clusterIndex < clusters.size(); ++ clusterIndex) {
+    clusterFirstNode[clusterIndex] = nodeCluster.size();
+    nodeCluster.insert(nodeCluster.end(), clusters[clusterIndex].nodes.size(), clusterIndex);
+  }
+  
+  anyClusterDirty = false;
+}
+
+void HierarchicalPathGraph::CopyChangesFrom(const HierarchicalPathGraph& source) {
+  CHECK(!source.anyClusterDirty) << "CopyChangesFrom() called for a graph that needs an update";
+  
+  if (width != source.width || height != source.height) {
+    width = source.width;
+    height = source.height;
+    clustersX = source.clustersX;
+    clustersY = source.clustersY;
+    clusters = source.clusters;
+    rightBorderTransitions = source.rightBorderTransitions;
+    bottomBorderTransitions = source.bottomBorderTransitions;
+    nodeAtTile = source.nodeAtTile;
+    clusterUpdateCounts = source.clusterUpdateCounts;
+  } else {
+    for (usize clusterIndex = 0; clusterIndex < clusters.size(); ++ clusterIndex) {
+      if (source.clusterUpdateCounts[clusterIndex] <= updateCount) {
+        continue;
+      }
+      clusterUpdateCounts[clusterIndex] = source.clusterUpdateCounts[clusterIndex];
+      
+      // The border transitions of a cluster only change if the cluster is rebuilt (see Update()),
+      // and the nodes of a cluster are within its area.
+      clusters[clusterIndex] = source.clusters[clusterIndex];
+      rightBorderTransitions[clusterIndex] = source.rightBorderTransitions[clusterIndex];
+      bottomBorderTransitions[clusterIndex] = source.bottomBorderTransitions[clusterIndex];
+      const QRect& area = clusters[clusterIndex].area;
+      for (int y = area.top(); y <= area.bottom(); ++ y) {
+        std::copy_n(source.nodeAtTile.data() + y * width + area.left(), area.width(), nodeAtTile.data() + y * width + area.left());
+      }
+    }
+  }
+  
+  clusterFirstNode = source.clusterFirstNode;
+  nodeCluster = source.nodeCluster;
+  anyClusterDirty = false;
+  updateCount = source.updateCount;
+}
+
+void HierarchicalPathGraph::ComputeBorderTransitions(const PathfindingGrid& grid, int clusterIndex, bool vertical) {
+  const QRect& area = clusters[clusterIndex].area;
+  std::vector<std::pair<QPoint, QPoint>>& transitions = vertical ? rightBorderTransitions[clusterIndex] : bottomBorderTransitions[clusterIndex];
+  transitions.clear();
+  
+  // Tiles along the border within this cluster are given by: base + i * step,
+  // and the corresponding tiles in the neighboring cluster by: base + i * step + across.
+  QPoint base = vertical ? QPoint(area.right(), area.top()) : QPoint(area.left(), area.bottom());
+  QPoint step = vertical ? QPoint(0, 1) : QPoint(1, 0);
+  QPoint across = vertical ? QPoint(1, 0) : QPoint(0, 1);
+  int borderLength = vertical ? area.height() : area.width();
+  
+  auto addTransition = [&](int i) {
+    QPoint tile = base + QPoint(i * step.x(), i * step.y());
+    transitions.emplace_back(tile, tile + across);
+  };
+  
+  int runStart = -1;
+  for (int i = 0; i <= borderLength; ++ i) {
+    bool free = false;
+    if (i < borderLength) {
+      QPoint tile = base + QPoint(i * step.x(), i * step.y());
+      QPoint otherTile = tile + across;
+      free = !grid.IsOccupied(tile.x(), tile.y()) && !grid.IsOccupied(otherTile.x(), otherTile.y());
+    }
+    
+    if (free && runStart < 0) {
+      runStart = i;
+    } else if (!free && runStart >= 0) {
+      int runEnd = i - 1;
+      if (runEnd - runStart + 1 <= kMaxSingleTransitionRunLength) {
+        addTransition((runStart + runEnd) / 2);
+      } else {
+        addTransition(runStart);
+        addTransition(runEnd);
+      }
+      runStart = -1;
+    }
+  }
+}
+
+void HierarchicalPathGraph::RebuildCluster(const PathfindingGrid& grid, int clusterIndex) {
+  Cluster& cluster = clusters[clusterIndex];
+  
+  for (const Node& node : cluster.nodes) {
+    nodeAtTile[node.tile.y() * width + node.tile.x()] = -1;
+  }
+  cluster.nodes.clear();
+  
+  auto addTransition = [&](const QPoint& ownTile, const QPoint& otherTile) {
+    i16& nodeIndex = nodeAtTile[ownTile.y() * width + ownTile.x()];
+    if (nodeIndex < 0) {
+      nodeIndex = cluster.nodes.size();
+      cluster.nodes.emplace_back(ownTile);
+    }
+    cluster.nodes[nodeIndex].interNeighbors.push_back(otherTile);
+  };
+  
+  int clusterX = clusterIndex % clustersX;
+  int clusterY = clusterIndex / clustersX;
+  if (clusterX + 1 < clustersX) {
+    for (const auto& transition : rightBorderTransitions[clusterIndex]) {
+      addTransition(transition.first, transition.second);
+    }
+  }
+  if (clusterX > 0) {
+    for (const auto& transition : rightBorderTransitions[clusterIndex - 1]) {
+      addTransition(transition.second, transition.first);
+    }
+  }
+  if (clusterY + 1 < clustersY) {
+    for (const auto& transition : bottomBorderTransitions[clusterIndex]) {
+      addTransition(transition.first, transition.second);
+    }
+  }
+  if (clusterY > 0) {
+    for (const auto& transition : bottomBorderTransitions[clusterIndex - clustersX]) {
+      addTransition(transition.second, transition.first);
+    }
+  }
+  
+  // Compute the intra-cluster edges.
+  std::vector<QPoint> source(1);
+  for (usize nodeIndex = 0; nodeIndex < cluster.nodes.size(); ++ nodeIndex) {
+    Node& node = cluster.nodes[nodeIndex];
+    source[0] = node.tile;
+    areaSearch.Run(grid, cluster.area, source, QRect());
+    
+    for (usize otherIndex = 0; otherIndex < cluster.nodes.size(); ++ otherIndex) {
+      if (otherIndex == nodeIndex) {
+        continue;
+      }
+      float cost = areaSearch.GetCost(cluster.nodes[otherIndex].tile);
+      if (cost != std::numeric_limits<float>::infinity()) {
+        node.intraEdges.emplace_back(otherIndex, cost);
+      }
+    }
+  }
+}
+
+
+bool HierarchicalPathPlanner::PlanPath(const PathfindingGrid& grid, const QPoint& start, const QRect& goalRect, std::vector<QPoint>* reverseTilePath, bool* reachedGoal) {
+  expandedNodeCount = 0;
+  
+  if (graph == nullptr || graph->NeedsUpdate()) {
+    LOG(ERROR) << "HierarchicalPathPlanner::PlanPath() called without an up-to-date graph, falling back to A*.";
+    return PlanWithFallback(grid, start, goalRect, reverseTilePath, reachedGoal);
+  }
+  
+  // Determine the goal tile closest to the start. The goal rect may span multiple clusters;
+  // the search on the abstract graph uses the cluster of this tile.
+  QPoint goalTile(
+      std::max(goalRect.x(), std::min(goalRect.x() + goalRect.width() - 1, start.x())),
+      std::max(goalRect.y(), std::min(goalRect.y() + goalRect.height() - 1, start.y())));
+  int startCluster = graph->GetClusterIndex(start);
+  int goalCluster = graph->GetClusterIndex(goalTile);
+  if (startCluster == goalCluster) {
+    return PlanWithFallback(grid, start, goalRect, reverseTilePath, reachedGoal);
+  }
+  
+  std::vector<QPoint> waypoints;
+  if (!PlanAbstractPath(grid, start, goalRect, startCluster, goalCluster, &waypoints)) {
+    return PlanWithFallback(grid, start, goalRect, reverseTilePath, reachedGoal);
+  }
+  
+  // Refine the abstract path by planning tile paths between subsequent waypoints.
+  // Since those are close to each other, these searches are cheap.
+  reverseTilePath->clear();
+  std::vector<QPoint> forwardPath;
+  QPoint segmentStart = start;
+  for (usize i = 0; i <= waypoints.size(); ++ i) {
+    QRect segmentGoal = (i == waypoints.size()) ? goalRect : QRect(waypoints[i], QSize(1, 1));
+    
+    bool segmentReachedGoal;
+    bool segmentOk = tilePlanner.PlanPath(grid, segmentStart, segmentGoal, &segment, &segmentReachedGoal);
+    expandedNodeCount += tilePlanner.GetExpandedNodeCount();
+    if (!segmentOk || !segmentReachedGoal) {
+      // This should not happen since the abstract graph is consistent with the grid.
+      LOG(WARNING) << "HierarchicalPathPlanner: Refinement failed, falling back to A*.";
+      int abstractExpandedNodeCount = expandedNodeCount;
+      bool result = PlanWithFallback(grid, start, goalRect, reverseTilePath, reachedGoal);
+      expandedNodeCount += abstractExpandedNodeCount;
+      return result;
+    }
+    
+    forwardPath.insert(forwardPath.end(), segment.rbegin(), segment.rend());
+    if (!forwardPath.empty()) {
+      segmentStart = forwardPath.back();
+    }
+  }
+  
+  reverseTilePath->assign(forwardPath.rbegin(), forwardPath.rend());
+  *reachedGoal = true;
+  return true;
+}
+
+bool HierarchicalPathPlanner::PlanWithFallback(const PathfindingGrid& grid, const QPoint& start, const QRect& goalRect, std::vector<QPoint>* reverseTilePath, bool* reachedGoal) {
+  bool result = tilePlanner.PlanPath(grid, start, goalRect, reverseTilePath, reachedGoal);
+  expandedNodeCount += tilePlanner.GetExpandedNodeCount();
+  return result;
+}
+
+bool HierarchicalPathPlanner::PlanAbstractPath(const PathfindingGrid& grid, const QPoint& start, const QRect& goalRect, int startCluster, int goalCluster, std::vector<QPoint>* waypoints) {
+  const HierarchicalPathGraph::Cluster& startClusterRef = graph->GetCluster(startCluster);
+  const HierarchicalPathGraph::Cluster& goalClusterRef = graph->GetCluster(goalCluster);
+  
+  // Compute the costs from the goal to the nodes of the goal cluster.
+  sources.clear();
+  QRect goalArea = goalRect.intersected(goalClusterRef.area);
+  for (int y = goalArea.top(); y <= goalArea.bottom(); ++ y) {
+    for (int x = goalArea.left(); x <= goalArea.right(); ++ x) {
+      sources.emplace_back(x, y);
+    }
+  }
+  areaSearch.Run(grid, goalClusterRef.area, sources, goalRect);
+  expandedNodeCount += areaSearch.GetExpandedNodeCount();
+  goalCosts.resize(goalClusterRef.nodes.size());
+  bool anyGoalCostFinite = false;
+  for (usize i = 0; i < goalClusterRef.nodes.size(); ++ i) {
+    goalCosts[i] = areaSearch.GetCost(goalClusterRef.nodes[i].tile);
+    anyGoalCostFinite |= goalCosts[i] != std::numeric_limits<float>::infinity();
+  }
+  if (!anyGoalCostFinite) {
+    return false;
+  }
+  
+  // Prepare the search state.
+  int nodeCount = graph->GetNodeCount();
+  int goalNode = nodeCount;
+  if (searchIdOfNode.size() != static_cast<usize>(nodeCount + 1)) {
+    nodeCost.resize(nodeCount + 1);
+    nodeParent.resize(nodeCount + 1);
+    searchIdOfNode.assign(nodeCount + 1, 0);
+    currentSearchId = 0;
+  }
+  ++ currentSearchId;
+  if (currentSearchId == 0) {
+    std::fill(searchIdOfNode.begin(), searchIdOfNode.end(), 0);
+    currentSearchId = 1;
+  }
+  openList.clear();
+  auto greater = std::greater<std::pair<float, int>>();
+  
+  auto relax = [&](int node, float newCost, int parent, const QPoint& tile) {
+    if (searchIdOfNode[node] != currentSearchId) {
+      searchIdOfNode[node] = currentSearchId;
+      nodeCost[node] = std::numeric_limits<float>::infinity();
+    }
+    if (newCost < nodeCost[node]) {
+      nodeCost[node] = newCost;
+      nodeParent[node] = parent;
+      float heuristic = (node == goalNode) ? 0 : DiagonalDistanceToRect(tile, goalRect);
+      openList.emplace_back(newCost + heuristic, node);
+      std::push_heap(openList.begin(), openList.end(), greater);
+    }
+  };
+  
+  // Connect the start to the nodes of its cluster.
+  sources.resize(1);
+  sources[0] = start;
+  areaSearch.Run(grid, startClusterRef.area, sources, QRect());
+  expandedNodeCount += areaSearch.GetExpandedNodeCount();
+  int startFirstNode = graph->GetFirstNodeIndex(startCluster);
+  for (usize i = 0; i < startClusterRef.nodes.size(); ++ i) {
+    float cost = areaSearch.GetCost(startClusterRef.nodes[i].tile);
+    if (cost != std::numeric_limits<float>::infinity()) {
+      relax(startFirstNode + i, cost, -1, startClusterRef.nodes[i].tile);
+    }
+  }
+  
+  // Run A* on the abstract graph.
+  bool reachedGoal = false;
+  while (!openList.empty()) {
+    std::pop_heap(openList.begin(), openList.end(), greater);
+    std::pair<float, int> entry = openList.back();
+    openList.pop_back();
+    int current = entry.second;
+    
+    if (current == goalNode) {
+      reachedGoal = true;
+      break;
+    }
+    
+    int cluster = graph->GetClusterOfNode(current);
+    int firstNode = graph->GetFirstNodeIndex(cluster);
+    const HierarchicalPathGraph::Node& node = graph->GetCluster(cluster).nodes[current - firstNode];
+    float currentCost = nodeCost[current];
+    if (entry.first > currentCost + DiagonalDistanceToRect(node.tile, goalRect)) {
+      // Outdated entry.
+      continue;
+    }
+    ++ expandedNodeCount;
+    
+    if (cluster == goalCluster) {
+      float goalCost = goalCosts[current - firstNode];
+      if (goalCost != std::numeric_limits<float>::infinity()) {
+        relax(goalNode, currentCost + goalCost, current, node.tile);
+      }
+    }
+    
+    const auto& clusterNodes = graph->GetCluster(cluster).nodes;
+    for (const HierarchicalPathGraph::Edge& edge : node.intraEdges) {
+      relax(firstNode + edge.targetNode, currentCost + edge.cost, current, clusterNodes[edge.targetNode].tile);
+    }
+    for (const QPoint& neighborTile : node.interNeighbors) {
+      int neighborNode = graph->GetFirstNodeIndex(graph->GetClusterIndex(neighborTile)) + graph->GetNodeAtTile(neighborTile);
+      relax(neighborNode, currentCost + 1, current, neighborTile);
+    }
+  }
+  
+  if (!reachedGoal) {
+    return false;
+  }
+  
+  // Reconstruct the abstract path.
+  waypoints->clear();
+  for (int node = nodeParent[goalNode]; node >= 0; node = nodeParent[node]) {
+    int cluster = graph->GetClusterOfNode(node);
+    waypoints->push_back(graph->GetCluster(cluster).nodes[node - graph->GetFirstNodeIndex(cluster)].tile);
+  }
+  std::reverse(waypoints->begin(), waypoints->end());
+  return true;
+}
@@ -0,0 +1,209 @@
+// Copyright 2020 The FreeAge authors
+// This file is part of FreeAge, licensed under the new BSD license.
+// See the COPYING file in the project root for the license text.
+
+#pragma once
+
+#include <utility>
+#include <vector>
+
+#include <QPoint>
+#include <QRect>
+
+#include "FreeAge/common/free_age.hpp"
+#include "FreeAge/server/pathfinding.hpp"
+
+/// Dijkstra search that is restricted to a rectangular area of a PathfindingGrid.
+/// Uses the same movement rules as the GridPathPlanner classes.
+class AreaDijkstra {
+ public:
+  /// Computes the path costs from the closest of the given source tiles to all tiles within the area.
+  /// The source tiles must be within the area. Tiles within openRect are treated as free.
+  void Run(const PathfindingGrid& grid, const QRect& area, const std::vector<QPoint>& sources, const QRect& openRect);
+  
+  /// Returns the path cost to the given tile (which must be within the area) as computed
+  /// by the last call to Run(), or infinity if the tile is not reachable.
+  inline float GetCost(const QPoint& tile) const { return cost[(tile.y() - area.y()) * area.width() + (tile.x() - area.x())]; }
+  
+  /// Returns the number of nodes expanded by the last call to Run().
+  inline int GetExpandedNodeCount() const { return expandedNodeCount; }
+  
+ private:
+  QRect area;
+  std::vector<float> cost;
+  
+  /// Heap of (cost, area-local tile index) used as priority queue.
+  std::vector<std::pair<float, int>> openList;
+  
+  int expandedNodeCount = 0;
+};
+
+/// Abstract graph for hierarchical path planning (HPA*) on a PathfindingGrid.
+///
+/// The map is divided into square clusters of kClusterSize tiles. Wherever free tiles
+/// on both sides of a cluster border allow passing from one cluster to the next, a
+/// transition is created. The tiles of the transitions are the nodes of the abstract graph.
+/// Nodes within the same cluster are connected by intra-cluster edges whose costs are
+/// the lengths of the shortest paths within the cluster. Nodes of the same transition
+/// are connected by inter-cluster edges with cost 1.
+///
+/// When the occupancy of some tiles changes, MarkAreaChanged() must be called for them.
+/// Only the affected clusters (and their neighbors) are rebuilt by the next call to Update().
+class HierarchicalPathGraph {
+ public:
+  /// Side length of the clusters in tiles.
+  static constexpr int kClusterSize = 16;
+  
+  /// Maximum length of a free run of tiles along a cluster border for which a single
+  /// transition (in the center of the run) is created. Longer runs get two transitions,
+  /// one at each end.
+  static constexpr int kMaxSingleTransitionRunLength = 6;
+  
+  struct Edge {
+    inline Edge(int targetNode, float cost)
+        : targetNode(targetNode),
+          cost(cost) {}
+    
+    /// Index of the target node within the same cluster.
+    int targetNode;
+    float cost;
+  };
+  
+  struct Node {
+    inline Node(const QPoint& tile)
+        : tile(tile) {}
+    
+    QPoint tile;
+    
+    /// Edges to other nodes within the same cluster.
+    std::vector<Edge> intraEdges;
+    
+    /// Tiles of the nodes in neighboring clusters that this node is connected to (with cost 1).
+    std::vector<QPoint> interNeighbors;
+  };
+  
+  struct Cluster {
+    /// The tiles covered by the cluster.
+    QRect area;
+    
+    std::vector<Node> nodes;
+    
+    /// Whether the cluster needs to be rebuilt in the next call to Update().
+    bool dirty;
+  };
+  
+  /// Initializes the graph for a map of the given size. All clusters are marked as dirty.
+  void Initialize(int width, int height);
+  
+  /// Notifies the graph that the occupancy of the tiles within tileRect has changed.
+  void MarkAreaChanged(const QRect& tileRect);
+  
+  /// Rebuilds the dirty clusters (and their neighbors, whose transitions may have changed).
+  void Update(const PathfindingGrid& grid);
+  
+  /// Returns whether Update() must be called before using the graph.
+  inline bool NeedsUpdate() const { return anyClusterDirty; }
+  
+  /// Brings this graph up-to-date with source, which must always be the same graph and must not need an update.
+  /// Only the clusters that were rebuilt since the last call are copied. This is used to keep copies for other threads cheaply.
+  void CopyChangesFrom(const HierarchicalPathGraph& source);
+  
+  inline int GetClusterIndex(const QPoint& tile) const { return (tile.y() / kClusterSize) * clustersX + (tile.x() / kClusterSize); }
+  inline const Cluster& GetCluster(int clusterIndex) const { return clusters[clusterIndex]; }
+  
+  /// Returns the index of the node at the given tile within the tile's cluster, or -1 if there is no node at this tile.
+  inline int GetNodeAtTile(const QPoint& tile) const { return nodeAtTile[tile.y() * width + tile.x()]; }
+  
+  /// Nodes can also be addressed with a global index, which is: GetFirstNodeIndex(clusterIndex) + node index within the cluster.
+  inline int GetFirstNodeIndex(int clusterIndex) const { return clusterFirstNode[clusterIndex]; }
+  inline int GetClusterOfNode(int globalNodeIndex) const { return nodeCluster[globalNodeIndex]; }
+  inline int GetNodeCount() const { return nodeCluster.size(); }
+  
+ private:
+  /// Computes the transitions across the right border (if vertical is true) or the bottom border
+  /// (if vertical is false) of the given cluster.
+  void ComputeBorderTransitions(const PathfindingGrid& grid, int clusterIndex, bool vertical);
+  
+  /// Recreates the nodes and edges of the given cluster from the current border transitions.
+  void RebuildCluster(const PathfindingGrid& grid, int clusterIndex);
+  
+  
+  int width = 0;
+  int height = 0;
+  
+  int clustersX = 0;
+  int clustersY = 0;
+  
+  /// The clusters in row-major order.
+  std::vector<Cluster> clusters;
+  
+  /// For each cluster, the transitions across its right and bottom borders.
+  /// For each transition, the first tile is within the cluster and the second tile is in the neighboring cluster.
+  std::vector<std::vector<std::pair<QPoint, QPoint>>> rightBorderTransitions;
+  std::vector<std::vector<std::pair<QPoint, QPoint>>> bottomBorderTransitions;
+  
+  /// For each tile, the index of the node at this tile within its cluster, or -1.
+  std::vector<i16> nodeAtTile;
+  
+  /// Prefix sums of the node counts of the clusters, and the inverse mapping from global node index to cluster index.
+  std::vector<int> clusterFirstNode;
+  std::vector<int> nodeCluster;
+  
+  bool anyClusterDirty = false;
+  
+  /// Counter that is incremented by each call to Update() that rebuilds clusters, and for each cluster,
+  /// the value of the counter when it was last rebuilt. For copies made by CopyChangesFrom(),
+  /// updateCount is the source's counter at the time of the copy.
+  u32 updateCount = 0;
+  std::vector<u32> clusterUpdateCounts;
+  
+  AreaDijkstra areaSearch;
+};
+
+/// Hierarchical path planner (HPA*). Plans a path on the abstract graph of a
+/// HierarchicalPathGraph first, and then refines each abstract edge to a tile path with A*.
+///
+/// This is much cheaper than A* on the full grid for long paths. The resulting paths may
+/// be slightly longer than optimal ones, but they are smoothed afterwards anyway.
+/// If the start and the goal are in the same cluster, or if the abstract search fails
+/// (for example, because the goal is not reachable), this falls back to A* on the full grid.
+class HierarchicalPathPlanner : public GridPathPlanner {
+ public:
+  /// Sets the graph to use. It must be up-to-date with the grid passed to PlanPath().
+  inline void SetGraph(const HierarchicalPathGraph* graph) { this->graph = graph; }
+  
+  bool PlanPath(const PathfindingGrid& grid, const QPoint& start, const QRect& goalRect, std::vector<QPoint>* reverseTilePath, bool* reachedGoal) override;
+  
+ private:
+  /// Searches for a path on the abstract graph. On success, returns the tiles of the
+  /// abstract nodes on the path in forward order.
+  bool PlanAbstractPath(const PathfindingGrid& grid, const QPoint& start, const QRect& goalRect, int startCluster, int goalCluster, std::vector<QPoint>* waypoints);
+  
+  /// Plans on the full grid using tilePlanner.
+  bool PlanWithFallback(const PathfindingGrid& grid, const QPoint& start, const QRect& goalRect, std::vector<QPoint>* reverseTilePath, bool* reachedGoal);
+  
+  
+  const HierarchicalPathGraph* graph = nullptr;
+  
+  /// Planner used for refinement and as fallback.
+  AStarPathPlanner tilePlanner;
+  
+  /// Used to connect the start and the goal to the nodes of their clusters.
+  AreaDijkstra areaSearch;
+  
+  // Search state for the abstract graph, indexed by global node index.
+  // The virtual goal node has index graph->GetNodeCount().
+  std::vector<float> nodeCost;
+  std::vector<int> nodeParent;
+  std::vector<u32> searchIdOfNode;
+  u32 currentSearchId = 0;
+  
+  /// Heap of (cost + heuristic, global node index) used as priority queue.
+  std::vector<std::pair<float, int>> openList;
+  
+  /// Costs from the goal to the nodes of the goal cluster.
+  std::vector<float> goalCosts;
+  
+  std::vector<QPoint> sources;
+  std::vector<QPoint> segment;
+};
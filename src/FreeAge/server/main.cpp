@@ -3,8 +3,10 @@
 // See the COPYING file in the project root for the license text.
 
 #include <chrono>
+#include <cstdlib>
 #include <limits>
 #include <memory>
+#include <string>
 #include <vector>
 
 #include <QApplication>
@@ -18,10 +20,51 @@
 #include "FreeAge/common/messages.hpp"
 #include "FreeAge/server/game.hpp"
 #include "FreeAge/server/match_setup.hpp"
+#include "FreeAge/server/replay.hpp"
 #include "FreeAge/server/settings.hpp"
 
 #include <mango/core/endian.hpp>
 
+/// Replays the game from the replay log given by settings->replayPath, without network communication.
+static int RunReplay(ServerSettings* settings) {
+  ReplayReader reader;
+  ReplayHeader header;
+  if (!reader.Open(settings->replayPath, &header)) {
+    return 1;
+  }
+  LOG(INFO) << "Server: Replaying " << settings->replayPath.toStdString() << " (" << header.initialResources.size() << " players, map size " << header.mapSize << ")";
+  
+  // Use the settings of the recorded game that affect the simulation.
+  settings->mapSize = header.mapSize;
+  settings->pathPlanner = header.pathPlanner;
+  settings->logStateHashes = true;
+  
+  std::vector<std::shared_ptr<PlayerInGame>> playersInGame;
+  for (usize playerIndex = 0; playerIndex < header.initialResources.size(); ++ playerIndex) {
+    std::shared_ptr<PlayerInGame> newPlayer(new PlayerInGame());
+    
+    newPlayer->index = playerIndex;
+    newPlayer->socket = new DiscardingSocket();
+    newPlayer->name = QString::number(playerIndex);
+    newPlayer->playerColorIndex = playerIndex;
+    newPlayer->lastPingTime = Clock::now();
+    newPlayer->resources = header.initialResources[playerIndex];
+    newPlayer->lastResources = newPlayer->resources;
+    
+    playersInGame.emplace_back(newPlayer);
+  }
+  
+  Game game(settings);
+  game.RunReplay(&playersInGame, &reader, header);
+  
+  for (const auto& player : playersInGame) {
+    delete player->socket;
+  }
+  
+  LOG(INFO) << "Server: Exit";
+  return 0;
+}
+
 int main(int argc, char** argv) {
   // Seed the random number generator.
   srand(time(nullptr));
@@ -46,10 +89,29 @@ int main(int argc, char** argv) {
   // Parse command line arguments.
   ServerSettings settings;
   settings.serverStartTime = Clock::now();
-  if (argc != 2) {
-    LOG(INFO) << "Usage: FreeAgeServer <host_token>";
+  if (argc < 2) {
+    LOG(INFO) << "Usage: FreeAgeServer <host_token> [--path-planner=astar|jps] [--simulation-threads=<count>] [--log-state-hashes] [--record-replay=<path>] [--replay=<path>]";
     return 1;
   }
+  for (int i = 2; i < argc; ++ i) {
+    std::string argument = argv[i];
+    if (argument == "--path-planner=astar") {
+      settings.pathPlanner = GridPathPlannerType::AStar;
+    } else if (argument == "--path-planner=jps") {
+      settings.pathPlanner = GridPathPlannerType::JumpPointSearch;
+    } else if (argument.rfind("--simulation-threads=", 0) == 0) {
+      settings.simulationThreadCount = std::atoi(argument.c_str() + std::string("--simulation-threads=").size());
+    } else if (argument == "--log-state-hashes") {
+      settings.logStateHashes = true;
+    } else if (argument.rfind("--record-replay=", 0) == 0) {
+      settings.recordReplayPath = QString::fromStdString(argument.substr(std::string("--record-replay=").size()));
+    } else if (argument.rfind("--replay=", 0) == 0) {
+      settings.replayPath = QString::fromStdString(argument.substr(std::string("--replay=").size()));
+    } else {
+      LOG(ERROR) << "Unknown argument: " << argument;
+      return 1;
+    }
+  }
   if (argv[1] == std::string("--no-token")) {
     settings.hostToken = "aaaaaa";
   } else {
@@ -60,6 +122,11 @@ int main(int argc, char** argv) {
     return 1;
   }
   
+  // In replay mode, simulate the recorded game instead of hosting a game.
+  if (!settings.replayPath.isEmpty()) {
+    return RunReplay(&settings);
+  }
+  
   // Start listening for incoming connections.
   std::shared_ptr<QTcpServer> server(new QTcpServer());
   if (!server->listen(QHostAddress::Any, serverPort)) {
@@ -93,7 +160,7 @@ int main(int argc, char** argv) {
       
       newPlayer->index = playersInGame.size();
       newPlayer->socket = player->socket;
-      newPlayer->unparsedBuffer = player->unparsedBuffer;
+      newPlayer->unparsedBuffer = std::move(player->unparsedBuffer);
       newPlayer->name = player->name;
       newPlayer->playerColorIndex = player->playerColorIndex;
       newPlayer->lastPingTime = player->lastPingTime;
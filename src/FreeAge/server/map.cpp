@@ -4,7 +4,9 @@
 
 #include "FreeAge/server/map.hpp"
 
+#include <algorithm>
 #include <cmath>
+#include <cstring>
 #include <vector>
 
 #include <mango/core/endian.hpp>
@@ -12,6 +14,7 @@
 
 #include "FreeAge/common/logging.hpp"
 #include "FreeAge/common/messages.hpp"
+#include "FreeAge/common/util.hpp"
 #include "FreeAge/server/building.hpp"
 #include "FreeAge/server/unit.hpp"
 
@@ -34,6 +37,23 @@ ServerMap::ServerMap(int width, int height)
       }
     }
   }
+  
+  hierarchicalPathGraph.Initialize(width, height);
+  connectedComponents.Initialize(GetPathfindingGrid());
+  
+  occupancyBlocksX = (width + kOccupancyBlockSize - 1) / kOccupancyBlockSize;
+  occupancyBlockVersions.resize(occupancyBlocksX * ((height + kOccupancyBlockSize - 1) / kOccupancyBlockSize), 0);
+  
+  // Initialize the spatial unit index.
+  unitCellsX = (width + kUnitCellSize - 1) / kUnitCellSize;
+  unitCellsY = (height + kUnitCellSize - 1) / kUnitCellSize;
+  unitCells.resize(unitCellsX * unitCellsY);
+  unitChangeVersions.resize(width * height, 0);
+  
+  maxUnitRadius = 0;
+  for (int type = 0; type < static_cast<int>(UnitType::NumUnits); ++ type) {
+    maxUnitRadius = std::max(maxUnitRadius, GetUnitRadius(static_cast<UnitType>(type)));
+  }
 }
 
 ServerMap::~ServerMap() {
@@ -389,7 +409,7 @@ void ServerMap::PlaceElevation(int tileX, int tileY, int elevationValue) {
   }
 }
 
-bool ServerMap::DoesUnitCollide(ServerUnit* unit, const QPointF& mapCoord, ServerUnit** collidingUnit) {
+bool ServerMap::DoesUnitCollide(const ServerUnit* unit, const QPointF& mapCoord, ServerUnit** collidingUnit) const {
   float radius = GetUnitRadius(unit->GetUnitType());
   
   // Test collision with the map bounds, accounting for NaNs with the negation
@@ -432,23 +452,26 @@ bool ServerMap::DoesUnitCollide(ServerUnit* unit, const QPointF& mapCoord, Serve
   }
   
   // Test collision with other units
-  // TODO: Use some spatial access structure to reduce the number of tests.
-  //       Probably store a list of units on each map tile.
-  for (const auto& item : objects) {
-    ServerObject* object = item.second;
-    if (object->isUnit() && object != unit) {
-      ServerUnit* otherUnit = AsUnit(object);
-      
-      float otherRadius = GetUnitRadius(otherUnit->GetUnitType());
-      QPointF offset = otherUnit->GetMapCoord() - mapCoord;
-      float squaredDistance = offset.x() * offset.x() + offset.y() * offset.y();
-      if (squaredDistance < (radius + otherRadius) * (radius + otherRadius)) {
-        if (collidingUnit) {
-          *collidingUnit = otherUnit;
-        }
-        return true;
+  bool collides = false;
+  ForEachUnitInArea(mapCoord.x() - radius, mapCoord.y() - radius, mapCoord.x() + radius, mapCoord.y() + radius, [&](ServerUnit* otherUnit) {
+    if (otherUnit == unit) {
+      return true;
+    }
+    
+    float otherRadius = GetUnitRadius(otherUnit->GetUnitType());
+    QPointF offset = otherUnit->GetMapCoord() - mapCoord;
+    float squaredDistance = offset.x() * offset.x() + offset.y() * offset.y();
+    if (squaredDistance < (radius + otherRadius) * (radius + otherRadius)) {
+      if (collidingUnit) {
+        *collidingUnit = otherUnit;
       }
+      collides = true;
+      return false;
     }
+    return true;
+  });
+  if (collides) {
+    return true;
   }
   
   return false;
@@ -456,7 +479,7 @@ bool ServerMap::DoesUnitCollide(ServerUnit* unit, const QPointF& mapCoord, Serve
 
 ServerBuilding* ServerMap::AddBuilding(int player, BuildingType type, const QPoint& baseTile, float buildPercentage, u32* id, bool addOccupancy) {
   ServerBuilding* newBuilding = new ServerBuilding(player, type, baseTile, buildPercentage);
-  int newId = AddBuilding(newBuilding, addOccupancy);
+  u32 newId = AddBuilding(newBuilding, addOccupancy);
   if (id) {
     *id = newId;
   }
@@ -465,15 +488,15 @@ ServerBuilding* ServerMap::AddBuilding(int player, BuildingType type, const QPoi
 
 u32 ServerMap::AddBuilding(ServerBuilding* newBuilding, bool addOccupancy) {
   // Insert into objects map
-  objects.insert(std::make_pair(nextObjectID, newBuilding));
-  ++ nextObjectID;
+  u32 newId = objects.insert(newBuilding);
+  newBuilding->SetId(newId);
   
   // Mark the occupied tiles as such
   if (addOccupancy) {
     AddBuildingOccupancy(newBuilding);
   }
   
-  return nextObjectID - 1;
+  return newId;
 }
 
 void ServerMap::AddBuildingOccupancy(ServerBuilding* building) {
@@ -494,9 +517,37 @@ ServerUnit* ServerMap::AddUnit(int player, UnitType type, const QPointF& positio
 }
 
 u32 ServerMap::AddUnit(ServerUnit* newUnit) {
-  objects.insert(std::make_pair(nextObjectID, newUnit));
-  ++ nextObjectID;
-  return nextObjectID - 1;
+  u32 newId = objects.insert(newUnit);
+  newUnit->SetId(newId);
+  InsertUnitIntoCell(newUnit);
+  return newId;
+}
+
+void ServerMap::SetUnitMapCoord(ServerUnit* unit, const QPointF& mapCoord) {
+  if (UnitCellIndex(unit->GetMapCoord()) == UnitCellIndex(mapCoord)) {
+    MarkUnitsChanged(unit->GetMapCoord());
+    unit->SetMapCoord(mapCoord);
+    MarkUnitsChanged(mapCoord);
+    return;
+  }
+  
+  RemoveUnitFromCell(unit);
+  unit->SetMapCoord(mapCoord);
+  InsertUnitIntoCell(unit);
+}
+
+bool ServerMap::DeleteObject(u32 objectId) {
+  auto it = objects.find(objectId);
+  if (it == objects.end()) {
+    return false;
+  }
+  
+  if (it->second->isUnit()) {
+    RemoveUnitFromCell(AsUnit(it->second));
+  }
+  delete it->second;
+  objects.erase(it);
+  return true;
 }
 
 void ServerMap::SetBuildingOccupancy(ServerBuilding* building, bool occupied) {
@@ -507,6 +558,16 @@ void ServerMap::SetBuildingOccupancy(ServerBuilding* building, bool occupied) {
       occupiedForUnitsAt(x, y) = occupied;
     }
   }
+  QRect changedRect(baseTile + occupancyRect.topLeft(), occupancyRect.size());
+  hierarchicalPathGraph.MarkAreaChanged(changedRect);
+  connectedComponents.Update(GetPathfindingGrid(), changedRect);
+  ++ occupancyVersion;
+  
+  for (int blockY = changedRect.top() / kOccupancyBlockSize; blockY <= changedRect.bottom() / kOccupancyBlockSize; ++ blockY) {
+    for (int blockX = changedRect.left() / kOccupancyBlockSize; blockX <= changedRect.right() / kOccupancyBlockSize; ++ blockX) {
+      occupancyBlockVersions[blockY * occupancyBlocksX + blockX] = occupancyVersion;
+    }
+  }
   
   QSize buildingSize = GetBuildingSize(building->GetBuildingType());
   for (int y = baseTile.y(), endY = baseTile.y() + buildingSize.height(); y < endY; ++ y) {
@@ -516,6 +577,90 @@ void ServerMap::SetBuildingOccupancy(ServerBuilding* building, bool occupied) {
   }
 }
 
+void ServerMap::CopyOccupancyChangedSince(u32 version, bool* occupied) const {
+  for (usize block = 0; block < occupancyBlockVersions.size(); ++ block) {
+    if (occupancyBlockVersions[block] <= version) {
+      continue;
+    }
+    
+    int minX = (block % occupancyBlocksX) * kOccupancyBlockSize;
+    int minY = (block / occupancyBlocksX) * kOccupancyBlockSize;
+    int blockWidth = std::min(kOccupancyBlockSize, width - minX);
+    for (int y = minY, endY = std::min(height, minY + kOccupancyBlockSize); y < endY; ++ y) {
+      memcpy(occupied + y * width + minX, occupiedForUnits + y * width + minX, blockWidth * sizeof(bool));
+    }
+  }
+}
+
+const HierarchicalPathGraph& ServerMap::GetHierarchicalPathGraph() {
+  hierarchicalPathGraph.Update(GetPathfindingGrid());
+  return hierarchicalPathGraph;
+}
+
+bool ServerMap::HaveUnitsChangedSince(const QRect& tiles, u64 version) const {
+  for (int y = tiles.top(); y <= tiles.bottom(); ++ y) {
+    for (int x = tiles.left(); x <= tiles.right(); ++ x) {
+      if (unitChangeVersions[y * width + x] > version) {
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+u64 ServerMap::ComputeObjectStateHash() const {
+  u64 hash = kInitialHashValue;
+  for (const auto& item : objects) {
+    const ServerObject* object = item.second;
+    HashValue(item.first, &hash);
+    HashValue(object->GetPlayerIndex(), &hash);
+    HashValue(object->GetHPInternalFloat(), &hash);
+    
+    if (object->isUnit()) {
+      const ServerUnit* unit = AsUnit(object);
+      HashValue(unit->GetUnitType(), &hash);
+      HashValue(unit->GetMapCoord().x(), &hash);
+      HashValue(unit->GetMapCoord().y(), &hash);
+      HashValue(unit->GetMovementDirection().x(), &hash);
+      HashValue(unit->GetMovementDirection().y(), &hash);
+      HashValue(unit->GetCurrentAction(), &hash);
+      HashValue(unit->GetTargetObjectId(), &hash);
+      HashValue(unit->HasPath(), &hash);
+      HashValue(unit->GetCarriedResourceType(), &hash);
+      HashValue(unit->GetCarriedResourceAmountInternalFloat(), &hash);
+    } else if (object->isBuilding()) {
+      const ServerBuilding* building = AsBuilding(object);
+      HashValue(building->GetBuildingType(), &hash);
+      HashValue(building->GetBaseTile().x(), &hash);
+      HashValue(building->GetBaseTile().y(), &hash);
+      HashValue(building->GetBuildPercentage(), &hash);
+      HashValue(building->IsProducing(), &hash);
+      HashValue(building->GetProductionEndStep(), &hash);
+    }
+  }
+  return hash;
+}
+
+void ServerMap::InsertUnitIntoCell(ServerUnit* unit) {
+  unitCells[UnitCellIndex(unit->GetMapCoord())].push_back(unit);
+  MarkUnitsChanged(unit->GetMapCoord());
+}
+
+void ServerMap::RemoveUnitFromCell(ServerUnit* unit) {
+  std::vector<ServerUnit*>& cell = unitCells[UnitCellIndex(unit->GetMapCoord())];
+  for (usize i = 0, size = cell.size(); i < size; ++ i) {
+    if (cell[i] == unit) {
+      // Moving the last unit of the cell changes the iteration order of the cell's units.
+      MarkUnitsChanged(unit->GetMapCoord());
+      MarkUnitsChanged(cell.back()->GetMapCoord());
+      cell[i] = cell.back();
+      cell.pop_back();
+      return;
+    }
+  }
+  LOG(ERROR) << "Did not find the unit to remove in the spatial unit index.";
+}
+
 bool ServerMap::SpawnBuildingClump(const QPoint& spawnLoc, int count, BuildingType type) {
   QPoint curLoc = spawnLoc;
   
@@ -4,14 +4,20 @@
 
 #pragma once
 
-#include <unordered_map>
+#include <algorithm>
+#include <vector>
 
 #include <QByteArray>
 #include <QPoint>
+#include <QRect>
 
 #include "FreeAge/common/building_types.hpp"
 #include "FreeAge/common/unit_types.hpp"
+#include "FreeAge/server/connected_components.hpp"
+#include "FreeAge/server/hierarchical_pathfinding.hpp"
 #include "FreeAge/server/object.hpp"
+#include "FreeAge/server/pathfinding.hpp"
+#include "FreeAge/server/slot_map.hpp"
 
 class ServerBuilding;
 class ServerUnit;
@@ -46,11 +52,71 @@ class ServerMap {
   /// Adds the given unit to the map and returns the ID that it received.
   u32 AddUnit(ServerUnit* newUnit);
   
+  /// Moves the given unit (which must have been added to the map already) to the given mapCoord.
+  /// This must be used instead of setting the unit's position directly since it keeps
+  /// the spatial unit index up-to-date.
+  void SetUnitMapCoord(ServerUnit* unit, const QPointF& mapCoord);
+  
+  /// Removes the object with the given ID from the map and deletes it.
+  /// Returns false if no object with this ID exists.
+  bool DeleteObject(u32 objectId);
+  
   /// Tests whether the given unit could stand at the given mapCoord without
   /// colliding with other units or occupied space (buildings, etc.).
   /// If the function returns true and the unit would collide with another unit,
   /// returns that unit in "collidingUnit".
-  bool DoesUnitCollide(ServerUnit* unit, const QPointF& mapCoord, ServerUnit** collidingUnit = nullptr);
+  bool DoesUnitCollide(const ServerUnit* unit, const QPointF& mapCoord, ServerUnit** collidingUnit = nullptr) const;
+  
+  /// Calls callback(ServerUnit*) for all units that might overlap the given area (given in map coordinates).
+  /// The area is automatically extended by the maximum unit radius, so all units whose circle
+  /// intersects the area are visited; some units further away may be visited as well.
+  /// If the callback returns false, the iteration stops early.
+  template <typename Callback>
+  void ForEachUnitInArea(float minX, float minY, float maxX, float maxY, Callback callback) const {
+    int minCellX = UnitCellCoord(minX - maxUnitRadius, unitCellsX);
+    int minCellY = UnitCellCoord(minY - maxUnitRadius, unitCellsY);
+    int maxCellX = UnitCellCoord(maxX + maxUnitRadius, unitCellsX);
+    int maxCellY = UnitCellCoord(maxY + maxUnitRadius, unitCellsY);
+    for (int cellY = minCellY; cellY <= maxCellY; ++ cellY) {
+      for (int cellX = minCellX; cellX <= maxCellX; ++ cellX) {
+        for (ServerUnit* unit : unitCells[cellY * unitCellsX + cellX]) {
+          if (!callback(unit)) {
+            return;
+          }
+        }
+      }
+    }
+  }
+  
+  /// Returns the tiles which contain the centers of all units that might overlap the given area (given in map coordinates),
+  /// i.e., the tiles whose units may affect the result of ForEachUnitInArea() and DoesUnitCollide() for this area.
+  /// Coordinates outside of the map are clamped to the border tiles.
+  inline QRect GetUnitTilesInArea(float minX, float minY, float maxX, float maxY) const {
+    // The small margin accounts for rounding in the computation of the unit tiles.
+    constexpr float kMargin = 0.01f;
+    float extent = maxUnitRadius + kMargin;
+    return QRect(
+        QPoint(UnitTileCoord(minX - extent, width), UnitTileCoord(minY - extent, height)),
+        QPoint(UnitTileCoord(maxX + extent, width), UnitTileCoord(maxY + extent, height)));
+  }
+  
+  /// Returns the tile that contains the center of a unit at the given mapCoord (clamped to the map).
+  inline QRect GetUnitTile(const QPointF& mapCoord) const {
+    return QRect(UnitTileCoord(mapCoord.x(), width), UnitTileCoord(mapCoord.y(), height), 1, 1);
+  }
+  
+  /// Returns a counter that is incremented whenever a unit is added, removed, or moved, or the iteration
+  /// order of the units in the spatial unit index changes. Together with HaveUnitsChangedSince(),
+  /// this allows to detect whether the result of a collision test is still up-to-date.
+  inline u64 GetUnitsVersion() const { return unitsVersion; }
+  
+  /// Returns whether any unit within the given tiles (as returned by GetUnitTilesInArea())
+  /// has changed after GetUnitsVersion() returned the given version.
+  bool HaveUnitsChangedSince(const QRect& tiles, u64 version) const;
+  
+  /// Returns a hash of the state of all objects on the map. This allows to verify that
+  /// different ways of simulating the game lead to exactly the same result.
+  u64 ComputeObjectStateHash() const;
   
   /// Returns the elevation at the given tile corner.
   inline int& elevationAt(int cornerX, int cornerY) { return elevation[cornerY * (width + 1) + cornerX]; }
@@ -63,8 +129,34 @@ class ServerMap {
   inline bool& occupiedForBuildingsAt(int tileX, int tileY) { return occupiedForBuildings[tileY * width + tileX]; }
   inline const bool& occupiedForBuildingsAt(int tileX, int tileY) const { return occupiedForBuildings[tileY * width + tileX]; }
   
-  inline std::unordered_map<u32, ServerObject*>& GetObjects() { return objects; }
-  inline const std::unordered_map<u32, ServerObject*>& GetObjects() const { return objects; }
+  /// Returns a view on the occupancy for units, which is used for path planning.
+  inline PathfindingGrid GetPathfindingGrid() const { return PathfindingGrid(width, height, occupiedForUnits); }
+  
+  /// Returns a counter that is incremented whenever the occupancy for units changes.
+  /// This allows to detect whether copies of the occupancy are still up-to-date.
+  inline u32 GetOccupancyVersion() const { return occupancyVersion; }
+  
+  /// Side length (in tiles) of the square blocks in which changes of the occupancy for units are tracked.
+  static constexpr int kOccupancyBlockSize = HierarchicalPathGraph::kClusterSize;
+  
+  /// Returns, for each block of kOccupancyBlockSize x kOccupancyBlockSize tiles (in row-major order),
+  /// the occupancy version after the last change of the occupancy for units within the block.
+  inline const std::vector<u32>& GetOccupancyBlockVersions() const { return occupancyBlockVersions; }
+  
+  /// Copies the occupancy for units of the tiles that changed after the given occupancy version to occupied,
+  /// which must have the size of the map and be up-to-date with this version otherwise. The occupancy is
+  /// copied in whole blocks (see GetOccupancyBlockVersions()).
+  void CopyOccupancyChangedSince(u32 version, bool* occupied) const;
+  
+  /// Returns the abstract graph for hierarchical path planning.
+  /// It is updated to the current occupancy for units before it is returned.
+  const HierarchicalPathGraph& GetHierarchicalPathGraph();
+  
+  /// Returns the connected components of the free tiles, which are always up-to-date with the occupancy for units.
+  inline const ConnectedComponents& GetConnectedComponents() const { return connectedComponents; }
+  
+  inline SlotMap<ServerObject*>& GetObjects() { return objects; }
+  inline const SlotMap<ServerObject*>& GetObjects() const { return objects; }
   
   inline int GetWidth() const { return width; }
   inline int GetHeight() const { return height; }
@@ -74,6 +166,35 @@ class ServerMap {
   
   bool SpawnBuildingClump(const QPoint& spawnLoc, int count, BuildingType type);
   
+  /// Returns the index of the unit cell (in one dimension) that contains the given map coordinate.
+  /// Coordinates outside of the map (and NaNs) are clamped to the border cells.
+  inline int UnitCellCoord(float mapCoord, int cellCount) const {
+    if (!(mapCoord >= 0)) {
+      return 0;
+    }
+    return std::min(cellCount - 1, static_cast<int>(mapCoord / kUnitCellSize));
+  }
+  inline int UnitCellIndex(const QPointF& mapCoord) const {
+    return UnitCellCoord(mapCoord.y(), unitCellsY) * unitCellsX + UnitCellCoord(mapCoord.x(), unitCellsX);
+  }
+  
+  void InsertUnitIntoCell(ServerUnit* unit);
+  void RemoveUnitFromCell(ServerUnit* unit);
+  
+  /// Returns the index of the tile (in one dimension) that contains the given map coordinate,
+  /// clamped to the map like UnitCellCoord().
+  inline int UnitTileCoord(float mapCoord, int tileCount) const {
+    if (!(mapCoord >= 0)) {
+      return 0;
+    }
+    return std::min(tileCount - 1, static_cast<int>(mapCoord));
+  }
+  
+  /// Records a change of the unit(s) in the tile that contains the given map coordinate (see GetUnitsVersion()).
+  inline void MarkUnitsChanged(const QPointF& mapCoord) {
+    unitChangeVersions[UnitTileCoord(mapCoord.y(), height) * width + UnitTileCoord(mapCoord.x(), width)] = ++ unitsVersion;
+  }
+  
   
   /// The maximum possible elevation level (the lowest is zero).
   /// This may be higher than the maximum actually existing
@@ -105,9 +226,42 @@ class ServerMap {
   /// Height of the map in tiles.
   int height;
   
-  /// The next ID that will be given to the next added building or unit.
-  u32 nextObjectID = 0;
+  /// Map of object ID -> ServerObject*. The object IDs are the slot map's handles,
+  /// so IDs of deleted objects are never handed out again. The pointer is owned by the map.
+  SlotMap<ServerObject*> objects;
+  
+  /// Abstract graph for hierarchical path planning. It is updated lazily, i.e., changes
+  /// to the occupancy only mark the affected clusters as dirty.
+  HierarchicalPathGraph hierarchicalPathGraph;
+  
+  /// Connected components of the free tiles with respect to the occupancy for units.
+  /// In contrast to hierarchicalPathGraph, these are updated immediately when the occupancy changes.
+  ConnectedComponents connectedComponents;
+  
+  /// See GetOccupancyVersion().
+  u32 occupancyVersion = 0;
+  
+  /// See GetOccupancyBlockVersions().
+  int occupancyBlocksX;
+  std::vector<u32> occupancyBlockVersions;
+  
+  /// Side length of the cells of the spatial unit index, in tiles.
+  static constexpr int kUnitCellSize = 2;
+  
+  /// Spatial index for the units on the map: a grid of cells, each storing the units whose
+  /// center is within the cell. This is used to only test nearby units in collision queries.
+  /// The array size is unitCellsX * unitCellsY. An element (x, y) has index: [y * unitCellsX + x].
+  std::vector<std::vector<ServerUnit*>> unitCells;
+  int unitCellsX;
+  int unitCellsY;
+  
+  /// For each tile, the value of unitsVersion after the last change of a unit whose center is in the tile.
+  /// An element (x, y) has index: [y * width + x].
+  std::vector<u64> unitChangeVersions;
+  
+  /// See GetUnitsVersion().
+  u64 unitsVersion = 0;
   
-  /// Map of object ID -> ServerObject*. The pointer is owned by the map.
-  std::unordered_map<u32, ServerObject*> objects;
+  /// The largest radius of any unit type. Used to extend the area in spatial index queries.
+  float maxUnitRadius;
 };
@@ -5,10 +5,10 @@
 #include "FreeAge/server/match_setup.hpp"
 
 #include <QApplication>
-#include <QThread>
 
 #include "FreeAge/common/logging.hpp"
 #include "FreeAge/common/messages.hpp"
+#include "FreeAge/server/event_waiter.hpp"
 
 // TODO (puzzlepaint): For some reason, this include needed to be after the Qt includes on my laptop
 // in order for CIDE not to show some errors. Compiling always worked. Check the reason for the errors.
@@ -125,15 +125,15 @@ void SendWelcomeAndJoinMessage(PlayerInMatch* player, const std::vector<std::sha
   }
 }
 
-bool HandleHostConnect(const QByteArray& msg, int len, PlayerInMatch* player, const std::vector<std::shared_ptr<PlayerInMatch>>& playersInMatch, const ServerSettings& settings) {
+bool HandleHostConnect(const MessageView& msg, PlayerInMatch* player, const std::vector<std::shared_ptr<PlayerInMatch>>& playersInMatch, const ServerSettings& settings) {
   LOG(INFO) << "Server: Received HostConnect";
   
-  if (msg.length() < 3 + hostTokenLength || len < 3 + hostTokenLength) {
+  if (msg.GetSize() < 3 + hostTokenLength) {
     LOG(ERROR) << "Received a too short HostConnect message";
     return false;
   }
   
-  QByteArray providedToken = msg.mid(3, hostTokenLength);
+  QByteArray providedToken = msg.Mid(3, hostTokenLength);
   if (providedToken != settings.hostToken) {
     LOG(WARNING) << "Received a HostConnect message with an invalid host token: " << providedToken.toStdString();
     return false;
@@ -147,7 +147,7 @@ bool HandleHostConnect(const QByteArray& msg, int len, PlayerInMatch* player, co
   }
   player->isHost = true;
   
-  player->name = QString::fromUtf8(msg.mid(3 + hostTokenLength, len - (3 + hostTokenLength)));
+  player->name = QString::fromUtf8(msg.Mid(3 + hostTokenLength, msg.GetSize() - (3 + hostTokenLength)));
   player->playerColorIndex = 0;
   player->state = PlayerInMatch::State::Joined;
   
@@ -155,7 +155,7 @@ bool HandleHostConnect(const QByteArray& msg, int len, PlayerInMatch* player, co
   return true;
 }
 
-bool HandleConnect(const QByteArray& msg, int len, PlayerInMatch* player, const std::vector<std::shared_ptr<PlayerInMatch>>& playersInMatch, const ServerSettings& settings) {
+bool HandleConnect(const MessageView& msg, PlayerInMatch* player, const std::vector<std::shared_ptr<PlayerInMatch>>& playersInMatch, const ServerSettings& settings) {
   LOG(INFO) << "Server: Received Connect";
   
   bool thereIsAHost = false;
@@ -170,7 +170,7 @@ bool HandleConnect(const QByteArray& msg, int len, PlayerInMatch* player, const
     return false;
   }
   
-  player->name = QString::fromUtf8(msg.mid(3, len - 3));
+  player->name = QString::fromUtf8(msg.Mid(3, msg.GetSize() - 3));
   // Find the lowest free player color index
   int playerColorToTest = 0;
   for (; playerColorToTest < 999; ++ playerColorToTest) {
@@ -193,15 +193,15 @@ bool HandleConnect(const QByteArray& msg, int len, PlayerInMatch* player, const
   return true;
 }
 
-void HandleSettingsUpdate(const QByteArray& msg, const std::vector<std::shared_ptr<PlayerInMatch>>& playersInMatch, QTcpServer* server, ServerSettings* settings) {
-  if (msg.size() < 3 + 3) {
+void HandleSettingsUpdate(const MessageView& msg, const std::vector<std::shared_ptr<PlayerInMatch>>& playersInMatch, QTcpServer* server, ServerSettings* settings) {
+  if (msg.GetSize() < 3 + 3) {
     LOG(ERROR) << "Received a too short SettingsUpdate message";
     return;
   }
   
-  settings->allowNewConnections = msg.data()[3] > 0;
+  settings->allowNewConnections = msg.GetData()[3] > 0;
   
-  settings->mapSize = mango::uload16(msg.data() + 4);
+  settings->mapSize = mango::uload16(msg.GetData() + 4);
   
   // Check whether accepting new connections needs to be paused/resumed
   bool isHostReady = false;
@@ -230,13 +230,13 @@ void HandleSettingsUpdate(const QByteArray& msg, const std::vector<std::shared_p
   }
 }
 
-void HandleReadyUp(const QByteArray& msg, PlayerInMatch* player, const std::vector<std::shared_ptr<PlayerInMatch>>& playersInMatch, QTcpServer* server, ServerSettings* settings) {
-  if (msg.size() < 3 + 1) {
+void HandleReadyUp(const MessageView& msg, PlayerInMatch* player, const std::vector<std::shared_ptr<PlayerInMatch>>& playersInMatch, QTcpServer* server, ServerSettings* settings) {
+  if (msg.GetSize() < 3 + 1) {
     LOG(ERROR) << "Received a too short ReadyUp message";
     return;
   }
   
-  bool isReady = msg.data()[3] > 0;
+  bool isReady = msg.GetData()[3] > 0;
   
   // If the ready state of the host changes, check whether accepting new connections needs to be paused/resumed
   if (player->isHost) {
@@ -260,8 +260,8 @@ void HandleReadyUp(const QByteArray& msg, PlayerInMatch* player, const std::vect
   }
 }
 
-static void HandleChat(const QByteArray& msg, PlayerInMatch* player, int len, const std::vector<std::shared_ptr<PlayerInMatch>>& playersInMatch) {
-  QString text = QString::fromUtf8(msg.mid(3, len - 3));
+static void HandleChat(const MessageView& msg, PlayerInMatch* player, const std::vector<std::shared_ptr<PlayerInMatch>>& playersInMatch) {
+  QString text = QString::fromUtf8(msg.Mid(3, msg.GetSize() - 3));
   
   // Determine the index of the sending player.
   int sendingPlayerIndex = 0;
@@ -276,13 +276,13 @@ static void HandleChat(const QByteArray& msg, PlayerInMatch* player, int len, co
   SendChatBroadcast(sendingPlayerIndex, text, playersInMatch);
 }
 
-static void HandlePing(const QByteArray& msg, PlayerInMatch* player, const ServerSettings& settings) {
-  if (msg.size() < 3 + 8) {
+static void HandlePing(const MessageView& msg, PlayerInMatch* player, const ServerSettings& settings) {
+  if (msg.GetSize() < 3 + 8) {
     LOG(ERROR) << "Received a too short Ping message";
     return;
   }
   
-  u64 number = mango::uload64(msg.data() + 3);
+  u64 number = mango::uload64(msg.GetData() + 3);
   
   TimePoint pingHandleTime = Clock::now();
   player->lastPingTime = pingHandleTime;
@@ -292,7 +292,7 @@ static void HandlePing(const QByteArray& msg, PlayerInMatch* player, const Serve
   player->socket->flush();
 }
 
-void HandleLeave(const QByteArray& /*msg*/, PlayerInMatch* player, const std::vector<std::shared_ptr<PlayerInMatch>>& playersInMatch) {
+void HandleLeave(const MessageView& /*msg*/, PlayerInMatch* player, const std::vector<std::shared_ptr<PlayerInMatch>>& playersInMatch) {
   if (player->isHost) {
     LOG(INFO) << "Server: Received Leave by host";
   } else {
@@ -323,7 +323,7 @@ void HandleLeave(const QByteArray& /*msg*/, PlayerInMatch* player, const std::ve
   }
 }
 
-bool HandleStartGame(const QByteArray& /*msg*/, PlayerInMatch* player, const std::vector<std::shared_ptr<PlayerInMatch>>& playersInMatch) {
+bool HandleStartGame(const MessageView& /*msg*/, PlayerInMatch* player, const std::vector<std::shared_ptr<PlayerInMatch>>& playersInMatch) {
   if (player->isHost) {
     LOG(INFO) << "Server: Received StartGame by host";
   } else {
@@ -350,52 +350,42 @@ enum class ParseMessagesResult {
 };
 
 static ParseMessagesResult TryParseClientMessages(PlayerInMatch* player, const std::vector<std::shared_ptr<PlayerInMatch>>& playersInMatch, QTcpServer* server, ServerSettings* settings) {
-  while (true) {
-    if (player->unparsedBuffer.size() < 3) {
-      return ParseMessagesResult::NoAction;
-    }
-    
-    char* data = player->unparsedBuffer.data();
-    u16 msgLength = mango::uload16(data + 1);
-    
-    if (player->unparsedBuffer.size() < msgLength) {
-      return ParseMessagesResult::NoAction;
-    }
-    
-    if (msgLength < 3) {
-      LOG(ERROR) << "Received a too short message. The given message length is (should be at least 3): " << msgLength;
+  MessageView msg;
+  while (player->unparsedBuffer.GetNextMessage(&msg)) {
+    if (msg.GetSize() < 3) {
+      LOG(ERROR) << "Received a too short message. The given message length is (should be at least 3): " << msg.GetSize();
     } else {
-      ClientToServerMessage msgType = static_cast<ClientToServerMessage>(data[0]);
+      ClientToServerMessage msgType = static_cast<ClientToServerMessage>(msg.GetType());
       
       switch (msgType) {
       case ClientToServerMessage::HostConnect:
-        if (!HandleHostConnect(player->unparsedBuffer, msgLength, player, playersInMatch, *settings)) {
+        if (!HandleHostConnect(msg, player, playersInMatch, *settings)) {
           return ParseMessagesResult::PlayerLeftOrShouldBeDisconnected;
         }
         break;
       case ClientToServerMessage::Connect:
-        if (!HandleConnect(player->unparsedBuffer, msgLength, player, playersInMatch, *settings)) {
+        if (!HandleConnect(msg, player, playersInMatch, *settings)) {
           return ParseMessagesResult::PlayerLeftOrShouldBeDisconnected;
         }
         break;
       case ClientToServerMessage::SettingsUpdate:
-        HandleSettingsUpdate(player->unparsedBuffer, playersInMatch, server, settings);
+        HandleSettingsUpdate(msg, playersInMatch, server, settings);
         break;
       case ClientToServerMessage::ReadyUp:
-        HandleReadyUp(player->unparsedBuffer, player, playersInMatch, server, settings);
+        HandleReadyUp(msg, player, playersInMatch, server, settings);
         break;
       case ClientToServerMessage::Chat:
-        HandleChat(player->unparsedBuffer, player, msgLength, playersInMatch);
+        HandleChat(msg, player, playersInMatch);
         break;
       case ClientToServerMessage::Ping:
-        HandlePing(player->unparsedBuffer, player, *settings);
+        HandlePing(msg, player, *settings);
         break;
       case ClientToServerMessage::Leave:
-        HandleLeave(player->unparsedBuffer, player, playersInMatch);
+        HandleLeave(msg, player, playersInMatch);
         return ParseMessagesResult::PlayerLeftOrShouldBeDisconnected;
       case ClientToServerMessage::StartGame:
-        HandleStartGame(player->unparsedBuffer, player, playersInMatch);
-        player->unparsedBuffer.remove(0, msgLength);
+        HandleStartGame(msg, player, playersInMatch);
+        player->unparsedBuffer.PopMessage(msg);
         return ParseMessagesResult::GameStarted;
       default:
         LOG(ERROR) << "Received a message in the match setup phase that cannot be parsed in this phase: " << static_cast<int>(msgType);
@@ -403,11 +393,15 @@ static ParseMessagesResult TryParseClientMessages(PlayerInMatch* player, const s
       }
     }
     
-    player->unparsedBuffer.remove(0, msgLength);
+    player->unparsedBuffer.PopMessage(msg);
   }
+  
+  return ParseMessagesResult::NoAction;
 }
 
 bool RunMatchSetupLoop(QTcpServer* server, std::vector<std::shared_ptr<PlayerInMatch>>* playersInMatch, ServerSettings* settings) {
+  EventWaiter eventWaiter;
+  
   while (true) {
     // Check for new connections
     while (QTcpSocket* socket = server->nextPendingConnection()) {
@@ -432,9 +426,7 @@ bool RunMatchSetupLoop(QTcpServer* server, std::vector<std::shared_ptr<PlayerInM
       PlayerInMatch& player = **it;
       
       // Read new data from the connection.
-      int prevSize = player.unparsedBuffer.size();
-      player.unparsedBuffer += player.socket->readAll();
-      if (player.unparsedBuffer.size() > prevSize) {
+      if (player.unparsedBuffer.ReadFrom(player.socket) > 0) {
         ParseMessagesResult parseResult = TryParseClientMessages(&player, *playersInMatch, server, settings);
         
         if (parseResult == ParseMessagesResult::GameStarted) {
@@ -484,7 +476,8 @@ bool RunMatchSetupLoop(QTcpServer* server, std::vector<std::shared_ptr<PlayerInM
       ++ it;
     }
     
-    qApp->processEvents(QEventLoop::AllEvents);
-    QThread::msleep(1);
+    // Wait for new connections or data without using the CPU. Wake up regularly to check the timeouts.
+    constexpr int kIdleWakeUpIntervalMilliseconds = 100;
+    eventWaiter.ProcessEventsUntil(Clock::now() + std::chrono::milliseconds(kIdleWakeUpIntervalMilliseconds));
   }
 }
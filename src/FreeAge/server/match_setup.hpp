@@ -12,6 +12,7 @@
 #include <QTcpSocket>
 
 #include "FreeAge/common/free_age.hpp"
+#include "FreeAge/common/message_buffer.hpp"
 #include "FreeAge/server/settings.hpp"
 
 /// Represents a player who joined a match that has not started yet.
@@ -29,7 +30,7 @@ struct PlayerInMatch {
   
   /// Buffer for bytes that have been received from the client, but could not
   /// be parsed yet (because only a partial message was received so far).
-  QByteArray unparsedBuffer;
+  MessageBuffer unparsedBuffer;
   
   /// Whether this client can administrate the match.
   bool isHost;
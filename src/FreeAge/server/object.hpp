@@ -6,6 +6,8 @@
 
 #include <cmath>
 
+#include <QPointF>
+
 #include "FreeAge/common/free_age.hpp"
 #include "FreeAge/common/object_types.hpp"
 
@@ -22,19 +24,44 @@ class ServerObject {
   
   inline int GetPlayerIndex() const { return playerIndex; }
   
+  /// The ID of the object in ServerMap::GetObjects(). This is set when the object is added to the map.
+  inline u32 GetId() const { return id; }
+  inline void SetId(u32 newId) { id = newId; }
+  
   inline u32 GetHP() const { return std::round(hp); }
   inline float GetHPInternalFloat() const { return hp; };
   inline void SetHP(float newHP) { hp = newHP; }
   
+  /// The field of view that this object currently adds to its player's PlayerVisibility
+  /// (see Game::UpdateFieldOfView()). A radius of zero means that it does not add any.
+  inline const QPointF& GetFieldOfViewCenter() const { return fieldOfViewCenter; }
+  inline float GetFieldOfViewRadius() const { return fieldOfViewRadius; }
+  inline void SetFieldOfView(const QPointF& center, float radius) { fieldOfViewCenter = center; fieldOfViewRadius = radius; }
+  
+  /// Whether Game::DeleteObject() was called for this object. The object is only removed from
+  /// the map at the end of the game step, so this prevents it from being deleted twice.
+  inline bool IsPendingDelete() const { return pendingDelete; }
+  inline void SetPendingDelete() { pendingDelete = true; }
+  
  private:
   /// Current hitpoints of the object.
   /// For display on the client, those are rounded to the nearest integer.
   float hp;
   
+  /// See GetFieldOfViewCenter().
+  QPointF fieldOfViewCenter;
+  float fieldOfViewRadius = 0;
+  
+  /// See GetId().
+  u32 id = kInvalidObjectId;
+  
   u8 playerIndex;
   
   /// 0 for buildings, 1 for units.
   u8 objectType;
+  
+  /// See IsPendingDelete().
+  bool pendingDelete = false;
 };
 
 /// Returns how the actor can interact with the target.
@@ -0,0 +1,267 @@
+// Copyright 2020 The FreeAge authors
+// This file is part of FreeAge, licensed under the new BSD license.
+// See the COPYING file in the project root for the license text.
+
+#include "FreeAge/server/path_request_scheduler.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <iterator>
+
+#include "FreeAge/common/logging.hpp"
+#include "FreeAge/common/timing.hpp"
+#include "FreeAge/server/map.hpp"
+
+static_assert(FlowField::kBlockSize == ServerMap::kOccupancyBlockSize, "The flow fields must track their dependencies in the blocks of the occupancy versions");
+
+PathRequestScheduler::PathRequestScheduler(int threadCount, int maxRequestsPerDispatch, GridPathPlannerType pathPlanner)
+    : maxRequestsPerDispatch(maxRequestsPerDispatch),
+      pathPlanner(pathPlanner),
+      workerPlanners(std::max(1, threadCount)),
+      threadPool(threadCount) {
+  for (WorkerPlanners& planners : workerPlanners) {
+    freeWorkerPlanners.push_back(&planners);
+  }
+}
+
+PathRequestScheduler::~PathRequestScheduler() {
+  threadPool.WaitForAll();
+}
+
+u32 PathRequestScheduler::RequestPath(u32 unitId, float unitRadius, const QPointF& startMapCoord, const QPoint& startTile, const QRect& goalRect, const QPointF& goalMapCoord, const std::shared_ptr<FlowField>& flowField) {
+  PathRequest request;
+  request.requestId = nextRequestId;
+  request.unitId = unitId;
+  request.unitRadius = unitRadius;
+  request.startMapCoord = startMapCoord;
+  request.startTile = startTile;
+  request.goalRect = goalRect;
+  request.goalMapCoord = goalMapCoord;
+  request.flowField = flowField;
+  queuedRequests.push_back(request);
+  
+  // Skip zero on wrap-around, since units use it to indicate that they have no pending request.
+  ++ nextRequestId;
+  if (nextRequestId == 0) {
+    nextRequestId = 1;
+  }
+  
+  return request.requestId;
+}
+
+void PathRequestScheduler::Dispatch(ServerMap* map, u32 gameStep) {
+  if (queuedRequests.empty()) {
+    return;
+  }
+  
+  std::unique_ptr<Batch> batch(new Batch());
+  batch->snapshot = GetSnapshot(map);
+  
+  int dispatchCount = std::min<int>(queuedRequests.size(), maxRequestsPerDispatch);
+  batch->requests.assign(queuedRequests.begin(), queuedRequests.begin() + dispatchCount);
+  queuedRequests.erase(queuedRequests.begin(), queuedRequests.begin() + dispatchCount);
+  batch->results.resize(dispatchCount);
+  batch->nextRequest = 0;
+  batch->resultGameStep = gameStep + kResultDelaySteps;
+  
+  batch->remainingTaskCount = std::min<int>(dispatchCount, workerPlanners.size());
+  Batch* batchPtr = batch.get();
+  dispatchedBatches.push_back(std::move(batch));
+  
+  // If another batch is still being planned, this batch is started by its last worker task.
+  std::unique_lock<std::mutex> lock(batchMutex);
+  if (batchRunning) {
+    waitingBatches.push_back(batchPtr);
+  } else {
+    batchRunning = true;
+    StartBatch(batchPtr);
+  }
+}
+
+void PathRequestScheduler::TakeResults(u32 gameStep, std::vector<PathResult>* results) {
+  results->clear();
+  
+  while (!dispatchedBatches.empty() && dispatchedBatches.front()->resultGameStep <= gameStep) {
+    Batch* batch = dispatchedBatches.front().get();
+    if (batch->remainingTaskCount != 0) {
+      // The workers did not finish the batch in time. The results must be applied in this
+      // game step to keep the simulation deterministic, so there is no choice but to wait.
+      Timer waitTimer("Path planning wait");
+      std::unique_lock<std::mutex> lock(batchMutex);
+      batchFinishedCondition.wait(lock, [batch]() { return batch->remainingTaskCount == 0; });
+    }
+    
+    results->insert(results->end(), std::make_move_iterator(batch->results.begin()), std::make_move_iterator(batch->results.end()));
+    dispatchedBatches.pop_front();
+  }
+}
+
+std::shared_ptr<const PathRequestScheduler::Snapshot> PathRequestScheduler::GetSnapshot(ServerMap* map) {
+  if (!snapshots.empty() && snapshots.back()->occupancyVersion == map->GetOccupancyVersion()) {
+    return snapshots.back();
+  }
+  
+  // Take the most recent snapshot that is not used by any batch anymore, since it needs the fewest
+  // changes. Only if all snapshots are in use, create a new one.
+  std::shared_ptr<Snapshot> snapshot;
+  for (int i = static_cast<int>(snapshots.size()) - 1; i >= 0; -- i) {
+    if (snapshots[i].use_count() == 1) {
+      snapshot = snapshots[i];
+      snapshots.erase(snapshots.begin() + i);
+      break;
+    }
+  }
+  if (!snapshot) {
+    snapshot.reset(new Snapshot());
+  }
+  
+  // Copy the parts of the map state that changed since the snapshot was taken.
+  PathfindingGrid grid = map->GetPathfindingGrid();
+  if (!snapshot->occupied || snapshot->width != grid.width || snapshot->height != grid.height) {
+    snapshot->width = grid.width;
+    snapshot->height = grid.height;
+    snapshot->occupied.reset(new bool[grid.width * grid.height]);
+    memcpy(snapshot->occupied.get(), grid.occupied, grid.width * grid.height * sizeof(bool));
+  } else {
+    map->CopyOccupancyChangedSince(snapshot->occupancyVersion, snapshot->occupied.get());
+  }
+  snapshot->hierarchicalPathGraph.CopyChangesFrom(map->GetHierarchicalPathGraph());
+  snapshot->connectedComponents.CopyChangesFrom(map->GetConnectedComponents());
+  snapshot->occupancyVersion = map->GetOccupancyVersion();
+  snapshot->occupancyBlockVersions = map->GetOccupancyBlockVersions();
+  
+  snapshots.push_back(snapshot);
+  return snapshot;
+}
+
+void PathRequestScheduler::StartBatch(Batch* batch) {
+  for (int i = 0, taskCount = batch->remainingTaskCount; i < taskCount; ++ i) {
+    threadPool.Enqueue([this, batch]() { WorkerTask(batch); });
+  }
+}
+
+void PathRequestScheduler::WorkerTask(Batch* batch) {
+  WorkerPlanners* planners;
+  {
+    std::unique_lock<std::mutex> lock(freeWorkerPlannersMutex);
+    planners = freeWorkerPlanners.back();
+    freeWorkerPlanners.pop_back();
+  }
+  
+  int count = batch->requests.size();
+  while (true) {
+    int index = batch->nextRequest.fetch_add(1);
+    if (index >= count) {
+      break;
+    }
+    PlanPath(*batch->snapshot, batch->requests[index], planners, &batch->results[index]);
+  }
+  
+  {
+    std::unique_lock<std::mutex> lock(freeWorkerPlannersMutex);
+    freeWorkerPlanners.push_back(planners);
+  }
+  
+  // The batch may be deleted by TakeResults() as soon as the last task finishes, so it must not be accessed afterwards.
+  if (batch->remainingTaskCount.fetch_sub(1) == 1) {
+    std::unique_lock<std::mutex> lock(batchMutex);
+    if (waitingBatches.empty()) {
+      batchRunning = false;
+    } else {
+      StartBatch(waitingBatches.front());
+      waitingBatches.pop_front();
+    }
+    batchFinishedCondition.notify_all();
+  }
+}
+
+void PathRequestScheduler::PlanPath(const Snapshot& snapshot, const PathRequest& request, WorkerPlanners* planners, PathResult* result) {
+  constexpr bool kOutputPathfindingDebugMessages = false;
+  
+  Timer pathPlanningTimer;
+  
+  result->requestId = request.requestId;
+  result->unitId = request.unitId;
+  result->reversePath.clear();
+  
+  PathfindingGrid grid = snapshot.GetGrid();
+  
+  // If the goal is not reachable, the planners would search the whole component of the start
+  // before falling back to the reachable tile that is closest to the goal. Detect this case
+  // with the connected components instead, and plan a path to the closest tile directly.
+  // If the start tile is occupied (which may happen if a building was placed on it), its
+  // component is unknown, so the planners handle this case as usual.
+  QRect goalRect = request.goalRect;
+  bool goalUnreachable = false;
+  u32 startComponent = snapshot.connectedComponents.GetComponent(request.startTile);
+  if (startComponent != ConnectedComponents::kNoComponent &&
+      !request.goalRect.contains(request.startTile) &&
+      !snapshot.connectedComponents.CanReach(grid, startComponent, request.goalRect)) {
+    QPoint closestTile = snapshot.connectedComponents.FindClosestTile(startComponent, request.goalRect);
+    if (closestTile == request.startTile) {
+      if (kOutputPathfindingDebugMessages) {
+        LOG(1) << "Pathfinding: Goal not reachable and the unit is at the closest reachable tile already. Stopping.";
+      }
+      result->success = false;
+      return;
+    }
+    goalRect = QRect(closestTile, QSize(1, 1));
+    goalUnreachable = true;
+  }
+  
+  std::vector<QPoint> reverseTilePath;
+  
+  // If the unit belongs to a group with a flow field, and it can reach the goal, take its path from the field.
+  // This is only done if the start tile's component is known, since otherwise, the search of the field might
+  // have to exhaust the start's component to find out that the goal is not reachable.
+  if (request.flowField && !goalUnreachable && startComponent != ConnectedComponents::kNoComponent) {
+    bool extractedPath;
+    {
+      std::unique_lock<std::mutex> lock(request.flowField->GetMutex());
+      request.flowField->Update(grid, snapshot.occupancyVersion, snapshot.occupancyBlockVersions);
+      extractedPath = request.flowField->ExtractPath(grid, request.startTile, &reverseTilePath);
+    }
+    if (extractedPath) {
+      result->success = true;
+      TilePathToSmoothedPath(grid, request.unitRadius, request.startMapCoord, request.goalRect, request.goalMapCoord, /*reachedGoal*/ true, reverseTilePath, &result->reversePath);
+      return;
+    }
+  }
+  
+  // Plan the path on the tile grid. For long paths, use hierarchical path planning,
+  // which only searches on the full grid locally.
+  GridPathPlanner* planner;
+  if (pathPlanner == GridPathPlannerType::JumpPointSearch) {
+    planner = &planners->jumpPointSearchPathPlanner;
+  } else {
+    planner = &planners->aStarPathPlanner;
+  }
+  if (DiagonalDistanceToRect(request.startTile, goalRect) >= kMinHierarchicalPathPlanningDistance) {
+    planners->hierarchicalPathPlanner.SetGraph(&snapshot.hierarchicalPathGraph);
+    planner = &planners->hierarchicalPathPlanner;
+  }
+  
+  bool reachedGoal;
+  result->success = planner->PlanPath(grid, request.startTile, goalRect, &reverseTilePath, &reachedGoal);
+  if (!result->success) {
+    if (kOutputPathfindingDebugMessages) {
+      LOG(1) << "Pathfinding: Goal not reached and there is no better tile than the initial one. Stopping.";
+    }
+    return;
+  }
+  if (goalUnreachable) {
+    reachedGoal = false;
+  }
+  
+  if (kOutputPathfindingDebugMessages) {
+    LOG(1) << "Pathfinding: considered " << planner->GetExpandedNodeCount() << " nodes (max possible: " << (grid.width * grid.height) << ")";
+    LOG(1) << "Pathfinding: " << (reachedGoal ? "Goal reached" : "Goal not reached; going as close as possible");
+  }
+  
+  TilePathToSmoothedPath(grid, request.unitRadius, request.startMapCoord, request.goalRect, request.goalMapCoord, reachedGoal, reverseTilePath, &result->reversePath);
+  
+  if (kOutputPathfindingDebugMessages) {
+    LOG(1) << "Pathfinding: Smoothed path length is " << result->reversePath.size();
+    LOG(1) << "Pathfinding: Took " << pathPlanningTimer.Stop(false) << " s";
+  }
+}
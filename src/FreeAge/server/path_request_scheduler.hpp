@@ -0,0 +1,192 @@
+// Copyright 2020 The FreeAge authors
+// This file is part of FreeAge, licensed under the new BSD license.
+// See the COPYING file in the project root for the license text.
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include <QPoint>
+#include <QPointF>
+#include <QRect>
+
+#include "FreeAge/common/free_age.hpp"
+#include "FreeAge/common/thread_pool.hpp"
+#include "FreeAge/server/connected_components.hpp"
+#include "FreeAge/server/flow_field.hpp"
+#include "FreeAge/server/hierarchical_pathfinding.hpp"
+#include "FreeAge/server/pathfinding.hpp"
+
+class ServerMap;
+
+/// A request to plan a path for a unit, see PathRequestScheduler.
+struct PathRequest {
+  /// ID of the request, which is used to detect outdated results.
+  u32 requestId;
+  
+  u32 unitId;
+  float unitRadius;
+  
+  /// The unit's position and tile at the time of the request.
+  QPointF startMapCoord;
+  QPoint startTile;
+  
+  /// The goal tiles, which are treated as free during planning.
+  QRect goalRect;
+  
+  /// The exact goal location. If the path reaches a 1x1 goalRect, it ends at this point.
+  QPointF goalMapCoord;
+  
+  /// Optional flow field of the unit's group, whose goal tile must be the (1x1) goalRect.
+  /// If the goal is reachable, the path is taken from this field instead of being planned.
+  std::shared_ptr<FlowField> flowField;
+};
+
+/// The result of a PathRequest.
+struct PathResult {
+  u32 requestId;
+  u32 unitId;
+  
+  /// False if the unit cannot get any closer to the goal (in particular, if not a single
+  /// tile other than the start tile is reachable). In this case, the unit should stop.
+  bool success;
+  
+  /// The smoothed path in reverse order, as expected by ServerUnit::SetPath().
+  std::vector<QPointF> reversePath;
+};
+
+/// Plans unit paths on worker threads, such that path planning does not block the game simulation.
+///
+/// The game simulation queues requests with RequestPath() during a game step and calls
+/// Dispatch() at the end of the step. This starts planning the oldest queued requests
+/// (at most maxRequestsPerDispatch of them) as a batch, against a snapshot of the map state that
+/// is not modified while the batch is planned. The results of the batch are returned by TakeResults()
+/// at the start of the game step that comes kResultDelaySteps steps after the next one. The simulation
+/// thus continues while the workers plan, and only waits for a batch if it is still not finished then.
+///
+/// The batches are planned one after another, such that flow fields that are shared by the requests of
+/// several batches are always brought up-to-date with the snapshots in dispatch order. The results thus only
+/// depend on the game state and on the order of requests, not on the number of worker threads or on their
+/// timing, which keeps the simulation deterministic. Requests that exceed the per-step budget stay queued
+/// for the following steps.
+class PathRequestScheduler {
+ public:
+  /// Paths whose start and goal are at least this far apart (in tiles) are planned
+  /// with hierarchical path planning instead of on the full grid.
+  static constexpr float kMinHierarchicalPathPlanningDistance = 2 * HierarchicalPathGraph::kClusterSize;
+  
+  /// Number of game steps by which the results of a batch are delayed in addition to the
+  /// step that follows its dispatch. This gives the workers time to plan the batch.
+  static constexpr u32 kResultDelaySteps = 2;
+  
+  /// pathPlanner selects the planner for paths that are too short for hierarchical path planning.
+  PathRequestScheduler(int threadCount, int maxRequestsPerDispatch, GridPathPlannerType pathPlanner);
+  
+  /// Waits for dispatched requests to finish.
+  ~PathRequestScheduler();
+  
+  /// Queues a path request and returns its ID. The returned ID is never zero.
+  u32 RequestPath(u32 unitId, float unitRadius, const QPointF& startMapCoord, const QPoint& startTile, const QRect& goalRect, const QPointF& goalMapCoord, const std::shared_ptr<FlowField>& flowField);
+  
+  /// Starts planning the oldest queued requests on the worker threads. gameStep is the number of
+  /// game steps that have been simulated so far.
+  void Dispatch(ServerMap* map, u32 gameStep);
+  
+  /// Returns the results of all batches that were dispatched kResultDelaySteps or more game steps before,
+  /// in request order. gameStep is the number of game steps that have been simulated so far (i.e., the number
+  /// of the step that is about to be simulated). Only waits for the workers if they did not finish these batches yet.
+  void TakeResults(u32 gameStep, std::vector<PathResult>* results);
+  
+  inline usize GetQueuedRequestCount() const { return queuedRequests.size(); }
+  
+ private:
+  /// Immutable (while requests are being planned) copy of the map state that is required for path planning.
+  struct Snapshot {
+    inline PathfindingGrid GetGrid() const { return PathfindingGrid(width, height, occupied.get()); }
+    
+    int width = 0;
+    int height = 0;
+    std::unique_ptr<bool[]> occupied;
+    HierarchicalPathGraph hierarchicalPathGraph;
+    ConnectedComponents connectedComponents;
+    
+    /// ServerMap::GetOccupancyVersion() and ServerMap::GetOccupancyBlockVersions() at the time the snapshot was taken.
+    u32 occupancyVersion = 0;
+    std::vector<u32> occupancyBlockVersions;
+  };
+  
+  /// Requests that were dispatched together, and their results (with the same indexing).
+  struct Batch {
+    std::shared_ptr<const Snapshot> snapshot;
+    
+    std::vector<PathRequest> requests;
+    std::vector<PathResult> results;
+    
+    /// Index of the next request to be taken by a worker.
+    std::atomic<int> nextRequest;
+    
+    /// Number of worker tasks for this batch that have not finished yet.
+    std::atomic<int> remainingTaskCount;
+    
+    /// The game step at whose start TakeResults() returns the results.
+    u32 resultGameStep;
+  };
+  
+  /// Per-worker planners. They keep their search state between calls
+  /// to avoid allocations that are proportional to the map size.
+  struct WorkerPlanners {
+    AStarPathPlanner aStarPathPlanner;
+    JumpPointSearchPathPlanner jumpPointSearchPathPlanner;
+    HierarchicalPathPlanner hierarchicalPathPlanner;
+  };
+  
+  /// Returns a snapshot of the current map state. Snapshots that are not used by any batch anymore are
+  /// reused, such that only the parts of the map state that changed since they were taken need to be copied.
+  std::shared_ptr<const Snapshot> GetSnapshot(ServerMap* map);
+  
+  /// Enqueues the worker tasks for the batch.
+  void StartBatch(Batch* batch);
+  
+  /// Runs on a worker thread: plans requests of the batch until none remain.
+  /// The last task of a batch starts the next batch.
+  void WorkerTask(Batch* batch);
+  
+  void PlanPath(const Snapshot& snapshot, const PathRequest& request, WorkerPlanners* planners, PathResult* result);
+  
+  
+  u32 nextRequestId = 1;
+  int maxRequestsPerDispatch;
+  GridPathPlannerType pathPlanner;
+  
+  std::deque<PathRequest> queuedRequests;
+  
+  /// The batches that have been dispatched, but whose results have not been taken yet, in dispatch order.
+  std::deque<std::unique_ptr<Batch>> dispatchedBatches;
+  
+  /// The dispatched batches that wait for the batch that is being planned to finish, in dispatch order,
+  /// and whether a batch is being planned. Protected by batchMutex.
+  std::deque<Batch*> waitingBatches;
+  bool batchRunning = false;
+  
+  /// Protects the members above, and is used to wait for batchFinishedCondition,
+  /// which is notified when the last worker task of a batch finishes.
+  std::mutex batchMutex;
+  std::condition_variable batchFinishedCondition;
+  
+  /// The snapshots that were taken so far, with the most recent one last.
+  std::vector<std::shared_ptr<Snapshot>> snapshots;
+  
+  /// Per-worker planners, and the ones that are not used by a running worker task.
+  /// At most one task runs per worker thread, so a task always finds free planners.
+  std::vector<WorkerPlanners> workerPlanners;
+  std::vector<WorkerPlanners*> freeWorkerPlanners;
+  std::mutex freeWorkerPlannersMutex;
+  
+  /// Declared last such that it is destroyed (and its threads are joined) first.
+  ThreadPool threadPool;
+};
@@ -0,0 +1,709 @@
+// Copyright 2020 The FreeAge authors
+// This file is part of FreeAge, licensed under the new BSD license.
+// See the COPYING file in the project root for the license text.
+
+#include "FreeAge/server/pathfinding.hpp"
+
+#include <cmath>
+#include <cstring>
+#include <functional>
+#include <iostream>
+
+#include <QImage>
+
+#include "FreeAge/common/logging.hpp"
+#include "FreeAge/common/util.hpp"
+
+bool IsPathFree(const PathfindingGrid& grid, float unitRadius, const QPointF& p0, const QPointF& p1, const QRect& openRect) {
+  // Obtain the points to the right and left of p0 and p1.
+  constexpr float kErrorEpsilon = 1e-3f;
+  
+  QPointF p0ToP1 = p1 - p0;
+  QPointF right(
+      -p0ToP1.y(),
+      p0ToP1.x());
+  right *= (unitRadius + kErrorEpsilon) / std::max(1e-4f, Length(right));
+  
+  QPointF p0Right = p0 + right;
+  QPointF p0Left = p0 - right;
+  QPointF p1Right = p1 + right;
+  QPointF p1Left = p1 - right;
+  
+  // Rasterize the polygon defined by all the points into the map grid.
+  int minRow = std::numeric_limits<int>::max();
+  int maxRow = 0;
+  std::vector<std::pair<int, int>> rowRanges(grid.height, std::make_pair(std::numeric_limits<int>::max(), 0));
+  
+  auto rasterize = [&](int x, int y) {
+    // For safety, clamp the coordinate to the map area.
+    x = std::max(0, std::min(grid.width - 1, x));
+    y = std::max(0, std::min(grid.height - 1, y));
+    
+    minRow = std::min(minRow, y);
+    maxRow = std::max(maxRow, y);
+    
+    auto& rowRange = rowRanges[y];
+    rowRange.first = std::min(rowRange.first, x);
+    rowRange.second = std::max(rowRange.second, x);
+  };
+  
+  auto rasterizeLine = [&](const QPointF& start, const QPointF& end) {
+    QPointF cur = start;
+    QPointF remaining = end - start;
+    
+    int x = static_cast<int>(cur.x());
+    int y = static_cast<int>(cur.y());
+    
+    int endX = static_cast<int>(end.x());
+    int endY = static_cast<int>(end.y());
+    
+    int sx = (remaining.x() > 0) ? 1 : -1;
+    int sy = (remaining.y() > 0) ? 1 : -1;
+    
+    while (true) {
+      rasterize(x, y);
+      
+      float fx = cur.x() - x;
+      float fy = cur.y() - y;
+      
+      float xToBorder = (sx > 0) ? (1 - fx) : fx;
+      float yToBorder = (sy > 0) ? (1 - fy) : fy;
+      
+      if (fabs(remaining.x()) <= xToBorder &&
+          fabs(remaining.y()) <= yToBorder) {
+        // The goal is in the current square.
+        break;
+      }
+      if ((endX - x) * sx <= 0 &&
+          (endY - y) * sy <= 0) {
+        // We somehow surpassed the end without noticing.
+        LOG(WARNING) << "Emergency exit.";
+        break;
+      }
+      
+      float diffX, diffY;
+      if (fabs(remaining.x()) / std::max<float>(1e-5f, fabs(remaining.y())) >
+          xToBorder / std::max(1e-5f, yToBorder)) {
+        // Go in x direction
+        if (sx > 0) {
+          // Go to the right.
+          diffX = - (1 - fx);
+        } else {
+          // Go to the left.
+          diffX = fx;
+        }
+        diffY = remaining.y() * ((remaining.x() + diffX) / remaining.x() - 1);
+        x += sx;
+      } else {
+        // Go in y direction
+        if (sy > 0) {
+          // Go to the bottom.
+          diffY = - (1 - fy);
+        } else {
+          // Go to the top.
+          diffY = fy;
+        }
+        diffX = remaining.x() * ((remaining.y() + diffY) / remaining.y() - 1);
+        y += sy;
+      }
+      
+      remaining.setX(remaining.x() + diffX);
+      remaining.setY(remaining.y() + diffY);
+      cur.setX(cur.x() - diffX);
+      cur.setY(cur.y() - diffY);
+    }
+  };
+  
+  rasterizeLine(p0Right, p1Right);
+  rasterizeLine(p0Left, p1Left);
+  rasterizeLine(p0Right, p0Left);
+  rasterizeLine(p1Right, p1Left);
+  
+  // Test whether any tile within the boundaries of the rasterized area is occupied.
+  // If yes, the path is blocked.
+  constexpr bool kDebugRasterization = false;
+  constexpr const char* kDebugImagePath = "/tmp/FreeAge_pathFree_debug.png";
+  if (kDebugRasterization) {
+    QImage debugImage(grid.width, grid.height, QImage::Format_RGB32);
+    debugImage.fill(qRgb(255, 255, 255));
+    
+    for (int row = minRow; row <= maxRow; ++ row) {
+      auto& rowRange = rowRanges[row];
+      for (int col = rowRange.first; col <= rowRange.second; ++ col) {
+        if (grid.IsOccupied(col, row) && !openRect.contains(col, row, false)) {
+          debugImage.setPixelColor(col, row, qRgb(255, 0, 0));
+        } else {
+          debugImage.setPixelColor(col, row, qRgb(0, 255, 0));
+        }
+      }
+    }
+    
+    LOG(WARNING) << "Saving IsPathFree() debug image to " << kDebugImagePath;
+    debugImage.save(kDebugImagePath);
+    
+    char dummy;
+    std::cin >> dummy;
+  }
+  
+  for (int row = minRow; row <= maxRow; ++ row) {
+    auto& rowRange = rowRanges[row];
+    for (int col = rowRange.first; col <= rowRange.second; ++ col) {
+      if (grid.IsOccupied(col, row) && !openRect.contains(col, row, false)) {
+        return false;
+      }
+    }
+  }
+  
+  return true;
+}
+
+void SmoothPath(const PathfindingGrid& grid, float unitRadius, const QPointF& startMapCoord, const QRect& openRect, std::vector<QPointF>* reversePath) {
+  for (usize i = 1; i < reversePath->size(); ++ i) {
+    const QPointF& p0 = (i == reversePath->size() - 1) ? startMapCoord : reversePath->at(i + 1);
+    const QPointF& p1 = reversePath->at(i - 1);
+    
+    if (IsPathFree(grid, unitRadius, p0, p1, openRect)) {
+      reversePath->erase(reversePath->begin() + i);
+      -- i;
+    }
+  }
+}
+
+void TilePathToSmoothedPath(const PathfindingGrid& grid, float unitRadius, const QPointF& startMapCoord, const QRect& goalRect, const QPointF& goalMapCoord, bool reachedGoal, const std::vector<QPoint>& reverseTilePath, std::vector<QPointF>* reversePath) {
+  reversePath->resize(reverseTilePath.size());
+  for (usize i = 0; i < reverseTilePath.size(); ++ i) {
+    (*reversePath)[i] = QPointF(reverseTilePath[i].x() + 0.5f, reverseTilePath[i].y() + 0.5f);
+  }
+  
+  // Replace the last point with the exact goal location (if we can reach the goal)
+  // TODO: If we can't reach the goal, maybe append a point here that makes the unit walk into the obstacle?
+  if (reachedGoal) {
+    if (reversePath->empty()) {
+      reversePath->push_back(goalMapCoord);
+    } else if (goalRect.width() == 1 && goalRect.height() == 1) {
+      (*reversePath)[0] = goalMapCoord;
+    }
+  }
+  
+  // Smooth the planned path by attempting to drop corners.
+  SmoothPath(grid, unitRadius, startMapCoord, goalRect, reversePath);
+}
+
+
+// Directions are encoded as row-major indices of grid cells in a 4x4 grid,
+// with (1, 1) being the origin of movement. A 3x3 grid would suffice,
+// however, with a 4x4 grid, computations are faster. So, for example,
+// the value 0 corresponds to cell (0, 0) in the grid, which has an offset of (-1, -1)
+// from the movement origin. So, the movement came from (-1, -1).
+// Second example: The value 4 corresponds to cell (0, 1) with movement (-1, 0).
+// The value 5 corresponds to zero movement, this is used for the start and for initialization.
+static int numNeighborsToCheckArray[11] = {
+  3,
+  7,
+  3,
+  0,  // no valid direction
+  7,
+  8,
+  7,
+  0,  // no valid direction
+  3,
+  7,
+  3,
+};
+static QPoint neighborsToCheckArray[11][8] = {
+  {QPoint(1, 0), QPoint(0, 1), /*dependent on previous being free*/ QPoint(1, 1)},
+  {QPoint(0, 1), /*occ. test*/ QPoint(1, -1), QPoint(1, 0), QPoint(1, 1), /*occ. test*/ QPoint(-1, -1), QPoint(-1, 0), QPoint(-1, 1)},
+  {QPoint(-1, 0), QPoint(0, 1), /*dependent on previous being free*/ QPoint(-1, 1)},
+  {},
+  {QPoint(1, 0), /*occ. test*/ QPoint(-1, -1), QPoint(0, -1), QPoint(1, -1), /*occ. test*/ QPoint(-1, 1), QPoint(0, 1), QPoint(1, 1)},
+  {QPoint(0, -1), QPoint(-1, 0), QPoint(1, 0), QPoint(0, 1), QPoint(1, 1), QPoint(-1, -1), QPoint(1, -1), QPoint(-1, 1)},
+  {QPoint(-1, 0), /*occ. test*/ QPoint(1, -1), QPoint(0, -1), QPoint(-1, -1), /*occ. test*/ QPoint(1, 1), QPoint(0, 1), QPoint(-1, 1)},
+  {},
+  {QPoint(0, -1), QPoint(1, 0), /*dependent on previous being free*/ QPoint(1, -1)},
+  {QPoint(0, -1), /*occ. test*/ QPoint(1, 1), QPoint(1, 0), QPoint(1, -1), /*occ. test*/ QPoint(-1, 1), QPoint(-1, 0), QPoint(-1, -1)},
+  {QPoint(-1, 0), QPoint(0, -1), /*dependent on previous being free*/ QPoint(-1, -1)},
+};
+// Here we encode that diagonal movements require the two adjacent tiles to be free.
+static u8 neighborsRequireFreeTiles[11][8] = {
+  {0, 0, 0b11},
+  {0, /*occ. test*/ 0, 0, 0b101, /*occ. test*/ 0, 0, 0b100001},
+  {0, 0, 0b11},
+  {},
+  {0, /*occ. test*/ 0, 0, 0b101, /*occ. test*/ 0, 0, 0b100001},
+  {0, 0, 0, 0, 0b1100, 0b0011, 0b0101, 0b1010},
+  {0, /*occ. test*/ 0, 0, 0b101, /*occ. test*/ 0, 0, 0b100001},
+  {},
+  {0, 0, 0b11},
+  {0, /*occ. test*/ 0, 0, 0b101, /*occ. test*/ 0, 0, 0b100001},
+  {0, 0, 0b11},
+};
+
+void AStarPathPlanner::BeginSearch(int tileCount) {
+  if (searchIdOfTile.size() != static_cast<usize>(tileCount)) {
+    costSoFar.resize(tileCount);
+    cameFrom.resize(tileCount);
+    searchIdOfTile.assign(tileCount, 0);
+    currentSearchId = 0;
+  }
+  
+  ++ currentSearchId;
+  if (currentSearchId == 0) {
+    // The search ID wrapped around. Reset all tiles such that no stale state is considered valid.
+    std::fill(searchIdOfTile.begin(), searchIdOfTile.end(), 0);
+    currentSearchId = 1;
+  }
+  
+  openList.clear();
+}
+
+bool AStarPathPlanner::PlanPath(const PathfindingGrid& grid, const QPoint& start, const QRect& goalRect, std::vector<QPoint>* reverseTilePath, bool* reachedGoal) {
+  int mapWidth = grid.width;
+  int mapHeight = grid.height;
+  
+  reverseTilePath->clear();
+  *reachedGoal = false;
+  expandedNodeCount = 0;
+  
+  // Use A* to plan a path from the start to the goal tile.
+  // * Treat occupied tiles as obstacles.
+  // * Treat tiles within the goal rect as free,
+  //   such that the algorithm can plan a path "into" the goal.
+  // * If the goal is not reachable, return the path that leads to the reachable
+  //   position that is closest to the goal.
+  BeginSearch(mapWidth * mapHeight);
+  
+  auto greater = std::greater<Location>();
+  openList.emplace_back(start, 0.f);
+  
+  int startGridIndex = start.x() + mapWidth * start.y();
+  TouchTile(startGridIndex);
+  costSoFar[startGridIndex] = 0;
+  
+  CostT smallestReachedHeuristicValue = std::numeric_limits<CostT>::max();
+  QPoint smallestReachedHeuristicTile(-1, -1);
+  
+  // Set this to true to have a debug image written to /tmp/FreeAge_pathfinding_debug.png.
+  // Legend:
+  // * Black: Occupied tiles.
+  // * Dark green: open rect.
+  // * White: Free tiles, never considered by pathfinding.
+  // * Light red: Free tiles, considered by pathfinding.
+  // * Light yellow: Free tiles, added to the priority queue as a neighbor but not directly considered.
+  // * Green: Free tiles that are part of the final path.
+  constexpr bool kOutputDebugImage = false;
+  constexpr const char* kDebugImagePath = "/tmp/FreeAge_pathfinding_debug.png";
+  QImage debugImage;
+  if (kOutputDebugImage) {
+    debugImage = QImage(mapWidth, mapHeight, QImage::Format_RGB32);
+    for (int y = 0; y < mapHeight; ++ y) {
+      for (int x = 0; x < mapWidth; ++ x) {
+        if (grid.IsOccupied(x, y)) {
+          debugImage.setPixel(x, y, qRgb(0, 0, 0));
+        } else {
+          debugImage.setPixel(x, y, qRgb(255, 255, 255));
+        }
+      }
+    }
+    for (int y = goalRect.y(); y < goalRect.bottom(); ++ y) {
+      for (int x = goalRect.x(); x < goalRect.right(); ++ x) {
+        debugImage.setPixel(x, y, qRgb(0, 100, 0));
+      }
+    }
+  }
+  
+  QPoint reachedGoalTile(-1, -1);
+  while (!openList.empty()) {
+    std::pop_heap(openList.begin(), openList.end(), greater);
+    Location current = openList.back();
+    openList.pop_back();
+    
+    ++ expandedNodeCount;
+    if (kOutputDebugImage) {
+      debugImage.setPixel(current.loc.x(), current.loc.y(), qRgb(255, 127, 127));
+    }
+    
+    if (goalRect.contains(current.loc, false)) {
+      reachedGoalTile = current.loc;
+      break;
+    }
+    
+    int currentGridIndex = current.loc.x() + mapWidth * current.loc.y();
+    CostT currentCost = costSoFar[currentGridIndex];
+    int currentCameFrom = cameFrom[currentGridIndex];
+    
+    int numNeighborsToCheck = numNeighborsToCheckArray[currentCameFrom];
+    QPoint* neighbors = neighborsToCheckArray[currentCameFrom];
+    u8 freeNeighbors = 0;  // bitmask with a 1 for each free neighbor
+    
+    for (int neighborIdx = 0; neighborIdx < numNeighborsToCheck; ++ neighborIdx) {
+      QPoint neighborDir = neighbors[neighborIdx];
+      QPoint nextTile = current.loc + neighborDir;
+      int nextGridIndex = nextTile.x() + mapWidth * nextTile.y();
+      
+      // Special case:
+      // For straight movements, numNeighborsToCheck is 7. It contains two sets of directions preceded by an occupancy check.
+      // This means that we only consider those directions if the occupancy-checked tile is occupied.
+      // The occupancy check is at neighbor indices 1 and 4 and each applies to the two following neighbors.
+      int skipLenght = 0;
+      if (numNeighborsToCheck == 7 &&
+          (neighborIdx == 1 || neighborIdx == 4)) {
+        // This neighbor is an occupancy check. If it is occupied, we need to consider the following
+        // two neighbors, otherwise we can skip them.
+        skipLenght = 2;
+      } else {
+        u8 requiredFreeNeighbors = neighborsRequireFreeTiles[currentCameFrom][neighborIdx];
+        if ((freeNeighbors & requiredFreeNeighbors) != requiredFreeNeighbors) {
+          // The required previous free neighbors are not free.
+          continue;
+        }
+      }
+      
+      // Skip neighbor if it is outside of the map.
+      if (nextTile.x() < 0 || nextTile.y() < 0 ||
+          nextTile.x() >= mapWidth || nextTile.y() >= mapHeight) {
+        neighborIdx += skipLenght;
+        continue;
+      }
+      // Skip neighbor if it is occupied.
+      if (grid.IsOccupied(nextTile.x(), nextTile.y()) && !goalRect.contains(nextTile, false)) {
+        // Continue while not skipping over possible neighbors depending on this as an occupancy check (since the check returned true).
+        continue;
+      }
+      
+      freeNeighbors |= 1 << neighborIdx;
+      
+      // Skip this if it is a failed occupancy check (instead of an actual neighbor).
+      if (skipLenght > 0) {
+        // If this was an occupancy check, but the tile is free, continue while skipping over the dependent neighbors.
+        neighborIdx += skipLenght;
+        continue;
+      }
+      
+      // Compute the cost to reach this neighbor from the start.
+      constexpr float sqrt2 = 1.41421356237310f;
+      CostT newCost = currentCost + ((neighborDir.manhattanLength() == 2) ? sqrt2 : 1);
+      
+      // If the cost is better than the best cost known so far, expand the path to this neighbor.
+      TouchTile(nextGridIndex);
+      CostT* nextCostSoFar = &costSoFar[nextGridIndex];
+      if (newCost < *nextCostSoFar) {
+        *nextCostSoFar = newCost;
+        
+        // Compute the "diagonal distance" as a heuristic for the remaining path length to the goal.
+        CostT heuristic = DiagonalDistanceToRect(nextTile, goalRect);
+        
+        // Remember the closest tile to the goal that we found. This becomes important
+        // in case we cannot reach the goal at all.
+        if (heuristic < smallestReachedHeuristicValue) {
+          smallestReachedHeuristicValue = heuristic;
+          smallestReachedHeuristicTile = nextTile;
+        }
+        
+        openList.emplace_back(nextTile, newCost + heuristic);
+        std::push_heap(openList.begin(), openList.end(), greater);
+        cameFrom[nextGridIndex] = ((-neighborDir.x()) + 1) + 4 * ((-neighborDir.y()) + 1);
+        
+        if (kOutputDebugImage) {
+          debugImage.setPixel(nextTile.x(), nextTile.y(), qRgb(255, 255, 127));
+        }
+      }
+    }
+  }
+  
+  // Did we find a path to the goal or only to some other tile that is close to the goal?
+  QPoint targetTile;
+  if (reachedGoalTile.x() < 0) {
+    // No path to the goal was found. Go to the reachable node that is closest to the goal.
+    if (smallestReachedHeuristicTile.x() < 0) {
+      return false;
+    }
+    targetTile = smallestReachedHeuristicTile;
+  } else {
+    targetTile = reachedGoalTile;
+    *reachedGoal = true;
+  }
+  
+  // Reconstruct the path, tracking back from "targetTile" using "cameFrom".
+  // We leave out the start tile since the unit is already within that tile.
+  QPoint currentTile = targetTile;
+  while (currentTile != start) {
+    reverseTilePath->push_back(currentTile);
+    
+    if (kOutputDebugImage) {
+      debugImage.setPixel(currentTile.x(), currentTile.y(), qRgb(0, 255, 0));
+    }
+    
+    int cameFromDirection = cameFrom[currentTile.x() + mapWidth * currentTile.y()];
+    if (cameFromDirection >= 11 || numNeighborsToCheckArray[cameFromDirection] == 0 || cameFromDirection == 5) {
+      LOG(ERROR) << "Erroneous value in cameFrom[] while reconstructing path: " << cameFromDirection;
+      break;
+    }
+    
+    int cameFromX = (cameFromDirection % 4) - 1;
+    currentTile.setX(currentTile.x() + cameFromX);
+    
+    int cameFromY = (cameFromDirection / 4) - 1;
+    currentTile.setY(currentTile.y() + cameFromY);
+  }
+  if (kOutputDebugImage) {
+    debugImage.setPixel(start.x(), start.y(), qRgb(0, 255, 0));
+    
+    LOG(WARNING) << "Writing pathfinding debug image to: " << kDebugImagePath;
+    debugImage.save(kDebugImagePath);
+  }
+  
+  return true;
+}
+
+void JumpPointSearchPathPlanner::BeginSearch(int tileCount) {
+  if (searchIdOfTile.size() != static_cast<usize>(tileCount)) {
+    costSoFar.resize(tileCount);
+    parent.resize(tileCount);
+    searchIdOfTile.assign(tileCount, 0);
+    currentSearchId = 0;
+  }
+  
+  ++ currentSearchId;
+  if (currentSearchId == 0) {
+    // The search ID wrapped around. Reset all tiles such that no stale state is considered valid.
+    std::fill(searchIdOfTile.begin(), searchIdOfTile.end(), 0);
+    currentSearchId = 1;
+  }
+  
+  openList.clear();
+}
+
+bool JumpPointSearchPathPlanner::JumpStraight(int x, int y, int dx, int dy, int origin, const QPoint& corner, QPoint* result) {
+  while (IsWalkable(x, y)) {
+    ConsiderClosestTile(x, y, origin, corner);
+    
+    // Tiles within the goal rect are jump points, such that the search ends when popping them.
+    bool isJumpPoint = IsInGoalRect(x, y);
+    
+    // Check for forced neighbors: a tile next to the line that is free while the tile behind it
+    // is occupied. Since corners cannot be cut, the shortest path to that tile may need to turn here.
+    if (dx != 0) {
+      isJumpPoint |= (IsWalkable(x, y - 1) && !IsWalkable(x - dx, y - 1)) ||
+                     (IsWalkable(x, y + 1) && !IsWalkable(x - dx, y + 1));
+    } else {
+      isJumpPoint |= (IsWalkable(x - 1, y) && !IsWalkable(x - 1, y - dy)) ||
+                     (IsWalkable(x + 1, y) && !IsWalkable(x + 1, y - dy));
+    }
+    
+    if (isJumpPoint) {
+      *result = QPoint(x, y);
+      return true;
+    }
+    
+    x += dx;
+    y += dy;
+  }
+  return false;
+}
+
+bool JumpPointSearchPathPlanner::JumpDiagonal(int x, int y, int dx, int dy, int origin, QPoint* result) {
+  QPoint unusedResult;
+  while (IsWalkable(x, y)) {
+    QPoint corner(x, y);
+    ConsiderClosestTile(x, y, origin, corner);
+    
+    // A tile on the diagonal is a jump point if it is within the goal rect,
+    // or if one of the straight scans that branch off from it finds a jump point.
+    if (IsInGoalRect(x, y) ||
+        JumpStraight(x + dx, y, dx, 0, origin, corner, &unusedResult) ||
+        JumpStraight(x, y + dy, 0, dy, origin, corner, &unusedResult)) {
+      *result = corner;
+      return true;
+    }
+    
+    // Diagonal movements require the two adjacent tiles to be free.
+    if (!IsWalkable(x + dx, y) || !IsWalkable(x, y + dy)) {
+      return false;
+    }
+    
+    x += dx;
+    y += dy;
+  }
+  return false;
+}
+
+void JumpPointSearchPathPlanner::JumpAndPush(int currentGridIndex, CostT currentCost, int dx, int dy) {
+  int x = currentGridIndex % grid->width;
+  int y = currentGridIndex / grid->width;
+  
+  QPoint jumpPoint;
+  bool found;
+  if (dx != 0 && dy != 0) {
+    found = JumpDiagonal(x + dx, y + dy, dx, dy, currentGridIndex, &jumpPoint);
+  } else {
+    found = JumpStraight(x + dx, y + dy, dx, dy, currentGridIndex, QPoint(x, y), &jumpPoint);
+  }
+  if (!found) {
+    return;
+  }
+  
+  // Since the segment between two jump points is either straight or diagonal,
+  // its cost is given by the diagonal distance.
+  int jumpPointGridIndex = jumpPoint.x() + grid->width * jumpPoint.y();
+  CostT newCost = currentCost + DiagonalDistance(jumpPoint.x() - x, jumpPoint.y() - y);
+  TouchTile(jumpPointGridIndex);
+  if (newCost < costSoFar[jumpPointGridIndex]) {
+    costSoFar[jumpPointGridIndex] = newCost;
+    parent[jumpPointGridIndex] = currentGridIndex;
+    
+    openList.emplace_back(jumpPointGridIndex, newCost, newCost + DiagonalDistanceToRect(jumpPoint, goalRect));
+    std::push_heap(openList.begin(), openList.end(), std::greater<JumpPoint>());
+  }
+}
+
+int JumpPointSearchPathPlanner::Search() {
+  int mapWidth = grid->width;
+  BeginSearch(mapWidth * grid->height);
+  
+  auto greater = std::greater<JumpPoint>();
+  int startGridIndex = start.x() + mapWidth * start.y();
+  TouchTile(startGridIndex);
+  costSoFar[startGridIndex] = 0;
+  openList.emplace_back(startGridIndex, 0.f, 0.f);
+  
+  while (!openList.empty()) {
+    std::pop_heap(openList.begin(), openList.end(), greater);
+    JumpPoint current = openList.back();
+    openList.pop_back();
+    
+    if (current.cost > costSoFar[current.gridIndex]) {
+      // Outdated entry, the jump point was reached on a shorter path in the meantime.
+      continue;
+    }
+    
+    ++ expandedNodeCount;
+    
+    int x = current.gridIndex % mapWidth;
+    int y = current.gridIndex / mapWidth;
+    if (IsInGoalRect(x, y)) {
+      return current.gridIndex;
+    }
+    
+    // Determine the directions to scan in. At the start, these are all directions.
+    // Otherwise, the directions are pruned according to the direction of the movement from
+    // the parent jump point: all tiles that are not listed below can be reached at least as
+    // cheaply without passing through the current tile.
+    int parentGridIndex = parent[current.gridIndex];
+    if (parentGridIndex < 0) {
+      bool freeLeft = IsWalkable(x - 1, y);
+      bool freeRight = IsWalkable(x + 1, y);
+      bool freeTop = IsWalkable(x, y - 1);
+      bool freeBottom = IsWalkable(x, y + 1);
+      
+      if (freeLeft) { JumpAndPush(current.gridIndex, current.cost, -1, 0); }
+      if (freeRight) { JumpAndPush(current.gridIndex, current.cost, 1, 0); }
+      if (freeTop) { JumpAndPush(current.gridIndex, current.cost, 0, -1); }
+      if (freeBottom) { JumpAndPush(current.gridIndex, current.cost, 0, 1); }
+      // Diagonal movements require the two adjacent tiles to be free.
+      if (freeLeft && freeTop && IsWalkable(x - 1, y - 1)) { JumpAndPush(current.gridIndex, current.cost, -1, -1); }
+      if (freeRight && freeTop && IsWalkable(x + 1, y - 1)) { JumpAndPush(current.gridIndex, current.cost, 1, -1); }
+      if (freeLeft && freeBottom && IsWalkable(x - 1, y + 1)) { JumpAndPush(current.gridIndex, current.cost, -1, 1); }
+      if (freeRight && freeBottom && IsWalkable(x + 1, y + 1)) { JumpAndPush(current.gridIndex, current.cost, 1, 1); }
+      continue;
+    }
+    
+    int parentX = parentGridIndex % mapWidth;
+    int parentY = parentGridIndex / mapWidth;
+    int dx = (x > parentX) - (x < parentX);
+    int dy = (y > parentY) - (y < parentY);
+    
+    if (dx != 0 && dy != 0) {
+      bool freeX = IsWalkable(x + dx, y);
+      bool freeY = IsWalkable(x, y + dy);
+      if (freeX) { JumpAndPush(current.gridIndex, current.cost, dx, 0); }
+      if (freeY) { JumpAndPush(current.gridIndex, current.cost, 0, dy); }
+      if (freeX && freeY && IsWalkable(x + dx, y + dy)) { JumpAndPush(current.gridIndex, current.cost, dx, dy); }
+    } else if (dx != 0) {
+      bool freeNext = IsWalkable(x + dx, y);
+      bool freeTop = IsWalkable(x, y - 1);
+      bool freeBottom = IsWalkable(x, y + 1);
+      if (freeNext) { JumpAndPush(current.gridIndex, current.cost, dx, 0); }
+      if (freeTop) { JumpAndPush(current.gridIndex, current.cost, 0, -1); }
+      if (freeBottom) { JumpAndPush(current.gridIndex, current.cost, 0, 1); }
+      if (freeNext && freeTop && IsWalkable(x + dx, y - 1)) { JumpAndPush(current.gridIndex, current.cost, dx, -1); }
+      if (freeNext && freeBottom && IsWalkable(x + dx, y + 1)) { JumpAndPush(current.gridIndex, current.cost, dx, 1); }
+    } else {
+      bool freeNext = IsWalkable(x, y + dy);
+      bool freeLeft = IsWalkable(x - 1, y);
+      bool freeRight = IsWalkable(x + 1, y);
+      if (freeNext) { JumpAndPush(current.gridIndex, current.cost, 0, dy); }
+      if (freeLeft) { JumpAndPush(current.gridIndex, current.cost, -1, 0); }
+      if (freeRight) { JumpAndPush(current.gridIndex, current.cost, 1, 0); }
+      if (freeNext && freeLeft && IsWalkable(x - 1, y + dy)) { JumpAndPush(current.gridIndex, current.cost, -1, dy); }
+      if (freeNext && freeRight && IsWalkable(x + 1, y + dy)) { JumpAndPush(current.gridIndex, current.cost, 1, dy); }
+    }
+  }
+  
+  return -1;
+}
+
+bool JumpPointSearchPathPlanner::PlanPath(const PathfindingGrid& grid, const QPoint& start, const QRect& goalRect, std::vector<QPoint>* reverseTilePath, bool* reachedGoal) {
+  int mapWidth = grid.width;
+  
+  reverseTilePath->clear();
+  *reachedGoal = false;
+  expandedNodeCount = 0;
+  
+  this->grid = &grid;
+  this->start = start;
+  this->goalRect = goalRect;
+  goalMinX = goalRect.x();
+  goalMinY = goalRect.y();
+  goalMaxX = goalRect.x() + goalRect.width() - 1;
+  goalMaxY = goalRect.y() + goalRect.height() - 1;
+  
+  trackClosestTile = false;
+  int reachedGoalGridIndex = Search();
+  if (reachedGoalGridIndex < 0) {
+    // The goal is not reachable. Repeat the search while keeping track of the scanned tile
+    // that is closest to the goal. This is not done in the first place since it slows down
+    // the scans considerably, while the goal is reachable in most cases.
+    trackClosestTile = true;
+    closestTile.distance = std::numeric_limits<CostT>::infinity();
+    closestTile.origin = -1;
+    Search();
+  }
+  
+  // Appends the tiles from "from" (inclusive) to "to" (exclusive) to the path.
+  // The segment must be straight or diagonal.
+  auto appendSegment = [&](QPoint from, const QPoint& to) {
+    QPoint step((to.x() > from.x()) - (to.x() < from.x()), (to.y() > from.y()) - (to.y() < from.y()));
+    while (from != to) {
+      reverseTilePath->push_back(from);
+      from += step;
+    }
+  };
+  auto tileOfGridIndex = [&](int gridIndex) {
+    return QPoint(gridIndex % mapWidth, gridIndex / mapWidth);
+  };
+  
+  // Did we find a path to the goal or only to some other tile that is close to the goal?
+  int currentGridIndex;
+  if (reachedGoalGridIndex < 0) {
+    // No path to the goal was found. Go to the reachable tile that is closest to the goal,
+    // via the scan on which it was found.
+    if (closestTile.origin < 0) {
+      return false;
+    }
+    appendSegment(closestTile.tile, closestTile.corner);
+    appendSegment(closestTile.corner, tileOfGridIndex(closestTile.origin));
+    currentGridIndex = closestTile.origin;
+  } else {
+    currentGridIndex = reachedGoalGridIndex;
+    *reachedGoal = true;
+  }
+  
+  // Reconstruct the path by tracking back along the parent jump points, filling in the tiles between them.
+  // We leave out the start tile since the unit is already within that tile.
+  while (parent[currentGridIndex] >= 0) {
+    appendSegment(tileOfGridIndex(currentGridIndex), tileOfGridIndex(parent[currentGridIndex]));
+    currentGridIndex = parent[currentGridIndex];
+  }
+  
+  return true;
+}
@@ -0,0 +1,282 @@
+// Copyright 2020 The FreeAge authors
+// This file is part of FreeAge, licensed under the new BSD license.
+// See the COPYING file in the project root for the license text.
+
+#pragma once
+
+#include <algorithm>
+#include <cstdlib>
+#include <limits>
+#include <vector>
+
+#include <QPoint>
+#include <QPointF>
+#include <QRect>
+
+#include "FreeAge/common/free_age.hpp"
+
+/// Read-only view on a grid of occupancy flags, which is the input to path planning.
+/// The occupancy array has the size width * height.
+/// An element (x, y) has index: [y * width + x].
+struct PathfindingGrid {
+  inline PathfindingGrid(int width, int height, const bool* occupied)
+      : width(width),
+        height(height),
+        occupied(occupied) {}
+  
+  inline bool IsOccupied(int tileX, int tileY) const { return occupied[tileY * width + tileX]; }
+  inline bool IsInside(int tileX, int tileY) const { return tileX >= 0 && tileY >= 0 && tileX < width && tileY < height; }
+  
+  int width;
+  int height;
+  const bool* occupied;
+};
+
+/// Returns the "diagonal distance" between two tiles which differ by (xDiff, yDiff).
+/// This is the length of the shortest path on an empty grid while allowing diagonal movements.
+inline float DiagonalDistance(int xDiff, int yDiff) {
+  constexpr float sqrt2 = 1.41421356237310f;
+  xDiff = std::abs(xDiff);
+  yDiff = std::abs(yDiff);
+  int minDiff = std::min(xDiff, yDiff);
+  int maxDiff = std::max(xDiff, yDiff);
+  return minDiff * sqrt2 + (maxDiff - minDiff) * 1;
+}
+
+/// Returns the diagonal distance from the given tile to the closest tile within rect.
+inline float DiagonalDistanceToRect(const QPoint& tile, const QRect& rect) {
+  int rectX = std::max(rect.x(), std::min(rect.x() + rect.width() - 1, tile.x()));
+  int rectY = std::max(rect.y(), std::min(rect.y() + rect.height() - 1, tile.y()));
+  return DiagonalDistance(tile.x() - rectX, tile.y() - rectY);
+}
+
+/// Tests whether a unit with the given radius could walk from p0 to p1 (or vice versa) without
+/// colliding with an occupied tile. Tiles within openRect are treated as free. Notice that this
+/// function does not check whether the start and end points themselves are (fully) free,
+/// it only checks the space between them.
+bool IsPathFree(const PathfindingGrid& grid, float unitRadius, const QPointF& p0, const QPointF& p1, const QRect& openRect);
+
+/// Smooths the given path (in the reverse order that is used by ServerUnit::SetPath())
+/// by attempting to drop corners, given that the unit starts at startMapCoord.
+void SmoothPath(const PathfindingGrid& grid, float unitRadius, const QPointF& startMapCoord, const QRect& openRect, std::vector<QPointF>* reversePath);
+
+/// Converts a tile path (in the format returned by GridPathPlanner::PlanPath()) into a smoothed
+/// path of map coordinates in reverse order, as used by ServerUnit::SetPath(). If the path reached
+/// a 1x1 goalRect, it ends exactly at goalMapCoord.
+void TilePathToSmoothedPath(const PathfindingGrid& grid, float unitRadius, const QPointF& startMapCoord, const QRect& goalRect, const QPointF& goalMapCoord, bool reachedGoal, const std::vector<QPoint>& reverseTilePath, std::vector<QPointF>* reversePath);
+
+/// The planners that can be used for unit paths on the full tile grid.
+enum class GridPathPlannerType {
+  /// AStarPathPlanner
+  AStar = 0,
+  
+  /// JumpPointSearchPathPlanner
+  JumpPointSearch
+};
+
+/// Base class for path planners on a PathfindingGrid.
+///
+/// Paths are planned on the 8-connected tile grid, with costs of 1 for straight and
+/// sqrt(2) for diagonal movements. Diagonal movements require the two adjacent tiles to be free.
+class GridPathPlanner {
+ public:
+  virtual inline ~GridPathPlanner() {}
+  
+  /// Plans a path from the start tile to any tile within goalRect.
+  /// The tiles within goalRect are treated as free even if they are occupied.
+  /// This allows planning a path "into" a target (for example, a building).
+  ///
+  /// If the goal is reachable, sets reachedGoal to true. Otherwise, the path leads to the
+  /// reachable tile that is closest to the goal and reachedGoal is set to false.
+  /// The resulting path is returned in reverseTilePath in reverse order (the first entry is the
+  /// last tile of the path). The start tile is not included.
+  ///
+  /// Returns false if not a single tile other than the start tile could be reached.
+  virtual bool PlanPath(const PathfindingGrid& grid, const QPoint& start, const QRect& goalRect, std::vector<QPoint>* reverseTilePath, bool* reachedGoal) = 0;
+  
+  /// Returns the number of nodes expanded by the last PlanPath() call.
+  inline int GetExpandedNodeCount() const { return expandedNodeCount; }
+  
+ protected:
+  int expandedNodeCount = 0;
+};
+
+/// A* path planner on the full tile grid.
+///
+/// The per-tile search state is kept between calls and lazily re-initialized
+/// by tagging each tile with the ID of the search that last touched it. This way,
+/// no allocation or initialization proportional to the map size is required per call.
+class AStarPathPlanner : public GridPathPlanner {
+ public:
+  bool PlanPath(const PathfindingGrid& grid, const QPoint& start, const QRect& goalRect, std::vector<QPoint>* reverseTilePath, bool* reachedGoal) override;
+  
+ private:
+  typedef float CostT;
+  
+  struct Location {
+    inline Location(const QPoint& loc, float priority)
+        : loc(loc),
+          priority(priority) {}
+    
+    inline bool operator> (const Location& other) const {
+      return priority > other.priority;
+    }
+    
+    QPoint loc;
+    float priority;
+  };
+  
+  /// Prepares the search state for a new search on a grid with the given number of tiles.
+  void BeginSearch(int tileCount);
+  
+  /// Initializes the search state for the given tile if it was not touched by the current search yet.
+  inline void TouchTile(int gridIndex) {
+    if (searchIdOfTile[gridIndex] != currentSearchId) {
+      searchIdOfTile[gridIndex] = currentSearchId;
+      costSoFar[gridIndex] = std::numeric_limits<CostT>::infinity();
+      cameFrom[gridIndex] = kCameFromUninitializedValue;
+    }
+  }
+  
+  
+  static constexpr u8 kCameFromUninitializedValue = 5;
+  
+  std::vector<CostT> costSoFar;
+  
+  /// Direction from which each tile was reached, see PlanPath() for the encoding.
+  std::vector<u8> cameFrom;
+  
+  /// For each tile, the ID of the last search that initialized its state.
+  std::vector<u32> searchIdOfTile;
+  u32 currentSearchId = 0;
+  
+  /// Heap used as priority queue.
+  std::vector<Location> openList;
+};
+
+/// Jump Point Search (JPS) path planner on the full tile grid.
+///
+/// Returns paths with the same cost as AStarPathPlanner, but instead of pushing every
+/// neighbor tile to the priority queue, it scans along straight and diagonal lines and
+/// only pushes the "jump points" at which the optimal path may change its direction
+/// (because an obstacle ends next to the line). On open terrain, this expands only a small
+/// fraction of the nodes that A* expands.
+///
+/// The variant used here does not allow cutting corners, matching the movement rules of
+/// GridPathPlanner. Every tile within goalRect is a jump point, such that paths into
+/// (occupied) goal rects are found as with A*.
+///
+/// The returned tile path contains all tiles along the path, not only the jump points.
+class JumpPointSearchPathPlanner : public GridPathPlanner {
+ public:
+  bool PlanPath(const PathfindingGrid& grid, const QPoint& start, const QRect& goalRect, std::vector<QPoint>* reverseTilePath, bool* reachedGoal) override;
+  
+ private:
+  typedef float CostT;
+  
+  struct JumpPoint {
+    inline JumpPoint(int gridIndex, CostT cost, CostT priority)
+        : gridIndex(gridIndex),
+          cost(cost),
+          priority(priority) {}
+    
+    inline bool operator> (const JumpPoint& other) const {
+      return priority > other.priority;
+    }
+    
+    int gridIndex;
+    CostT cost;
+    CostT priority;
+  };
+  
+  /// The scanned tile that is closest to goalRect, and how to reach it: from the jump point
+  /// with grid index origin, move diagonally to corner, then straight to tile.
+  /// This is used as the path's target if the goal is not reachable.
+  struct ClosestTile {
+    CostT distance;
+    int origin;
+    QPoint corner;
+    QPoint tile;
+  };
+  
+  /// Returns whether a unit may walk on the given tile in the current search.
+  inline bool IsWalkable(int x, int y) const {
+    return x >= 0 && y >= 0 && x < grid->width && y < grid->height &&
+           (!grid->IsOccupied(x, y) || IsInGoalRect(x, y));
+  }
+  
+  inline bool IsInGoalRect(int x, int y) const {
+    return x >= goalMinX && y >= goalMinY && x <= goalMaxX && y <= goalMaxY;
+  }
+  
+  /// Prepares the search state for a new search on a grid with the given number of tiles.
+  void BeginSearch(int tileCount);
+  
+  /// Initializes the search state for the given tile if it was not touched by the current search yet.
+  inline void TouchTile(int gridIndex) {
+    if (searchIdOfTile[gridIndex] != currentSearchId) {
+      searchIdOfTile[gridIndex] = currentSearchId;
+      costSoFar[gridIndex] = std::numeric_limits<CostT>::infinity();
+      parent[gridIndex] = -1;
+    }
+  }
+  
+  /// Remembers the given tile as closest tile to the goal if it is closer than the previous one.
+  /// The start tile is not considered, as with AStarPathPlanner.
+  inline void ConsiderClosestTile(int x, int y, int origin, const QPoint& corner) {
+    if (!trackClosestTile) {
+      return;
+    }
+    QPoint tile(x, y);
+    if (tile == start) {
+      return;
+    }
+    CostT distance = DiagonalDistanceToRect(tile, goalRect);
+    if (distance < closestTile.distance) {
+      closestTile.distance = distance;
+      closestTile.origin = origin;
+      closestTile.corner = corner;
+      closestTile.tile = tile;
+    }
+  }
+  
+  /// Scans from the walkable tile (x, y) in the straight direction (dx, dy) and
+  /// returns the first jump point in *result, or false if there is none.
+  bool JumpStraight(int x, int y, int dx, int dy, int origin, const QPoint& corner, QPoint* result);
+  
+  /// Scans from the walkable tile (x, y) in the diagonal direction (dx, dy) and
+  /// returns the first jump point in *result, or false if there is none.
+  bool JumpDiagonal(int x, int y, int dx, int dy, int origin, QPoint* result);
+  
+  /// Scans in direction (dx, dy) from the jump point with the given grid index and pushes the
+  /// resulting jump point (if any) to the open list.
+  void JumpAndPush(int currentGridIndex, CostT currentCost, int dx, int dy);
+  
+  /// Runs the search from the start tile. Returns the grid index of the goal tile that was
+  /// reached, or -1 if the goal is not reachable.
+  int Search();
+  
+  
+  /// State of the current search.
+  const PathfindingGrid* grid;
+  QPoint start;
+  QRect goalRect;
+  int goalMinX;
+  int goalMinY;
+  int goalMaxX;
+  int goalMaxY;
+  ClosestTile closestTile;
+  bool trackClosestTile;
+  
+  std::vector<CostT> costSoFar;
+  
+  /// Grid index of the jump point from which each jump point was reached, or -1 for the start.
+  std::vector<int> parent;
+  
+  /// For each tile, the ID of the last search that initialized its state.
+  std::vector<u32> searchIdOfTile;
+  u32 currentSearchId = 0;
+  
+  /// Heap used as priority queue.
+  std::vector<JumpPoint> openList;
+};
@@ -0,0 +1,166 @@
+// Copyright 2020 The FreeAge authors
+// This file is part of FreeAge, licensed under the new BSD license.
+// See the COPYING file in the project root for the license text.
+
+#include "FreeAge/server/replay.hpp"
+
+#include <cstring>
+
+#include "FreeAge/common/logging.hpp"
+
+#include <mango/core/endian.hpp>
+
+/// Identifies replay log files.
+static const char kReplayMagic[4] = {'F', 'A', 'R', 'L'};
+
+/// Size of the fixed part of the header: magic (4), protocol version (4), map size (2), path planner (1),
+/// player count (1), game begin server time (8).
+static constexpr int kReplayHeaderSize = 4 + 4 + 2 + 1 + 1 + 8;
+
+/// Size of the per-player part of the header: initial wood, food, gold, and stone (4 each).
+static constexpr int kReplayPlayerHeaderSize = 4 * 4;
+
+/// Size of the fields preceding the message in each entry: game step (4), player index (1).
+static constexpr int kReplayEntryPrefixSize = 4 + 1;
+
+/// The player index that marks the end-step record, which has no message: game step count (4), player index (1).
+static constexpr u8 kReplayEndStepPlayerIndex = 0xFF;
+static constexpr int kReplayEndStepRecordSize = 4 + 1;
+
+bool ReplayRecorder::Open(const QString& path, const ReplayHeader& header) {
+  file.setFileName(path);
+  if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+    LOG(ERROR) << "Failed to create the replay log: " << path.toStdString();
+    return false;
+  }
+  
+  int playerCount = header.initialResources.size();
+  QByteArray headerData(kReplayHeaderSize + playerCount * kReplayPlayerHeaderSize, Qt::Initialization::Uninitialized);
+  char* data = headerData.data();
+  memcpy(data, kReplayMagic, 4);
+  mango::ustore32(data + 4, networkProtocolVersion);
+  mango::ustore16(data + 8, header.mapSize);
+  data[10] = static_cast<u8>(header.pathPlanner);
+  data[11] = playerCount;
+  memcpy(data + 12, &header.gameBeginServerTime, 8);
+  data += kReplayHeaderSize;
+  for (const ResourceAmount& resources : header.initialResources) {
+    mango::ustore32(data + 0, resources.wood());
+    mango::ustore32(data + 4, resources.food());
+    mango::ustore32(data + 8, resources.gold());
+    mango::ustore32(data + 12, resources.stone());
+    data += kReplayPlayerHeaderSize;
+  }
+  
+  file.write(headerData);
+  file.flush();
+  return true;
+}
+
+void ReplayRecorder::RecordCommand(u32 gameStep, u8 playerIndex, const MessageView& msg) {
+  int offset = buffer.size();
+  buffer.resize(offset + kReplayEntryPrefixSize + msg.GetSize());
+  char* data = buffer.data() + offset;
+  mango::ustore32(data, gameStep);
+  data[4] = playerIndex;
+  memcpy(data + kReplayEntryPrefixSize, msg.GetData(), msg.GetSize());
+}
+
+void ReplayRecorder::Flush(u32 gameStepCount) {
+  // Overwrite the previous end-step record, such that the log always ends with a single one.
+  if (endStepRecordOffset >= 0) {
+    file.seek(endStepRecordOffset);
+  }
+  file.write(buffer);
+  buffer.clear();
+  
+  endStepRecordOffset = file.pos();
+  char endStepRecord[kReplayEndStepRecordSize];
+  mango::ustore32(endStepRecord, gameStepCount);
+  endStepRecord[4] = kReplayEndStepPlayerIndex;
+  file.write(endStepRecord, kReplayEndStepRecordSize);
+  file.flush();
+}
+
+bool ReplayReader::Open(const QString& path, ReplayHeader* header) {
+  QFile file(path);
+  if (!file.open(QIODevice::ReadOnly)) {
+    LOG(ERROR) << "Failed to open the replay log: " << path.toStdString();
+    return false;
+  }
+  data = file.readAll();
+  
+  if (data.size() < kReplayHeaderSize ||
+      memcmp(data.constData(), kReplayMagic, 4) != 0) {
+    LOG(ERROR) << "Not a replay log: " << path.toStdString();
+    return false;
+  }
+  const char* headerData = data.constData();
+  u32 protocolVersion = mango::uload32(headerData + 4);
+  if (protocolVersion != networkProtocolVersion) {
+    LOG(ERROR) << "The replay log was recorded with network protocol version " << protocolVersion << ", but this server uses version " << networkProtocolVersion;
+    return false;
+  }
+  header->mapSize = mango::uload16(headerData + 8);
+  header->pathPlanner = static_cast<GridPathPlannerType>(headerData[10]);
+  int playerCount = static_cast<u8>(headerData[11]);
+  memcpy(&header->gameBeginServerTime, headerData + 12, 8);
+  
+  offset = kReplayHeaderSize + playerCount * kReplayPlayerHeaderSize;
+  if (data.size() < offset) {
+    LOG(ERROR) << "The replay log has a truncated header: " << path.toStdString();
+    return false;
+  }
+  header->initialResources.resize(playerCount);
+  for (int i = 0; i < playerCount; ++ i) {
+    const char* playerData = headerData + kReplayHeaderSize + i * kReplayPlayerHeaderSize;
+    header->initialResources[i] = ResourceAmount(
+        mango::uload32(playerData + 0),
+        mango::uload32(playerData + 4),
+        mango::uload32(playerData + 8),
+        mango::uload32(playerData + 12));
+  }
+  
+  return true;
+}
+
+bool ReplayReader::ReadNextCommand(u32* gameStep, u8* playerIndex, MessageView* msg) {
+  if (offset + kReplayEndStepRecordSize <= data.size() &&
+      static_cast<u8>(data.constData()[offset + 4]) == kReplayEndStepPlayerIndex) {
+    if (offset + kReplayEndStepRecordSize != data.size()) {
+      LOG(WARNING) << "The replay log has data after its end-step record";
+    }
+    haveEndGameStep = true;
+    endGameStep = mango::uload32(data.constData() + offset);
+    offset = data.size();
+    return false;
+  }
+  
+  if (offset + kReplayEntryPrefixSize + MessageBuffer::kHeaderSize > data.size()) {
+    if (offset != data.size()) {
+      LOG(WARNING) << "The replay log ends with a truncated entry";
+    }
+    return false;
+  }
+  
+  const char* entry = data.constData() + offset;
+  int msgSize = mango::uload16(entry + kReplayEntryPrefixSize + 1);
+  if (msgSize < MessageBuffer::kHeaderSize ||
+      offset + kReplayEntryPrefixSize + msgSize > data.size()) {
+    LOG(WARNING) << "The replay log ends with a truncated entry";
+    return false;
+  }
+  
+  *gameStep = mango::uload32(entry);
+  *playerIndex = entry[4];
+  *msg = MessageView(entry + kReplayEntryPrefixSize, msgSize);
+  offset += kReplayEntryPrefixSize + msgSize;
+  return true;
+}
+
+bool ReplayReader::GetEndGameStep(u32* gameStepCount) const {
+  if (haveEndGameStep) {
+    *gameStepCount = endGameStep;
+  }
+  return haveEndGameStep;
+}
@@ -0,0 +1,108 @@
+// Copyright 2020 The FreeAge authors
+// This file is part of FreeAge, licensed under the new BSD license.
+// See the COPYING file in the project root for the license text.
+
+#pragma once
+
+#include <vector>
+
+#include <QByteArray>
+#include <QFile>
+#include <QString>
+#include <QTcpSocket>
+
+#include "FreeAge/common/free_age.hpp"
+#include "FreeAge/common/message_buffer.hpp"
+#include "FreeAge/common/messages.hpp"
+#include "FreeAge/common/resources.hpp"
+#include "FreeAge/server/pathfinding.hpp"
+
+/// The game setup at the start of a recorded game, which is stored at the start of a replay log.
+struct ReplayHeader {
+  /// The map size (which together with the player count determines the generated map).
+  u16 mapSize;
+  
+  /// The path planner that the server used, which affects the unit paths.
+  GridPathPlannerType pathPlanner;
+  
+  /// The server time at which the game began. The game step times are computed from it.
+  double gameBeginServerTime;
+  
+  /// The initial resources of each player, indexed by the player index.
+  std::vector<ResourceAmount> initialResources;
+};
+
+/// Records the client commands that the server handles during a game into a compact binary log,
+/// from which ReplayReader and Game::RunReplay() can reproduce the game exactly.
+///
+/// The log consists of the serialized ReplayHeader, followed by one entry for each command:
+/// the number of the game step before which the command was handled (u32), the index of the
+/// player who sent it (u8), and the client message as it was received (including its header).
+/// Since the simulation is deterministic, this is sufficient to reproduce the whole game state.
+/// The log ends with an end-step record: the number of game steps that were simulated (u32),
+/// followed by the player index 0xFF. This allows to replay the steps after the last command.
+///
+/// The entries are buffered and written to the file with Flush(), which the server calls once
+/// per game step, such that a log of a crashed server contains all game steps except the last.
+class ReplayRecorder {
+ public:
+  /// Creates the log file and writes the header. Returns false if the file cannot be created.
+  bool Open(const QString& path, const ReplayHeader& header);
+  
+  /// Appends a command that was handled before the given game step.
+  void RecordCommand(u32 gameStep, u8 playerIndex, const MessageView& msg);
+  
+  /// Writes the buffered entries to the file, followed by an end-step record for the given number of
+  /// simulated game steps. This replaces the end-step record written by the previous call.
+  void Flush(u32 gameStepCount);
+  
+ private:
+  QFile file;
+  
+  /// Offset of the end-step record in the file, or -1 if none was written yet.
+  qint64 endStepRecordOffset = -1;
+  
+  /// Entries that have not been written to the file yet.
+  QByteArray buffer;
+};
+
+/// Reads replay logs written by ReplayRecorder.
+class ReplayReader {
+ public:
+  /// Reads the whole log file and parses its header. Returns false if this fails.
+  bool Open(const QString& path, ReplayHeader* header);
+  
+  /// Returns the next command in the log, or false if the end of the log is reached.
+  /// The message view stays valid as long as the reader exists.
+  bool ReadNextCommand(u32* gameStep, u8* playerIndex, MessageView* msg);
+  
+  /// Returns the number of game steps that the recorded game simulated, if the log contains an end-step record.
+  /// This is only known after ReadNextCommand() returned false.
+  bool GetEndGameStep(u32* gameStepCount) const;
+  
+ private:
+  /// The content of the log file.
+  QByteArray data;
+  
+  /// Offset of the next entry in data.
+  int offset = 0;
+  
+  /// See GetEndGameStep().
+  bool haveEndGameStep = false;
+  u32 endGameStep = 0;
+};
+
+/// Socket that is not connected to anything and discards all data that is written to it.
+/// Used for the players when replaying a game, such that the game's messages are still
+/// created as in a live game (being part of the replayed workload), but not sent anywhere.
+class DiscardingSocket : public QTcpSocket {
+ public:
+  inline DiscardingSocket() {
+    setOpenMode(QIODevice::WriteOnly);
+  }
+  
+ protected:
+  inline qint64 writeData(const char* /*data*/, qint64 size) override {
+    return size;
+  }
+};
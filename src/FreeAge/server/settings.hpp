@@ -5,8 +5,10 @@
 #pragma once
 
 #include <QByteArray>
+#include <QString>
 
 #include "FreeAge/common/free_age.hpp"
+#include "FreeAge/server/pathfinding.hpp"
 
 struct ServerSettings {
   /// Time point at which the server was started. This serves as the reference time point
@@ -27,4 +29,26 @@ struct ServerSettings {
   
   /// The map size chosen by the host.
   u16 mapSize = kDefaultMapSize;
+  
+  /// The planner used for unit paths that are not long enough for hierarchical path planning.
+  /// Chosen with the --path-planner command line argument.
+  GridPathPlannerType pathPlanner = GridPathPlannerType::AStar;
+  
+  /// Number of threads used to simulate the game steps. Zero uses all hardware threads,
+  /// one simulates serially. The game state does not depend on this setting.
+  /// Chosen with the --simulation-threads command line argument.
+  int simulationThreadCount = 0;
+  
+  /// Whether to log a hash of the game state after each game step. This allows to verify
+  /// that the game state does not depend on the number of simulation threads.
+  /// Enabled with the --log-state-hashes command line argument.
+  bool logStateHashes = false;
+  
+  /// If not empty, the client commands of the game are recorded into a replay log at this path.
+  /// Set with the --record-replay=<path> command line argument.
+  QString recordReplayPath;
+  
+  /// If not empty, the server does not accept connections, but replays the game from the
+  /// replay log at this path as fast as possible. Set with the --replay=<path> command line argument.
+  QString replayPath;
 };
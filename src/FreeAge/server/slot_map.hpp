@@ -0,0 +1,139 @@
+// Copyright 2020 The FreeAge authors
+// This file is part of FreeAge, licensed under the new BSD license.
+// See the COPYING file in the project root for the license text.
+
+#pragma once
+
+#include <utility>
+#include <vector>
+
+#include "FreeAge/common/free_age.hpp"
+#include "FreeAge/common/object_types.hpp"
+
+/// Generational slot map: a container that hands out u32 handles for inserted values.
+///
+/// The values are stored contiguously (as std::pair<handle, value>, similar to the
+/// elements of a std::unordered_map), such that iterating over them is cache-friendly.
+/// Handle lookups go through an indirection table of slots and do not require hashing.
+///
+/// A handle consists of a slot index (the lower kIndexBits bits) and the generation
+/// of that slot (the upper bits). The generation is increased each time a slot is freed,
+/// so handles to erased values are detected as stale in O(1) and never alias a newer value.
+/// Slots whose generation counter would wrap around are retired rather than reused.
+/// kInvalidObjectId is never returned as a handle.
+///
+/// Erasing swaps the last value into the erased position, so erase() invalidates
+/// iterators and changes the iteration order. insert() may invalidate iterators as well.
+template <typename T>
+class SlotMap {
+ public:
+  typedef std::pair<u32, T> value_type;
+  typedef typename std::vector<value_type>::iterator iterator;
+  typedef typename std::vector<value_type>::const_iterator const_iterator;
+  
+  static constexpr int kIndexBits = 20;
+  static constexpr u32 kIndexMask = (1u << kIndexBits) - 1;
+  static constexpr u32 kMaxGeneration = (1u << (32 - kIndexBits)) - 1;
+  /// The maximum number of slots. The index kIndexMask is not used such that
+  /// no handle can equal kInvalidObjectId.
+  static constexpr u32 kMaxSlots = kIndexMask;
+  
+  /// Inserts the value and returns its handle. Returns kInvalidObjectId if the map is full.
+  u32 insert(const T& value) {
+    u32 slotIndex;
+    if (!freeSlots.empty()) {
+      slotIndex = freeSlots.back();
+      freeSlots.pop_back();
+    } else {
+      if (slots.size() >= kMaxSlots) {
+        return kInvalidObjectId;
+      }
+      slotIndex = slots.size();
+      slots.emplace_back();
+    }
+    
+    Slot& slot = slots[slotIndex];
+    slot.denseIndex = dense.size();
+    u32 handle = (slot.generation << kIndexBits) | slotIndex;
+    dense.emplace_back(handle, value);
+    return handle;
+  }
+  
+  /// Returns an iterator to the value with the given handle, or end() if the handle is stale or invalid.
+  inline iterator find(u32 handle) {
+    u32 denseIndex = DenseIndex(handle);
+    return (denseIndex == kFree) ? dense.end() : (dense.begin() + denseIndex);
+  }
+  inline const_iterator find(u32 handle) const {
+    u32 denseIndex = DenseIndex(handle);
+    return (denseIndex == kFree) ? dense.end() : (dense.begin() + denseIndex);
+  }
+  
+  inline bool contains(u32 handle) const { return DenseIndex(handle) != kFree; }
+  
+  /// Erases the value with the given handle. Returns false if the handle is stale or invalid.
+  bool erase(u32 handle) {
+    u32 denseIndex = DenseIndex(handle);
+    if (denseIndex == kFree) {
+      return false;
+    }
+    
+    // Move the last value into the freed position.
+    if (denseIndex != dense.size() - 1) {
+      dense[denseIndex] = std::move(dense.back());
+      slots[dense[denseIndex].first & kIndexMask].denseIndex = denseIndex;
+    }
+    dense.pop_back();
+    
+    // Free the slot, invalidating all existing handles to it.
+    u32 slotIndex = handle & kIndexMask;
+    Slot& slot = slots[slotIndex];
+    slot.denseIndex = kFree;
+    if (slot.generation < kMaxGeneration) {
+      ++ slot.generation;
+      freeSlots.push_back(slotIndex);
+    }
+    return true;
+  }
+  inline void erase(iterator it) { erase(it->first); }
+  
+  inline iterator begin() { return dense.begin(); }
+  inline iterator end() { return dense.end(); }
+  inline const_iterator begin() const { return dense.begin(); }
+  inline const_iterator end() const { return dense.end(); }
+  
+  /// Direct access to the i-th value in iteration order, for 0 <= i < size().
+  inline value_type& at(usize i) { return dense[i]; }
+  inline const value_type& at(usize i) const { return dense[i]; }
+  
+  inline usize size() const { return dense.size(); }
+  inline bool empty() const { return dense.empty(); }
+  
+ private:
+  static constexpr u32 kFree = static_cast<u32>(-1);
+  
+  struct Slot {
+    /// Index of the slot's value in dense, or kFree if the slot is unused.
+    u32 denseIndex = kFree;
+    u32 generation = 0;
+  };
+  
+  inline u32 DenseIndex(u32 handle) const {
+    u32 slotIndex = handle & kIndexMask;
+    if (slotIndex >= slots.size()) {
+      return kFree;
+    }
+    const Slot& slot = slots[slotIndex];
+    return (slot.generation == (handle >> kIndexBits)) ? slot.denseIndex : kFree;
+  }
+  
+  
+  /// Contiguous storage of (handle, value) pairs.
+  std::vector<value_type> dense;
+  
+  /// Indirection table from slot index to dense index.
+  std::vector<Slot> slots;
+  
+  /// Indices of unused slots that may be reused.
+  std::vector<u32> freeSlots;
+};
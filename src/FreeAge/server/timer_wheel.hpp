@@ -0,0 +1,102 @@
+// Copyright 2020 The FreeAge authors
+// This file is part of FreeAge, licensed under the new BSD license.
+// See the COPYING file in the project root for the license text.
+
+#pragma once
+
+#include <vector>
+
+#include "FreeAge/common/free_age.hpp"
+#include "FreeAge/common/logging.hpp"
+
+/// Hierarchical timer wheel that schedules events for future game steps.
+///
+/// Level 0 has one slot for each of the next kSlots game steps. Each slot of a higher level spans
+/// kSlots times as many game steps as a slot of the level below. An event is stored in the lowest
+/// level whose range contains its step. When the current step reaches the range of a higher-level
+/// slot, the slot's events are moved down into the lower levels ("cascading"). Thus, scheduling an
+/// event and advancing by a game step take amortized constant time, regardless of how many events
+/// are scheduled and how far in the future they are.
+///
+/// Events cannot be cancelled. Instead, users check whether an event is still valid when it is due.
+template <typename T>
+class TimerWheel {
+ public:
+  /// Schedules the event for the given game step, which must not be before GetCurrentStep().
+  void Schedule(u32 step, const T& event) {
+    if (step < currentStep) {
+      LOG(ERROR) << "TimerWheel::Schedule() called for a past game step";
+      step = currentStep;
+    }
+    Insert(Entry{step, event});
+    ++ size;
+  }
+  
+  /// Appends the events that are due in the current game step to dueEvents, and advances to the next step.
+  void Advance(std::vector<T>* dueEvents) {
+    // Move the events of the higher-level slots that start at the current step down into the lower levels.
+    for (int level = kLevels - 1; level > 0; -- level) {
+      if ((currentStep & ((1u << (kSlotBits * level)) - 1)) != 0) {
+        continue;
+      }
+      std::vector<Entry>& slot = slots[level][(currentStep >> (kSlotBits * level)) & kSlotMask];
+      if (slot.empty()) {
+        continue;
+      }
+      cascadeBuffer.swap(slot);
+      for (const Entry& entry : cascadeBuffer) {
+        Insert(entry);
+      }
+      cascadeBuffer.clear();
+    }
+    
+    std::vector<Entry>& slot = slots[0][currentStep & kSlotMask];
+    for (const Entry& entry : slot) {
+      dueEvents->push_back(entry.event);
+    }
+    size -= slot.size();
+    slot.clear();
+    
+    ++ currentStep;
+  }
+  
+  /// Returns the game step whose events are returned by the next call to Advance().
+  inline u32 GetCurrentStep() const { return currentStep; }
+  
+  /// Returns the number of scheduled events.
+  inline usize GetSize() const { return size; }
+  
+  static constexpr int kSlotBits = 8;
+  static constexpr u32 kSlots = 1u << kSlotBits;
+  
+ private:
+  struct Entry {
+    u32 step;
+    T event;
+  };
+  
+  /// Inserts the entry into the lowest level whose range (relative to currentStep) contains it.
+  void Insert(const Entry& entry) {
+    int level = 0;
+    while (level < kLevels - 1 &&
+           (entry.step >> (kSlotBits * (level + 1))) != (currentStep >> (kSlotBits * (level + 1)))) {
+      ++ level;
+    }
+    slots[level][(entry.step >> (kSlotBits * level)) & kSlotMask].push_back(entry);
+  }
+  
+  
+  static constexpr u32 kSlotMask = kSlots - 1;
+  
+  /// The number of levels, which suffices to cover all u32 game steps.
+  static constexpr int kLevels = 32 / kSlotBits;
+  
+  /// The events in each slot of each level, indexed by [level][slot].
+  std::vector<Entry> slots[kLevels][kSlots];
+  
+  /// Temporary storage used while cascading, kept to avoid reallocations.
+  std::vector<Entry> cascadeBuffer;
+  
+  u32 currentStep = 0;
+  usize size = 0;
+};
@@ -5,6 +5,7 @@
 #include "FreeAge/server/unit.hpp"
 
 #include "FreeAge/server/building.hpp"
+#include "FreeAge/server/flow_field.hpp"
 
 ServerUnit::ServerUnit(int playerIndex, UnitType type, const QPointF& mapCoord)
     : ServerObject(ObjectType::Unit, playerIndex),
@@ -55,6 +56,8 @@ void ServerUnit::RemoveTarget() {
 void ServerUnit::SetMoveToTarget(const QPointF& mapCoord) {
   // The path will be computed on the next game state update.
   hasPath = false;
+  pendingPathRequestId = 0;
+  flowField.reset();
   
   moveToTarget = mapCoord;
   hasMoveToTarget = true;
@@ -66,6 +69,8 @@ void ServerUnit::SetMoveToTarget(const QPointF& mapCoord) {
 void ServerUnit::SetTargetInternal(u32 targetObjectId, ServerObject* targetObject, bool isManualTargeting) {
   // The path will be computed on the next game state update.
   hasPath = false;
+  pendingPathRequestId = 0;
+  flowField.reset();
   
   if (targetObject->isBuilding()) {
     ServerBuilding* targetBuilding = AsBuilding(targetObject);
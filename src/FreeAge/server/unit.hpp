@@ -4,11 +4,16 @@
 
 #pragma once
 
+#include <memory>
+
+#include <QPoint>
 #include <QPointF>
 
 #include "FreeAge/common/unit_types.hpp"
 #include "FreeAge/server/object.hpp"
 
+class FlowField;
+
 /// Represents a unit on the server.
 class ServerUnit : public ServerObject {
  public:
@@ -17,7 +22,6 @@ class ServerUnit : public ServerObject {
   inline UnitType GetUnitType() const { return type; }
   
   inline const QPointF& GetMapCoord() const { return mapCoord; }
-  inline void SetMapCoord(const QPointF& mapCoord) { this->mapCoord = mapCoord; }
   
   inline UnitAction GetCurrentAction() const { return currentAction; }
   inline void SetCurrentAction(UnitAction newAction) { currentAction = newAction; }
@@ -37,17 +41,41 @@ class ServerUnit : public ServerObject {
   inline bool HasMoveToTarget() const { return hasMoveToTarget; }
   inline const QPointF& GetMoveToTargetMapCoord() const { return moveToTarget; }
   
+  /// Updates the map coord that the unit moves to without discarding its current path.
+  /// This is used when re-planning the path to a moving target: the unit keeps following
+  /// its old path until the new one has been planned.
+  inline void UpdateMoveToTargetMapCoord(const QPointF& mapCoord) { moveToTarget = mapCoord; }
+  
+  /// The ID of the PathRequestScheduler request that plans the unit's next path, or zero if there is none.
+  /// Commanding the unit to do something else resets this, which makes the result of the request be ignored.
+  inline u32 GetPendingPathRequestId() const { return pendingPathRequestId; }
+  inline void SetPendingPathRequestId(u32 requestId) { pendingPathRequestId = requestId; }
+  
+  /// The flow field that the unit uses to obtain its path to its move-to target, if it
+  /// was commanded to move as part of a group. This is shared among the units of the group
+  /// and reset when the unit gets another command or stops.
+  inline const std::shared_ptr<FlowField>& GetFlowField() const { return flowField; }
+  inline void SetFlowField(const std::shared_ptr<FlowField>& field) { flowField = field; }
+  
   // TODO: Accept more complex paths (rather than just a single target).
   inline bool HasPath() const { return hasPath; }
   inline void SetPath(const std::vector<QPointF>& reversePath) { hasPath = true; this->reversePath = reversePath; }
   inline void PauseMovement() { currentAction = UnitAction::Idle; }
-  inline void StopMovement() { currentAction = UnitAction::Idle; hasMoveToTarget = false; hasPath = false; currentMovementDirection = QPointF(0, 0); }
+  inline void StopMovement() { currentAction = UnitAction::Idle; hasMoveToTarget = false; hasPath = false; pendingPathRequestId = 0; flowField.reset(); currentMovementDirection = QPointF(0, 0); }
   inline const QPointF& GetNextPathTarget() const { return reversePath.empty() ? moveToTarget : reversePath.back(); }
   inline void PathSegmentCompleted() { reversePath.pop_back(); if (reversePath.empty()) { hasPath = false; } }
   
   inline const QPointF& GetMovementDirection() const { return currentMovementDirection; }
   inline void SetMovementDirection(const QPointF& direction) { currentMovementDirection = direction; }
   
+  /// Returns whether simulating a game step for the unit would do nothing: it does not attack,
+  /// has no move-to target, and does not move. Only non-idle units need to be simulated.
+  inline bool IsIdle() const { return currentAction != UnitAction::Attack && !hasMoveToTarget && currentMovementDirection == QPointF(0, 0); }
+  
+  /// Whether the unit is in the game's list of active units (see Game::ActivateUnit()).
+  inline bool IsActive() const { return isActive; }
+  inline void SetActive(bool active) { isActive = active; }
+  
   inline ResourceType GetCarriedResourceType() const { return carriedResourceType; }
   inline void SetCarriedResourceType(ResourceType type) { carriedResourceType = type; }
   
@@ -55,10 +83,29 @@ class ServerUnit : public ServerObject {
   inline float GetCarriedResourceAmountInternalFloat() const { return carriedResourceAmount; }
   inline void SetCarriedResourceAmount(float amount) { carriedResourceAmount = amount; }
   
+  /// Bitmask of the players that currently know about the unit, since they see it (bit i is set for
+  /// the player with index i). Messages about the unit are only sent to these players.
+  inline u32 GetVisibleToPlayers() const { return visibleToPlayers; }
+  inline void SetVisibleToPlayers(u32 mask) { visibleToPlayers = mask; }
+  inline bool IsVisibleToPlayer(int playerIndex) const { return visibleToPlayers & (1u << playerIndex); }
+  
+  /// The start point of the last movement that was sent to the clients for this unit (or the map coord
+  /// at which the clients got to know the unit), quantized with QuantizeUnitMovementCoord().
+  /// UnitMovementBatch messages give start points relative to this. All clients that see the unit have
+  /// the same reference, since they receive all of its movements.
+  inline const QPoint& GetMovementReferenceCoord() const { return movementReferenceCoord; }
+  inline void SetMovementReferenceCoord(const QPoint& coord) { movementReferenceCoord = coord; }
+  
   // TODO: Load this from some database for each unit type
   inline float GetMoveSpeed() const { return (type == UnitType::Scout) ? 2.f : 1.f; }
   
  private:
+  friend class ServerMap;
+  
+  /// Sets the unit's position. This is private since units on the map must be moved with
+  /// ServerMap::SetUnitMapCoord(), which keeps the map's spatial unit index up-to-date.
+  inline void SetMapCoord(const QPointF& mapCoord) { this->mapCoord = mapCoord; }
+  
   void SetTargetInternal(u32 targetObjectId, ServerObject* targetObject, bool isManualTargeting);
   
   
@@ -89,6 +136,12 @@ class ServerUnit : public ServerObject {
   bool hasMoveToTarget = false;
   QPointF moveToTarget;
   
+  /// See GetPendingPathRequestId().
+  u32 pendingPathRequestId = 0;
+  
+  /// See GetFlowField().
+  std::shared_ptr<FlowField> flowField;
+  
   /// Whether reversePath is valid. TODO: Could be dropped now; could represent not having a path as reversePath being empty
   bool hasPath = false;
   /// The currenly planned path to the unit's target. The first entry is the last node in the path, thus "reverse".
@@ -104,6 +157,15 @@ class ServerUnit : public ServerObject {
   
   // Type of resources carried (for villagers).
   ResourceType carriedResourceType = ResourceType::NumTypes;
+  
+  /// See GetVisibleToPlayers().
+  u32 visibleToPlayers = 0;
+  
+  /// See GetMovementReferenceCoord().
+  QPoint movementReferenceCoord;
+  
+  /// See IsActive().
+  bool isActive = false;
 };
 
 /// Convenience function to cast a ServerUnit to a ServerObject.
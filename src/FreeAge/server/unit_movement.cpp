@@ -0,0 +1,164 @@
+// Copyright 2020 The FreeAge authors
+// This file is part of FreeAge, licensed under the new BSD license.
+// See the COPYING file in the project root for the license text.
+
+#include "FreeAge/server/unit_movement.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+#include "FreeAge/common/util.hpp"
+#include "FreeAge/server/map.hpp"
+#include "FreeAge/server/unit.hpp"
+
+/// Sets the unit's movement direction towards its next path target.
+static void FaceNextPathTarget(ServerUnit* unit) {
+  QPointF direction = unit->GetNextPathTarget() - unit->GetMapCoord();
+  direction = direction / std::max(1e-4f, Length(direction));
+  unit->SetMovementDirection(direction);
+}
+
+/// Returns the tiles whose units may affect ServerMap::DoesUnitCollide() for the given unit and mapCoord.
+static QRect GetCollisionTestTiles(const ServerMap& map, const ServerUnit* unit, const QPointF& mapCoord) {
+  float radius = GetUnitRadius(unit->GetUnitType());
+  return map.GetUnitTilesInArea(mapCoord.x() - radius, mapCoord.y() - radius, mapCoord.x() + radius, mapCoord.y() + radius);
+}
+
+static bool TryEvadeUnit(const ServerUnit* unit, float moveDistance, const QPointF& newMapCoord, const ServerUnit* collidingUnit, QPointF* evadeMapCoord) {
+  // Intersect a circle of radius "moveDistance", centered at unit->GetMapCoord(),
+  // with a circle of radius GetUnitRadius(unit->GetUnitType()) + GetUnitRadius(collidingUnit->GetUnitType()), centered at collidingUnit->GetMapCoord().
+  constexpr float kErrorTolerance = 1e-3f;
+  
+  const QPointF unitCenter = unit->GetMapCoord();
+  float unitMoveRadius = moveDistance;
+  
+  const QPointF obstacleCenter = collidingUnit->GetMapCoord();
+  float obstacleRadius = GetUnitRadius(unit->GetUnitType()) + GetUnitRadius(collidingUnit->GetUnitType()) + kErrorTolerance;
+  
+  QPointF unitToObstacle = obstacleCenter - unitCenter;
+  float centerDistance = Length(unitToObstacle);
+  QPointF unitToObstacleDir = unitToObstacle / std::max(1e-5f, centerDistance);
+  
+  float a = (unitMoveRadius * unitMoveRadius - obstacleRadius * obstacleRadius + centerDistance * centerDistance) / (2 * centerDistance);
+  float termInSqrt = unitMoveRadius * unitMoveRadius - a * a;
+  if (termInSqrt <= 0) {
+    return false;
+  }
+  float h = sqrtf(termInSqrt);
+  
+  QPointF basePoint = unitCenter + a * unitToObstacleDir;
+  
+  QPointF intersection1 = basePoint + h * QPointF(unitToObstacleDir.y(), -unitToObstacleDir.x());
+  QPointF intersection2 = basePoint - h * QPointF(unitToObstacleDir.y(), -unitToObstacleDir.x());
+  
+  float squaredDistance1 = SquaredDistance(newMapCoord, intersection1);
+  float squaredDistance2 = SquaredDistance(newMapCoord, intersection2);
+  
+  *evadeMapCoord = (squaredDistance1 < squaredDistance2) ? intersection1 : intersection2;
+  return true;
+}
+
+void SetUnitPath(ServerUnit* unit, const std::vector<QPointF>& reversePath) {
+  // Assign the path to the unit.
+  unit->SetPath(reversePath);
+  
+  // Start traversing the path:
+  // Set the unit's movement direction to the first segment of the path.
+  FaceNextPathTarget(unit);
+}
+
+void PlanUnitMovement(const ServerMap& map, const ServerUnit* unit, float stepLengthInSeconds, UnitMovement* movement) {
+  float moveDistance = unit->GetMoveSpeed() * stepLengthInSeconds;
+  QPointF newMapCoord = unit->GetMapCoord() + moveDistance * unit->GetMovementDirection();
+  
+  movement->unitsVersion = map.GetUnitsVersion();
+  movement->occupancyVersion = map.GetOccupancyVersion();
+  
+  // Test whether the current goal was reached.
+  QPointF toGoal = unit->GetNextPathTarget() - unit->GetMapCoord();
+  float squaredDistanceToGoal = SquaredLength(toGoal);
+  float directionDotToGoal =
+      unit->GetMovementDirection().x() * toGoal.x() +
+      unit->GetMovementDirection().y() * toGoal.y();
+  
+  if (squaredDistanceToGoal <= moveDistance * moveDistance || directionDotToGoal <= 0) {
+    movement->type = UnitMovementType::ReachPathTarget;
+    movement->pathTargetFree = !map.DoesUnitCollide(unit, unit->GetNextPathTarget());
+    movement->readUnitTiles = GetCollisionTestTiles(map, unit, unit->GetNextPathTarget());
+    return;
+  }
+  
+  // Move the unit if the path is free.
+  movement->readUnitTiles = GetCollisionTestTiles(map, unit, newMapCoord);
+  ServerUnit* collidingUnit;
+  if (!map.DoesUnitCollide(unit, newMapCoord, &collidingUnit)) {
+    movement->type = UnitMovementType::Move;
+    movement->newMapCoord = newMapCoord;
+    return;
+  }
+  
+  movement->type = UnitMovementType::Blocked;
+  if (collidingUnit != nullptr) {
+    // Try to evade the unit by moving alongside it.
+    QPointF evadeMapCoord;
+    if (TryEvadeUnit(unit, moveDistance, newMapCoord, collidingUnit, &evadeMapCoord)) {
+      movement->readUnitTiles = movement->readUnitTiles.united(GetCollisionTestTiles(map, unit, evadeMapCoord));
+      
+      // If this found a side step that avoids bumping into the other unit,
+      // test whether this would still bring us closer to our goal.
+      if (!map.DoesUnitCollide(unit, evadeMapCoord) &&
+          SquaredDistance(unit->GetNextPathTarget(), evadeMapCoord) <
+          SquaredDistance(unit->GetNextPathTarget(), unit->GetMapCoord())) {
+        movement->type = UnitMovementType::Evade;
+        movement->newMapCoord = evadeMapCoord;
+      }
+    }
+  }
+}
+
+bool IsUnitMovementUpToDate(const ServerMap& map, const UnitMovement& movement) {
+  return movement.occupancyVersion == map.GetOccupancyVersion() &&
+         !map.HaveUnitsChangedSince(movement.readUnitTiles, movement.unitsVersion);
+}
+
+bool ApplyUnitMovement(ServerMap* map, ServerUnit* unit, const UnitMovement& movement) {
+  switch (movement.type) {
+  case UnitMovementType::ReachPathTarget:
+    if (movement.pathTargetFree) {
+      map->SetUnitMapCoord(unit, unit->GetNextPathTarget());
+    }
+    
+    // Continue with the next part of the path if any, or stop if the path was completed.
+    unit->PathSegmentCompleted();
+    if (unit->HasPath()) {
+      FaceNextPathTarget(unit);
+    } else {
+      unit->StopMovement();
+    }
+    return true;
+  case UnitMovementType::Move:
+    map->SetUnitMapCoord(unit, movement.newMapCoord);
+    
+    if (unit->GetCurrentAction() != UnitAction::Moving) {
+      unit->SetCurrentAction(UnitAction::Moving);
+      return true;
+    }
+    return false;
+  case UnitMovementType::Evade:
+    // Change our movement direction in order to still face the next path goal.
+    map->SetUnitMapCoord(unit, movement.newMapCoord);
+    FaceNextPathTarget(unit);
+    
+    if (unit->GetCurrentAction() != UnitAction::Moving) {
+      unit->SetCurrentAction(UnitAction::Moving);
+    }
+    return true;
+  case UnitMovementType::Blocked:
+    if (unit->GetCurrentAction() != UnitAction::Idle) {
+      unit->PauseMovement();
+      return true;
+    }
+    return false;
+  }
+  return false;
+}
@@ -0,0 +1,66 @@
+// Copyright 2020 The FreeAge authors
+// This file is part of FreeAge, licensed under the new BSD license.
+// See the COPYING file in the project root for the license text.
+
+#pragma once
+
+#include <vector>
+
+#include <QPointF>
+#include <QRect>
+
+#include "FreeAge/common/free_age.hpp"
+
+class ServerMap;
+class ServerUnit;
+
+/// The possible outcomes of moving a unit along its path for one game step.
+enum class UnitMovementType {
+  /// The unit is blocked and pauses its movement.
+  Blocked = 0,
+  
+  /// The unit reaches the next target on its path.
+  ReachPathTarget,
+  
+  /// The unit moves on in its movement direction.
+  Move,
+  
+  /// The unit side-steps another unit that blocks its way.
+  Evade
+};
+
+/// The movement of a unit along its path during one game step, as determined by PlanUnitMovement().
+///
+/// Planning only reads the map, so the movements of many units can be planned in parallel.
+/// Applying the result with ApplyUnitMovement() has the same effect as planning and applying
+/// the movement at the time of application, as long as IsUnitMovementUpToDate() returns true.
+struct UnitMovement {
+  UnitMovementType type;
+  
+  /// For ReachPathTarget: whether the unit can be placed exactly at the path target.
+  bool pathTargetFree;
+  
+  /// For Move and Evade: the unit's new map coord.
+  QPointF newMapCoord;
+  
+  /// The tiles whose units may affect the collision tests (see ServerMap::GetUnitTilesInArea()).
+  QRect readUnitTiles;
+  
+  /// The values of ServerMap::GetUnitsVersion() and ServerMap::GetOccupancyVersion() at planning time.
+  u64 unitsVersion;
+  u32 occupancyVersion;
+};
+
+/// Assigns the given path to the unit and makes it face the first path target.
+void SetUnitPath(ServerUnit* unit, const std::vector<QPointF>& reversePath);
+
+/// Determines how the given unit moves along its path during a game step of the given length.
+/// The unit must have a path and a non-zero movement direction.
+void PlanUnitMovement(const ServerMap& map, const ServerUnit* unit, float stepLengthInSeconds, UnitMovement* movement);
+
+/// Returns whether none of the map state that the planning of the given movement depended on has changed since.
+bool IsUnitMovementUpToDate(const ServerMap& map, const UnitMovement& movement);
+
+/// Applies a movement that was planned for the given unit with PlanUnitMovement().
+/// Returns true if the clients need to be notified about the unit's new movement.
+bool ApplyUnitMovement(ServerMap* map, ServerUnit* unit, const UnitMovement& movement);
@@ -0,0 +1,55 @@
+// Copyright 2020 The FreeAge authors
+// This file is part of FreeAge, licensed under the new BSD license.
+// See the COPYING file in the project root for the license text.
+
+#include "FreeAge/server/visibility.hpp"
+
+#include <algorithm>
+
+PlayerVisibility::PlayerVisibility(int width, int height)
+    : width(width),
+      height(height),
+      viewCount(width * height, 0),
+      isTileChanged(width * height, 0) {}
+
+void PlayerVisibility::UpdateFieldOfView(float centerMapCoordX, float centerMapCoordY, float radius, int change) {
+  // This must match Map::UpdateFieldOfView() on the client (apart from the margin).
+  float effectiveRadius = radius + 0.7f + kMargin;
+  float effectiveRadiusSquared = effectiveRadius * effectiveRadius;
+  
+  int minX = std::max<int>(0, centerMapCoordX - effectiveRadius);
+  int minY = std::max<int>(0, centerMapCoordY - effectiveRadius);
+  int maxX = std::min<int>(width - 1, centerMapCoordX + effectiveRadius);
+  int maxY = std::min<int>(height - 1, centerMapCoordY + effectiveRadius);
+  
+  float centerMapCoordXMinusHalf = centerMapCoordX - 0.5f;
+  float centerMapCoordYMinusHalf = centerMapCoordY - 0.5f;
+  
+  for (int y = minY; y <= maxY; ++ y) {
+    int* row = viewCount.data() + width * y;
+    for (int x = minX; x <= maxX; ++ x) {
+      float dx = x - centerMapCoordXMinusHalf;
+      float dy = y - centerMapCoordYMinusHalf;
+      
+      if (dx * dx + dy * dy <= effectiveRadiusSquared) {
+        row[x] += change;
+        
+        // Record the tile if its view count crossed zero.
+        if (row[x] == 0 || row[x] == change) {
+          int tileIndex = width * y + x;
+          if (!isTileChanged[tileIndex]) {
+            isTileChanged[tileIndex] = 1;
+            changedTiles.push_back(tileIndex);
+          }
+        }
+      }
+    }
+  }
+}
+
+void PlayerVisibility::ClearChangedTiles() {
+  for (int tileIndex : changedTiles) {
+    isTileChanged[tileIndex] = 0;
+  }
+  changedTiles.clear();
+}
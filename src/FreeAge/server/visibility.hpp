@@ -0,0 +1,54 @@
+// Copyright 2020 The FreeAge authors
+// This file is part of FreeAge, licensed under the new BSD license.
+// See the COPYING file in the project root for the license text.
+
+#pragma once
+
+#include <vector>
+
+#include "FreeAge/common/free_age.hpp"
+
+/// Tracks which map tiles a player sees. The server uses this to only tell the player about
+/// the units that it can see (interest management).
+///
+/// The fields of view are computed in the same way as on the client (see Map::UpdateFieldOfView()
+/// there), except that their radius is enlarged by kMargin. This is because the clients update the
+/// fields of view of their moving units continuously, while the server only does so once per game step.
+/// The margin ensures that the clients already know about the units that they are about to see.
+class PlayerVisibility {
+ public:
+  /// Additional radius (in tiles) that is added to all fields of view.
+  static constexpr float kMargin = 1;
+  
+  PlayerVisibility(int width, int height);
+  
+  /// Adds (change = 1) or removes (change = -1) a field of view with the given center and radius.
+  /// Tiles that become visible or invisible by this are recorded (see GetChangedTiles()).
+  void UpdateFieldOfView(float centerMapCoordX, float centerMapCoordY, float radius, int change);
+  
+  /// Returns whether the given tile is within any field of view.
+  inline bool IsTileVisible(int x, int y) const { return viewCount[y * width + x] > 0; }
+  
+  /// Returns the indices (y * width + x) of the tiles whose visibility may have changed since the last call
+  /// to ClearChangedTiles(), i.e., whose view count went from zero to non-zero or the other way round.
+  /// Each tile is contained at most once. A tile may have changed back to its previous visibility.
+  inline const std::vector<int>& GetChangedTiles() const { return changedTiles; }
+  void ClearChangedTiles();
+  
+  inline int GetWidth() const { return width; }
+  inline int GetHeight() const { return height; }
+  
+ private:
+  int width;
+  int height;
+  
+  /// The number of fields of view that contain each tile.
+  /// An element (x, y) has index: [y * width + x].
+  std::vector<int> viewCount;
+  
+  /// See GetChangedTiles().
+  std::vector<int> changedTiles;
+  
+  /// Whether each tile is in changedTiles, indexed like viewCount.
+  std::vector<u8> isTileChanged;
+};
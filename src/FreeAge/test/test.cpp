@@ -2,11 +2,30 @@
 // This file is part of FreeAge, licensed under the new BSD license.
 // See the COPYING file in the project root for the license text.
 
+#include <cstring>
+#include <limits>
+#include <memory>
+#include <random>
+#include <unordered_map>
+
 #include <gtest/gtest.h>
 #include <QApplication>
+#include <QDir>
 
 #include "FreeAge/common/logging.hpp"
+#include "FreeAge/common/message_buffer.hpp"
+#include "FreeAge/common/messages.hpp"
+#include "FreeAge/common/thread_pool.hpp"
+#include "FreeAge/common/util.hpp"
 #include "FreeAge/client/map.hpp"
+#include "FreeAge/client/sprite_decoding.hpp"
+#include "FreeAge/server/connected_components.hpp"
+#include "FreeAge/server/drop_off_points.hpp"
+#include "FreeAge/server/flow_field.hpp"
+#include "FreeAge/server/pathfinding.hpp"
+#include "FreeAge/server/replay.hpp"
+#include "FreeAge/server/slot_map.hpp"
+#include "FreeAge/server/timer_wheel.hpp"
 
 int main(int argc, char** argv) {
   // Initialize loguru
@@ -79,3 +98,635 @@ TEST(Map, CoordinateConversion_HillyMap) {
   
   TestProjectedCoordToMapCoord(testMap);
 }
+
+
+TEST(SlotMap, InsertFindErase) {
+  SlotMap<int> slotMap;
+  
+  constexpr usize kNumValues = 100;
+  std::vector<u32> handles(kNumValues);
+  for (usize i = 0; i < kNumValues; ++ i) {
+    handles[i] = slotMap.insert(i);
+    EXPECT_NE(kInvalidObjectId, handles[i]);
+  }
+  EXPECT_EQ(kNumValues, slotMap.size());
+  
+  // Erase every second value.
+  for (usize i = 0; i < kNumValues; i += 2) {
+    EXPECT_TRUE(slotMap.erase(handles[i]));
+  }
+  EXPECT_EQ(kNumValues / 2, slotMap.size());
+  
+  for (usize i = 0; i < kNumValues; ++ i) {
+    auto it = slotMap.find(handles[i]);
+    if (i % 2 == 0) {
+      EXPECT_TRUE(it == slotMap.end());
+      EXPECT_FALSE(slotMap.erase(handles[i]));
+    } else {
+      ASSERT_TRUE(it != slotMap.end());
+      EXPECT_EQ(handles[i], it->first);
+      EXPECT_EQ(static_cast<int>(i), it->second);
+    }
+  }
+  
+  // Iteration visits exactly the remaining values.
+  usize sum = 0;
+  for (const auto& item : slotMap) {
+    sum += item.second;
+  }
+  EXPECT_EQ(kNumValues * kNumValues / 4, sum);
+}
+
+TEST(SlotMap, StaleHandlesAfterSlotReuse) {
+  SlotMap<int> slotMap;
+  
+  u32 oldHandle = slotMap.insert(1);
+  EXPECT_TRUE(slotMap.erase(oldHandle));
+  
+  // The slot gets reused, but the old handle must not refer to the new value.
+  u32 newHandle = slotMap.insert(2);
+  EXPECT_NE(oldHandle, newHandle);
+  EXPECT_FALSE(slotMap.contains(oldHandle));
+  ASSERT_TRUE(slotMap.contains(newHandle));
+  EXPECT_EQ(2, slotMap.find(newHandle)->second);
+  
+  EXPECT_FALSE(slotMap.contains(kInvalidObjectId));
+}
+
+TEST(ThreadPool, WaitForAllRunsAllTasks) {
+  ThreadPool threadPool(3);
+  EXPECT_EQ(3, threadPool.GetThreadCount());
+  
+  constexpr int kTaskCount = 100;
+  std::vector<int> results(kTaskCount, 0);
+  for (int round = 1; round <= 2; ++ round) {
+    for (int i = 0; i < kTaskCount; ++ i) {
+      threadPool.Enqueue([&results, i, round]() { results[i] = round * i; });
+    }
+    threadPool.WaitForAll();
+    
+    for (int i = 0; i < kTaskCount; ++ i) {
+      EXPECT_EQ(round * i, results[i]);
+    }
+  }
+}
+
+TEST(MessageBuffer, SplitsStreamIntoMessages) {
+  // Create messages of different sizes, consisting of the header and a payload that depends on the message index.
+  constexpr int kMessageCount = 200;
+  std::vector<QByteArray> messages(kMessageCount);
+  QByteArray stream;
+  for (int i = 0; i < kMessageCount; ++ i) {
+    u16 size = 3 + (i * 7) % 40;
+    messages[i] = QByteArray(size, static_cast<char>(i));
+    messages[i][0] = static_cast<char>(i % 16);
+    memcpy(messages[i].data() + 1, &size, 2);
+    stream += messages[i];
+  }
+  
+  // Pass the stream to a small buffer in chunks of different sizes, such that the
+  // messages are split across the chunks and wrap around the end of the ring buffer.
+  MessageBuffer buffer(16);
+  int nextMessage = 0;
+  int streamOffset = 0;
+  int chunkIndex = 0;
+  while (streamOffset < stream.size()) {
+    int chunkSize = std::min(1 + (chunkIndex * 13) % 50, stream.size() - streamOffset);
+    buffer.Append(stream.data() + streamOffset, chunkSize);
+    streamOffset += chunkSize;
+    ++ chunkIndex;
+    
+    MessageView message;
+    while (buffer.GetNextMessage(&message)) {
+      ASSERT_LT(nextMessage, kMessageCount);
+      EXPECT_EQ(nextMessage % 16, message.GetType());
+      EXPECT_EQ(QByteArray(message.GetData(), message.GetSize()), messages[nextMessage]);
+      buffer.PopMessage(message);
+      ++ nextMessage;
+    }
+  }
+  
+  EXPECT_EQ(kMessageCount, nextMessage);
+  EXPECT_TRUE(buffer.IsEmpty());
+}
+
+TEST(Messages, UnitMovementBatchRoundTrip) {
+  std::mt19937 generator(/*seed*/ 0);
+  std::uniform_int_distribution<int> deltaDistribution(-100000, 100000);
+  std::uniform_real_distribution<float> angleDistribution(0, 2 * M_PI);
+  const float speeds[] = {0.f, 1.f, 2.f, 1.35f};
+  
+  // Append many entries, with other messages in between some of them. The runs of entries between
+  // the other messages are longer than what fits into a single batch, so full batches get split, too.
+  constexpr int kEntryCount = 40000;
+  std::vector<UnitMovementBatchEntry> entries(kEntryCount);
+  MessageWriter writer(kGameStepTimeMessageSize);
+  int batchOffset = -1;
+  int otherMessageCount = 0;
+  for (int i = 0; i < kEntryCount; ++ i) {
+    UnitMovementBatchEntry& entry = entries[i];
+    entry.unitId = (i % 7 == 0) ? (0xfff00000 + i) : i;
+    entry.coordDelta = (i % 3 == 0) ? QPoint(0, 0) : QPoint(deltaDistribution(generator), deltaDistribution(generator));
+    float speed = speeds[i % 4];
+    float angle = angleDistribution(generator);
+    entry.speed = QPointF(speed * std::cos(angle), speed * std::sin(angle));
+    entry.action = static_cast<UnitAction>(i % static_cast<int>(UnitAction::NumActions));
+    AppendUnitMovementBatchEntry(&writer, &batchOffset, entry.unitId, entry.coordDelta, entry.speed, entry.action);
+    
+    if (i % 10000 == 9999) {
+      WriteObjectDeathMessage(&writer, i);
+      ++ otherMessageCount;
+    }
+  }
+  
+  // Split the buffer into messages and decode the entries.
+  MessageBuffer messageBuffer;
+  messageBuffer.Append(writer.GetMessages(), writer.GetMessagesSize());
+  int nextEntry = 0;
+  int batchCount = 0;
+  int parsedOtherMessageCount = 0;
+  MessageView message;
+  while (messageBuffer.GetNextMessage(&message)) {
+    if (static_cast<ServerToClientMessage>(message.GetType()) != ServerToClientMessage::UnitMovementBatch) {
+      ++ parsedOtherMessageCount;
+      messageBuffer.PopMessage(message);
+      continue;
+    }
+    
+    ++ batchCount;
+    const char* data = message.GetData() + MessageBuffer::kHeaderSize;
+    int size = message.GetSize() - MessageBuffer::kHeaderSize;
+    int offset = 0;
+    while (offset < size) {
+      ASSERT_LT(nextEntry, kEntryCount);
+      const UnitMovementBatchEntry& expected = entries[nextEntry];
+      UnitMovementBatchEntry entry;
+      ASSERT_TRUE(ParseUnitMovementBatchEntry(data, size, &offset, &entry));
+      EXPECT_EQ(expected.unitId, entry.unitId);
+      EXPECT_EQ(expected.coordDelta, entry.coordDelta);
+      EXPECT_EQ(expected.action, entry.action);
+      EXPECT_NEAR(expected.speed.x(), entry.speed.x(), 1e-3f);
+      EXPECT_NEAR(expected.speed.y(), entry.speed.y(), 1e-3f);
+      ++ nextEntry;
+    }
+    messageBuffer.PopMessage(message);
+  }
+  
+  EXPECT_EQ(kEntryCount, nextEntry);
+  EXPECT_EQ(otherMessageCount, parsedOtherMessageCount);
+  EXPECT_GT(batchCount, otherMessageCount + 1);
+}
+
+/// Returns whether a unit may walk along the given tile path according to the movement rules of GridPathPlanner.
+static bool IsValidTilePath(const PathfindingGrid& grid, const QPoint& start, const QRect& goalRect, const std::vector<QPoint>& reverseTilePath) {
+  auto isFree = [&](int x, int y) {
+    return grid.IsInside(x, y) && (!grid.IsOccupied(x, y) || goalRect.contains(x, y));
+  };
+  QPoint previous = start;
+  for (auto it = reverseTilePath.rbegin(); it != reverseTilePath.rend(); ++ it) {
+    QPoint step = *it - previous;
+    if (std::abs(step.x()) > 1 || std::abs(step.y()) > 1 || step.isNull() ||
+        !isFree(it->x(), it->y()) ||
+        (step.manhattanLength() == 2 && (!isFree(previous.x() + step.x(), previous.y()) || !isFree(previous.x(), previous.y() + step.y())))) {
+      return false;
+    }
+    previous = *it;
+  }
+  return true;
+}
+
+TEST(Replay, RecordedCommandsAreReadBack) {
+  QString path = QDir::temp().filePath("FreeAgeTest_replay.bin");
+  
+  ReplayHeader header;
+  header.mapSize = 123;
+  header.pathPlanner = GridPathPlannerType::JumpPointSearch;
+  header.gameBeginServerTime = 1.25;
+  header.initialResources = {ResourceAmount(200, 200, 100, 200), ResourceAmount(1, 2, 3, 4)};
+  
+  std::vector<QByteArray> commands = {
+      CreateMoveToMapCoordMessage({1, 2, 3}, QPointF(4.5f, 6.5f)),
+      CreateSetTargetMessage({7}, 8),
+      CreateLeaveMessage()};
+  constexpr u32 kEndGameStep = 50;
+  {
+    ReplayRecorder recorder;
+    ASSERT_TRUE(recorder.Open(path, header));
+    for (usize i = 0; i < commands.size(); ++ i) {
+      recorder.RecordCommand(10 * i, i % 2, MessageView(commands[i].constData(), commands[i].size()));
+      recorder.Flush(10 * i + 1);
+    }
+    recorder.Flush(kEndGameStep);
+  }
+  
+  ReplayReader reader;
+  ReplayHeader readHeader;
+  ASSERT_TRUE(reader.Open(path, &readHeader));
+  EXPECT_EQ(header.mapSize, readHeader.mapSize);
+  EXPECT_EQ(header.pathPlanner, readHeader.pathPlanner);
+  EXPECT_EQ(header.gameBeginServerTime, readHeader.gameBeginServerTime);
+  ASSERT_EQ(header.initialResources.size(), readHeader.initialResources.size());
+  for (usize i = 0; i < header.initialResources.size(); ++ i) {
+    EXPECT_TRUE(header.initialResources[i] == readHeader.initialResources[i]);
+  }
+  
+  u32 gameStep;
+  u8 playerIndex;
+  MessageView msg;
+  for (usize i = 0; i < commands.size(); ++ i) {
+    ASSERT_TRUE(reader.ReadNextCommand(&gameStep, &playerIndex, &msg));
+    EXPECT_EQ(10 * i, gameStep);
+    EXPECT_EQ(i % 2, playerIndex);
+    EXPECT_EQ(commands[i], QByteArray(msg.GetData(), msg.GetSize()));
+  }
+  EXPECT_FALSE(reader.ReadNextCommand(&gameStep, &playerIndex, &msg));
+  
+  u32 endGameStep;
+  ASSERT_TRUE(reader.GetEndGameStep(&endGameStep));
+  EXPECT_EQ(kEndGameStep, endGameStep);
+  
+  QFile::remove(path);
+}
+
+static float TilePathLength(const QPoint& start, const std::vector<QPoint>& reverseTilePath) {
+  float length = 0;
+  QPoint previous = start;
+  for (auto it = reverseTilePath.rbegin(); it != reverseTilePath.rend(); ++ it) {
+    length += DiagonalDistance(it->x() - previous.x(), it->y() - previous.y());
+    previous = *it;
+  }
+  return length;
+}
+
+TEST(Pathfinding, JumpPointSearchMatchesAStar) {
+  constexpr int kGridSize = 40;
+  constexpr int kNumGrids = 20;
+  constexpr int kNumQueriesPerGrid = 50;
+  
+  std::mt19937 generator(0);
+  std::uniform_int_distribution<int> coordDistribution(0, kGridSize - 2);
+  std::uniform_int_distribution<int> percentDistribution(0, 99);
+  
+  AStarPathPlanner aStarPlanner;
+  JumpPointSearchPathPlanner jumpPointSearchPlanner;
+  std::vector<QPoint> aStarPath;
+  std::vector<QPoint> jumpPointSearchPath;
+  
+  for (int gridIdx = 0; gridIdx < kNumGrids; ++ gridIdx) {
+    // Use different obstacle densities, from open terrain to mostly disconnected areas.
+    int occupiedPercent = 50 * gridIdx / kNumGrids;
+    std::unique_ptr<bool[]> occupied(new bool[kGridSize * kGridSize]);
+    for (int i = 0; i < kGridSize * kGridSize; ++ i) {
+      occupied[i] = percentDistribution(generator) < occupiedPercent;
+    }
+    PathfindingGrid grid(kGridSize, kGridSize, occupied.get());
+    
+    for (int query = 0; query < kNumQueriesPerGrid; ++ query) {
+      QPoint start(coordDistribution(generator), coordDistribution(generator));
+      int goalSize = 1 + query % 2;
+      QRect goalRect(coordDistribution(generator), coordDistribution(generator), goalSize, goalSize);
+      
+      bool aStarReachedGoal;
+      bool aStarSuccess = aStarPlanner.PlanPath(grid, start, goalRect, &aStarPath, &aStarReachedGoal);
+      bool jumpPointSearchReachedGoal;
+      bool jumpPointSearchSuccess = jumpPointSearchPlanner.PlanPath(grid, start, goalRect, &jumpPointSearchPath, &jumpPointSearchReachedGoal);
+      
+      ASSERT_EQ(aStarSuccess, jumpPointSearchSuccess);
+      if (!aStarSuccess) {
+        continue;
+      }
+      ASSERT_EQ(aStarReachedGoal, jumpPointSearchReachedGoal);
+      EXPECT_TRUE(IsValidTilePath(grid, start, goalRect, jumpPointSearchPath));
+      if (aStarReachedGoal) {
+        // Both paths must be shortest paths.
+        EXPECT_NEAR(TilePathLength(start, aStarPath), TilePathLength(start, jumpPointSearchPath), 1e-3f);
+      } else {
+        // Both paths must lead to a tile that is closest to the goal.
+        EXPECT_EQ(DiagonalDistanceToRect(aStarPath.front(), goalRect), DiagonalDistanceToRect(jumpPointSearchPath.front(), goalRect));
+      }
+    }
+  }
+}
+
+TEST(ConnectedComponents, IncrementalUpdatesMatchFromScratchLabeling) {
+  constexpr int kGridSize = 32;
+  constexpr int kNumChanges = 400;
+  
+  std::mt19937 generator(0);
+  std::uniform_int_distribution<int> coordDistribution(0, kGridSize - 1);
+  std::uniform_int_distribution<int> sizeDistribution(1, 3);
+  
+  std::unique_ptr<bool[]> occupied(new bool[kGridSize * kGridSize]);
+  for (int i = 0; i < kGridSize * kGridSize; ++ i) {
+    occupied[i] = false;
+  }
+  PathfindingGrid grid(kGridSize, kGridSize, occupied.get());
+  
+  ConnectedComponents components;
+  components.Initialize(grid);
+  
+  for (int change = 0; change < kNumChanges; ++ change) {
+    // Occupy or free a random rect, with a bias towards occupying to create walls and enclosed areas.
+    QRect rect(coordDistribution(generator), coordDistribution(generator), sizeDistribution(generator), sizeDistribution(generator));
+    bool occupy = coordDistribution(generator) < kGridSize * 2 / 3;
+    for (int y = rect.y(); y < std::min(kGridSize, rect.y() + rect.height()); ++ y) {
+      for (int x = rect.x(); x < std::min(kGridSize, rect.x() + rect.width()); ++ x) {
+        occupied[y * kGridSize + x] = occupy;
+      }
+    }
+    components.Update(grid, rect);
+    
+    // Two tiles must have the same incremental label if and only if they have the same label from scratch.
+    ConnectedComponents reference;
+    reference.Initialize(grid);
+    std::unordered_map<u32, u32> referenceToIncremental;
+    std::unordered_map<u32, u32> incrementalToReference;
+    for (int y = 0; y < kGridSize; ++ y) {
+      for (int x = 0; x < kGridSize; ++ x) {
+        u32 label = components.GetComponent(QPoint(x, y));
+        u32 referenceLabel = reference.GetComponent(QPoint(x, y));
+        ASSERT_EQ(referenceLabel == ConnectedComponents::kNoComponent, label == ConnectedComponents::kNoComponent);
+        if (label == ConnectedComponents::kNoComponent) {
+          continue;
+        }
+        ASSERT_EQ(reference.GetComponentSize(referenceLabel), components.GetComponentSize(label));
+        auto result = referenceToIncremental.emplace(referenceLabel, label);
+        ASSERT_EQ(label, result.first->second);
+        result = incrementalToReference.emplace(label, referenceLabel);
+        ASSERT_EQ(referenceLabel, result.first->second);
+      }
+    }
+  }
+}
+
+TEST(ConnectedComponents, CopyChangesFromMatchesSource) {
+  // The grid is larger than a change block, such that some blocks are not copied.
+  constexpr int kGridSize = 3 * ConnectedComponents::kChangeBlockSize;
+  constexpr int kNumChanges = 200;
+  
+  std::mt19937 generator(0);
+  std::uniform_int_distribution<int> coordDistribution(0, kGridSize - 1);
+  std::uniform_int_distribution<int> sizeDistribution(1, 4);
+  
+  std::unique_ptr<bool[]> occupied(new bool[kGridSize * kGridSize]);
+  for (int i = 0; i < kGridSize * kGridSize; ++ i) {
+    occupied[i] = false;
+  }
+  PathfindingGrid grid(kGridSize, kGridSize, occupied.get());
+  
+  ConnectedComponents components;
+  components.Initialize(grid);
+  ConnectedComponents copy;
+  
+  for (int change = 0; change < kNumChanges; ++ change) {
+    QRect rect(coordDistribution(generator), coordDistribution(generator), sizeDistribution(generator), sizeDistribution(generator));
+    bool occupy = coordDistribution(generator) < kGridSize * 2 / 3;
+    for (int y = rect.y(); y < std::min(kGridSize, rect.y() + rect.height()); ++ y) {
+      for (int x = rect.x(); x < std::min(kGridSize, rect.x() + rect.width()); ++ x) {
+        occupied[y * kGridSize + x] = occupy;
+      }
+    }
+    components.Update(grid, rect);
+    
+    // Copy after a varying number of changes.
+    if (change % 3 != 0) {
+      continue;
+    }
+    copy.CopyChangesFrom(components);
+    for (int y = 0; y < kGridSize; ++ y) {
+      for (int x = 0; x < kGridSize; ++ x) {
+        u32 label = components.GetComponent(QPoint(x, y));
+        ASSERT_EQ(label, copy.GetComponent(QPoint(x, y)));
+        if (label != ConnectedComponents::kNoComponent) {
+          ASSERT_EQ(components.GetComponentSize(label), copy.GetComponentSize(label));
+        }
+      }
+    }
+  }
+}
+
+TEST(ConnectedComponents, ReachabilityMatchesAStar) {
+  constexpr int kGridSize = 32;
+  constexpr int kNumQueries = 500;
+  
+  std::mt19937 generator(1);
+  std::uniform_int_distribution<int> coordDistribution(0, kGridSize - 2);
+  std::uniform_int_distribution<int> percentDistribution(0, 99);
+  
+  std::unique_ptr<bool[]> occupied(new bool[kGridSize * kGridSize]);
+  for (int i = 0; i < kGridSize * kGridSize; ++ i) {
+    occupied[i] = percentDistribution(generator) < 35;
+  }
+  PathfindingGrid grid(kGridSize, kGridSize, occupied.get());
+  
+  ConnectedComponents components;
+  components.Initialize(grid);
+  AStarPathPlanner planner;
+  std::vector<QPoint> reverseTilePath;
+  
+  for (int query = 0; query < kNumQueries; ++ query) {
+    QPoint start(coordDistribution(generator), coordDistribution(generator));
+    if (grid.IsOccupied(start.x(), start.y())) {
+      continue;
+    }
+    int goalSize = 1 + query % 2;
+    QRect goalRect(coordDistribution(generator), coordDistribution(generator), goalSize, goalSize);
+    if (goalRect.contains(start)) {
+      continue;
+    }
+    
+    bool reachedGoal;
+    bool success = planner.PlanPath(grid, start, goalRect, &reverseTilePath, &reachedGoal);
+    u32 component = components.GetComponent(start);
+    EXPECT_EQ(success && reachedGoal, components.CanReach(grid, component, goalRect));
+    if (success && !reachedGoal) {
+      // If the start tile itself is closest, A* leads to one of its neighbors instead, so this case is not compared.
+      QPoint closestTile = components.FindClosestTile(component, goalRect);
+      if (closestTile == start) {
+        continue;
+      }
+      EXPECT_EQ(DiagonalDistanceToRect(reverseTilePath.front(), goalRect), DiagonalDistanceToRect(closestTile, goalRect));
+    }
+  }
+}
+
+TEST(FlowField, ContinuedSearchMatchesRestartedSearch) {
+  constexpr int kGridSize = 3 * FlowField::kBlockSize;
+  constexpr int kBlocksX = kGridSize / FlowField::kBlockSize;
+  constexpr int kNumChanges = 100;
+  constexpr int kNumQueriesPerChange = 4;
+  
+  std::mt19937 generator(0);
+  std::uniform_int_distribution<int> coordDistribution(0, kGridSize - 1);
+  std::uniform_int_distribution<int> sizeDistribution(1, 3);
+  
+  std::unique_ptr<bool[]> occupied(new bool[kGridSize * kGridSize]);
+  for (int i = 0; i < kGridSize * kGridSize; ++ i) {
+    occupied[i] = false;
+  }
+  PathfindingGrid grid(kGridSize, kGridSize, occupied.get());
+  u32 occupancyVersion = 0;
+  std::vector<u32> occupancyBlockVersions(kBlocksX * kBlocksX, 0);
+  
+  const QPoint goalTile(kGridSize / 2, kGridSize / 2);
+  FlowField field(goalTile);
+  field.Reset(grid, occupancyVersion);
+  std::vector<QPoint> path;
+  std::vector<QPoint> referencePath;
+  
+  for (int change = 0; change < kNumChanges; ++ change) {
+    QRect rect(coordDistribution(generator), coordDistribution(generator), sizeDistribution(generator), sizeDistribution(generator));
+    rect = rect.intersected(QRect(0, 0, kGridSize, kGridSize));
+    bool occupy = coordDistribution(generator) < kGridSize * 2 / 3;
+    for (int y = rect.top(); y <= rect.bottom(); ++ y) {
+      for (int x = rect.left(); x <= rect.right(); ++ x) {
+        occupied[y * kGridSize + x] = occupy;
+      }
+    }
+    ++ occupancyVersion;
+    for (int blockY = rect.top() / FlowField::kBlockSize; blockY <= rect.bottom() / FlowField::kBlockSize; ++ blockY) {
+      for (int blockX = rect.left() / FlowField::kBlockSize; blockX <= rect.right() / FlowField::kBlockSize; ++ blockX) {
+        occupancyBlockVersions[blockY * kBlocksX + blockX] = occupancyVersion;
+      }
+    }
+    field.Update(grid, occupancyVersion, occupancyBlockVersions);
+    
+    // Query tiles around the goal, such that the search is usually paused before it covers the whole grid.
+    FlowField referenceField(goalTile);
+    referenceField.Reset(grid, occupancyVersion);
+    std::uniform_int_distribution<int> offsetDistribution(-change / 4, change / 4);
+    for (int query = 0; query < kNumQueriesPerChange; ++ query) {
+      QPoint start(
+          std::max(0, std::min(kGridSize - 1, goalTile.x() + offsetDistribution(generator))),
+          std::max(0, std::min(kGridSize - 1, goalTile.y() + offsetDistribution(generator))));
+      bool reachable = field.ExtractPath(grid, start, &path);
+      ASSERT_EQ(referenceField.ExtractPath(grid, start, &referencePath), reachable);
+      ASSERT_EQ(referencePath, path);
+    }
+  }
+}
+
+TEST(DropOffPointIndex, FindsClosestLikeExhaustiveSearch) {
+  constexpr int kMapSize = 200;
+  std::mt19937 generator(/*seed*/ 0);
+  std::uniform_real_distribution<float> coordDistribution(-5, kMapSize + 5);
+  
+  DropOffPointIndex index;
+  index.Initialize(kMapSize, kMapSize);
+  u32 buildingId;
+  EXPECT_FALSE(index.FindClosest(QPointF(10, 10), &buildingId));
+  
+  // Add and remove buildings, and compare the query results to an exhaustive search.
+  std::unordered_map<u32, QPointF> buildings;
+  u32 nextBuildingId = 1;
+  for (int iteration = 0; iteration < 500; ++ iteration) {
+    if (buildings.size() < 3 || generator() % 3 != 0) {
+      QPointF center(coordDistribution(generator), coordDistribution(generator));
+      index.Add(nextBuildingId, center);
+      buildings[nextBuildingId] = center;
+      ++ nextBuildingId;
+    } else {
+      auto it = buildings.begin();
+      std::advance(it, generator() % buildings.size());
+      index.Remove(it->first, it->second);
+      buildings.erase(it);
+    }
+    ASSERT_EQ(buildings.size(), index.GetSize());
+    
+    for (int query = 0; query < 10; ++ query) {
+      QPointF mapCoord(coordDistribution(generator), coordDistribution(generator));
+      float bestSquaredDistance = std::numeric_limits<float>::infinity();
+      for (const auto& item : buildings) {
+        bestSquaredDistance = std::min(bestSquaredDistance, SquaredDistance(item.second, mapCoord));
+      }
+      
+      ASSERT_TRUE(index.FindClosest(mapCoord, &buildingId));
+      ASSERT_EQ(1, buildings.count(buildingId));
+      EXPECT_EQ(bestSquaredDistance, SquaredDistance(buildings[buildingId], mapCoord));
+    }
+  }
+}
+
+TEST(TimerWheel, EventsAreDueAtTheirSteps) {
+  constexpr u32 kLastStep = 3 * TimerWheel<u32>::kSlots * TimerWheel<u32>::kSlots;
+  std::mt19937 generator(/*seed*/ 0);
+  
+  // Schedule events at random steps while advancing, with the event being its step.
+  // Some events are far in the future, such that they are stored in the higher levels of the wheel.
+  TimerWheel<u32> timers;
+  usize scheduledCount = 0;
+  usize dueCount = 0;
+  std::vector<u32> dueEvents;
+  while (timers.GetCurrentStep() < kLastStep) {
+    u32 currentStep = timers.GetCurrentStep();
+    if (generator() % 16 == 0) {
+      u32 maxDelay = (generator() % 4 == 0) ? kLastStep : 300;
+      u32 step = std::min(kLastStep - 1, currentStep + static_cast<u32>(generator() % maxDelay));
+      timers.Schedule(step, step);
+      ++ scheduledCount;
+    }
+    
+    dueEvents.clear();
+    timers.Advance(&dueEvents);
+    for (u32 event : dueEvents) {
+      ASSERT_EQ(currentStep, event);
+    }
+    dueCount += dueEvents.size();
+    ASSERT_EQ(scheduledCount - dueCount, timers.GetSize());
+  }
+  
+  EXPECT_EQ(scheduledCount, dueCount);
+  EXPECT_EQ(0, timers.GetSize());
+}
+
+TEST(SpriteDecoding, RunDecodingMatchesScalarReference) {
+  constexpr int kBlockCount = 64;
+  std::mt19937 generator(/*seed*/ 0);
+  
+  std::vector<u8> pixelArray(5 * kBlockCount);
+  for (u8& byte : pixelArray) {
+    byte = generator() % 256;
+  }
+  
+  Palette palette(kSMXPixelValueCount);
+  for (QRgb& color : palette) {
+    color = generator();
+  }
+  
+  for (bool playerColors : {false, true}) {
+    const Palette* testPalette = playerColors ? nullptr : &palette;
+    SMXColorTable colorTable;
+    colorTable.Initialize(testPalette, /*ignoreAlpha*/ true);
+    
+    for (bool eightToFive : {false, true}) {
+      // Decode the pixel array in runs of random lengths (as in the drawing commands) with both implementations.
+      const u8* referencePixelPtr = pixelArray.data();
+      int referenceState = 0;
+      const u8* pixelPtr = pixelArray.data();
+      int state = 0;
+      int remainingPixelCount = kBlockCount * (eightToFive ? 2 : 4);
+      while (remainingPixelCount > 0) {
+        int count = std::min<int>(remainingPixelCount, 1 + generator() % 64);
+        remainingPixelCount -= count;
+        
+        std::vector<QRgb> expected(count);
+        for (int i = 0; i < count; ++ i) {
+          expected[i] = eightToFive ?
+              DecompressNextPixel8To5(referencePixelPtr, referenceState, testPalette, /*ignoreAlpha*/ true) :
+              DecompressNextPixel4Plus1(referencePixelPtr, referenceState, testPalette, /*ignoreAlpha*/ true);
+        }
+        
+        std::vector<QRgb> result(count);
+        if (eightToFive) {
+          DecompressPixels8To5(pixelPtr, state, count, colorTable, result.data());
+        } else {
+          DecompressPixels4Plus1(pixelPtr, state, count, colorTable, result.data());
+        }
+        
+        ASSERT_EQ(expected, result);
+        ASSERT_EQ(referencePixelPtr, pixelPtr);
+        ASSERT_EQ(referenceState, state);
+      }
+    }
+  }
+}
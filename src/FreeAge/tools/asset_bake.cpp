@@ -0,0 +1,176 @@
+// Copyright 2020 The FreeAge authors
+// This file is part of FreeAge, licensed under the new BSD license.
+// See the COPYING file in the project root for the license text.
+
+#include <filesystem>
+#include <memory>
+
+#include <QCommandLineParser>
+#include <QDir>
+#include <QGuiApplication>
+#include <QOffscreenSurface>
+#include <QOpenGLContext>
+#include <QSurfaceFormat>
+
+#include "FreeAge/common/free_age.hpp"
+#include "FreeAge/common/logging.hpp"
+#include "FreeAge/common/thread_pool.hpp"
+#include "FreeAge/common/timing.hpp"
+#include "FreeAge/client/building.hpp"
+#include "FreeAge/client/mod_manager.hpp"
+#include "FreeAge/client/shader_color_dilation.hpp"
+#include "FreeAge/client/sprite.hpp"
+#include "FreeAge/client/unit.hpp"
+
+/// Writes the sprite cache files (see SaveSpriteCache()) for all unit and building sprites that the client
+/// loads, such that the client does not need to decode any of these sprites on its first launch. This loads
+/// the unit and building types in the same way as RenderWindow::LoadResources(), including the mods that are
+/// enabled in mod-status.json, so the sprites are decoded in parallel and the cache files have the same names.
+///
+/// Since the colors of the graphic atlases are dilated on the GPU, this requires an OpenGL 3.2 context, which
+/// is created for an offscreen surface. On machines without a display, Qt's offscreen platform plugin may
+/// be used (-platform offscreen) if it supports OpenGL there.
+///
+/// Usage: FreeAgeAssetBake [--mods-path path] [--cache-path path] data_path
+int main(int argc, char** argv) {
+  // Initialize loguru.
+  loguru::g_preamble_date = false;
+  loguru::g_preamble_thread = false;
+  loguru::g_preamble_uptime = false;
+  loguru::g_stderr_verbosity = 2;
+  if (argc > 0) {
+    loguru::init(argc, argv, /*verbosity_flag*/ nullptr);
+  }
+  
+  // Request the same OpenGL version as the client *before* creating the QGuiApplication.
+  QSurfaceFormat format;
+  format.setAlphaBufferSize(8);
+  format.setVersion(3, 2);
+  format.setProfile(QSurfaceFormat::CoreProfile);
+  QSurfaceFormat::setDefaultFormat(format);
+  
+  QGuiApplication qapp(argc, argv);
+  
+  // Parse the command line.
+  QCommandLineParser parser;
+  parser.setApplicationDescription(QObject::tr("Writes the sprite cache files of the FreeAge client ahead of time."));
+  parser.addHelpOption();
+  
+  QCommandLineOption modsPathOption("mods-path", QObject::tr("Sets the mods directory, containing mod-status.json. By default, no mods are used."), QObject::tr("Path"));
+  parser.addOption(modsPathOption);
+  
+  QCommandLineOption cachePathOption("cache-path", QObject::tr("Sets the directory to write the cache files to. By default, this is the graphics_cache directory next to this program, which is where the client looks for them."), QObject::tr("Path"));
+  parser.addOption(cachePathOption);
+  
+  parser.addPositionalArgument("data_path", QObject::tr("The game's data directory, containing the resources directory."));
+  
+  parser.process(qapp);
+  if (parser.positionalArguments().size() != 1) {
+    parser.showHelp(1);
+  }
+  
+  // Verify that the common resources path exists in the given game directory.
+  std::filesystem::path dataPath = parser.positionalArguments()[0].toStdString();
+  std::filesystem::path commonResourcesSubPath = std::filesystem::path("resources") / "_common";
+  if (!std::filesystem::exists(dataPath / commonResourcesSubPath)) {
+    LOG(ERROR) << "The common resources path does not exist: " << (dataPath / commonResourcesSubPath).string();
+    return 1;
+  }
+  
+  // Load the mod info.
+  ModManager::Instance().Clear(dataPath);
+  if (parser.isSet(modsPathOption)) {
+    std::filesystem::path modStatusJsonPath = QDir(parser.value(modsPathOption)).filePath("mod-status.json").toStdString();
+    if (!ModManager::Instance().LoadModStatus(modStatusJsonPath, dataPath)) {
+      LOG(ERROR) << "Failed to load: " << modStatusJsonPath.string();
+      return 1;
+    }
+  }
+  
+  // Load the palettes.
+  Palettes palettes;
+  if (!ReadPalettesConf(GetModdedPath(commonResourcesSubPath / "palettes" / "palettes.conf").string().c_str(), &palettes)) {
+    LOG(ERROR) << "Failed to load the palettes.";
+    return 1;
+  }
+  
+  // Use the same paths as the client.
+  std::filesystem::path graphicsSubPath = std::filesystem::path("resources") / "_common" / "drs" / "graphics";
+  std::filesystem::path cachePath = parser.isSet(cachePathOption) ?
+      std::filesystem::path(parser.value(cachePathOption).toStdString()) :
+      (std::filesystem::path(argv[0]).parent_path() / "graphics_cache");
+  if (!std::filesystem::exists(cachePath)) {
+    std::filesystem::create_directories(cachePath);
+  }
+  
+  // Create an OpenGL context for an offscreen surface.
+  QOpenGLContext context;
+  context.setFormat(QSurfaceFormat::defaultFormat());
+  if (!context.create()) {
+    LOG(ERROR) << "Failed to create an OpenGL context";
+    return 1;
+  }
+  
+  QOffscreenSurface surface;
+  surface.setFormat(context.format());
+  surface.create();
+  if (!surface.isValid() || !context.makeCurrent(&surface)) {
+    LOG(ERROR) << "Failed to create an offscreen surface for the OpenGL context";
+    return 1;
+  }
+  
+  std::shared_ptr<ColorDilationShader> colorDilationShader(new ColorDilationShader());
+  
+  // Load the unit and building types, which decodes their sprites in parallel and writes the cache files.
+  LOG(INFO) << "Baking the sprites to: " << cachePath.string();
+  TimePoint startTime = Clock::now();
+  
+  bool result = true;
+  ThreadPool spriteLoadingThreadPool(ThreadPool::GetDefaultThreadCount());
+  SpriteManager::Instance().BeginDeferredLoading(&spriteLoadingThreadPool);
+  
+  auto& unitTypes = ClientUnitType::GetUnitTypes();
+  unitTypes.resize(static_cast<int>(UnitType::NumUnits));
+  for (int unitType = 0; result && unitType < static_cast<int>(UnitType::NumUnits); ++ unitType) {
+    if (!unitTypes[unitType].Load(static_cast<UnitType>(unitType), graphicsSubPath, cachePath, colorDilationShader.get(), palettes)) {
+      LOG(ERROR) << "Failed to load unit type: " << unitType;
+      result = false;
+    }
+  }
+  
+  auto& buildingTypes = ClientBuildingType::GetBuildingTypes();
+  buildingTypes.resize(static_cast<int>(BuildingType::NumBuildings));
+  for (int buildingType = 0; result && buildingType < static_cast<int>(BuildingType::NumBuildings); ++ buildingType) {
+    if (!buildingTypes[buildingType].Load(static_cast<BuildingType>(buildingType), graphicsSubPath, cachePath, colorDilationShader.get(), palettes)) {
+      LOG(ERROR) << "Failed to load building type: " << buildingType;
+      result = false;
+    }
+  }
+  
+  int spriteCount = 0;
+  int loggedPercentage = 0;
+  auto logProgress = [&](int completedSprites, int totalSprites) {
+    spriteCount = totalSprites;
+    int percentage = 100 * completedSprites / totalSprites;
+    if (percentage >= loggedPercentage + 10) {
+      LOG(INFO) << "Baked " << completedSprites << " / " << totalSprites << " sprites";
+      loggedPercentage = percentage;
+    }
+  };
+  if (!SpriteManager::Instance().FinishDeferredLoading(colorDilationShader.get(), logProgress)) {
+    LOG(ERROR) << "Failed to load some of the sprites.";
+    result = false;
+  }
+  
+  if (result) {
+    LOG(INFO) << "Baked " << spriteCount << " sprites in " << SecondsDuration(Clock::now() - startTime).count() << " s";
+  }
+  
+  // Release the sprites and textures while the OpenGL context is current.
+  unitTypes.clear();
+  buildingTypes.clear();
+  colorDilationShader.reset();
+  context.doneCurrent();
+  
+  return result ? 0 : 1;
+}